@@ -4,249 +4,863 @@
 
 #include "../network.h"
 #include  "../transport_receiver.h"
+#include "../bitmap.h"
+#include "../checksum.h"
+#include "../fec.h"
+#include "../compress.h"
+#include "../telemetry.h"
+#include "../placement.h"
 
 RECEIVER_STATE g_receiver_state;
 
 // Initializes the fields inside PACKET_CACHE cache
-void initialize_cache(void){
-    // initialize the event that signals when packets are available
-    g_receiver_state.packet_cache.packets_waiting_in_cache =
+void initialize_cache(PPACKET_CACHE cache, ULONG64 capacity){
+    ASSERT(capacity != 0 && (capacity & (capacity - 1)) == 0)
+
+    // initialize the events that signal when packets are available, and when slots free up
+    cache->packets_waiting_in_cache =
         CreateEvent(NULL, AUTO_RESET, FALSE, NULL);
+    cache->space_available = CreateEvent(NULL, AUTO_RESET, FALSE, NULL);
 
     // initialize the circular buffer
-    g_receiver_state.packet_cache.slot_counter_reader = 0;
-    g_receiver_state.packet_cache.slot_counter_writer = 0;
-
-    // Initialize the buffer that we will write into
-    memset(g_receiver_state.packet_cache.packet_space, 0, sizeof(DATA_PACKET)*BUFFER_SIZE_IN_PACKETS);
-
-    // Initialize Bitmaps
-    memset(g_receiver_state.packet_cache.reserve_cache_slot, 0,
-        sizeof(g_receiver_state.packet_cache.reserve_cache_slot));
-    memset(g_receiver_state.packet_cache.is_cache_slot_written, 0,
-        sizeof(g_receiver_state.packet_cache.is_cache_slot_written));
+    cache->slot_counter_reader = 0;
+    cache->slot_counter_writer = 0;
+    cache->writers_waiting = 0;
+
+    // Initialize the buffer that we will write into. Every slot starts empty for the first lap.
+    cache->capacity = capacity;
+    cache->packet_space = allocate_local_memory(ROLE_RECEIVER, capacity * sizeof(CACHED_PACKET), MEM_RESERVE | MEM_COMMIT);
+    if (cache->packet_space == NULL) {
+        printf("Failed to allocate a packet cache\n");
+        exit(1);
+    }
+    for (ULONG64 i = 0; i < capacity; i++) {
+        cache->packet_space[i].sequence = (LONG64) i;
+    }
 }
 
 /**
  * Initializes data structures and launches threads for the receiver:
- *  - Reserves the sparse array for all transmission info entries.
- *  - Launches main receiver thread.
+ *  - Sets up the transmission pool.
+ *  - Launches one main receiver thread per receiver worker, each with its own cache and transmission map.
  */
 void create_receiver(void) {
 
-    // reserve memory for every possible id
-    g_receiver_state.transmission_info_sparse_array = VirtualAlloc(NULL, sizeof(TRANSMISSION_INFO) * MAXULONG32, MEM_RESERVE, PAGE_READWRITE);
-    if (g_receiver_state.transmission_info_sparse_array == NULL) {
-        printf("Failed to allocate memory for transmission info sparse array\n");
-        exit(1);
+    initialize_transmission_pool();
+
+    // start the receiver workers -- each cache and map is ready before its worker can touch it
+    for (ULONG64 i = 0; i < RECEIVER_WORKER_COUNT; i++) {
+        initialize_cache(&g_receiver_state.packet_caches[i], PACKET_CACHE_CAPACITY);
+        initialize_transmission_map(&g_receiver_state.transmission_maps[i]);
+        g_receiver_state.receiver_threads[i] = create_placed_thread(THREAD_RECEIVER_WORKER, main_receiver_thread, (LPVOID) i, NULL);
+    }
+}
+
+
+BOOL init_received_transmission(PTRANSMISSION_INFO info, UINT32 id, ULONG64 num_packets, ULONG64 payload_size,
+                                PRECEIVE_POSTING posting) {
+
+    info->staging_ring_packets = 0;
+
+    // With a receive already posted, the data goes straight to where the application wants it.
+    // A streamed one only needs room for the window, which wraps around once the transmission is bigger.
+    if (posting != NULL && posting->dest != NULL) {
+        info->transmission_data = posting->dest;
+        info->transmission_data_size_class = NO_REASSEMBLY_BUFFER;
+    } else if (posting != NULL) {
+        if (num_packets > STREAM_STAGING_RING_PACKETS(payload_size)) {
+            info->staging_ring_packets = STREAM_STAGING_RING_PACKETS(payload_size);
+        }
+        info->transmission_data = allocate_reassembly_buffer(
+            min(num_packets, STREAM_STAGING_RING_PACKETS(payload_size)) * payload_size,
+            &info->transmission_data_size_class);
+        if (info->transmission_data == NULL) {
+            return FALSE;
+        }
+    } else {
+        info->transmission_data = allocate_reassembly_buffer(num_packets * payload_size,
+                                                             &info->transmission_data_size_class);
+        if (info->transmission_data == NULL) {
+            return FALSE;
+        }
+    }
+    info->posting = posting;
+
+    // The bitmap is recycled with the info. Only a transmission bigger than any before it needs a new one.
+    ULONG64 numBitmaps = BITMAP_WORDS(num_packets);
+    if (numBitmaps > info->status_bitmap_capacity_in_words) {
+        free(info->status_bitmap);
+        info->status_bitmap = zero_malloc(numBitmaps * sizeof(ULONG64));
+        info->status_bitmap_capacity_in_words = numBitmaps;
     }
+    memset(info->status_bitmap, 0, numBitmaps * sizeof(ULONG64));
+
+    info->transmission_id = id;
+    info->num_packets = num_packets;
+    info->num_packets_left = num_packets;
+    info->payload_size = payload_size;
+    info->file_size_in_bytes = 0;
+    info->last_packet_bytes = 0;
+    info->packets_flushed = 0;
+
+    info->cumulative_ack = 0;
+    info->latest_packet_index = 0;
+    info->nacked_packet_index = NO_PACKET_NACKED;
+    info->packets_since_ack = 0;
+    info->ack_deadline = 0;
+    info->ack_pending = FALSE;
+
+    info->parity_groups = NULL;
+    info->packets_recovered = 0;
+    info->compressed_chunks = NULL;
+    return TRUE;
+}
+
+/**
+ * @brief Takes the receive posted for a transmission off the worker's waiting list.
+ * @return The posting, or NULL if the application hasn't posted one yet.
+ */
+static PRECEIVE_POSTING take_waiting_posting(PTRANSMISSION_MAP map, UINT32 transmission_id) {
 
-    // start the main receiver thread
-    g_receiver_state.receiver_thread = CreateThread(NULL, 0, main_receiver_thread, NULL, 0, NULL);
+    PRECEIVE_POSTING* link = &map->waiting_postings;
 
-    initialize_cache();
+    while (*link != NULL) {
+        PRECEIVE_POSTING posting = *link;
+        if (posting->transmission_id == transmission_id) {
+            *link = (PRECEIVE_POSTING) posting->flink.Next;
+            return posting;
+        }
+        link = (PRECEIVE_POSTING*) &posting->flink.Next;
+    }
+    return NULL;
 }
 
+/**
+ * @brief Finds the transmission a packet belongs to in the worker's map, starting a new one if this is
+ *        its first packet.
+ * @return The transmission's info, or NULL if it has already been delivered or there is no room for it.
+ */
+static PTRANSMISSION_INFO get_received_transmission(PTRANSMISSION_MAP map, PDATA_PACKET pkt) {
 
-void init_received_transmission(ULONG32 id, ULONG32 num_packets) {
-    ULONG64 address_of_transmission_info = (ULONG64) &g_receiver_state.transmission_info_sparse_array[id];
-    ULONG64 pageDataStartsOn = address_of_transmission_info & ~(PAGE_SIZE_IN_BYTES - 1);
-    ULONG64 pageDataEndsOn = (address_of_transmission_info + sizeof(TRANSMISSION_INFO)) & ~(PAGE_SIZE_IN_BYTES - 1);
+    PTRANSMISSION_INFO info = find_transmission(map, pkt->transmission_id);
+    if (info != NULL) {
+        return info;
+    }
 
-    // when multiple threads commit the same memory, nothing happens. so this is thread safe
-    if (VirtualAlloc( (LPVOID) pageDataStartsOn, pageDataEndsOn - pageDataStartsOn + PAGE_SIZE_IN_BYTES, MEM_COMMIT, PAGE_READWRITE) == 0) {
-        printf("Failed to commit memory for transmission info sparse array\n");
-        exit(1);
+    if (was_recently_delivered(map, pkt->transmission_id)) {
+        return NULL;
     }
-    //memset((LPVOID) pageDataStartsOn, 0, pageDataEndsOn - pageDataStartsOn + PAGE_SIZE_IN_BYTES);
 
-    // if someone else has started the initialization wait for it to finish
-    if (_interlockedbittestandset64(&(g_receiver_state.transmission_info_sparse_array[id].initializationStarted), 0) == 1) {
-        while (TRUE) {
-            if (ReadULong64NoFence(&g_receiver_state.transmission_info_sparse_array[id].initializationComplete) == 1) {
-                return;
-            }
+    // The packet's own header says how big the transmission's packets are. If that makes no sense, nothing will.
+    if (!IS_VALID_PAYLOAD_SIZE(pkt->payload_size)) {
+        return NULL;
+    }
+
+    PRECEIVE_POSTING posting = take_waiting_posting(map, pkt->transmission_id);
+
+    info = allocate_transmission_info();
+    if (!init_received_transmission(info, pkt->transmission_id, pkt->n_packets_in_transmission, pkt->payload_size,
+                                    posting) ||
+        !insert_transmission(map, info)) {
+
+        // The posting waits for the sender to try again.
+        if (posting != NULL) {
+            posting->flink.Next = (PSLIST_ENTRY) map->waiting_postings;
+            map->waiting_postings = posting;
         }
+        if (info->transmission_data != NULL && info->transmission_data_size_class != NO_REASSEMBLY_BUFFER) {
+            free_reassembly_buffer(info->transmission_data, info->transmission_data_size_class);
+        }
+        info->transmission_data = NULL;
+        free_transmission_info(info);
+        return NULL;
     }
+    info->connection_id = pkt->connection_id;
+    return info;
+}
 
+/**
+ * @brief Counts packets that have just been placed in the transmission's buffer (and set in its bitmap),
+ *        and hands the transmission on to the posted receive once that moves it along.
+ * @param transmission_info The transmission the packets belong to.
+ * @param packetNumber The index in the transmission of the first of them.
+ * @param n_packets How many consecutive packets to count. All but the last are full.
+ * @param bytes The total payload size of the packets.
+ */
+static void account_for_packets(PTRANSMISSION_INFO transmission_info, ULONG64 packetNumber, ULONG64 n_packets,
+                                ULONG64 bytes) {
 
+    // if we have the last packet, remember how much of it there is in case it has to be moved to dest
+    if (packetNumber + n_packets == transmission_info->num_packets) {
+        transmission_info->last_packet_bytes = bytes - (n_packets - 1) * transmission_info->payload_size;
+    }
+    InterlockedAdd64(&transmission_info->file_size_in_bytes, bytes);
 
-    g_receiver_state.transmission_info_sparse_array[id].transmission_data = VirtualAlloc(NULL, num_packets * PACKET_PAYLOAD_SIZE_IN_BYTES,  MEM_RESERVE, PAGE_READWRITE);
+    ULONG64 packetsLeft = InterlockedAdd64((volatile LONG64*) &transmission_info->num_packets_left,
+                                           -(LONG64) n_packets);
 
-    if (g_receiver_state.transmission_info_sparse_array[id].transmission_data == NULL) {
-        printf("Failed to allocate memory for transmission data\n");
-        exit(1);
+    ASSERT(packetsLeft != MAXULONG64)
+    PRECEIVE_POSTING posting = transmission_info->posting;
+    if (posting == NULL) {
+        return;
     }
+    if (posting->write_routine != NULL) {
+        flush_to_sink(transmission_info);
+    } else if (packetsLeft == 0) {
+        complete_posted_receive(transmission_info);
+    }
+}
 
+/**
+ * Called by main receiver thread.
+ * This adds the packet's data to its corresponding transmission info.
+ * It will update the bitmap associated with the transmission and copy
+ * the data from the packet's payload into the transmission's data buffer --
+ * the application's own buffer, once it has posted a receive.
+ * For a streamed receive, it then writes out whatever has become contiguous.
+ */
+void document_received_transmission(PTRANSMISSION_INFO transmission_info, PDATA_PACKET pkt) {
 
+    ULONG64 packetNumber = pkt->index_in_transmission;
+    if (packetNumber >= transmission_info->num_packets) {
+        return;
+    }
 
-    ULONG64 numBitmaps = (num_packets + 63) / 64;
+    // Each packet has exactly one place in the buffer, as big as the transmission's payload size.
+    if (pkt->payload_size != transmission_info->payload_size || pkt->bytes_in_payload > pkt->payload_size) {
+        return;
+    }
 
+    // A staging ring can only take packets up to one lap ahead of the sink. The sender keeps to the
+    // window we advertise, so anything further is stale or bogus -- drop it without ACKing it.
+    ULONG64 ring = transmission_info->staging_ring_packets;
+    if (ring != 0 && packetNumber >= transmission_info->packets_flushed + ring) {
+        return;
+    }
 
-    // This just commits it straight up, as we get bigger file sizes, I will do the same reserve and commit strategy
-    g_receiver_state.transmission_info_sparse_array[id].status_bitmap = VirtualAlloc(NULL, numBitmaps * sizeof(ULONG64),   MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    // A duplicate we already hold isn't worth checksumming.
+    if (BITMAP_TEST(transmission_info->status_bitmap, packetNumber)) {
+        telemetry_count(TELEMETRY_DUPLICATES_RECEIVED, 1);
+        return;
+    }
 
-    if (g_receiver_state.transmission_info_sparse_array[id].status_bitmap == NULL) {
-        printf("Failed to allocate memory for transmission status bitmap\n");
-        exit(1);
+    // The network flipped bits somewhere. Don't take the packet, but ask for it again straight away.
+    if (!PAYLOAD_CHECKSUM_MATCHES(pkt->payload_checksum, pkt->data, pkt->bytes_in_payload)) {
+        transmission_info->nacked_packet_index = packetNumber;
+        return;
     }
 
+    if (pkt->compressed_chunk_bytes != 0) {
+        document_compressed_packet(transmission_info, pkt);
+        return;
+    }
 
+    // Set this right bit
+    ULONG64 bitmapIndex = packetNumber / 64;
+    LONG64 bitIndex = packetNumber % 64;
 
-    memset(g_receiver_state.transmission_info_sparse_array[id].status_bitmap, 0 , numBitmaps * sizeof(ULONG64));
-    // if (num_packets % 64 != 0) {
-    //     ULONG64 num_remaining_packets = num_packets % 64;
-    //     // set the bits we do not need to 1
-    //
-    //     g_receiver_state.transmission_info_sparse_array[id].status_bitmap[numBitmaps - 1] = ~((1ULL << (num_remaining_packets + 1)) - 1);
-    //
-    // }
+    // if the bit is already set, we don't need to do anything because the packet has already been sent over the wire
+    ULONG64 output;
+    output = _interlockedbittestandset64(&transmission_info->status_bitmap[bitmapIndex], bitIndex);
+    if(output == 1) {
+        return;
+    }
 
-    g_receiver_state.transmission_info_sparse_array[id].num_packets_left = num_packets;
-    g_receiver_state.transmission_info_sparse_array[id].transmission_complete_event = CreateEvent(NULL, AUTO_RESET, FALSE, NULL);
+    // Either the posted dest or a reassembly buffer that comes from the pool already committed,
+    // so there is nothing to fault in here.
+    ULONG64 slot = ring != 0 ? packetNumber & (ring - 1) : packetNumber;
+    ULONG64 addressToWrite = (ULONG64) transmission_info->transmission_data + slot * transmission_info->payload_size;
 
-    _interlockedbittestandset64(&g_receiver_state.transmission_info_sparse_array[id].initializationComplete, 0);
+    // Only the payload bytes are valid -- the packet may be a view into network memory
+    // that ends right after them.
+    memcpy((PVOID) addressToWrite, &pkt->data, pkt->bytes_in_payload);
 
+    account_for_packets(transmission_info, packetNumber, 1, pkt->bytes_in_payload);
 
+    // This may have been the last hole the group's parity was waiting on.
+    if (transmission_info->parity_groups != NULL) {
+        rebuild_parity_group(transmission_info, packetNumber / PARITY_GROUP_SIZE_IN_PACKETS);
+    }
 }
 
-/**
- * Called by main receiver thread.
- * This adds the packet's data to its corresponding transmission info.
- * It will update the bitmap associated with the transmission and copy
- * the data from the packet's payload into the transmission's data buffer.
- */
-void document_received_transmission(PDATA_PACKET pkt) {
+ULONG64 document_parity_packet(PTRANSMISSION_INFO info, PDATA_PACKET pkt) {
+
+    // A staging ring may already have handed the group's early packets to the sink and reused their
+    // slots -- the rebuild needs every packet of the group. Streamed receives rely on retransmission.
+    if (info->staging_ring_packets != 0) {
+        return 0;
+    }
+
+    // Parity packets carry the index of the first packet of their group, and are always full size.
+    ULONG64 first = pkt->index_in_transmission;
+    ULONG64 payload_size = info->payload_size;
+    if (first >= info->num_packets || first % PARITY_GROUP_SIZE_IN_PACKETS != 0 ||
+        pkt->parity_count > FEC_MAX_PARITY_PACKETS || pkt->parity_index >= pkt->parity_count ||
+        pkt->payload_size != payload_size || pkt->bytes_in_payload != payload_size ||
+        pkt->parity_last_packet_bytes == 0 || pkt->parity_last_packet_bytes > payload_size) {
+        return 0;
+    }
 
+    // Corrupt parity would rebuild corrupt packets. There is nothing to NACK -- parity is never resent.
+    if (!PAYLOAD_CHECKSUM_MATCHES(pkt->payload_checksum, pkt->data, pkt->bytes_in_payload)) {
+        return 0;
+    }
 
+    // The sender never covers a compressed chunk with parity -- its packets aren't the transmission's data.
+    if (info->compressed_chunks != NULL &&
+        info->compressed_chunks[first / COMPRESSED_CHUNK_SIZE_IN_PACKETS].compressed_bytes != 0) {
+        return 0;
+    }
 
+    // Nothing to do for a group that is already whole.
+    ULONG64 n_data = min(PARITY_GROUP_SIZE_IN_PACKETS, info->num_packets - first);
+    if (bitmap_range_is_full(info->status_bitmap, first, first + n_data)) {
+        return 0;
+    }
 
-    TRANSMISSION_INFO *transmission_info = &g_receiver_state.transmission_info_sparse_array[pkt->transmission_id];
+    if (info->parity_groups == NULL) {
+        ULONG64 n_groups = (info->num_packets + PARITY_GROUP_SIZE_IN_PACKETS - 1) / PARITY_GROUP_SIZE_IN_PACKETS;
+        info->parity_groups = zero_malloc(n_groups * sizeof(RECEIVER_PARITY_GROUP));
+    }
 
+    // Every parity packet of a group is computed together, so they all agree on its shape.
+    PRECEIVER_PARITY_GROUP group = &info->parity_groups[first / PARITY_GROUP_SIZE_IN_PACKETS];
+    if (group->parity == NULL) {
+        group->parity = zero_malloc(pkt->parity_count * payload_size);
+        group->parity_received = 0;
+        group->parity_count = pkt->parity_count;
+        group->last_packet_bytes = pkt->parity_last_packet_bytes;
+    } else if (group->parity_count != pkt->parity_count || group->last_packet_bytes != pkt->parity_last_packet_bytes) {
+        return 0;
+    }
 
+    if (group->parity_received & (1ULL << pkt->parity_index)) {
+        return 0;
+    }
+    memcpy(group->parity + pkt->parity_index * payload_size, pkt->data, payload_size);
+    group->parity_received |= 1ULL << pkt->parity_index;
 
-    //todo ask landy about speed
-    boolean needsInitialization = FALSE;
-    __try {
-        // check if it is initialized
-        if (transmission_info->initializationStarted == 0) {
-            needsInitialization = TRUE;
-        } else {
-            // wait for initialization to finish
-            while (TRUE) {
-                if (transmission_info->initializationComplete == 1) {
-                    break;
-                }
+    return rebuild_parity_group(info, first / PARITY_GROUP_SIZE_IN_PACKETS);
+}
+
+ULONG64 rebuild_parity_group(PTRANSMISSION_INFO info, ULONG64 group_index) {
+
+    PRECEIVER_PARITY_GROUP group = &info->parity_groups[group_index];
+    if (group->parity == NULL) {
+        return 0;
+    }
+
+    PULONG64 bitmap = info->status_bitmap;
+    ULONG64 payload_size = info->payload_size;
+    ULONG64 first = group_index * PARITY_GROUP_SIZE_IN_PACKETS;
+    ULONG64 n_data = min(PARITY_GROUP_SIZE_IN_PACKETS, info->num_packets - first);
+    ULONG64 n_missing = n_data - bitmap_count_range(bitmap, first, first + n_data);
+
+    if (n_missing > (ULONG64) POPCOUNT64(group->parity_received)) {
+        return 0;
+    }
+
+    if (n_missing != 0) {
+        PBYTE data[FEC_MAX_DATA_PACKETS];
+        ULONG64 lengths[FEC_MAX_DATA_PACKETS];
+        ULONG64 missing[FEC_MAX_PARITY_PACKETS];
+        PBYTE parity[FEC_MAX_PARITY_PACKETS];
+        ULONG64 parity_rows[FEC_MAX_PARITY_PACKETS];
+
+        // The group's packets sit next to each other in the buffer, missing ones included.
+        for (ULONG64 i = 0; i < n_data; i++) {
+            data[i] = (PBYTE) info->transmission_data + (first + i) * payload_size;
+            lengths[i] = payload_size;
+        }
+        lengths[n_data - 1] = group->last_packet_bytes;
+
+        ULONG64 n = 0;
+        for (ULONG64 index = bitmap_find_next(bitmap, first, first + n_data, FALSE); index < first + n_data;
+             index = bitmap_find_next(bitmap, index + 1, first + n_data, FALSE)) {
+            missing[n++] = index - first;
+        }
+        ASSERT(n == n_missing)
+
+        // Any n_missing of the parity packets will do.
+        n = 0;
+        for (ULONG64 row = 0; row < group->parity_count && n < n_missing; row++) {
+            if (group->parity_received & (1ULL << row)) {
+                parity[n] = group->parity + row * payload_size;
+                parity_rows[n++] = row;
             }
         }
-    } __except (EXCEPTION_EXECUTE_HANDLER) {
 
-        init_received_transmission(pkt->transmission_id, pkt->n_packets_in_transmission);
+        fec_decode(data, lengths, n_data, missing, n_missing, parity, parity_rows, payload_size);
+
+        for (ULONG64 u = 0; u < n_missing; u++) {
+            ULONG64 packetNumber = first + missing[u];
+            _interlockedbittestandset64(&bitmap[packetNumber / 64], packetNumber % 64);
+            account_for_packets(info, packetNumber, 1, lengths[missing[u]]);
+        }
+        info->packets_recovered += n_missing;
+    }
+
+    // The group is whole, so its parity has nothing left to do.
+    free(group->parity);
+    group->parity = NULL;
+    group->parity_received = 0;
+    return n_missing;
+}
+
+void release_parity_groups(PTRANSMISSION_INFO info) {
+
+    if (info->parity_groups == NULL) {
+        return;
     }
 
-    if (needsInitialization) {
-        init_received_transmission(pkt->transmission_id, pkt->n_packets_in_transmission);
+    ULONG64 n_groups = (info->num_packets + PARITY_GROUP_SIZE_IN_PACKETS - 1) / PARITY_GROUP_SIZE_IN_PACKETS;
+    for (ULONG64 g = 0; g < n_groups; g++) {
+        free(info->parity_groups[g].parity);
     }
+    free(info->parity_groups);
+    info->parity_groups = NULL;
+}
 
+void document_compressed_packet(PTRANSMISSION_INFO info, PDATA_PACKET pkt) {
 
     ULONG64 packetNumber = pkt->index_in_transmission;
+    ULONG64 payload_size = info->payload_size;
+    ULONG64 first = packetNumber - packetNumber % COMPRESSED_CHUNK_SIZE_IN_PACKETS;
+    ULONG64 n_chunk_packets = min(COMPRESSED_CHUNK_SIZE_IN_PACKETS, info->num_packets - first);
+    ULONG64 compressed_bytes = pkt->compressed_chunk_bytes;
+    ULONG64 n_compressed_packets = (compressed_bytes + payload_size - 1) / payload_size;
+    ULONG64 chunk_bytes = pkt->chunk_bytes;
+    ULONG64 offset = (packetNumber - first) * payload_size;
+
+    // The chunk has to fill its packets as the sender's chunks do, compress into fewer of them,
+    // and have this packet carry its share of the compressed bytes.
+    if (chunk_bytes > n_chunk_packets * payload_size || chunk_bytes <= (n_chunk_packets - 1) * payload_size ||
+        n_compressed_packets >= n_chunk_packets || offset >= compressed_bytes ||
+        pkt->bytes_in_payload != min(payload_size, compressed_bytes - offset)) {
+        return;
+    }
 
+    // Decompressing fills every slot of the chunk at once, so a staging ring needs room for all of them.
+    // The sender waits for a window that covers the whole chunk, so anything else is stale or bogus.
+    ULONG64 ring = info->staging_ring_packets;
+    if (ring != 0 && first + n_chunk_packets > info->packets_flushed + ring) {
+        return;
+    }
 
-    // Set this right bit
-    ULONG64 bitmapIndex = packetNumber / 64;
-    LONG64 bitIndex = packetNumber % 64;
+    if (info->compressed_chunks == NULL) {
+        ULONG64 n_chunks = (info->num_packets + COMPRESSED_CHUNK_SIZE_IN_PACKETS - 1) / COMPRESSED_CHUNK_SIZE_IN_PACKETS;
+        info->compressed_chunks = zero_malloc(n_chunks * sizeof(RECEIVER_COMPRESSED_CHUNK));
+    }
 
-    // if the bit is already set, we don't need to do anything because the packet has already been sent over the wire
-    ULONG64 output;
-    output = _interlockedbittestandset64(&transmission_info->status_bitmap[bitmapIndex], bitIndex);
-    if(output == 1) {
+    PRECEIVER_COMPRESSED_CHUNK chunk = &info->compressed_chunks[first / COMPRESSED_CHUNK_SIZE_IN_PACKETS];
+    if (chunk->compressed_bytes == 0) {
+        chunk->packets_left = n_compressed_packets;
+        chunk->compressed_bytes = (UINT32) compressed_bytes;
+        chunk->chunk_bytes = (UINT32) chunk_bytes;
+    } else if (chunk->compressed_bytes != compressed_bytes || chunk->chunk_bytes != chunk_bytes) {
         return;
     }
 
-    ULONG64 addressToWrite = (ULONG64) transmission_info->transmission_data + packetNumber * 1024;
+    if (_interlockedbittestandset64(&info->status_bitmap[packetNumber / 64], packetNumber % 64)) {
+        return;
+    }
 
-#if 1
-    ULONG64 pageDataStartsOn = addressToWrite & ~(PAGE_SIZE_IN_BYTES - 1);
-    ULONG64 pageDataEndsOn = (addressToWrite + PACKET_PAYLOAD_SIZE_IN_BYTES - 1) & ~(PAGE_SIZE_IN_BYTES - 1);
+    // A ring never wraps within a chunk, so the chunk's slots are always next to each other.
+    PBYTE slots = (PBYTE) info->transmission_data + (ring != 0 ? first & (ring - 1) : first) * payload_size;
+    memcpy(slots + offset, pkt->data, pkt->bytes_in_payload);
+    if (--chunk->packets_left != 0) {
+        return;
+    }
 
-    if (VirtualAlloc( (LPVOID) pageDataStartsOn, pageDataEndsOn - pageDataStartsOn + PAGE_SIZE_IN_BYTES, MEM_COMMIT, PAGE_READWRITE) == 0) {
-        printf("Failed to commit memory for transmission data\n");
-        exit(1);
+    // The whole chunk is in. Its compressed bytes sit in the chunk's own first slots, so move them out of the
+    // way, and decompress straight over the slots.
+    ULONG64 size_class;
+    PBYTE compressed = allocate_reassembly_buffer(compressed_bytes, &size_class);
+    ASSERT(compressed != NULL)
+    memcpy(compressed, slots, compressed_bytes);
+    BOOL decompressed = decompress_block(compressed, compressed_bytes, slots, chunk_bytes);
+    free_reassembly_buffer(compressed, size_class);
+
+    // Every packet passed its checksum, so the sender compressed it wrong. Nothing we can ask for again fixes that.
+    if (!decompressed) {
+        ASSERT(FALSE)
+        return;
+    }
+
+    bitmap_set_range(info->status_bitmap, first + n_compressed_packets, first + n_chunk_packets);
+    account_for_packets(info, first, n_chunk_packets, chunk_bytes);
+}
+
+void release_compressed_chunks(PTRANSMISSION_INFO info) {
+
+    free(info->compressed_chunks);
+    info->compressed_chunks = NULL;
+}
+
+/**
+ * @brief Finds where the packets that can be written to a streamed receive's sink stop: the end of the
+ *        run that has arrived, or the first compressed chunk in it still waiting on packets.
+ */
+static ULONG64 end_of_writable_run(PTRANSMISSION_INFO info, ULONG64 start, ULONG64 end) {
+
+    if (info->compressed_chunks == NULL) {
+        return end;
     }
-#endif
 
+    for (ULONG64 c = start / COMPRESSED_CHUNK_SIZE_IN_PACKETS; c * COMPRESSED_CHUNK_SIZE_IN_PACKETS < end; c++) {
+        if (info->compressed_chunks[c].packets_left != 0) {
+            return max(start, c * COMPRESSED_CHUNK_SIZE_IN_PACKETS);
+        }
+    }
+    return end;
+}
 
+void flush_to_sink(PTRANSMISSION_INFO info) {
+
+    PULONG64 bitmap = info->status_bitmap;
+    ULONG64 num_packets = info->num_packets;
+    ULONG64 ring = info->staging_ring_packets;
+    PRECEIVE_POSTING posting = info->posting;
+    PBYTE data = info->transmission_data;
+    ULONG64 payload_size = info->payload_size;
+
+    // Write out everything below the first hole. The ring only wraps between two writes.
+    ULONG64 end = end_of_writable_run(info, info->packets_flushed,
+                                      bitmap_find_next(bitmap, info->packets_flushed, num_packets, FALSE));
+    while (info->packets_flushed < end) {
+        ULONG64 first = info->packets_flushed;
+        ULONG64 slot = first;
+        ULONG64 n_packets = end - first;
+        if (ring != 0) {
+            slot = first & (ring - 1);
+            n_packets = min(n_packets, ring - slot);
+        }
 
+        ULONG64 bytes = n_packets * payload_size;
+        if (first + n_packets == num_packets) {
+            bytes -= payload_size - info->last_packet_bytes;
+        }
+        if (!posting->write_routine(posting->write_context, first * payload_size,
+                                    data + slot * payload_size, bytes)) {
+            printf("Failed to write transmission %u to its sink\n", info->transmission_id);
+            exit(1);
+        }
+        info->packets_flushed = first + n_packets;
+    }
 
+    if (info->packets_flushed == num_packets) {
+        complete_posted_receive(info);
+    }
+}
 
+/**
+ * @brief Copies every packet of a transmission that has arrived from one whole-transmission buffer to another.
+ */
+static void copy_arrived_packets(PTRANSMISSION_INFO info, PBYTE dest, PBYTE source) {
+
+    PULONG64 bitmap = info->status_bitmap;
+    ULONG64 num_packets = info->num_packets;
+    ULONG64 payload_size = info->payload_size;
+
+    // Copy a run of arrived packets at a time. Only the last packet of the transmission can be short.
+    ULONG64 start = bitmap_find_next(bitmap, 0, num_packets, TRUE);
+    while (start < num_packets) {
+        ULONG64 end = bitmap_find_next(bitmap, start, num_packets, FALSE);
+        ULONG64 bytes = (end - start) * payload_size;
+        if (end == num_packets) {
+            bytes -= payload_size - info->last_packet_bytes;
+        }
+        memcpy(dest + start * payload_size, source + start * payload_size, bytes);
+        start = bitmap_find_next(bitmap, end, num_packets, TRUE);
+    }
+}
 
-    memcpy((PVOID) addressToWrite, &pkt->data, PACKET_PAYLOAD_SIZE_IN_BYTES);
+/**
+ * @brief Attaches a receive the application has just posted to a transmission that has already started
+ *        arriving. Moves what has arrived so far into dest, and places the rest there directly.
+ *        A streamed receive keeps the reassembly buffer, and starts writing out of it.
+ */
+static void attach_posting(PTRANSMISSION_INFO info, PRECEIVE_POSTING posting) {
 
+    if (posting->write_routine != NULL) {
+        info->posting = posting;
+        flush_to_sink(info);
+        return;
+    }
 
-    // if we have the last packet, change the size
-    InterlockedAdd64(&transmission_info->file_size_in_bytes, pkt->bytes_in_payload);
+    PBYTE dest = posting->dest;
+    copy_arrived_packets(info, dest, info->transmission_data);
 
-    ULONG64 packetsLeft = InterlockedDecrement64(&transmission_info->num_packets_left);
+    free_reassembly_buffer(info->transmission_data, info->transmission_data_size_class);
+    info->transmission_data = dest;
+    info->transmission_data_size_class = NO_REASSEMBLY_BUFFER;
+    info->posting = posting;
 
-    ASSERT(packetsLeft != MAXULONG64)
-    if (packetsLeft == 0) {
-        SetEvent(transmission_info->transmission_complete_event);
+    if (info->num_packets_left == 0) {
+        complete_posted_receive(info);
     }
 }
 
 /**
- * @pre Assume the packet passed in has already been ACK'd in global data
- * @param pkt The packet to assemble a comm packet from
- * @return A comm packet that ACKs the current packet
+ * @brief Picks up the receives the application has posted to this worker. Each is attached to its
+ *        transmission if that has started, otherwise it waits for the first packet.
  */
-COMM_PACKET assemble_COMM_packet_from_packet(DATA_PACKET pkt) {
+static void attach_posted_receives(PTRANSMISSION_MAP map) {
+
+    PSLIST_ENTRY entry = InterlockedFlushSList(&map->posted);
+
+    while (entry != NULL) {
+        PRECEIVE_POSTING posting = (PRECEIVE_POSTING) entry;
+        entry = entry->Next;
+
+        // A streamed receive that timed out may have left only a window of the transmission behind,
+        // which can't fill a dest. Such a receive waits until it times out too.
+        PTRANSMISSION_INFO info = find_transmission(map, posting->transmission_id);
+        if (info != NULL && (posting->write_routine != NULL || info->staging_ring_packets == 0)) {
+            attach_posting(info, posting);
+            continue;
+        }
+
+        posting->flink.Next = (PSLIST_ENTRY) map->waiting_postings;
+        map->waiting_postings = posting;
+    }
+}
+
+void assemble_ack(PTRANSMISSION_INFO info, PCOMM_PACKET comm_packet) {
+
+    PULONG64 bitmap = info->status_bitmap;
+    ULONG64 num_packets = info->num_packets;
+
+    comm_packet->must_be_one = 1;
+    comm_packet->transmission_id = info->transmission_id;
+    comm_packet->bytes_in_header = 24;
+    comm_packet->connection_id = info->connection_id;
+    comm_packet->bytes_in_comm_fields = 32;
+    comm_packet->nacked_packet_index = (UINT32) info->nacked_packet_index;
+    info->nacked_packet_index = NO_PACKET_NACKED;
+    comm_packet->packets_recovered = (UINT32) info->packets_recovered;
+    info->packets_recovered = 0;
+    comm_packet->comm_reserved = 0;
+
+    // Everything below the first hole has arrived. The cumulative ACK never moves backwards,
+    // so we only need to scan from where it was last time.
+    ULONG64 cumulative_ack = bitmap_find_next(bitmap, info->cumulative_ack, num_packets, FALSE);
+    info->cumulative_ack = cumulative_ack;
+
+    // Work backwards from the run holding the latest packet, so the packets that triggered this ACK
+    // are always covered even when there are more holes than ranges. Older runs were reported by
+    // earlier ACKs. If the latest packet was a duplicate below the cumulative ACK, start from the top.
+    ULONG64 latest = info->latest_packet_index;
+    ULONG64 end = latest >= cumulative_ack
+        ? bitmap_find_next(bitmap, latest, num_packets, FALSE)
+        : bitmap_find_prev(bitmap, num_packets, cumulative_ack, TRUE);
+
+    UINT32 n_ranges = 0;
+    while (n_ranges < MAX_SACK_RANGES && end > cumulative_ack) {
+        ULONG64 start = bitmap_find_prev(bitmap, end, cumulative_ack, FALSE);
+        comm_packet->sack_ranges[n_ranges].first_packet_index = (UINT32) start;
+        comm_packet->sack_ranges[n_ranges].n_packets = (UINT32) (end - start);
+        n_ranges++;
+        end = bitmap_find_prev(bitmap, start, cumulative_ack, TRUE);
+    }
+
+    comm_packet->cumulative_ack = (UINT32) cumulative_ack;
+    comm_packet->latest_packet_index = (UINT32) latest;
+
+    // A staging ring holds one lap past what has gone to the sink. Everything else can take it all.
+    comm_packet->receive_window_end = (UINT32) (info->staging_ring_packets != 0
+        ? min(num_packets, info->packets_flushed + info->staging_ring_packets)
+        : num_packets);
+    comm_packet->bytes_in_sack_ranges = n_ranges * sizeof(SACK_RANGE);
+    comm_packet->payload_checksum = PAYLOAD_CHECKSUM(comm_packet->sack_ranges, comm_packet->bytes_in_sack_ranges);
+}
+
+void send_ack(PTRANSMISSION_INFO info) {
+
+    COMM_PACKET comm_packet;
+    assemble_ack(info, &comm_packet);
+    info->packets_since_ack = 0;
+
+    send_packet((PPACKET) &comm_packet, ROLE_RECEIVER);
+    telemetry_count(TELEMETRY_ACKS_SENT, 1);
 
-    COMM_PACKET commPacket;
-    commPacket.must_be_one = 1;
-    commPacket.transmission_id = pkt.transmission_id;
+#if SUPERFLUOUS_PRINTS
+    printf("sent ack with id %u, cumulative %u and %llu ranges\n", info->transmission_id, comm_packet.cumulative_ack,
+        comm_packet.bytes_in_sack_ranges / sizeof(SACK_RANGE));
+#endif
+}
 
-    commPacket.bytes_in_header = 16;
-    commPacket.bytes_in_comm_fields = 16;
+/**
+ * @brief ACKs every packet of a transmission we no longer hold any state for, because it has already
+ *        been delivered. The sender is retransmitting, so it must have missed our last ACK.
+ * @param pkt The retransmitted packet.
+ */
+static void send_delivered_ack(PDATA_PACKET pkt) {
+
+    COMM_PACKET comm_packet;
+    comm_packet.must_be_one = 1;
+    comm_packet.transmission_id = pkt->transmission_id;
+    comm_packet.bytes_in_header = 24;
+    comm_packet.connection_id = pkt->connection_id;
+    comm_packet.payload_checksum = PAYLOAD_CHECKSUM(comm_packet.sack_ranges, 0);
+    comm_packet.bytes_in_comm_fields = 32;
+    comm_packet.nacked_packet_index = NO_PACKET_NACKED;
+    comm_packet.packets_recovered = 0;
+    comm_packet.comm_reserved = 0;
+    comm_packet.cumulative_ack = pkt->n_packets_in_transmission;
+    comm_packet.receive_window_end = pkt->n_packets_in_transmission;
+    comm_packet.latest_packet_index = pkt->index_in_transmission;
+    comm_packet.bytes_in_sack_ranges = 0;
+
+    send_packet((PPACKET) &comm_packet, ROLE_RECEIVER);
+    telemetry_count(TELEMETRY_ACKS_SENT, 1);
+}
 
+/**
+ * @brief Sends the ACKs whose timer has run out, and forgets the ones that have already gone out
+ *        because enough packets arrived.
+ * @param pending_acks The IDs of transmissions with an ACK waiting on the timer.
+ * @param n_pending The number of entries in pending_acks. Updated as entries are removed.
+ */
+static void flush_pending_acks(PTRANSMISSION_INFO* pending_acks, PULONG64 n_pending) {
 
-    ULONG64 packetNumber = pkt.index_in_transmission;
-    // the byte the packet resides  on
-    ULONG64 bitMapNumber = packetNumber / 8;
+    ULONG64 now = time_now();
+    ULONG64 i = 0;
 
-    // the starting location to right to
-    ULONG64 bitmapStart = (bitMapNumber /1024);
+    while (i < *n_pending) {
+        PTRANSMISSION_INFO info = pending_acks[i];
 
+        if (info->packets_since_ack != 0 && now < info->ack_deadline) {
+            i++;
+            continue;
+        }
+        if (info->packets_since_ack != 0) {
+            send_ack(info);
+        }
+        info->ack_pending = FALSE;
+        pending_acks[i] = pending_acks[--(*n_pending)];
+    }
+}
 
-    ULONG64 lastPacket = (bitmapStart + 1024);
+/**
+ * @brief Takes a transmission out of the map and returns its info to the pool, along with its reassembly
+ *        buffer if it has one. Any ACK still on the timer is dropped.
+ * @param map The worker's transmission map.
+ * @param info The transmission.
+ * @param pending_acks The worker's list of transmissions with an ACK waiting on the timer.
+ * @param n_pending The number of entries in pending_acks. Updated as entries are removed.
+ */
+static void forget_transmission(PTRANSMISSION_MAP map, PTRANSMISSION_INFO info, PTRANSMISSION_INFO* pending_acks,
+                                PULONG64 n_pending) {
 
-    size_t numBytes = PACKET_PAYLOAD_SIZE_IN_BYTES;
-    // confirm if the num packets is always a multiple of 8
-    if (lastPacket > (pkt.n_packets_in_transmission / 8)) {
-        numBytes = lastPacket - bitmapStart;
+    if (info->ack_pending) {
+        for (ULONG64 i = 0; i < *n_pending; i++) {
+            if (pending_acks[i] == info) {
+                pending_acks[i] = pending_acks[--(*n_pending)];
+                break;
+            }
+        }
     }
 
+    remove_transmission(map, info->transmission_id);
+
+    // Data in the application's buffer is the application's -- nothing to hand back.
+    if (info->transmission_data_size_class != NO_REASSEMBLY_BUFFER) {
+        free_reassembly_buffer(info->transmission_data, info->transmission_data_size_class);
+    }
+    info->transmission_data = NULL;
+    info->posting = NULL;
+    release_parity_groups(info);
+    release_compressed_chunks(info);
+    free_transmission_info(info);
+}
 
-    commPacket.n_bits_to_read  = (UINT32) numBytes * 8;
-    commPacket.bytes_in_bitmap = (UINT32) numBytes;
-    commPacket.first_packet_index = (UINT32) (bitmapStart * 8);
+/**
+ * @brief Reclaims the transmissions that have been delivered: takes them out of the map,
+ *        remembers their IDs, and returns their infos to the pool.
+ * @param map The worker's transmission map.
+ * @param pending_acks The worker's list of transmissions with an ACK waiting on the timer.
+ * @param n_pending The number of entries in pending_acks. Updated as entries are removed.
+ */
+static void reclaim_delivered_transmissions(PTRANSMISSION_MAP map, PTRANSMISSION_INFO* pending_acks, PULONG64 n_pending) {
 
+    PSLIST_ENTRY entry = InterlockedFlushSList(&map->delivered);
 
+    while (entry != NULL) {
+        PTRANSMISSION_INFO info = (PTRANSMISSION_INFO) entry;
+        entry = entry->Next;
 
-    // todo make beckett right a multiple of eight to my bits.
-    memcpy(&commPacket.bitmap, &g_receiver_state.transmission_info_sparse_array[pkt.transmission_id].status_bitmap[bitmapStart], numBytes);
-    return commPacket;
+        // Every packet was in before the transmission was delivered, so the ACK that completed
+        // the transmission has already gone. Anything still on the timer has nothing left to say.
+        map->recently_delivered[map->recently_delivered_next++ % RECENTLY_DELIVERED_COUNT] = info->transmission_id;
+        forget_transmission(map, info, pending_acks, n_pending);
+    }
 }
 
+/**
+ * @brief Lets go of the receives the application has given up on. A transmission that was being placed
+ *        in dest moves what it has back to a reassembly buffer. A streamed one keeps its reassembly
+ *        buffer, and picks up where it left off once the receive is posted again.
+ * @param map The worker's transmission map.
+ * @param pending_acks The worker's list of transmissions with an ACK waiting on the timer.
+ * @param n_pending The number of entries in pending_acks. Updated as entries are removed.
+ */
+static void withdraw_receives(PTRANSMISSION_MAP map, PTRANSMISSION_INFO* pending_acks, PULONG64 n_pending) {
+
+    PSLIST_ENTRY entry = InterlockedFlushSList(&map->withdrawing);
+    if (entry == NULL) {
+        return;
+    }
+
+    // Every receive was posted before it was withdrawn, so once these are picked up each one
+    // is either waiting, attached to its transmission, or already complete.
+    attach_posted_receives(map);
+
+    while (entry != NULL) {
+        PRECEIVE_POSTING posting = CONTAINING_RECORD(entry, RECEIVE_POSTING, withdraw_flink);
+        entry = entry->Next;
+
+        PRECEIVE_POSTING* link = &map->waiting_postings;
+        while (*link != NULL && *link != posting) {
+            link = (PRECEIVE_POSTING*) &(*link)->flink.Next;
+        }
+
+        PTRANSMISSION_INFO info = find_transmission(map, posting->transmission_id);
+        if (*link != NULL) {
+            *link = (PRECEIVE_POSTING) posting->flink.Next;
+        } else if (!posting->complete && info != NULL && info->posting == posting) {
+            info->posting = NULL;
+
+            if (info->transmission_data_size_class == NO_REASSEMBLY_BUFFER) {
+                PBYTE dest = info->transmission_data;
+                info->transmission_data = allocate_reassembly_buffer(info->num_packets * info->payload_size,
+                                                                     &info->transmission_data_size_class);
+                // Without anywhere to keep it, the transmission starts over.
+                if (info->transmission_data == NULL) {
+                    info->transmission_data_size_class = NO_REASSEMBLY_BUFFER;
+                    forget_transmission(map, info, pending_acks, n_pending);
+                } else {
+                    copy_arrived_packets(info, info->transmission_data, dest);
+                }
+            }
+        }
 
+        // The posting lives on the application's stack, so this must be the last we touch it.
+        InterlockedExchange(&posting->withdrawn, TRUE);
+    }
+}
 
 /**
  * @par Woken by cache packet when packets are available to be processed.
  *      Sends ACKs and NACKs via comm packets.
- *      Updates sparse array data structures to track the status of each packet in a transmission.
+ *      Updates the data structures that track the status of each packet in a transmission.
  *      There are two data structures updated: there is a bitmap per transmission tracking the presence
- *      of each packet. And there is a sparse array of packet data into which the packets processed by
- *      this thread will be memcpy'd. For security purposes, we guard the memcpy with a try-except.
- * @param param
+ *      of each packet. And there is the application's posted buffer (or, until it posts one, a
+ *      reassembly buffer) into which the packets processed by this thread will be memcpy'd.
+ *      ACKs are coalesced per transmission: see ACK_COALESCE_PACKETS and ACK_COALESCE_DELAY_MS.
+ *      Also picks up posted receives, and reclaims the transmissions that have been delivered.
+ *      One of these runs per receiver worker.
+ * @param param The worker's index, which selects its packet cache and transmission map.
  * @return
  */
 DWORD main_receiver_thread(LPVOID param) {
@@ -254,121 +868,185 @@ DWORD main_receiver_thread(LPVOID param) {
 
     WaitForSingleObject(simulation_begin, INFINITE);
 
-    DATA_PACKET packet;
+    PPACKET_CACHE cache = &g_receiver_state.packet_caches[(ULONG64) param];
+    PTRANSMISSION_MAP map = &g_receiver_state.transmission_maps[(ULONG64) param];
+    PDATA_PACKET packet;
+    PVOID view;
     HANDLE events[2];
-    events[0] = g_receiver_state.packet_cache.packets_waiting_in_cache;
+    events[0] = cache->packets_waiting_in_cache;
     events[1] = simulation_end;
     DWORD returnEvent;
 
-    memset(&packet, 0, sizeof(DATA_PACKET));
+    PTRANSMISSION_INFO pending_acks[MAX_PENDING_ACKS];
+    ULONG64 n_pending = 0;
+
     while (TRUE) {
-        returnEvent = WaitForMultipleObjects(2, events, FALSE, INFINITE);
+        // Only wake up on the timer while there are ACKs waiting on it.
+        returnEvent = WaitForMultipleObjects(2, events, FALSE, n_pending ? ACK_COALESCE_DELAY_MS : INFINITE);
 
         //if the system shutdown event was signaled, exit
         if (returnEvent - WAIT_OBJECT_0 == 1) {
             return 0;
         }
 
+        // Before the packets, so that they land in dest rather than a reassembly buffer wherever we can.
+        attach_posted_receives(map);
+        withdraw_receives(map, pending_acks, &n_pending);
+
         while (TRUE) {
-            ULONG64 return_value = read_from_cache(&packet);
+            ULONG64 return_value = read_from_cache(cache, &packet, &view);
             if( return_value == PACKET_FAILED_TO_READ) {
                 break;
             }
         #if SUPERFLUOUS_PRINTS
-            printf("uncached packet transmission ID %d and index %d\n", packet.transmission_id, packet.index_in_transmission);
+            printf("uncached packet transmission ID %d and index %d\n", packet->transmission_id, packet->index_in_transmission);
 
         #endif
 
-            ASSERT(packet.must_be_zero == 0)
+            ASSERT(packet->must_be_zero == 0)
             // this is kind of code that represents that this packet is just zeroed
-            ASSERT(packet.n_packets_in_transmission != 0)
-           document_received_transmission(&packet);
-
-
-            COMM_PACKET commPacket = assemble_COMM_packet_from_packet(packet);
-            //DebugBreak();
-
-            send_packet((PPACKET) &commPacket, ROLE_RECEIVER);
+            ASSERT(packet->n_packets_in_transmission != 0)
+            PTRANSMISSION_INFO info = get_received_transmission(map, packet);
+            if (info == NULL) {
+                // Either a retransmission of something already delivered, or a transmission we have no
+                // room for yet. The first needs ACKing in full; the second will be sent again.
+                if (was_recently_delivered(map, packet->transmission_id)) {
+                    telemetry_count(TELEMETRY_DUPLICATES_RECEIVED, 1);
+                    send_delivered_ack(packet);
+                }
+                release_packet_view(view, ROLE_RECEIVER);
+                continue;
+            }
 
-        #if SUPERFLUOUS_PRINTS
+            // A parity packet isn't one the sender can be told about, only the packets it rebuilds. When it
+            // rebuilds none, there is nothing new to ACK.
+            if (packet->parity_count != 0) {
+                ULONG64 rebuilt = document_parity_packet(info, packet);
+                release_packet_view(view, ROLE_RECEIVER);
+                if (rebuilt == 0) {
+                    continue;
+                }
+            } else {
+                document_received_transmission(info, packet);
+                info->latest_packet_index = packet->index_in_transmission;
 
-            printf("sent ack with id %llu and index %llu \n", commPacket.transmission_id, commPacket.first_packet_index);
-        #endif
+                // We are done with the packet, so the network can have its memory back.
+                release_packet_view(view, ROLE_RECEIVER);
             }
 
-    }
+            // A NACK can't wait for the ACK timer -- the sender has to resend the packet either way.
+            if (info->nacked_packet_index != NO_PACKET_NACKED) {
+                send_ack(info);
+                continue;
+            }
 
+            // The first packet since the last ACK starts the timer.
+            if (info->packets_since_ack++ == 0) {
+                info->ack_deadline = deadline_from_now_ms(ACK_COALESCE_DELAY_MS);
+            }
 
-}
-boolean check_transmission(UINT32 transmission_id) {
+            // Don't hold back the ACK that completes the transmission, or any after it -- packets arriving
+            // then are retransmissions, which means the sender missed an ACK.
+            if (info->packets_since_ack >= ACK_COALESCE_PACKETS || info->num_packets_left == 0) {
+                send_ack(info);
+                continue;
+            }
 
-    __try {
-        PTRANSMISSION_INFO info = &g_receiver_state.transmission_info_sparse_array[transmission_id];
-        // Must verify initialization is complete before trusting num_packets_left.
-        // Without this, a race between memset (zeroing num_packets_left) and the
-        // assignment of the real packet count causes a false TRUE.
-        if (info->initializationComplete == 1 && info->num_packets_left == 0)
-            return TRUE;
+            if (!info->ack_pending) {
+                if (n_pending == MAX_PENDING_ACKS) {
+                    send_ack(info);
+                    continue;
+                }
+                info->ack_pending = TRUE;
+                pending_acks[n_pending++] = info;
+            }
+        }
 
-    } __except (EXCEPTION_EXECUTE_HANDLER) {
-        return FALSE;
+        reclaim_delivered_transmissions(map, pending_acks, &n_pending);
+        flush_pending_acks(pending_acks, &n_pending);
     }
 
-    return FALSE;
-}
-
 
-int reciever_handler(UINT32 transmission_id, PVOID dest, PSIZE_T out_length, ULONG64 timeout_ms) {
+}
+/**
+ * @brief Posts a receive and pumps packets from the network to the workers until it completes,
+ *        or until timeout_ms passes and the receive is withdrawn.
+ * @param posting The receive. It lives on the caller's stack, which is fine since we don't return
+ *        until the worker is done with it.
+ */
+static int wait_for_posted_receive(PRECEIVE_POSTING posting, PSIZE_T out_length, ULONG64 timeout_ms) {
 
     int result;
-    //Checks to see if the transmission has been initialized
-
-    ULONG64 time = time_now();
-
-    // TODO we still need to check for timeouts in this function.
     ULONG64 deadline = deadline_from_now_ms(timeout_ms);
 
-    while (TRUE) {
-
-
-        // check to see if it is complete, works regardless of whether it is initialized or not
-        if (check_transmission(transmission_id)) {
+    // Tell the worker where the data goes, whether or not any of it has arrived yet.
+    post_receive(posting);
 
-            PTRANSMISSION_INFO info = &g_receiver_state.transmission_info_sparse_array[transmission_id];
-            size_t file_size = info->file_size_in_bytes;
-
-            // Write all data from global struct into this transmission's memory (dest)
-            memcpy(dest, info->transmission_data, file_size);
-
-            // Update the transmission's size (out_length)
-            *out_length = file_size;
+    while (TRUE) {
 
-            // Finish the transmission and return
+        // The worker has placed every packet straight into dest (or the sink), so there is nothing left to copy
+        if (posting->complete) {
+            *out_length = posting->bytes_received;
             return TRANSMISSION_RECEIVED;
+        }
 
+        // The worker has to let go of the posting before we can return. It may complete first.
+        if (time_now() > deadline) {
+            withdraw_receive(posting);
+            if (posting->complete) {
+                *out_length = posting->bytes_received;
+                return TRANSMISSION_RECEIVED;
+            }
+            break;
         }
 
         //Calls receive packet at the dest and saves the result to check if transmission was successful
-        //Here I create a local data packet to memcopy space for the transmission
-        DATA_PACKET local_pkt;
-        result = receive_packet((PPACKET) &local_pkt, 10, ROLE_RECEIVER);
+        //The packet is lent to us by the network, so it is not copied until it is documented
+        PDATA_PACKET local_pkt;
+        PVOID view;
+        result = receive_packet_view((PPACKET*) &local_pkt, &view, 10, ROLE_RECEIVER);
 
         if (result == NO_PACKET_AVAILABLE) {
             continue;
         }
 #if SUPERFLUOUS_PRINTS
-        printf("Cached packet with transmission ID %d and index %d\n", local_pkt.transmission_id, local_pkt.index_in_transmission);
+        printf("Cached packet with transmission ID %d and index %d\n", local_pkt->transmission_id, local_pkt->index_in_transmission);
 #endif
 
-        write_to_cache(&local_pkt);
+        // If the cache is full, hold onto the packet until the worker makes room rather than dropping it.
+        // It stays in network memory meanwhile, which pushes back on the sender instead of costing an RTO.
+        while (write_to_cache(local_pkt, view) == PACKET_CACHE_FULL) {
+            telemetry_count(TELEMETRY_CACHE_FULL_WAITS, 1);
+            wait_for_cache_space(local_pkt, CACHE_BACKPRESSURE_WAIT_MS);
+        }
     }
 #if DEBUG
-    if (time_now() > deadline) {
-        printf("Timed out waiting for transmission %d\n", transmission_id);
-    }
+    printf("Timed out waiting for transmission %d\n", posting->transmission_id);
 #endif
 
-    printf("Timed out waiting for transmission %d\n", transmission_id);
     //If we get to this point, we know runtime exceeded the deadline threshold
     return NO_TRANSMISSION_AVAILABLE;
 }
+
+int reciever_handler(UINT32 transmission_id, PVOID dest, PSIZE_T out_length, ULONG64 timeout_ms) {
+
+    RECEIVE_POSTING posting;
+    posting.transmission_id = transmission_id;
+    posting.dest = dest;
+    posting.write_routine = NULL;
+    posting.write_context = NULL;
+
+    return wait_for_posted_receive(&posting, out_length, timeout_ms);
+}
+
+int stream_receiver_handler(UINT32 transmission_id, TRANSMISSION_WRITE_ROUTINE write_routine, PVOID context,
+                            PSIZE_T out_length, ULONG64 timeout_ms) {
+
+    RECEIVE_POSTING posting;
+    posting.transmission_id = transmission_id;
+    posting.dest = NULL;
+    posting.write_routine = write_routine;
+    posting.write_context = context;
+
+    return wait_for_posted_receive(&posting, out_length, timeout_ms);
+}
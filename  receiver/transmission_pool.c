@@ -0,0 +1,240 @@
+//
+// Pooled receiver transmission state: the per-worker transmission maps, and the pool
+// that transmission infos and reassembly buffers are recycled through.
+//
+
+#include "../transport_receiver.h"
+#include "../placement.h"
+
+/**
+ * @brief Commits a region for the pool, on large pages if we can get them.
+ * @param bytes The size of the region. Large pages are only tried for multiples of the large page size.
+ */
+static PVOID allocate_pool_region(SIZE_T bytes) {
+
+    SIZE_T large_page_size = g_receiver_state.pool.large_page_size;
+
+    if (large_page_size != 0 && bytes % large_page_size == 0) {
+        PVOID region = allocate_local_memory(ROLE_RECEIVER, bytes, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES);
+        if (region != NULL) {
+            return region;
+        }
+        // Most likely we don't hold SeLockMemoryPrivilege -- don't keep paying for the failed call.
+        g_receiver_state.pool.large_page_size = 0;
+    }
+
+    PVOID region = allocate_local_memory(ROLE_RECEIVER, bytes, MEM_RESERVE | MEM_COMMIT);
+    if (region == NULL) {
+        printf("Failed to allocate memory for the transmission pool\n");
+        exit(1);
+    }
+    return region;
+}
+
+void initialize_transmission_pool(void) {
+
+    InitializeSListHead(&g_receiver_state.pool.free_transmission_infos);
+    for (ULONG64 i = 0; i < REASSEMBLY_SIZE_CLASS_COUNT; i++) {
+        InitializeSListHead(&g_receiver_state.pool.free_buffers[i]);
+    }
+
+    // Our slabs are sized to match the usual large page. Anything else, and we don't bother.
+    SIZE_T large_page_size = GetLargePageMinimum();
+    g_receiver_state.pool.large_page_size =
+        (large_page_size != 0 && REASSEMBLY_SLAB_SIZE_IN_BYTES % large_page_size == 0) ? large_page_size : 0;
+}
+
+PTRANSMISSION_INFO allocate_transmission_info(void) {
+
+    PTRANSMISSION_INFO info = (PTRANSMISSION_INFO) InterlockedPopEntrySList(&g_receiver_state.pool.free_transmission_infos);
+    if (info != NULL) {
+        return info;
+    }
+
+    // The pool is dry. Keep one from a new slab and hand the rest to the pool.
+    PTRANSMISSION_INFO slab = allocate_local_memory(ROLE_RECEIVER, TRANSMISSION_INFO_SLAB_COUNT * sizeof(TRANSMISSION_INFO),
+                                                    MEM_RESERVE | MEM_COMMIT);
+    if (slab == NULL) {
+        printf("Failed to allocate transmission infos\n");
+        exit(1);
+    }
+    for (ULONG64 i = 1; i < TRANSMISSION_INFO_SLAB_COUNT; i++) {
+        InterlockedPushEntrySList(&g_receiver_state.pool.free_transmission_infos, &slab[i].flink);
+    }
+    return &slab[0];
+}
+
+void free_transmission_info(PTRANSMISSION_INFO info) {
+    InterlockedPushEntrySList(&g_receiver_state.pool.free_transmission_infos, &info->flink);
+}
+
+PVOID allocate_reassembly_buffer(ULONG64 bytes, PULONG64 size_class) {
+
+    // Round up to the next power of two, but no smaller than the smallest class.
+    ULONG shift = REASSEMBLY_MIN_SIZE_CLASS_SHIFT;
+    if (bytes > (1ULL << REASSEMBLY_MIN_SIZE_CLASS_SHIFT)) {
+        _BitScanReverse64(&shift, bytes - 1);
+        shift++;
+    }
+    ULONG64 class_index = shift - REASSEMBLY_MIN_SIZE_CLASS_SHIFT;
+    if (class_index >= REASSEMBLY_SIZE_CLASS_COUNT) {
+        return NULL;
+    }
+    *size_class = class_index;
+
+    PSLIST_HEADER free_list = &g_receiver_state.pool.free_buffers[class_index];
+    PVOID buffer = InterlockedPopEntrySList(free_list);
+    if (buffer != NULL) {
+        return buffer;
+    }
+
+    // Big classes get a region of their own.
+    ULONG64 buffer_size = 1ULL << shift;
+    if (buffer_size >= REASSEMBLY_SLAB_SIZE_IN_BYTES) {
+        return allocate_pool_region(buffer_size);
+    }
+
+    // Small classes are carved out of a slab. Keep the first buffer and hand the rest to the free list.
+    PBYTE slab = allocate_pool_region(REASSEMBLY_SLAB_SIZE_IN_BYTES);
+    for (ULONG64 offset = buffer_size; offset < REASSEMBLY_SLAB_SIZE_IN_BYTES; offset += buffer_size) {
+        InterlockedPushEntrySList(free_list, (PSLIST_ENTRY) (slab + offset));
+    }
+    return slab;
+}
+
+void free_reassembly_buffer(PVOID buffer, ULONG64 size_class) {
+    ASSERT(size_class < REASSEMBLY_SIZE_CLASS_COUNT)
+    InterlockedPushEntrySList(&g_receiver_state.pool.free_buffers[size_class], (PSLIST_ENTRY) buffer);
+}
+
+// Uses the bottom bits of the same multiplicative hash whose top bits picked the worker.
+#define transmission_map_home(id) (((UINT32) (id) * 2654435761u) & (TRANSMISSION_MAP_SIZE - 1))
+
+void initialize_transmission_map(PTRANSMISSION_MAP map) {
+
+    memset(map->entries, 0, sizeof(map->entries));
+    map->count = 0;
+    InitializeSListHead(&map->posted);
+    map->waiting_postings = NULL;
+    InitializeSListHead(&map->withdrawing);
+    InitializeSListHead(&map->delivered);
+
+    for (ULONG64 i = 0; i < RECENTLY_DELIVERED_COUNT; i++) {
+        map->recently_delivered[i] = UINT32_MAX;
+    }
+    map->recently_delivered_next = 0;
+}
+
+PTRANSMISSION_INFO find_transmission(PTRANSMISSION_MAP map, UINT32 transmission_id) {
+
+    for (UINT32 index = transmission_map_home(transmission_id); ; index = (index + 1) & (TRANSMISSION_MAP_SIZE - 1)) {
+        PTRANSMISSION_MAP_ENTRY entry = &map->entries[index];
+        if (entry->info == NULL) {
+            return NULL;
+        }
+        if (entry->transmission_id == transmission_id) {
+            return entry->info;
+        }
+    }
+}
+
+BOOL insert_transmission(PTRANSMISSION_MAP map, PTRANSMISSION_INFO info) {
+
+    if (map->count >= TRANSMISSION_MAP_MAX_COUNT) {
+        return FALSE;
+    }
+
+    UINT32 index = transmission_map_home(info->transmission_id);
+    while (map->entries[index].info != NULL) {
+        index = (index + 1) & (TRANSMISSION_MAP_SIZE - 1);
+    }
+
+    map->entries[index].transmission_id = info->transmission_id;
+    map->entries[index].info = info;
+    map->count++;
+
+    return TRUE;
+}
+
+void remove_transmission(PTRANSMISSION_MAP map, UINT32 transmission_id) {
+
+    UINT32 hole = transmission_map_home(transmission_id);
+    while (map->entries[hole].transmission_id != transmission_id) {
+        if (map->entries[hole].info == NULL) {
+            return;
+        }
+        hole = (hole + 1) & (TRANSMISSION_MAP_SIZE - 1);
+    }
+    if (map->entries[hole].info == NULL) {
+        return;
+    }
+
+    // Walk the rest of the chain, pulling back any entry that the hole would cut off from its home.
+    UINT32 index = hole;
+    while (TRUE) {
+        index = (index + 1) & (TRANSMISSION_MAP_SIZE - 1);
+        PTRANSMISSION_MAP_ENTRY entry = &map->entries[index];
+        if (entry->info == NULL) {
+            break;
+        }
+
+        // The entry can stay if its home lies cyclically in (hole, index].
+        UINT32 home = transmission_map_home(entry->transmission_id);
+        if (((index - home) & (TRANSMISSION_MAP_SIZE - 1)) < ((index - hole) & (TRANSMISSION_MAP_SIZE - 1))) {
+            continue;
+        }
+
+        map->entries[hole] = *entry;
+        hole = index;
+    }
+
+    map->entries[hole].info = NULL;
+    map->count--;
+}
+
+BOOL was_recently_delivered(PTRANSMISSION_MAP map, UINT32 transmission_id) {
+
+    for (ULONG64 i = 0; i < RECENTLY_DELIVERED_COUNT; i++) {
+        if (map->recently_delivered[i] == transmission_id) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+void post_receive(PRECEIVE_POSTING posting) {
+
+    UINT32 worker = receiver_worker_for_transmission(posting->transmission_id);
+
+    posting->bytes_received = 0;
+    posting->complete = FALSE;
+    posting->withdrawn = FALSE;
+
+    // Only the worker may touch the transmission's state, so it does the attaching.
+    InterlockedPushEntrySList(&g_receiver_state.transmission_maps[worker].posted, &posting->flink);
+    SetEvent(g_receiver_state.packet_caches[worker].packets_waiting_in_cache);
+}
+
+void withdraw_receive(PRECEIVE_POSTING posting) {
+
+    UINT32 worker = receiver_worker_for_transmission(posting->transmission_id);
+
+    InterlockedPushEntrySList(&g_receiver_state.transmission_maps[worker].withdrawing, &posting->withdraw_flink);
+    SetEvent(g_receiver_state.packet_caches[worker].packets_waiting_in_cache);
+
+    // The worker only takes as long as one pass over its cache.
+    while (!posting->withdrawn) {
+        YieldProcessor();
+    }
+}
+
+void complete_posted_receive(PTRANSMISSION_INFO info) {
+
+    PTRANSMISSION_MAP map = &g_receiver_state.transmission_maps[receiver_worker_for_transmission(info->transmission_id)];
+
+    info->posting->bytes_received = info->file_size_in_bytes;
+    InterlockedExchange(&info->posting->complete, TRUE);
+
+    // The worker reclaims it at the end of this pass. Later retransmissions find it recently delivered.
+    InterlockedPushEntrySList(&map->delivered, &info->flink);
+}
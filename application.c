@@ -47,6 +47,9 @@
 
 
 #include "application.h"
+#include "bitmap.h"
+#include "telemetry.h"
+#include "placement.h"
 
 // Our global variables:
 APP_STATE app = {0};
@@ -76,7 +79,6 @@ void app_sender(void) {
     LONG64 slot = 0;
     LONG64 row = 0;
     LONG64 offset = 0;
-    LONG64 mask = 0;
     PAPP_TRANSMISSION_INFO transmission;
     int status;
 
@@ -86,22 +88,15 @@ void app_sender(void) {
     // This comparison is not interlocked, which is okay --
     // we don't mind going around an extra time if necessary.
     while (app.transmissions_sent < app.transmission_count) {
-        slot = slot % app.transmission_count;
-        row = slot / 64;
-        offset = slot % 64;
-        mask = (1LL << offset);
-
-        // Check the lock -- if it's totally 1s, move on to the next row
-        if (app.lock_sent[row] == BITMAP_ROW_FULL_VALUE) {
-            slot = (row + 1) * 64;
-            continue;
-        }
-
-        // Check this bit -- if it's 1, move on to the next bit
-        if (app.lock_sent[row] & mask) {
-            slot++;
+        // Skip straight to the next transmission nobody has claimed. If there isn't one, start over.
+        slot = (LONG64) bitmap_find_next((PULONG64) app.lock_sent, slot % app.transmission_count,
+                                         app.transmission_count, FALSE);
+        if (slot == app.transmission_count) {
+            slot = 0;
             continue;
         }
+        row = slot / 64;
+        offset = slot % 64;
 
         // Interlocked set it -- if you did not win, move on to the next bit
         if (InterlockedBitTestAndSet64(&app.lock_sent[row], offset)) {
@@ -164,7 +159,6 @@ void app_receiver(void) {
     ULONG64 slot = 0;
     ULONG64 row = 0;
     ULONG64 offset = 0;
-    ULONG64 mask = 0;
 
     // Wait for simulation start event
     WaitForSingleObject(simulation_begin, INFINITE);
@@ -175,21 +169,15 @@ void app_receiver(void) {
     // While there are still transmissions to receive AND we haven't timed out
     while (time_now() < end_time && app.transmissions_received < app.transmission_count) {
 
-        // Check the lock -- if it's totally 1s, move on to the next row
-        slot = slot % app.transmission_count;
-        row = slot / 64;
-        if (app.lock_received[row] == BITMAP_ROW_FULL_VALUE) {
-            slot = (row + 1) * 64;
+        // Skip straight to the next transmission nobody has received yet. If there isn't one, start over.
+        slot = bitmap_find_next((PULONG64) app.lock_received, slot % app.transmission_count,
+                                app.transmission_count, FALSE);
+        if (slot == (ULONG64) app.transmission_count) {
+            slot = 0;
             continue;
         }
-
-        // Check this bit -- if it's 1, move on to the next bit
+        row = slot / 64;
         offset = slot % 64;
-        mask = (1LL << offset);
-        if (app.lock_received[row] & mask) {
-            slot++;
-            continue;
-        }
 
         // Okay, let's consider THIS particular transmission
         info = &app.transmission_info[slot];
@@ -351,7 +339,12 @@ void print_stats(void) {
 
     printf("AVERAGE LATENCY: \t\t%.2f ms\n", stats.latency_avg_ms);
     printf("THROUGHPUT: \t\t\t%.1f Kbps\n", stats.throughput_bps / KB(1));
-    printf("TIME ELAPSED: \t\t\t%llu ms\n", elapsed_time);
+    printf("TIME ELAPSED: \t\t\t%llu ms\n\n", elapsed_time);
+
+    PTELEMETRY_SNAPSHOT snapshot = zero_malloc(sizeof(TELEMETRY_SNAPSHOT));
+    telemetry_snapshot(snapshot);
+    telemetry_print(snapshot, NULL);
+    free(snapshot);
 
 }
 
@@ -397,8 +390,8 @@ void noah_stats(void) {
             printf("  [%d] FAIL at byte %zu (packet %zu, offset %zu): sent=0x%02X recv=0x%02X\n",
                 i,
                 first_bad,
-                first_bad / MAX_PAYLOAD_SIZE,
-                first_bad % MAX_PAYLOAD_SIZE,
+                first_bad / get_payload_size(),
+                first_bad % get_payload_size(),
                 sent_bytes[first_bad],
                 recv_bytes[first_bad]);
             failed++;
@@ -461,12 +454,10 @@ void create_application_layer(void) {
     // Create receiver threads
     for (int i = 0; i < app.receiving_thread_count; i++) {
 
-        app.receiver_threads[i] = CreateThread(
-            DEFAULT_SECURITY,           // default security
-            DEFAULT_STACK_SIZE,         // default stack size
+        app.receiver_threads[i] = create_placed_thread(
+            THREAD_APP_RECEIVER,        // on the receiver's node
             (LPTHREAD_START_ROUTINE) app_receiver,
             NULL,                       // no parameter
-            DEFAULT_CREATION_FLAGS,     // run immediately
             &app.receiver_thread_ids[i] // thread index is ID
         );
 
@@ -479,12 +470,10 @@ void create_application_layer(void) {
     // Create sender threads
     for (int i = 0; i < app.sending_thread_count; i++) {
 
-        app.sender_threads[i] = CreateThread(
-            DEFAULT_SECURITY,           // default security
-            DEFAULT_STACK_SIZE,         // default stack size
+        app.sender_threads[i] = create_placed_thread(
+            THREAD_APP_SENDER,          // on the sender's node
             (LPTHREAD_START_ROUTINE) app_sender,
             NULL,                       // no parameter
-            DEFAULT_CREATION_FLAGS,     // run immediately
             &app.sender_thread_ids[i]   // thread index is ID
         );
 
@@ -529,19 +518,23 @@ void initialize_layers_and_all_data(void) {
         );
     // Initialize timing
     time_init();
+    bitmap_init();
+    placement_init();
 
     // Initialize all layers
     create_application_layer();
     create_network_layer();
     create_transport_layer();
 
-
-
+#if TELEMETRY_EXPORT_PERIOD_MS
+    telemetry_start_export(TELEMETRY_EXPORT_PERIOD_MS);
+#endif
 }
 
 void free_all_data_and_shut_down(void) {
 
     SetEvent(simulation_end);
+    telemetry_stop_export();
 
     free_network_layer();
     free_transport_layer();
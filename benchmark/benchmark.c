@@ -0,0 +1,527 @@
+/*
+ * benchmark.c
+ *
+ * Benchmark Suite Implementation
+ *
+ * Sweeps the settings given on the command line (see benchmark.h and usage below), and writes one
+ * CSV row or JSON object per point:
+ *
+ *   label, threads, transmission_bytes, transmissions, loss_percent, latency_ms, minions,
+ *   payload_bytes, trials, received, failed,
+ *   latency_p50_us, latency_p99_us, latency_p999_us, latency_max_us,
+ *   goodput_median_mbps, goodput_min_mbps, goodput_max_mbps
+ *
+ * A transmission's latency runs from the call to send_transmission to the return of the
+ * receive_transmission that got it. The percentiles are taken over every transmission of every
+ * measured trial of the point. A trial's goodput is the bytes received intact divided by the time
+ * from the start of the trial to the last of them arriving.
+ */
+
+#include "benchmark.h"
+#include "../bitmap.h"
+#include "../placement.h"
+
+HANDLE simulation_begin;
+HANDLE simulation_end;
+
+static BENCHMARK_TRIAL trial;
+
+// Every transmission gets an ID of its own, across all trials and points.
+static UINT32 next_transmission_id;
+
+static void print_usage(void) {
+    printf("Usage: PacketTransporterBenchmark.exe [options]\n"
+           "\t--threads LIST      sending (and as many receiving) threads.     Default: %s\n"
+           "\t--sizes LIST        bytes per transmission, 1K to 1G.            Default: %s\n"
+           "\t--counts LIST       transmissions per trial.                     Default: %s\n"
+           "\t--loss LIST         packet loss, percent.                        Default: %s\n"
+           "\t--latency LIST      one-way latency in each direction, ms.       Default: %s\n"
+           "\t--minions LIST      active sender minions, 1 to %d.              Default: %s\n"
+           "\t--trials N          measured trials per point.                   Default: %d\n"
+           "\t--warmup N          warm-up trials per point.                    Default: %d\n"
+           "\t--payload BYTES     payload size.                                Default: %d\n"
+           "\t--seed N            impairment seed.                             Default: %d\n"
+           "\t--format csv|json                                                Default: csv\n"
+           "\t--output FILE       where to write the results.                  Default: stdout\n"
+           "\t--label TEXT        copied into every result, to tell runs apart.\n"
+           "LISTs are comma-separated, and sizes may end in K, M or G.\n",
+           DEFAULT_BENCHMARK_THREAD_COUNTS, DEFAULT_BENCHMARK_TRANSMISSION_SIZES,
+           DEFAULT_BENCHMARK_TRANSMISSION_COUNTS, DEFAULT_BENCHMARK_LOSS_RATES, DEFAULT_BENCHMARK_LATENCIES_MS,
+           SENDER_MINION_COUNT, DEFAULT_BENCHMARK_MINION_COUNTS, DEFAULT_BENCHMARK_TRIALS,
+           DEFAULT_BENCHMARK_WARMUP_TRIALS, DEFAULT_PAYLOAD_SIZE, DEFAULT_BENCHMARK_SEED);
+}
+
+/**
+ * @brief Fills in the settings from the command line, starting from the defaults.
+ * @return FALSE, having said why, if any argument is not valid.
+ */
+static BOOL parse_settings(int argc, char** argv, PBENCHMARK_SETTINGS settings) {
+
+    char* thread_counts = DEFAULT_BENCHMARK_THREAD_COUNTS;
+    char* sizes = DEFAULT_BENCHMARK_TRANSMISSION_SIZES;
+    char* counts = DEFAULT_BENCHMARK_TRANSMISSION_COUNTS;
+    char* loss_rates = DEFAULT_BENCHMARK_LOSS_RATES;
+    char* latencies = DEFAULT_BENCHMARK_LATENCIES_MS;
+    char* minions = DEFAULT_BENCHMARK_MINION_COUNTS;
+    char* output = NULL;
+
+    settings->trials = DEFAULT_BENCHMARK_TRIALS;
+    settings->warmup_trials = DEFAULT_BENCHMARK_WARMUP_TRIALS;
+    settings->payload_size = DEFAULT_PAYLOAD_SIZE;
+    settings->seed = DEFAULT_BENCHMARK_SEED;
+    settings->format = BENCHMARK_FORMAT_CSV;
+    settings->output = stdout;
+    settings->label = "";
+
+    for (int i = 1; i < argc; i++) {
+        char* option = argv[i];
+        char* value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(option, "--help") == 0) {
+            return FALSE;
+        }
+        if (value == NULL) {
+            printf("Error: %s needs a value.\n", option);
+            return FALSE;
+        }
+        i++;
+
+        if (strcmp(option, "--threads") == 0) thread_counts = value;
+        else if (strcmp(option, "--sizes") == 0) sizes = value;
+        else if (strcmp(option, "--counts") == 0) counts = value;
+        else if (strcmp(option, "--loss") == 0) loss_rates = value;
+        else if (strcmp(option, "--latency") == 0) latencies = value;
+        else if (strcmp(option, "--minions") == 0) minions = value;
+        else if (strcmp(option, "--output") == 0) output = value;
+        else if (strcmp(option, "--label") == 0) settings->label = value;
+        else if (strcmp(option, "--trials") == 0) {
+            settings->trials = parse_size(value);
+            if (settings->trials == ARG_ERROR || settings->trials == 0 || settings->trials > MAX_BENCHMARK_TRIALS) {
+                printf("Error: trials must be between 1 and %d.\n", MAX_BENCHMARK_TRIALS);
+                return FALSE;
+            }
+        } else if (strcmp(option, "--warmup") == 0) {
+            settings->warmup_trials = parse_size(value);
+            if (settings->warmup_trials == ARG_ERROR || settings->warmup_trials > MAX_BENCHMARK_TRIALS) {
+                printf("Error: warm-up trials must be between 0 and %d.\n", MAX_BENCHMARK_TRIALS);
+                return FALSE;
+            }
+        } else if (strcmp(option, "--payload") == 0) {
+            settings->payload_size = parse_size(value);
+            if (settings->payload_size == ARG_ERROR || !IS_VALID_PAYLOAD_SIZE(settings->payload_size)) {
+                printf("Error: the payload size must be a power of two from %d to %d.\n",
+                       MIN_PAYLOAD_SIZE, MAX_PAYLOAD_SIZE);
+                return FALSE;
+            }
+        } else if (strcmp(option, "--seed") == 0) {
+            settings->seed = parse_size(value);
+            if (settings->seed == ARG_ERROR) {
+                printf("Error: the seed must be a number.\n");
+                return FALSE;
+            }
+        } else if (strcmp(option, "--format") == 0) {
+            if (!parse_format(value, &settings->format)) {
+                printf("Error: the format must be csv or json.\n");
+                return FALSE;
+            }
+        } else {
+            printf("Error: unknown option %s.\n", option);
+            return FALSE;
+        }
+    }
+
+    if (!parse_sweep(thread_counts, &settings->thread_counts, 1, MAX_BENCHMARK_THREADS)) {
+        printf("Error: thread counts must be between 1 and %d.\n", MAX_BENCHMARK_THREADS);
+        return FALSE;
+    }
+    if (!parse_sweep(sizes, &settings->transmission_sizes, MIN_BENCHMARK_TRANSMISSION_BYTES,
+                     MAX_BENCHMARK_TRANSMISSION_BYTES)) {
+        printf("Error: transmission sizes must be between 1K and 1G.\n");
+        return FALSE;
+    }
+    if (!parse_sweep(counts, &settings->transmission_counts, 1, MAX_BENCHMARK_TRANSMISSIONS)) {
+        printf("Error: transmission counts must be between 1 and %d.\n", MAX_BENCHMARK_TRANSMISSIONS);
+        return FALSE;
+    }
+    if (!parse_rate_sweep(loss_rates, &settings->loss_rates)) {
+        printf("Error: loss rates must be percentages.\n");
+        return FALSE;
+    }
+    if (!parse_sweep(latencies, &settings->latencies_ms, 0, MAX_BENCHMARK_LATENCY_MS)) {
+        printf("Error: latencies must be between 0 and %d ms.\n", MAX_BENCHMARK_LATENCY_MS);
+        return FALSE;
+    }
+    if (!parse_sweep(minions, &settings->minion_counts, 1, SENDER_MINION_COUNT)) {
+        printf("Error: minion counts must be between 1 and %d.\n", SENDER_MINION_COUNT);
+        return FALSE;
+    }
+
+    if (output != NULL) {
+        settings->output = fopen(output, "w");
+        if (settings->output == NULL) {
+            printf("Error: could not open %s.\n", output);
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/**
+ * @brief Fills a buffer with bytes that don't compress, the same ones every time for the same seed.
+ */
+static void fill_with_pattern(PBYTE data, ULONG64 bytes, ULONG64 seed) {
+
+    // xorshift64*. The state must never be 0.
+    ULONG64 state = seed * 0x9E3779B97F4A7C15ULL + 1;
+    ULONG64 i = 0;
+
+    for (; i + sizeof(ULONG64) <= bytes; i += sizeof(ULONG64)) {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        ULONG64 word = state * 0x2545F4914F6CDD1DULL;
+        memcpy(data + i, &word, sizeof(word));
+    }
+    for (; i < bytes; i++) {
+        data[i] = (BYTE) (i * 31 + seed);
+    }
+}
+
+/**
+ * @brief Allocates a buffer of the given size, or exits -- a benchmark that can't hold its data can't run.
+ */
+static PBYTE allocate_buffer(ULONG64 bytes) {
+
+    PBYTE buffer = VirtualAlloc(NULL, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    if (buffer == NULL) {
+        printf("Failed to allocate %llu bytes for the benchmark's transmissions\n", bytes);
+        exit(1);
+    }
+    return buffer;
+}
+
+/**
+ * @brief Sends every transmission of the trial that falls to this thread, one after another.
+ */
+static DWORD WINAPI benchmark_sender(LPVOID param) {
+
+    ULONG64 index = (ULONG64) param;
+    WaitForSingleObject(trial.start, INFINITE);
+
+    for (ULONG64 i = index; i < trial.transmission_count; i += trial.thread_count) {
+        PBENCHMARK_TRANSMISSION transmission = &trial.transmissions[i];
+        transmission->time_sent = time_now();
+        send_transmission(transmission->id, transmission->data_sent, trial.transmission_bytes);
+    }
+    return 0;
+}
+
+/**
+ * @brief Receives every transmission of the trial that falls to this thread, in the order they are sent.
+ *        Gives up on the rest once the trial's deadline passes.
+ */
+static DWORD WINAPI benchmark_receiver(LPVOID param) {
+
+    ULONG64 index = (ULONG64) param;
+    WaitForSingleObject(trial.start, INFINITE);
+
+    for (ULONG64 i = index; i < trial.transmission_count; i += trial.thread_count) {
+        PBENCHMARK_TRANSMISSION transmission = &trial.transmissions[i];
+
+        while (time_now() < trial.deadline) {
+            if (receive_transmission(transmission->id, transmission->data_received, &transmission->bytes_received,
+                                     BENCHMARK_RECEIVE_TIMEOUT_MS) == TRANSMISSION_RECEIVED) {
+                transmission->time_received = time_now();
+                break;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Runs one trial of the point set up in trial: sends and receives every transmission, then
+ *        checks each one against what was sent.
+ * @param result Where to add the trial's latencies and goodput, or NULL for a warm-up trial.
+ */
+static void run_trial(PBENCHMARK_POINT point, PBENCHMARK_SETTINGS settings, PBENCHMARK_RESULT result) {
+
+    HANDLE threads[2 * MAX_BENCHMARK_THREADS];
+    ULONG64 thread_count = point->thread_count;
+
+    // Every trial starts the impairments over, so the same settings see the same losses.
+    NETWORK_IMPAIRMENTS impairments = {
+        .drop_rate = point->loss_rate,
+        .duplicate_rate = NETWORK_DUPLICATE_RATE,
+        .corrupt_rate = NETWORK_CORRUPT_RATE,
+        .reorder_rate = NETWORK_REORDER_ENABLED ? NETWORK_REORDER_RATE : 0,
+        .reorder_max_delay_ms = NETWORK_REORDER_MAX_DELAY_MS,
+        .seed = settings->seed,
+    };
+    configure_impairments(&impairments);
+
+    for (ULONG64 i = 0; i < trial.transmission_count; i++) {
+        PBENCHMARK_TRANSMISSION transmission = &trial.transmissions[i];
+        transmission->id = next_transmission_id++;
+        transmission->bytes_received = 0;
+        transmission->time_sent = 0;
+        transmission->time_received = 0;
+    }
+
+    ResetEvent(trial.start);
+    trial.deadline = deadline_from_now_ms(BENCHMARK_TRIAL_TIMEOUT_MS);
+    for (ULONG64 i = 0; i < thread_count; i++) {
+        threads[i] = create_placed_thread(THREAD_APP_SENDER, benchmark_sender, (LPVOID) i, NULL);
+        threads[thread_count + i] = create_placed_thread(THREAD_APP_RECEIVER, benchmark_receiver, (LPVOID) i, NULL);
+        if (threads[i] == NULL || threads[thread_count + i] == NULL) {
+            printf("Failed to create the benchmark's threads\n");
+            exit(1);
+        }
+    }
+
+    ULONG64 start = time_now();
+    SetEvent(trial.start);
+
+    // The receivers give up at the deadline. A sender still waiting on its ACKs well after that
+    // never will get them, and the transport has nothing left to measure.
+    for (ULONG64 i = 0; i < 2 * thread_count; i++) {
+        ULONG64 now = time_now();
+        ULONG64 wait = trial.deadline > now ? tsc_to_ms(trial.deadline - now) : 0;
+        if (WaitForSingleObject(threads[i], (DWORD) wait + BENCHMARK_TRIAL_TIMEOUT_MS) != WAIT_OBJECT_0) {
+            printf("A benchmark trial has hung\n");
+            exit(1);
+        }
+        CloseHandle(threads[i]);
+    }
+
+    if (result == NULL) {
+        return;
+    }
+
+    ULONG64 bytes_delivered = 0;
+    ULONG64 last_received = start;
+    for (ULONG64 i = 0; i < trial.transmission_count; i++) {
+        PBENCHMARK_TRANSMISSION transmission = &trial.transmissions[i];
+
+        if (transmission->time_received == 0 || transmission->bytes_received != trial.transmission_bytes ||
+            memcmp(transmission->data_sent, transmission->data_received, trial.transmission_bytes) != 0) {
+            result->failed++;
+            continue;
+        }
+
+        result->latencies[result->latency_count++] = transmission->time_received - transmission->time_sent;
+        bytes_delivered += trial.transmission_bytes;
+        last_received = max(last_received, transmission->time_received);
+    }
+
+    double seconds = (double) (last_received - start) / (double) ms_to_tsc(1000);
+    result->goodputs[result->trials_run++] = seconds > 0 ? (double) bytes_delivered * 8 / seconds / 1e6 : 0;
+}
+
+static int compare_latencies(const void* a, const void* b) {
+    ULONG64 x = *(const ULONG64*) a;
+    ULONG64 y = *(const ULONG64*) b;
+    return (x > y) - (x < y);
+}
+
+static int compare_goodputs(const void* a, const void* b) {
+    double x = *(const double*) a;
+    double y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Finds a percentile of a sorted array of latencies, by nearest rank.
+ * @return The latency in microseconds, or 0 if there are none.
+ */
+static double latency_percentile_us(PULONG64 sorted, ULONG64 count, double percentile) {
+
+    if (count == 0) {
+        return 0;
+    }
+    double exact = percentile / 100.0 * (double) count;
+    ULONG64 rank = (ULONG64) exact;
+    if ((double) rank < exact) {
+        rank++;
+    }
+    rank = min(max(rank, 1), count);
+    return (double) sorted[rank - 1] * 1000.0 / (double) ms_to_tsc(1);
+}
+
+static void print_header(PBENCHMARK_SETTINGS settings) {
+
+    if (settings->format == BENCHMARK_FORMAT_JSON) {
+        fprintf(settings->output, "[\n");
+        return;
+    }
+    fprintf(settings->output, "label,threads,transmission_bytes,transmissions,loss_percent,latency_ms,minions,"
+                              "payload_bytes,trials,received,failed,latency_p50_us,latency_p99_us,latency_p999_us,"
+                              "latency_max_us,goodput_median_mbps,goodput_min_mbps,goodput_max_mbps\n");
+}
+
+static void print_footer(PBENCHMARK_SETTINGS settings) {
+
+    if (settings->format == BENCHMARK_FORMAT_JSON) {
+        fprintf(settings->output, "\n]\n");
+    }
+}
+
+/**
+ * @brief Writes one point's results, as a CSV row or a JSON object.
+ * @param first Whether this is the first point written, which a JSON object isn't preceded by a comma for.
+ */
+static void print_result(PBENCHMARK_SETTINGS settings, PBENCHMARK_POINT point, PBENCHMARK_RESULT result,
+                         BOOL first) {
+
+    qsort(result->latencies, result->latency_count, sizeof(ULONG64), compare_latencies);
+    qsort(result->goodputs, result->trials_run, sizeof(double), compare_goodputs);
+
+    double p50 = latency_percentile_us(result->latencies, result->latency_count, 50);
+    double p99 = latency_percentile_us(result->latencies, result->latency_count, 99);
+    double p999 = latency_percentile_us(result->latencies, result->latency_count, 99.9);
+    double p100 = latency_percentile_us(result->latencies, result->latency_count, 100);
+    double goodput_median = result->goodputs[result->trials_run / 2];
+    double goodput_min = result->goodputs[0];
+    double goodput_max = result->goodputs[result->trials_run - 1];
+
+    if (settings->format == BENCHMARK_FORMAT_JSON) {
+        fprintf(settings->output,
+                "%s  {\"label\": \"%s\", \"threads\": %llu, \"transmission_bytes\": %llu, \"transmissions\": %llu, "
+                "\"loss_percent\": %g, \"latency_ms\": %llu, \"minions\": %llu, \"payload_bytes\": %llu, "
+                "\"trials\": %llu, \"received\": %llu, \"failed\": %llu, "
+                "\"latency_p50_us\": %.1f, \"latency_p99_us\": %.1f, \"latency_p999_us\": %.1f, "
+                "\"latency_max_us\": %.1f, \"goodput_median_mbps\": %.2f, \"goodput_min_mbps\": %.2f, "
+                "\"goodput_max_mbps\": %.2f}",
+                first ? "" : ",\n", settings->label, point->thread_count, point->transmission_bytes,
+                point->transmission_count, point->loss_rate, point->latency_ms, point->minion_count,
+                settings->payload_size, result->trials_run, result->latency_count, result->failed,
+                p50, p99, p999, p100, goodput_median, goodput_min, goodput_max);
+    } else {
+        fprintf(settings->output, "%s,%llu,%llu,%llu,%g,%llu,%llu,%llu,%llu,%llu,%llu,%.1f,%.1f,%.1f,%.1f,%.2f,%.2f,%.2f\n",
+                settings->label, point->thread_count, point->transmission_bytes, point->transmission_count,
+                point->loss_rate, point->latency_ms, point->minion_count, settings->payload_size,
+                result->trials_run, result->latency_count, result->failed,
+                p50, p99, p999, p100, goodput_median, goodput_min, goodput_max);
+    }
+    fflush(settings->output);
+}
+
+/**
+ * @brief Sets the layers up for a point, runs its warm-up and measured trials, and writes its results.
+ */
+static void run_point(PBENCHMARK_SETTINGS settings, PBENCHMARK_POINT point, BOOL first) {
+
+    configure_link_latency(ROLE_SENDER, point->latency_ms);
+    configure_link_latency(ROLE_RECEIVER, point->latency_ms);
+    set_sender_minion_count((ULONG) point->minion_count);
+
+    ULONG64 bytes = point->transmission_bytes * point->transmission_count;
+    PBYTE data_sent = allocate_buffer(bytes);
+    PBYTE data_received = allocate_buffer(bytes);
+    fill_with_pattern(data_sent, bytes, settings->seed);
+
+    trial.transmissions = zero_malloc(point->transmission_count * sizeof(BENCHMARK_TRANSMISSION));
+    trial.transmission_count = point->transmission_count;
+    trial.transmission_bytes = point->transmission_bytes;
+    trial.thread_count = point->thread_count;
+    for (ULONG64 i = 0; i < point->transmission_count; i++) {
+        trial.transmissions[i].data_sent = data_sent + i * point->transmission_bytes;
+        trial.transmissions[i].data_received = data_received + i * point->transmission_bytes;
+    }
+
+    BENCHMARK_RESULT result = {0};
+    result.latencies = zero_malloc(settings->trials * point->transmission_count * sizeof(ULONG64));
+
+    for (ULONG64 w = 0; w < settings->warmup_trials; w++) {
+        run_trial(point, settings, NULL);
+    }
+    for (ULONG64 t = 0; t < settings->trials; t++) {
+        run_trial(point, settings, &result);
+    }
+
+    print_result(settings, point, &result, first);
+
+    free(result.latencies);
+    free(trial.transmissions);
+    VirtualFree(data_sent, 0, MEM_RELEASE);
+    VirtualFree(data_received, 0, MEM_RELEASE);
+}
+
+/*
+ * main
+ *
+ * Entry point. Brings the layers up once, then runs every point of the sweep in turn.
+ *
+ * Usage: see print_usage.
+ */
+int main(int argc, char** argv) {
+
+    BENCHMARK_SETTINGS settings;
+    if (!parse_settings(argc, argv, &settings)) {
+        print_usage();
+        return 1;
+    }
+
+    simulation_begin = CreateEvent(NULL, MANUAL_RESET, FALSE, NULL);
+    simulation_end = CreateEvent(NULL, MANUAL_RESET, FALSE, NULL);
+    trial.start = CreateEvent(NULL, MANUAL_RESET, FALSE, NULL);
+
+    time_init();
+    bitmap_init();
+    placement_init();
+    create_network_layer();
+    create_transport_layer();
+    if (!set_payload_size(settings.payload_size)) {
+        printf("Error: packets with a %llu byte payload are bigger than the network can carry.\n",
+               settings.payload_size);
+        exit(1);
+    }
+    SetEvent(simulation_begin);
+
+    ULONG64 n_points = settings.minion_counts.count * settings.latencies_ms.count * settings.loss_rates.count *
+                       settings.thread_counts.count * settings.transmission_sizes.count *
+                       settings.transmission_counts.count;
+    ULONG64 point_number = 0;
+
+    print_header(&settings);
+
+    // The settings that take the longest to settle after a change -- the minions, the latency and the
+    // loss -- change least often.
+    for (ULONG64 m = 0; m < settings.minion_counts.count; m++)
+    for (ULONG64 l = 0; l < settings.latencies_ms.count; l++)
+    for (ULONG64 r = 0; r < settings.loss_rates.count; r++)
+    for (ULONG64 t = 0; t < settings.thread_counts.count; t++)
+    for (ULONG64 s = 0; s < settings.transmission_sizes.count; s++)
+    for (ULONG64 c = 0; c < settings.transmission_counts.count; c++) {
+
+        BENCHMARK_POINT point;
+        point.thread_count = settings.thread_counts.values[t];
+        point.transmission_bytes = settings.transmission_sizes.values[s];
+        point.loss_rate = settings.loss_rates.values[r];
+        point.latency_ms = settings.latencies_ms.values[l];
+        point.minion_count = settings.minion_counts.values[m];
+
+        ULONG64 most = max(BENCHMARK_BYTES_PER_TRIAL / (2 * point.transmission_bytes), 1);
+        point.transmission_count = min(settings.transmission_counts.values[c], most);
+
+        // Progress goes to stderr, so the results can be piped somewhere on their own.
+        fprintf(stderr, "Point %llu of %llu: %llu threads, %llu x %llu bytes, %g%% loss, %llu ms, %llu minions\n",
+                ++point_number, n_points, point.thread_count, point.transmission_count, point.transmission_bytes,
+                point.loss_rate, point.latency_ms, point.minion_count);
+
+        run_point(&settings, &point, point_number == 1);
+    }
+
+    print_footer(&settings);
+
+    SetEvent(simulation_end);
+    free_network_layer();
+    free_transport_layer();
+    CloseHandle(trial.start);
+    CloseHandle(simulation_begin);
+    CloseHandle(simulation_end);
+
+    if (settings.output != stdout) {
+        fclose(settings.output);
+    }
+    return 0;
+}
@@ -0,0 +1,107 @@
+/*
+ * benchmark.h
+ *
+ * Benchmark Suite
+ *
+ * Runs the whole stack -- application threads, transport and simulated network -- over a sweep
+ * of settings, and reports completion latency percentiles and goodput for each combination as CSV
+ * or JSON, one row or object per combination.
+ *
+ * Each dimension of the sweep is a comma-separated list on the command line. Every combination of
+ * them is a point. A point runs its warm-up trials, whose results are thrown away, and then its
+ * measured trials. A trial sends every one of the point's transmissions and waits for all of them
+ * to be received and checked.
+ *
+ * The points run one after another in the same process, on the same transport and network, so the
+ * layers are reconfigured between points rather than rebuilt: the loss rate with
+ * configure_impairments, the latency with configure_link_latency and the minion count with
+ * set_sender_minion_count. The warm-up trials let the congestion control and the RTT estimate
+ * settle after each change. The impairments are reseeded at the start of every trial, so the same
+ * settings see the same losses.
+ */
+
+#pragma once
+
+#include "../transport.h"
+#include "sweep.h"
+
+// What each dimension sweeps when it isn't given on the command line.
+#define DEFAULT_BENCHMARK_THREAD_COUNTS         "1,4"
+#define DEFAULT_BENCHMARK_TRANSMISSION_SIZES    "1K,64K,1M,16M"
+#define DEFAULT_BENCHMARK_TRANSMISSION_COUNTS   "16"
+#define DEFAULT_BENCHMARK_LOSS_RATES            "0,1"
+#define DEFAULT_BENCHMARK_LATENCIES_MS          "20"
+#define DEFAULT_BENCHMARK_MINION_COUNTS         "8"
+#define DEFAULT_BENCHMARK_TRIALS                5
+#define DEFAULT_BENCHMARK_WARMUP_TRIALS         1
+#define DEFAULT_BENCHMARK_SEED                  1
+
+#define MAX_BENCHMARK_THREADS                   64
+#define MAX_BENCHMARK_TRANSMISSIONS             1024
+#define MIN_BENCHMARK_TRANSMISSION_BYTES        KB(1)
+#define MAX_BENCHMARK_TRANSMISSION_BYTES        GB(1)
+#define MAX_BENCHMARK_TRIALS                    1000
+#define MAX_BENCHMARK_LATENCY_MS                1000
+
+// A trial's transmissions, sent and received, are all held at once. Past this many bytes of them,
+// a point sends fewer transmissions than it was asked to -- at least one -- and says so in its output.
+#define BENCHMARK_BYTES_PER_TRIAL               (4ULL * GB(1))
+
+// How long each receive_transmission call waits, and how long a trial may take before the
+// transmissions still missing are counted as failed.
+#define BENCHMARK_RECEIVE_TIMEOUT_MS            50
+#define BENCHMARK_TRIAL_TIMEOUT_MS              (10 * 60 * 1000)
+
+typedef struct {
+    SWEEP thread_counts;
+    SWEEP transmission_sizes;
+    SWEEP transmission_counts;
+    RATE_SWEEP loss_rates;
+    SWEEP latencies_ms;
+    SWEEP minion_counts;
+    ULONG64 trials;
+    ULONG64 warmup_trials;
+    ULONG64 payload_size;
+    ULONG64 seed;
+    ULONG64 format;
+    FILE* output;
+    char* label;
+} BENCHMARK_SETTINGS, *PBENCHMARK_SETTINGS;
+
+// One combination of the sweep.
+typedef struct {
+    ULONG64 thread_count;
+    ULONG64 transmission_bytes;
+    ULONG64 transmission_count;             // After BENCHMARK_BYTES_PER_TRIAL
+    double loss_rate;                       // Percent
+    ULONG64 latency_ms;                     // One way, in each direction
+    ULONG64 minion_count;
+} BENCHMARK_POINT, *PBENCHMARK_POINT;
+
+typedef struct {
+    UINT32 id;
+    PBYTE data_sent;
+    PBYTE data_received;
+    SIZE_T bytes_received;
+    ULONG64 time_sent;                      // TSC
+    ULONG64 time_received;                  // TSC. 0 until it has been received.
+} BENCHMARK_TRANSMISSION, *PBENCHMARK_TRANSMISSION;
+
+// The trial in progress. Thread i sends, and receives, every transmission whose index is i mod thread_count.
+typedef struct {
+    PBENCHMARK_TRANSMISSION transmissions;
+    ULONG64 transmission_count;
+    ULONG64 transmission_bytes;
+    ULONG64 thread_count;
+    ULONG64 deadline;                       // TSC
+    HANDLE start;                           // Manual reset. Set once every thread has been created.
+} BENCHMARK_TRIAL, *PBENCHMARK_TRIAL;
+
+// What a point's measured trials add up to.
+typedef struct {
+    PULONG64 latencies;                     // TSC, one per transmission received
+    ULONG64 latency_count;
+    double goodputs[MAX_BENCHMARK_TRIALS];  // Megabits per second, one per trial
+    ULONG64 trials_run;
+    ULONG64 failed;                         // Transmissions missing, or received wrong
+} BENCHMARK_RESULT, *PBENCHMARK_RESULT;
@@ -0,0 +1,537 @@
+/*
+ * network_microbenchmark.c
+ *
+ * Network Layer Microbenchmark Implementation
+ *
+ * Sweeps the thread counts and fill levels given on the command line (see network_microbenchmark.h
+ * and usage below) for every phase, and writes one CSV row or JSON object per operation:
+ *
+ *   label, operation, threads, fill_percent, trials, calls, failed, ns_per_call, mcalls_per_second
+ *
+ * ns_per_call is the time the threads spent in the operation's calls over how many they made, so it
+ * grows with contention. mcalls_per_second is every thread's calls over the average time each spent
+ * making them, so it is the scaling curve. Both are the median over the trials; calls and failed are
+ * the totals.
+ */
+
+#include "../network.c"
+#include "network_microbenchmark.h"
+
+// The primitives measured are the simulator's, and a real backend never calls them.
+#if NETWORK_BACKEND != NETWORK_BACKEND_SIMULATOR
+    #error The network microbenchmark needs NETWORK_BACKEND set to NETWORK_BACKEND_SIMULATOR
+#endif
+
+typedef struct {
+    PACKET header;
+    DC_HEADER data_header;
+    BYTE payload[MICROBENCHMARK_PAYLOAD_BYTES];
+} MICROBENCHMARK_PACKET, *PMICROBENCHMARK_PACKET;
+
+static const char* operation_names[MICROBENCHMARK_OPERATIONS] = {
+    "get_next_pm",
+    "acquire_slots",
+    "free_pm",
+    "add_pm_to_wheel",
+    "try_get_available_packet",
+    "round_trip",
+};
+
+static const ULONG64 operation_phases[MICROBENCHMARK_OPERATIONS] = {
+    PHASE_PM_LIFECYCLE,
+    PHASE_PM_LIFECYCLE,
+    PHASE_PM_LIFECYCLE,
+    PHASE_TIMER_WHEEL,
+    PHASE_TIMER_WHEEL,
+    PHASE_ROUND_TRIP,
+};
+
+static MICROBENCHMARK_TRIAL trial;
+
+static MICROBENCHMARK_RESULT trial_results[MAX_MICROBENCHMARK_TRIALS][MICROBENCHMARK_OPERATIONS];
+
+// The PMs the main thread holds to fill the buffer, one slot each.
+static PPM held_pms[NETWORK_BUFFER_NUMBER_OF_SLOTS];
+static ULONG64 held_count;
+
+static void print_usage(void) {
+    printf("Usage: PacketTransporterMicrobenchmark.exe [options]\n"
+           "\t--threads LIST      threads calling at once, 1 to %d.           Default: %s\n"
+           "\t--fill LIST         how full the buffer is kept, percent.        Default: %s\n"
+           "\t--operations N      calls per thread, per trial.                 Default: %d\n"
+           "\t--trials N          trials per point.                            Default: %d\n"
+           "\t--format csv|json                                                Default: csv\n"
+           "\t--output FILE       where to write the results.                  Default: stdout\n"
+           "\t--label TEXT        copied into every result, to tell runs apart.\n"
+           "LISTs are comma-separated.\n",
+           MAX_MICROBENCHMARK_THREADS, DEFAULT_MICROBENCHMARK_THREAD_COUNTS, DEFAULT_MICROBENCHMARK_FILL_LEVELS,
+           DEFAULT_MICROBENCHMARK_OPERATIONS, DEFAULT_MICROBENCHMARK_TRIALS);
+}
+
+/**
+ * @brief Fills in the settings from the command line, starting from the defaults.
+ * @return FALSE, having said why, if any argument is not valid.
+ */
+static BOOL parse_settings(int argc, char** argv, PMICROBENCHMARK_SETTINGS settings) {
+
+    char* thread_counts = DEFAULT_MICROBENCHMARK_THREAD_COUNTS;
+    char* fill_levels = DEFAULT_MICROBENCHMARK_FILL_LEVELS;
+    char* output = NULL;
+
+    settings->operations = DEFAULT_MICROBENCHMARK_OPERATIONS;
+    settings->trials = DEFAULT_MICROBENCHMARK_TRIALS;
+    settings->format = BENCHMARK_FORMAT_CSV;
+    settings->output = stdout;
+    settings->label = "";
+
+    for (int i = 1; i < argc; i++) {
+        char* option = argv[i];
+        char* value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(option, "--help") == 0) {
+            return FALSE;
+        }
+        if (value == NULL) {
+            printf("Error: %s needs a value.\n", option);
+            return FALSE;
+        }
+        i++;
+
+        if (strcmp(option, "--threads") == 0) thread_counts = value;
+        else if (strcmp(option, "--fill") == 0) fill_levels = value;
+        else if (strcmp(option, "--output") == 0) output = value;
+        else if (strcmp(option, "--label") == 0) settings->label = value;
+        else if (strcmp(option, "--operations") == 0) {
+            settings->operations = parse_size(value);
+            if (settings->operations == ARG_ERROR || settings->operations == 0 ||
+                settings->operations > MAX_MICROBENCHMARK_OPERATIONS) {
+                printf("Error: operations must be between 1 and 1G.\n");
+                return FALSE;
+            }
+        } else if (strcmp(option, "--trials") == 0) {
+            settings->trials = parse_size(value);
+            if (settings->trials == ARG_ERROR || settings->trials == 0 || settings->trials > MAX_MICROBENCHMARK_TRIALS) {
+                printf("Error: trials must be between 1 and %d.\n", MAX_MICROBENCHMARK_TRIALS);
+                return FALSE;
+            }
+        } else if (strcmp(option, "--format") == 0) {
+            if (!parse_format(value, &settings->format)) {
+                printf("Error: the format must be csv or json.\n");
+                return FALSE;
+            }
+        } else {
+            printf("Error: unknown option %s.\n", option);
+            return FALSE;
+        }
+    }
+
+    if (!parse_sweep(thread_counts, &settings->thread_counts, 1, MAX_MICROBENCHMARK_THREADS)) {
+        printf("Error: thread counts must be between 1 and %d.\n", MAX_MICROBENCHMARK_THREADS);
+        return FALSE;
+    }
+    if (!parse_sweep(fill_levels, &settings->fill_levels, 0, MAX_MICROBENCHMARK_FILL_PERCENT)) {
+        printf("Error: fill levels must be between 0 and %d percent.\n", MAX_MICROBENCHMARK_FILL_PERCENT);
+        return FALSE;
+    }
+
+    if (output != NULL) {
+        settings->output = fopen(output, "w");
+        if (settings->output == NULL) {
+            printf("Error: could not open %s.\n", output);
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/**
+ * @brief Finds the network every phase runs on: connection 0, from sender to receiver.
+ */
+static PNET benchmark_network(void) {
+    return &network_state.SR_nets[0];
+}
+
+/**
+ * @brief Gives back the bits the calling thread holds in its magazines for the benchmark's network,
+ *        so that only what it has actually claimed is taken. Threads would hand them back as they
+ *        exit anyway, but doing it here means they are back before anyone waiting on the thread looks.
+ */
+static void return_magazines(void) {
+
+    PNET net = benchmark_network();
+    PNET_MAGAZINES magazines = get_thread_magazines(net);
+    return_magazine(&magazines->pm_magazine, &net->pm_lock);
+    return_magazine(&magazines->slot_magazine, &net->net_lock);
+}
+
+/**
+ * @brief Claims fill_percent of the network's PMs and data slots, and holds them until empty_network.
+ */
+static void fill_network(ULONG64 fill_percent) {
+
+    PNET net = benchmark_network();
+    ULONG64 target = NETWORK_BUFFER_NUMBER_OF_SLOTS * fill_percent / 100;
+
+    held_count = 0;
+    while (held_count < target && get_next_pm(net, &held_pms[held_count])) {
+        acquire_slots(held_pms[held_count], 1, net);
+        held_count++;
+    }
+    return_magazines();
+}
+
+/**
+ * @brief Frees every packet a trial left in the network, and then the PMs fill_network holds.
+ */
+static void empty_network(void) {
+
+    PNET net = benchmark_network();
+    PPM pm;
+
+    // Round trips that timed out, and wheel batches other threads gave up on, leave packets behind.
+    for (UINT32 q = 0; q < RECEIVE_QUEUES_PER_NETWORK; q++) {
+        while (try_get_available_packet(&net->queues[q], &pm) == 0) {
+            free_pm(pm, net);
+        }
+    }
+
+    for (ULONG64 i = 0; i < held_count; i++) {
+        free_pm(held_pms[i], net);
+    }
+    held_count = 0;
+    return_magazines();
+
+    // Every thread that claimed anything has handed back what it didn't use.
+    ULONG64 pms_in_use = bitmap_count_range((PULONG64) net->pm_lock.bitmap, 0, net->pm_lock.num_bits);
+    ULONG64 slots_in_use = bitmap_count_range((PULONG64) net->net_lock.bitmap, 0, net->net_lock.num_bits);
+    if (pms_in_use != 0 || slots_in_use != 0) {
+        printf("A trial leaked %llu PMs and %llu slots\n", pms_in_use, slots_in_use);
+        exit(1);
+    }
+}
+
+static void record(PMICROBENCHMARK_WORKER worker, ULONG64 operation, ULONG64 ticks, ULONG64 calls, ULONG64 failed) {
+    worker->ticks[operation] += ticks;
+    worker->calls[operation] += calls;
+    worker->failed[operation] += failed;
+}
+
+/**
+ * @brief Claims a batch of PMs, gives each its slots, and frees them again, timing each step.
+ */
+static DWORD WINAPI pm_lifecycle_worker(LPVOID parameter) {
+
+    PMICROBENCHMARK_WORKER worker = &trial.workers[(ULONG64) parameter];
+    PNET net = benchmark_network();
+    PPM pms[MICROBENCHMARK_BATCH];
+
+    WaitForSingleObject(trial.start, INFINITE);
+
+    for (ULONG64 done = 0; done < trial.operations; done += MICROBENCHMARK_BATCH) {
+        ULONG64 claimed = 0;
+        ULONG64 short_of_slots = 0;
+
+        ULONG64 before_get = time_now();
+        for (ULONG64 i = 0; i < MICROBENCHMARK_BATCH; i++) {
+            if (get_next_pm(net, &pms[claimed])) claimed++;
+        }
+        ULONG64 before_acquire = time_now();
+        for (ULONG64 i = 0; i < claimed; i++) {
+            acquire_slots(pms[i], MICROBENCHMARK_SLOTS_PER_PACKET, net);
+            if (pms[i]->number_of_slots_reserved < MICROBENCHMARK_SLOTS_PER_PACKET) short_of_slots++;
+        }
+        ULONG64 before_free = time_now();
+        for (ULONG64 i = 0; i < claimed; i++) {
+            free_pm(pms[i], net);
+        }
+        ULONG64 after_free = time_now();
+
+        record(worker, OPERATION_GET_NEXT_PM, before_acquire - before_get, MICROBENCHMARK_BATCH,
+               MICROBENCHMARK_BATCH - claimed);
+        record(worker, OPERATION_ACQUIRE_SLOTS, before_free - before_acquire, claimed, short_of_slots);
+        record(worker, OPERATION_FREE_PM, after_free - before_free, claimed, 0);
+    }
+    return_magazines();
+    return 0;
+}
+
+/**
+ * @brief Adds a batch of PMs that have already arrived to a wheel shared by every thread, and takes
+ *        as many back off it, timing each step.
+ */
+static DWORD WINAPI timer_wheel_worker(LPVOID parameter) {
+
+    PMICROBENCHMARK_WORKER worker = &trial.workers[(ULONG64) parameter];
+    PNET net = benchmark_network();
+    PRECEIVE_QUEUE queue = &net->queues[0];
+    PPM pms[MICROBENCHMARK_BATCH];
+
+    WaitForSingleObject(trial.start, INFINITE);
+
+    for (ULONG64 done = 0; done < trial.operations; done += MICROBENCHMARK_BATCH) {
+        ULONG64 claimed = get_next_pms(net, pms, MICROBENCHMARK_BATCH);
+        ULONG64 now = time_now();
+        for (ULONG64 i = 0; i < claimed; i++) {
+            pms[i]->arrival_time = now;
+        }
+
+        ULONG64 before_add = time_now();
+        for (ULONG64 i = 0; i < claimed; i++) {
+            add_pm_to_wheel(pms[i], queue);
+        }
+        ULONG64 before_take = time_now();
+
+        // The PMs taken may be other threads'. If the wheel runs dry first, they have taken ours.
+        ULONG64 taken = 0;
+        ULONG64 calls = 0;
+        ULONG64 empty = 0;
+        while (taken < claimed) {
+            calls++;
+            ULONG64 eta = try_get_available_packet(queue, &pms[taken]);
+            if (eta == 0) {
+                taken++;
+                continue;
+            }
+            empty++;
+            if (eta == MAXULONG64) break;
+        }
+        ULONG64 after_take = time_now();
+
+        for (ULONG64 i = 0; i < taken; i++) {
+            free_pm(pms[i], net);
+        }
+
+        record(worker, OPERATION_ADD_PM_TO_WHEEL, before_take - before_add, claimed, 0);
+        record(worker, OPERATION_TRY_GET_AVAILABLE_PACKET, after_take - before_take, calls, empty);
+    }
+    return_magazines();
+    return 0;
+}
+
+/**
+ * @brief Sends a packet as the sender and receives one as the receiver, over and over. The packet
+ *        received may be another thread's; every thread receives as many as it sent.
+ */
+static DWORD WINAPI round_trip_worker(LPVOID parameter) {
+
+    ULONG64 index = (ULONG64) parameter;
+    PMICROBENCHMARK_WORKER worker = &trial.workers[index];
+    MICROBENCHMARK_PACKET sent;
+    MICROBENCHMARK_PACKET received;
+
+    memset(&sent, 0, sizeof(sent));
+    sent.header.total_bytes_in_packet_header = sizeof(PACKET);
+    sent.header.transmission_id = (UINT32) index;       // Spreads the threads over the receive queues
+    sent.header.bytes_in_payload = MICROBENCHMARK_PAYLOAD_BYTES;
+    sent.data_header.total_bytes_in_dc_header = sizeof(DC_HEADER);
+
+    WaitForSingleObject(trial.start, INFINITE);
+
+    ULONG64 failed = 0;
+    ULONG64 start = time_now();
+    for (ULONG64 i = 0; i < trial.operations; i++) {
+        if (send_packet((PPACKET) &sent, ROLE_SENDER) != PACKET_ACCEPTED) {
+            failed++;
+            continue;
+        }
+        if (receive_packet((PPACKET) &received, MICROBENCHMARK_RECEIVE_TIMEOUT_MS, ROLE_RECEIVER) != PACKET_RECEIVED) {
+            failed++;
+        }
+    }
+    record(worker, OPERATION_ROUND_TRIP, time_now() - start, trial.operations, failed);
+    return_magazines();
+
+    // As with the magazines, the next trial's threads find the queue free without waiting on our exit.
+    release_receive_queue(ROLE_RECEIVER);
+    return 0;
+}
+
+/**
+ * @brief Runs one trial of a phase, and sums what its threads did into one result per operation.
+ */
+static void run_trial(ULONG64 phase, ULONG64 thread_count, ULONG64 fill_percent, ULONG64 operations,
+                      PMICROBENCHMARK_RESULT results) {
+
+    static LPTHREAD_START_ROUTINE workers[MICROBENCHMARK_PHASES] = {
+        pm_lifecycle_worker,
+        timer_wheel_worker,
+        round_trip_worker,
+    };
+    HANDLE threads[MAX_MICROBENCHMARK_THREADS];
+
+    memset(trial.workers, 0, sizeof(trial.workers));
+    trial.phase = phase;
+    trial.thread_count = thread_count;
+    trial.operations = operations;
+
+    fill_network(fill_percent);
+
+    ResetEvent(trial.start);
+    for (ULONG64 i = 0; i < thread_count; i++) {
+        threads[i] = CreateThread(DEFAULT_SECURITY, DEFAULT_STACK_SIZE, workers[phase], (LPVOID) i,
+                                  DEFAULT_CREATION_FLAGS, NULL);
+        if (threads[i] == NULL) {
+            printf("Failed to create the microbenchmark's threads\n");
+            exit(1);
+        }
+    }
+    SetEvent(trial.start);
+
+    for (ULONG64 i = 0; i < thread_count; i++) {
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+    }
+
+    empty_network();
+
+    double ns_per_tick = 1e6 / (double) ms_to_tsc(1);
+    for (ULONG64 op = 0; op < MICROBENCHMARK_OPERATIONS; op++) {
+        ULONG64 ticks = 0;
+        PMICROBENCHMARK_RESULT result = &results[op];
+        memset(result, 0, sizeof(MICROBENCHMARK_RESULT));
+
+        for (ULONG64 i = 0; i < thread_count; i++) {
+            ticks += trial.workers[i].ticks[op];
+            result->calls += trial.workers[i].calls[op];
+            result->failed += trial.workers[i].failed[op];
+        }
+        if (result->calls == 0 || ticks == 0) continue;
+
+        result->ns_per_call = (double) ticks * ns_per_tick / (double) result->calls;
+        result->mcalls_per_second = (double) result->calls /
+                                    ((double) ticks * ns_per_tick / (double) thread_count) * 1e3;
+    }
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*) a;
+    double y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Finds the median of count values, reordering them.
+ */
+static double median(double* values, ULONG64 count) {
+    qsort(values, count, sizeof(double), compare_doubles);
+    return values[count / 2];
+}
+
+static void print_header(PMICROBENCHMARK_SETTINGS settings) {
+
+    if (settings->format == BENCHMARK_FORMAT_JSON) {
+        fprintf(settings->output, "[\n");
+        return;
+    }
+    fprintf(settings->output, "label,operation,threads,fill_percent,trials,calls,failed,ns_per_call,mcalls_per_second\n");
+}
+
+static void print_footer(PMICROBENCHMARK_SETTINGS settings) {
+
+    if (settings->format == BENCHMARK_FORMAT_JSON) {
+        fprintf(settings->output, "\n]\n");
+    }
+}
+
+/**
+ * @brief Writes one operation's results over the trials of a point, as a CSV row or a JSON object.
+ * @param first Whether this is the first result written, which a JSON object isn't preceded by a comma for.
+ */
+static void print_result(PMICROBENCHMARK_SETTINGS settings, ULONG64 operation, ULONG64 thread_count,
+                         ULONG64 fill_percent, BOOL first) {
+
+    double ns_per_call[MAX_MICROBENCHMARK_TRIALS];
+    double mcalls_per_second[MAX_MICROBENCHMARK_TRIALS];
+    ULONG64 calls = 0;
+    ULONG64 failed = 0;
+
+    for (ULONG64 t = 0; t < settings->trials; t++) {
+        ns_per_call[t] = trial_results[t][operation].ns_per_call;
+        mcalls_per_second[t] = trial_results[t][operation].mcalls_per_second;
+        calls += trial_results[t][operation].calls;
+        failed += trial_results[t][operation].failed;
+    }
+
+    if (settings->format == BENCHMARK_FORMAT_JSON) {
+        fprintf(settings->output,
+                "%s  {\"label\": \"%s\", \"operation\": \"%s\", \"threads\": %llu, \"fill_percent\": %llu, "
+                "\"trials\": %llu, \"calls\": %llu, \"failed\": %llu, \"ns_per_call\": %.1f, "
+                "\"mcalls_per_second\": %.3f}",
+                first ? "" : ",\n", settings->label, operation_names[operation], thread_count, fill_percent,
+                settings->trials, calls, failed, median(ns_per_call, settings->trials),
+                median(mcalls_per_second, settings->trials));
+    } else {
+        fprintf(settings->output, "%s,%s,%llu,%llu,%llu,%llu,%llu,%.1f,%.3f\n",
+                settings->label, operation_names[operation], thread_count, fill_percent, settings->trials,
+                calls, failed, median(ns_per_call, settings->trials), median(mcalls_per_second, settings->trials));
+    }
+    fflush(settings->output);
+}
+
+/*
+ * main
+ *
+ * Entry point. Brings the network layer up once, then runs every phase at every fill level and
+ * thread count in turn.
+ *
+ * Usage: see print_usage.
+ */
+int main(int argc, char** argv) {
+
+    MICROBENCHMARK_SETTINGS settings;
+    if (!parse_settings(argc, argv, &settings)) {
+        print_usage();
+        return 1;
+    }
+
+    trial.start = CreateEvent(NULL, MANUAL_RESET, FALSE, NULL);
+
+    time_init();
+    bitmap_init();
+    placement_init();
+    create_network_layer();
+
+    // Nothing but the calls themselves: no serialization, no latency and no impairments.
+    NETWORK_IMPAIRMENTS no_impairments = {0};
+    configure_impairments(&no_impairments);
+    configure_link(ROLE_SENDER, 0, 0);
+    configure_link_latency(ROLE_SENDER, 0);
+
+    ULONG64 n_points = MICROBENCHMARK_PHASES * settings.fill_levels.count * settings.thread_counts.count;
+    ULONG64 point_number = 0;
+    BOOL first = TRUE;
+
+    print_header(&settings);
+
+    // The thread counts change fastest, so each scaling curve comes out in one piece.
+    for (ULONG64 phase = 0; phase < MICROBENCHMARK_PHASES; phase++)
+    for (ULONG64 f = 0; f < settings.fill_levels.count; f++)
+    for (ULONG64 t = 0; t < settings.thread_counts.count; t++) {
+
+        ULONG64 fill_percent = settings.fill_levels.values[f];
+        ULONG64 thread_count = settings.thread_counts.values[t];
+
+        // Progress goes to stderr, so the results can be piped somewhere on their own.
+        fprintf(stderr, "Point %llu of %llu: phase %llu, %llu%% full, %llu threads\n",
+                ++point_number, n_points, phase, fill_percent, thread_count);
+
+        for (ULONG64 trial_number = 0; trial_number < settings.trials; trial_number++) {
+            run_trial(phase, thread_count, fill_percent, settings.operations, trial_results[trial_number]);
+        }
+
+        for (ULONG64 op = 0; op < MICROBENCHMARK_OPERATIONS; op++) {
+            if (operation_phases[op] != phase) continue;
+            print_result(&settings, op, thread_count, fill_percent, first);
+            first = FALSE;
+        }
+    }
+
+    print_footer(&settings);
+
+    free_network_layer();
+    CloseHandle(trial.start);
+
+    if (settings.output != stdout) {
+        fclose(settings.output);
+    }
+    return 0;
+}
@@ -0,0 +1,97 @@
+/*
+ * network_microbenchmark.h
+ *
+ * Network Layer Microbenchmark
+ *
+ * Measures the network layer's primitives on their own, with no transport on top: the cost of
+ * each call, and how it scales from one thread to many, as the buffer fills up. It is how to
+ * check again, after any change, what the development notes found with a one-off trace -- that
+ * the time goes to contention on shared state rather than to moving packets.
+ *
+ * The primitives are internal to network.c, so the microbenchmark is built with network.c
+ * included into it rather than linked beside it.
+ *
+ * Each point of the sweep is an operation's phase, a thread count and a fill level. Before a
+ * trial, the main thread claims that percentage of the PMs and data slots of connection 0's
+ * sender-to-receiver network and holds them, so the threads have to search past them. Then
+ * every thread runs the phase's loop the given number of times, in batches:
+ *
+ *   - PM lifecycle:  get_next_pm, acquire_slots and free_pm, a batch of each in turn
+ *   - Timer wheel:   add_pm_to_wheel, then try_get_available_packet until the batch is back
+ *   - Round trip:    send_packet and then receive_packet, one packet at a time
+ *
+ * The link is made infinitely fast, with no latency, so a round trip costs only its calls.
+ */
+
+#pragma once
+
+#include "../network.h"
+#include "sweep.h"
+
+#define DEFAULT_MICROBENCHMARK_THREAD_COUNTS    "1,2,4,8,16,32,64"
+#define DEFAULT_MICROBENCHMARK_FILL_LEVELS      "0,50,90"
+#define DEFAULT_MICROBENCHMARK_OPERATIONS       100000      // Per thread, per trial
+#define DEFAULT_MICROBENCHMARK_TRIALS           3
+
+#define MAX_MICROBENCHMARK_THREADS              64
+#define MAX_MICROBENCHMARK_FILL_PERCENT         99
+#define MAX_MICROBENCHMARK_OPERATIONS           GB(1)
+#define MAX_MICROBENCHMARK_TRIALS               100
+
+// Calls are timed a batch at a time, so reading the clock costs next to nothing per call.
+#define MICROBENCHMARK_BATCH                    32
+
+// Packets for the round trip take two slots: a realistic size, and one that makes acquire_slots loop.
+#define MICROBENCHMARK_SLOTS_PER_PACKET         2
+#define MICROBENCHMARK_PAYLOAD_BYTES            1500
+
+#define MICROBENCHMARK_RECEIVE_TIMEOUT_MS       1000
+
+// Phases
+#define PHASE_PM_LIFECYCLE                      0
+#define PHASE_TIMER_WHEEL                       1
+#define PHASE_ROUND_TRIP                        2
+#define MICROBENCHMARK_PHASES                   3
+
+// Operations, each reported on a row of its own
+#define OPERATION_GET_NEXT_PM                   0
+#define OPERATION_ACQUIRE_SLOTS                 1
+#define OPERATION_FREE_PM                       2
+#define OPERATION_ADD_PM_TO_WHEEL               3
+#define OPERATION_TRY_GET_AVAILABLE_PACKET      4
+#define OPERATION_ROUND_TRIP                    5
+#define MICROBENCHMARK_OPERATIONS               6
+
+typedef struct {
+    SWEEP thread_counts;
+    SWEEP fill_levels;                          // Percent
+    ULONG64 operations;
+    ULONG64 trials;
+    ULONG64 format;
+    FILE* output;
+    char* label;
+} MICROBENCHMARK_SETTINGS, *PMICROBENCHMARK_SETTINGS;
+
+// What one thread did in a trial. Each is written only by its own thread, so they are kept a line apart.
+typedef struct {
+    __declspec(align(CACHE_LINE_SIZE)) ULONG64 ticks[MICROBENCHMARK_OPERATIONS];   // TSC spent in the calls
+    ULONG64 calls[MICROBENCHMARK_OPERATIONS];
+    ULONG64 failed[MICROBENCHMARK_OPERATIONS];  // Calls that found nothing to claim, or to receive
+} MICROBENCHMARK_WORKER, *PMICROBENCHMARK_WORKER;
+
+// The trial in progress.
+typedef struct {
+    ULONG64 phase;
+    ULONG64 thread_count;
+    ULONG64 operations;
+    HANDLE start;                               // Manual reset. Set once every thread has been created.
+    MICROBENCHMARK_WORKER workers[MAX_MICROBENCHMARK_THREADS];
+} MICROBENCHMARK_TRIAL, *PMICROBENCHMARK_TRIAL;
+
+// One operation's results for a trial, summed over its threads.
+typedef struct {
+    ULONG64 calls;
+    ULONG64 failed;
+    double ns_per_call;
+    double mcalls_per_second;                   // Every thread's calls over the time each spent making them
+} MICROBENCHMARK_RESULT, *PMICROBENCHMARK_RESULT;
@@ -0,0 +1,82 @@
+//
+// Parsing for the lists and formats the benchmarks take on their command lines.
+//
+
+#include "sweep.h"
+
+ULONG64 parse_size(char* text) {
+
+    if (text == NULL || *text < '0' || *text > '9') return ARG_ERROR;
+
+    char* end;
+    errno = 0;
+    ULONG64 value = strtoull(text, &end, 10);
+    if (errno == ERANGE) return ARG_ERROR;
+
+    ULONG64 scale = 1;
+    if (*end == 'K' || *end == 'k') scale = KB(1);
+    if (*end == 'M' || *end == 'm') scale = MB(1);
+    if (*end == 'G' || *end == 'g') scale = GB(1);
+    if (scale != 1) end++;
+    if (*end != '\0') return ARG_ERROR;
+    if (value > MAXULONG64 / scale) return ARG_ERROR;
+
+    return value * scale;
+}
+
+/**
+ * @brief Ends the item of a comma-separated list that starts at item, where the next one starts.
+ * @return The start of the next item, or NULL if this was the last.
+ */
+static char* next_item(char* item) {
+
+    char* comma = strchr(item, ',');
+    if (comma == NULL) return NULL;
+    *comma = '\0';
+    return comma + 1;
+}
+
+BOOL parse_sweep(char* list, PSWEEP sweep, ULONG64 min, ULONG64 max) {
+
+    char copy[1024];
+    if (list == NULL || strlen(list) >= sizeof(copy)) return FALSE;
+    memcpy(copy, list, strlen(list) + 1);
+
+    sweep->count = 0;
+    for (char* item = copy; item != NULL; ) {
+        char* next = next_item(item);
+        ULONG64 value = parse_size(item);
+        if (value == ARG_ERROR || value < min || value > max) return FALSE;
+        if (sweep->count == MAX_SWEEP_VALUES) return FALSE;
+        sweep->values[sweep->count++] = value;
+        item = next;
+    }
+    return sweep->count != 0;
+}
+
+BOOL parse_rate_sweep(char* list, PRATE_SWEEP sweep) {
+
+    char copy[1024];
+    if (list == NULL || strlen(list) >= sizeof(copy)) return FALSE;
+    memcpy(copy, list, strlen(list) + 1);
+
+    sweep->count = 0;
+    for (char* item = copy; item != NULL; ) {
+        char* next = next_item(item);
+        char* end;
+        double value = strtod(item, &end);
+        if (end == item || *end != '\0' || !(value >= 0 && value <= 100)) return FALSE;
+        if (sweep->count == MAX_SWEEP_VALUES) return FALSE;
+        sweep->values[sweep->count++] = value;
+        item = next;
+    }
+    return sweep->count != 0;
+}
+
+BOOL parse_format(char* text, PULONG64 format) {
+
+    if (strcmp(text, "csv") == 0) *format = BENCHMARK_FORMAT_CSV;
+    else if (strcmp(text, "json") == 0) *format = BENCHMARK_FORMAT_JSON;
+    else return FALSE;
+    return TRUE;
+}
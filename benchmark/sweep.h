@@ -0,0 +1,54 @@
+/*
+ * sweep.h
+ *
+ * Benchmark Sweeps
+ *
+ * The command-line lists both benchmarks sweep over, and the output formats they share. A list is
+ * comma-separated; counts in it may end in K, M or G.
+ */
+
+#pragma once
+
+#include "../utils.h"
+
+#define MAX_SWEEP_VALUES                        16
+
+// What parse_size returns for anything that isn't a count.
+#define ARG_ERROR                               MAXULONG64
+
+#define BENCHMARK_FORMAT_CSV                    0
+#define BENCHMARK_FORMAT_JSON                   1
+
+typedef struct {
+    ULONG64 values[MAX_SWEEP_VALUES];
+    ULONG64 count;
+} SWEEP, *PSWEEP;
+
+typedef struct {
+    double values[MAX_SWEEP_VALUES];
+    ULONG64 count;
+} RATE_SWEEP, *PRATE_SWEEP;
+
+/**
+ * @brief Parses a count, with an optional K, M or G suffix.
+ * @return The count, or ARG_ERROR if it isn't one.
+ */
+ULONG64 parse_size(char* text);
+
+/**
+ * @brief Parses a comma-separated list of counts (or byte counts), each from min to max, into a sweep.
+ * @return FALSE if the list is empty, too long, or any value is out of range.
+ */
+BOOL parse_sweep(char* list, PSWEEP sweep, ULONG64 min, ULONG64 max);
+
+/**
+ * @brief Parses a comma-separated list of percentages from 0 to 100 into a sweep.
+ * @return FALSE if the list is empty, too long, or any value is out of range.
+ */
+BOOL parse_rate_sweep(char* list, PRATE_SWEEP sweep);
+
+/**
+ * @brief Parses "csv" or "json" into one of the BENCHMARK_FORMAT_ values.
+ * @return FALSE if it is neither.
+ */
+BOOL parse_format(char* text, PULONG64 format);
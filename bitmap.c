@@ -0,0 +1,247 @@
+//
+// Word kernels for the bitmap helpers, and the runtime dispatch between them.
+//
+
+#include "bitmap.h"
+#include "cpu_features.h"
+
+#if defined(_M_ARM64)
+    #include <arm64_neon.h>
+#elif defined(_M_X64) || defined(_M_IX86)
+    #include <immintrin.h>
+#else
+    #error "Unsupported architecture"
+#endif
+
+/*
+ * A find kernel returns the index of the first word in [start, end) that is not equal to skip,
+ * or end if they all are. A count kernel returns the number of set bits in count whole words.
+ */
+typedef ULONG64 (*FIND_WORD_ROUTINE)(PULONG64 words, ULONG64 start, ULONG64 end, ULONG64 skip);
+typedef ULONG64 (*COUNT_WORDS_ROUTINE)(PULONG64 words, ULONG64 count);
+
+static ULONG64 find_word_scalar(PULONG64 words, ULONG64 start, ULONG64 end, ULONG64 skip) {
+
+    while (start < end && words[start] == skip) {
+        start++;
+    }
+    return start;
+}
+
+static ULONG64 count_words_scalar(PULONG64 words, ULONG64 count) {
+
+    ULONG64 total = 0;
+    for (ULONG64 i = 0; i < count; i++) {
+        total += POPCOUNT64(words[i]);
+    }
+    return total;
+}
+
+#if defined(_M_ARM64)
+
+static ULONG64 find_word_neon(PULONG64 words, ULONG64 start, ULONG64 end, ULONG64 skip) {
+
+    uint64x2_t pattern = vdupq_n_u64(skip);
+
+    // Two words at a time. Lanes that match come back all ones, so the minimum tells us if both did.
+    while (start + 2 <= end) {
+        uint64x2_t equal = vceqq_u64(vld1q_u64(words + start), pattern);
+        if (vminvq_u32(vreinterpretq_u32_u64(equal)) != UINT32_MAX) {
+            break;
+        }
+        start += 2;
+    }
+    return find_word_scalar(words, start, end, skip);
+}
+
+static ULONG64 count_words_neon(PULONG64 words, ULONG64 count) {
+
+    ULONG64 total = 0;
+    ULONG64 i = 0;
+
+    // Per-byte counts top out at 8, so the 16 of them always fit in the byte vaddvq_u8 sums into.
+    for (; i + 2 <= count; i += 2) {
+        uint8x16_t bytes = vcntq_u8(vreinterpretq_u8_u64(vld1q_u64(words + i)));
+        total += vaddvq_u8(bytes);
+    }
+    return total + count_words_scalar(words + i, count - i);
+}
+
+#else
+
+static ULONG64 find_word_avx2(PULONG64 words, ULONG64 start, ULONG64 end, ULONG64 skip) {
+
+    __m256i pattern = _mm256_set1_epi64x((LONG64) skip);
+
+    // Four words at a time. Each word that matches sets its bit in the movemask.
+    while (start + 4 <= end) {
+        __m256i equal = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i*) (words + start)), pattern);
+        if (_mm256_movemask_pd(_mm256_castsi256_pd(equal)) != 0xF) {
+            break;
+        }
+        start += 4;
+    }
+    return find_word_scalar(words, start, end, skip);
+}
+
+static ULONG64 count_words_avx2(PULONG64 words, ULONG64 count) {
+
+    // Look up the count of each nibble, then sum the bytes of each word with a SAD against zero.
+    const __m256i nibble_counts = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                                   0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_nibbles = _mm256_set1_epi8(0x0F);
+    __m256i totals = _mm256_setzero_si256();
+    ULONG64 i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        __m256i block = _mm256_loadu_si256((const __m256i*) (words + i));
+        __m256i low = _mm256_and_si256(block, low_nibbles);
+        __m256i high = _mm256_and_si256(_mm256_srli_epi16(block, 4), low_nibbles);
+        __m256i bytes = _mm256_add_epi8(_mm256_shuffle_epi8(nibble_counts, low),
+                                        _mm256_shuffle_epi8(nibble_counts, high));
+        totals = _mm256_add_epi64(totals, _mm256_sad_epu8(bytes, _mm256_setzero_si256()));
+    }
+
+    ULONG64 lanes[4];
+    _mm256_storeu_si256((__m256i*) lanes, totals);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + count_words_scalar(words + i, count - i);
+}
+
+#endif
+
+static FIND_WORD_ROUTINE find_word = find_word_scalar;
+static COUNT_WORDS_ROUTINE count_words = count_words_scalar;
+
+void bitmap_init(void) {
+
+#if defined(_M_ARM64)
+    if (IsProcessorFeaturePresent(PF_ARM_NEON_INSTRUCTIONS_AVAILABLE)) {
+        find_word = find_word_neon;
+        count_words = count_words_neon;
+    }
+#else
+    // This also checks that the OS saves the YMM registers, which CPUID alone doesn't tell us.
+    if (IsProcessorFeaturePresent(PF_AVX2_INSTRUCTIONS_AVAILABLE)) {
+        find_word = find_word_avx2;
+        count_words = count_words_avx2;
+    }
+#endif
+}
+
+ULONG64 bitmap_find_next(PULONG64 bitmap, ULONG64 start, ULONG64 limit, BOOL value) {
+
+    if (start >= limit) {
+        return limit;
+    }
+
+    // Looking for a clear bit is looking for a set bit in the complement.
+    ULONG64 skip = value ? 0 : ~0ULL;
+    ULONG64 word_index = start / 64;
+    ULONG64 word = (bitmap[word_index] ^ skip) & (~0ULL << (start % 64));
+
+    if (word == 0) {
+        ULONG64 end_word = BITMAP_WORDS(limit);
+        word_index = find_word(bitmap, word_index + 1, end_word, skip);
+        if (word_index == end_word) {
+            return limit;
+        }
+        word = bitmap[word_index] ^ skip;
+    }
+
+    ULONG bit;
+    _BitScanForward64(&bit, word);
+    return min(limit, word_index * 64 + bit);
+}
+
+ULONG64 bitmap_find_prev(PULONG64 bitmap, ULONG64 end, ULONG64 floor, BOOL value) {
+
+    // Callers only ever look back over the last few gaps, so this one stays a word at a time.
+    while (end > floor) {
+        ULONG64 last = end - 1;
+        ULONG64 word = value ? bitmap[last / 64] : ~bitmap[last / 64];
+        word &= ~0ULL >> (63 - last % 64);
+        if (word != 0) {
+            ULONG bit;
+            _BitScanReverse64(&bit, word);
+            return max(floor, (last & ~63ULL) + bit + 1);
+        }
+        end = last & ~63ULL;
+    }
+    return floor;
+}
+
+ULONG64 bitmap_count_range(PULONG64 bitmap, ULONG64 start, ULONG64 end) {
+
+    if (start >= end) {
+        return 0;
+    }
+
+    ULONG64 first_word = start / 64;
+    ULONG64 last_word = (end - 1) / 64;
+    ULONG64 first_mask = ~0ULL << (start % 64);
+    ULONG64 last_mask = ~0ULL >> (63 - (end - 1) % 64);
+
+    if (first_word == last_word) {
+        return POPCOUNT64(bitmap[first_word] & first_mask & last_mask);
+    }
+
+    return POPCOUNT64(bitmap[first_word] & first_mask) +
+           count_words(bitmap + first_word + 1, last_word - first_word - 1) +
+           POPCOUNT64(bitmap[last_word] & last_mask);
+}
+
+BOOL bitmap_range_is_full(PULONG64 bitmap, ULONG64 start, ULONG64 end) {
+    return bitmap_find_next(bitmap, start, end, FALSE) == end;
+}
+
+ULONG64 bitmap_set_range(PULONG64 bitmap, ULONG64 start, ULONG64 end) {
+
+    if (start >= end) {
+        return 0;
+    }
+
+    ULONG64 first_word = start / 64;
+    ULONG64 last_word = (end - 1) / 64;
+    ULONG64 first_mask = ~0ULL << (start % 64);
+    ULONG64 last_mask = ~0ULL >> (63 - (end - 1) % 64);
+
+    if (first_word == last_word) {
+        ULONG64 newly_set = first_mask & last_mask & ~bitmap[first_word];
+        bitmap[first_word] |= newly_set;
+        return POPCOUNT64(newly_set);
+    }
+
+    ULONG64 newly_set = POPCOUNT64(first_mask & ~bitmap[first_word]) + POPCOUNT64(last_mask & ~bitmap[last_word]);
+    bitmap[first_word] |= first_mask;
+    bitmap[last_word] |= last_mask;
+
+    // Whatever the middle words were missing, they have now.
+    ULONG64 middle_words = last_word - first_word - 1;
+    if (middle_words != 0) {
+        newly_set += middle_words * 64 - count_words(bitmap + first_word + 1, middle_words);
+        memset(bitmap + first_word + 1, 0xFF, middle_words * sizeof(ULONG64));
+    }
+
+    return newly_set;
+}
+
+void bitmap_clear_range(PULONG64 bitmap, ULONG64 start, ULONG64 end) {
+
+    if (start >= end) {
+        return;
+    }
+
+    ULONG64 first_word = start / 64;
+    ULONG64 last_word = (end - 1) / 64;
+    ULONG64 first_mask = ~0ULL << (start % 64);
+    ULONG64 last_mask = ~0ULL >> (63 - (end - 1) % 64);
+
+    if (first_word == last_word) {
+        bitmap[first_word] &= ~(first_mask & last_mask);
+        return;
+    }
+
+    bitmap[first_word] &= ~first_mask;
+    bitmap[last_word] &= ~last_mask;
+    memset(bitmap + first_word + 1, 0, (last_word - first_word - 1) * sizeof(ULONG64));
+}
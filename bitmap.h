@@ -0,0 +1,59 @@
+#pragma once
+
+#include "utils.h"
+
+/**
+ * Bitmaps are flat arrays of ULONG64 words: bit i lives in bit (i % 64) of word (i / 64).
+ * Packet status bitmaps, the application's transmission locks and the network's slot
+ * bitmaps all share this layout.
+ *
+ * The single-word work (masking the partial words at either end of a range, finding a bit
+ * within a word) is done with _BitScanForward64 / POPCOUNT64. Long runs of whole words are
+ * handed to a kernel picked once at startup by bitmap_init: AVX2 on x64 processors that
+ * have it, NEON on ARM64, and plain word-at-a-time loops otherwise. Until bitmap_init is
+ * called the plain loops are used, so calling it is an optimization, not a requirement.
+ *
+ * None of these functions are interlocked. A bitmap that several threads set bits in must
+ * still be claimed with the Interlocked bit operations; these are for the scans around them.
+ */
+
+#define BITMAP_WORDS(bits)              (((bits) + 63) / 64)
+#define BITMAP_TEST(bitmap, index)      (((bitmap)[(index) / 64] >> ((index) % 64)) & 1)
+
+/**
+ * @brief Picks the fastest word kernels this processor supports. Call once, before the transport starts.
+ */
+void bitmap_init(void);
+
+/**
+ * @brief Finds the first bit at or after start that equals value.
+ * @return The index of the bit, or limit if there isn't one below limit.
+ */
+ULONG64 bitmap_find_next(PULONG64 bitmap, ULONG64 start, ULONG64 limit, BOOL value);
+
+/**
+ * @brief Finds the last bit below end (and at or above floor) that equals value.
+ * @return One past the index of the bit, or floor if there isn't one.
+ */
+ULONG64 bitmap_find_prev(PULONG64 bitmap, ULONG64 end, ULONG64 floor, BOOL value);
+
+/**
+ * @brief Counts the set bits in [start, end).
+ */
+ULONG64 bitmap_count_range(PULONG64 bitmap, ULONG64 start, ULONG64 end);
+
+/**
+ * @brief Checks whether every bit in [start, end) is set. Stops at the first clear word.
+ */
+BOOL bitmap_range_is_full(PULONG64 bitmap, ULONG64 start, ULONG64 end);
+
+/**
+ * @brief Sets every bit in [start, end).
+ * @return The number of those bits that were clear before the call.
+ */
+ULONG64 bitmap_set_range(PULONG64 bitmap, ULONG64 start, ULONG64 end);
+
+/**
+ * @brief Clears every bit in [start, end).
+ */
+void bitmap_clear_range(PULONG64 bitmap, ULONG64 start, ULONG64 end);
@@ -0,0 +1,106 @@
+//
+// CRC32C kernels and the runtime dispatch between them.
+//
+
+#include "checksum.h"
+#include "cpu_features.h"
+
+#if defined(_M_ARM64)
+    #include <intrin.h>
+#elif defined(_M_X64) || defined(_M_IX86)
+    #include <nmmintrin.h>
+#else
+    #error "Unsupported architecture"
+#endif
+
+// The Castagnoli polynomial, bit-reversed.
+#define CRC32C_POLYNOMIAL   0x82F63B78
+
+// Each kernel continues a running CRC -- the caller does the inversion at either end.
+typedef UINT32 (*CRC32C_ROUTINE)(UINT32 crc, PBYTE data, ULONG64 bytes);
+
+static UINT32 crc32c_table[256];
+
+static UINT32 crc32c_software(UINT32 crc, PBYTE data, ULONG64 bytes) {
+
+    for (ULONG64 i = 0; i < bytes; i++) {
+        crc = crc32c_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(_M_ARM64)
+
+static UINT32 crc32c_hardware(UINT32 crc, PBYTE data, ULONG64 bytes) {
+
+    for (; bytes >= 8; bytes -= 8, data += 8) {
+        ULONG64 word;
+        memcpy(&word, data, sizeof(word));
+        crc = __crc32cd(crc, word);
+    }
+    for (; bytes != 0; bytes--, data++) {
+        crc = __crc32cb(crc, *data);
+    }
+    return crc;
+}
+
+#elif defined(_M_X64)
+
+static UINT32 crc32c_hardware(UINT32 crc, PBYTE data, ULONG64 bytes) {
+
+    ULONG64 crc64 = crc;
+    for (; bytes >= 8; bytes -= 8, data += 8) {
+        ULONG64 word;
+        memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (UINT32) crc64;
+    for (; bytes != 0; bytes--, data++) {
+        crc = _mm_crc32_u8(crc, *data);
+    }
+    return crc;
+}
+
+#else
+
+static UINT32 crc32c_hardware(UINT32 crc, PBYTE data, ULONG64 bytes) {
+
+    for (; bytes >= 4; bytes -= 4, data += 4) {
+        UINT32 word;
+        memcpy(&word, data, sizeof(word));
+        crc = _mm_crc32_u32(crc, word);
+    }
+    for (; bytes != 0; bytes--, data++) {
+        crc = _mm_crc32_u8(crc, *data);
+    }
+    return crc;
+}
+
+#endif
+
+static CRC32C_ROUTINE crc32c_kernel = crc32c_software;
+
+void checksum_init(void) {
+
+    for (UINT32 i = 0; i < 256; i++) {
+        UINT32 crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLYNOMIAL : crc >> 1;
+        }
+        crc32c_table[i] = crc;
+    }
+
+#if defined(_M_ARM64)
+    if (IsProcessorFeaturePresent(PF_ARM_V8_CRC32_INSTRUCTIONS_AVAILABLE)) {
+        crc32c_kernel = crc32c_hardware;
+    }
+#else
+    if (IsProcessorFeaturePresent(PF_SSE4_2_INSTRUCTIONS_AVAILABLE)) {
+        crc32c_kernel = crc32c_hardware;
+    }
+#endif
+}
+
+UINT32 crc32c(PVOID data, ULONG64 bytes) {
+    return ~crc32c_kernel(~0u, (PBYTE) data, bytes);
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "utils.h"
+
+/**
+ * Payload checksums are CRC32C (the Castagnoli polynomial, as used by iSCSI and SCTP). Both
+ * ends of the transport compute it over a packet's payload and carry it in the universal
+ * header's payload_checksum field.
+ *
+ * checksum_init picks the kernel once: the SSE4.2 crc32 instruction on x64, the ARMv8 CRC32
+ * instructions on ARM64, or a table-driven loop when the processor has neither. The hardware
+ * kernels take 8 bytes per instruction, well under a cycle per byte.
+ */
+
+/**
+ * @brief Picks the CRC32C kernel for this processor. Must be called before the first checksum.
+ */
+void checksum_init(void);
+
+/**
+ * @brief Computes the CRC32C of bytes bytes starting at data.
+ */
+UINT32 crc32c(PVOID data, ULONG64 bytes);
+
+// The checksum a packet carries for bytes bytes of payload at data.
+#if PAYLOAD_CHECKSUMS
+#define PAYLOAD_CHECKSUM(data, bytes)           crc32c((data), (bytes))
+#define PAYLOAD_CHECKSUM_MATCHES(sum, data, bytes)  ((sum) == crc32c((data), (bytes)))
+#else
+#define PAYLOAD_CHECKSUM(data, bytes)           0
+#define PAYLOAD_CHECKSUM_MATCHES(sum, data, bytes)  TRUE
+#endif
@@ -0,0 +1,222 @@
+//
+// The LZ4-format block compressor and decompressor behind chunk compression.
+//
+
+#include "compress.h"
+
+#define COMPRESS_HASH(sequence)     (((sequence) * 2654435761u) >> (32 - COMPRESS_HASH_BITS))
+
+// After this many misses in a row the compressor starts skipping ahead, a byte further each time
+// it gets another this many more -- data that isn't matching is likely not to match for a while.
+#define COMPRESS_SKIP_SHIFT         6
+
+static UINT32 read32(PBYTE p) {
+    UINT32 value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static ULONG64 read64(PBYTE p) {
+    ULONG64 value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+/**
+ * @brief Counts how many of the bytes from a on match the ones from b, stopping at limit.
+ */
+static ULONG64 match_length(PBYTE a, PBYTE b, PBYTE limit) {
+
+    PBYTE start = a;
+
+    // Eight bytes at a time. The first differing byte is the lowest set bit of the difference.
+    while (a + sizeof(ULONG64) <= limit) {
+        ULONG64 difference = read64(a) ^ read64(b);
+        if (difference != 0) {
+            ULONG bit;
+            _BitScanForward64(&bit, difference);
+            return (ULONG64) (a - start) + bit / 8;
+        }
+        a += sizeof(ULONG64);
+        b += sizeof(ULONG64);
+    }
+    while (a < limit && *a == *b) {
+        a++;
+        b++;
+    }
+    return (ULONG64) (a - start);
+}
+
+/**
+ * @brief Writes the 255-byte continuation of a literal or match length that didn't fit in its token.
+ */
+static PBYTE write_length(PBYTE op, ULONG64 length) {
+
+    while (length >= 255) {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = (BYTE) length;
+    return op;
+}
+
+/**
+ * @brief Writes one sequence: its literals and then its match.
+ * @return Where the next sequence goes, or NULL if this one doesn't fit before op_end.
+ */
+static PBYTE write_sequence(PBYTE op, PBYTE op_end, PBYTE literals, ULONG64 n_literals, ULONG64 offset,
+                            ULONG64 match_bytes) {
+
+    ULONG64 match_code = match_bytes - COMPRESS_MIN_MATCH;
+    ULONG64 needed = 1 + n_literals / 255 + 1 + n_literals + 2 + match_code / 255 + 1;
+    if ((ULONG64) (op_end - op) < needed) {
+        return NULL;
+    }
+
+    PBYTE token = op++;
+    *token = (BYTE) ((min(n_literals, 15) << 4) | min(match_code, 15));
+    if (n_literals >= 15) {
+        op = write_length(op, n_literals - 15);
+    }
+    memcpy(op, literals, n_literals);
+    op += n_literals;
+
+    op[0] = (BYTE) offset;
+    op[1] = (BYTE) (offset >> 8);
+    op += 2;
+    if (match_code >= 15) {
+        op = write_length(op, match_code - 15);
+    }
+    return op;
+}
+
+ULONG64 compress_block(PBYTE src, ULONG64 src_bytes, PBYTE dst, ULONG64 dst_capacity) {
+
+    // Where each 4-byte sequence was last seen, plus one so that 0 can mean never.
+    UINT32 table[1 << COMPRESS_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    PBYTE op = dst;
+    PBYTE op_end = dst + dst_capacity;
+    ULONG64 anchor = 0;
+
+    // A block too short to hold a match is all literals.
+    if (src_bytes > COMPRESS_MATCH_LIMIT) {
+
+        ULONG64 match_start_limit = src_bytes - COMPRESS_MATCH_LIMIT;
+        PBYTE match_end_limit = src + src_bytes - COMPRESS_LAST_LITERALS;
+        ULONG64 ip = 0;
+        ULONG64 misses = 0;
+
+        while (ip < match_start_limit) {
+            UINT32 sequence = read32(src + ip);
+            UINT32 hash = COMPRESS_HASH(sequence);
+            ULONG64 candidate = table[hash];
+            table[hash] = (UINT32) (ip + 1);
+
+            if (candidate == 0 || ip - (candidate - 1) > COMPRESS_MAX_OFFSET || read32(src + candidate - 1) != sequence) {
+                ip += 1 + (misses++ >> COMPRESS_SKIP_SHIFT);
+                continue;
+            }
+            misses = 0;
+
+            ULONG64 reference = candidate - 1;
+            ULONG64 length = COMPRESS_MIN_MATCH + match_length(src + ip + COMPRESS_MIN_MATCH,
+                                                               src + reference + COMPRESS_MIN_MATCH,
+                                                               match_end_limit);
+            op = write_sequence(op, op_end, src + anchor, ip - anchor, ip - reference, length);
+            if (op == NULL) {
+                return 0;
+            }
+            ip += length;
+            anchor = ip;
+        }
+    }
+
+    // The last sequence is literals alone.
+    ULONG64 n_literals = src_bytes - anchor;
+    if ((ULONG64) (op_end - op) < 1 + n_literals / 255 + 1 + n_literals) {
+        return 0;
+    }
+    *op++ = (BYTE) (min(n_literals, 15) << 4);
+    if (n_literals >= 15) {
+        op = write_length(op, n_literals - 15);
+    }
+    memcpy(op, src + anchor, n_literals);
+    op += n_literals;
+
+    return (ULONG64) (op - dst);
+}
+
+/**
+ * @brief Reads the continuation of a literal or match length whose token said 15, adding it to length.
+ * @return FALSE if the block ends first.
+ */
+static BOOL read_length(PBYTE* ip, PBYTE ip_end, PULONG64 length) {
+
+    BYTE byte;
+    do {
+        if (*ip == ip_end) {
+            return FALSE;
+        }
+        byte = *(*ip)++;
+        *length += byte;
+    } while (byte == 255);
+    return TRUE;
+}
+
+BOOL decompress_block(PBYTE src, ULONG64 src_bytes, PBYTE dst, ULONG64 dst_bytes) {
+
+    PBYTE ip = src;
+    PBYTE ip_end = src + src_bytes;
+    PBYTE op = dst;
+    PBYTE op_end = dst + dst_bytes;
+
+    while (ip < ip_end) {
+        BYTE token = *ip++;
+
+        ULONG64 n_literals = token >> 4;
+        if (n_literals == 15 && !read_length(&ip, ip_end, &n_literals)) {
+            return FALSE;
+        }
+        if (n_literals > (ULONG64) (ip_end - ip) || n_literals > (ULONG64) (op_end - op)) {
+            return FALSE;
+        }
+        memcpy(op, ip, n_literals);
+        ip += n_literals;
+        op += n_literals;
+
+        // Only the last sequence has no match.
+        if (ip == ip_end) {
+            break;
+        }
+
+        if (ip_end - ip < 2) {
+            return FALSE;
+        }
+        ULONG64 offset = ip[0] | ((ULONG64) ip[1] << 8);
+        ip += 2;
+
+        ULONG64 match_bytes = token & 15;
+        if (match_bytes == 15 && !read_length(&ip, ip_end, &match_bytes)) {
+            return FALSE;
+        }
+        match_bytes += COMPRESS_MIN_MATCH;
+        if (offset == 0 || offset > (ULONG64) (op - dst) || match_bytes > (ULONG64) (op_end - op)) {
+            return FALSE;
+        }
+
+        // A match closer than its own length overlaps what it is writing, and repeats it.
+        PBYTE match = op - offset;
+        if (offset >= match_bytes) {
+            memcpy(op, match, match_bytes);
+        } else {
+            for (ULONG64 i = 0; i < match_bytes; i++) {
+                op[i] = match[i];
+            }
+        }
+        op += match_bytes;
+    }
+
+    return op == op_end;
+}
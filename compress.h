@@ -0,0 +1,42 @@
+#pragma once
+
+#include "utils.h"
+
+/**
+ * Chunk compression: a byte-aligned LZ77 codec in the LZ4 block format. Each block is a run of
+ * sequences, each one some literal bytes followed by a copy of earlier output (an offset of up to
+ * 64 KB back and a length of at least COMPRESS_MIN_MATCH). The last sequence is literals alone.
+ *
+ * The compressor finds matches through a small hash table of the positions of recent 4-byte
+ * sequences, and gives up as soon as its output would not fit in the space it was given -- so a
+ * block that doesn't compress well costs no more than one pass over it. Decompression is a loop of
+ * copies, and checks every length and offset against both buffers.
+ */
+
+#define COMPRESS_MIN_MATCH          4
+// The LZ4 format ends every block with at least this many literals, and starts no match closer
+// to the end than COMPRESS_MATCH_LIMIT.
+#define COMPRESS_LAST_LITERALS      5
+#define COMPRESS_MATCH_LIMIT        12
+#define COMPRESS_MAX_OFFSET         65535
+#define COMPRESS_HASH_BITS          12
+
+/**
+ * @brief Compresses a block.
+ * @param src The bytes to compress.
+ * @param src_bytes The number of bytes at src.
+ * @param dst Where to write the compressed block.
+ * @param dst_capacity The most the compressed block may take.
+ * @return The size of the compressed block, or 0 if it would not fit in dst_capacity.
+ */
+ULONG64 compress_block(PBYTE src, ULONG64 src_bytes, PBYTE dst, ULONG64 dst_capacity);
+
+/**
+ * @brief Decompresses a block written by compress_block.
+ * @param src The compressed block.
+ * @param src_bytes The size of the compressed block.
+ * @param dst Where to write the block's bytes.
+ * @param dst_bytes The exact number of bytes the block decompresses to.
+ * @return FALSE if the block is malformed, or doesn't decompress to exactly dst_bytes bytes.
+ */
+BOOL decompress_block(PBYTE src, ULONG64 src_bytes, PBYTE dst, ULONG64 dst_bytes);
@@ -18,9 +18,13 @@
 #define MB(x)       (KB(x) * 1024)
 #define GB(x)       (MB(x) * 1024)
 
-// Maximum number of bytes per packet
-#define MAX_PAYLOAD_SIZE        KB(1)
-#define MAX_PACKETS_TO_ACK      (MAX_PAYLOAD_SIZE * 8)
+// Number of bytes per packet. The payload size (our MTU) is chosen at runtime with set_payload_size,
+// and may be any power of two in this range. Anything that holds a whole packet is sized for the largest.
+#define MIN_PAYLOAD_SIZE        KB(1)
+#define MAX_PAYLOAD_SIZE        KB(64)
+#define DEFAULT_PAYLOAD_SIZE    KB(1)
+#define IS_VALID_PAYLOAD_SIZE(x)    ((x) >= MIN_PAYLOAD_SIZE && (x) <= MAX_PAYLOAD_SIZE && ((x) & ((x) - 1)) == 0)
+#define MAX_PACKETS_TO_ACK      (MIN_PAYLOAD_SIZE * 8)
 
 // Default timeout for receive_packet (milliseconds)
 #define PACKET_WAIT_TIME_MS     500
@@ -32,13 +36,83 @@
 /* 
  * Network reliability settings
  * Set to 0 to disable, or a value 1-100 representing percentage chance
+ * These are the defaults -- configure_impairments changes them at runtime.
  */
 #define NETWORK_DROP_RATE       0   // Percentage of packets silently dropped
 #define NETWORK_DUPLICATE_RATE  0   // Percentage of packets sent twice
 #define NETWORK_CORRUPT_RATE    0   // Percentage of packets with corrupted data
 
+/*
+ * Set to 1 to checksum every packet's payload, and drop (and NACK) packets that fail the check.
+ * Set to 0 to trust the network -- the checksum field is then left 0 and never looked at.
+ */
+#define PAYLOAD_CHECKSUMS       1
+
 /*
  * Set to 1 to enable packet reordering (packets may arrive out of order)
  * Set to 0 for in-order delivery
  */
-#define NETWORK_REORDER_ENABLED 0
\ No newline at end of file
+#define NETWORK_REORDER_ENABLED 0
+#define NETWORK_REORDER_RATE            10  // Percentage of packets held back when reordering is enabled
+#define NETWORK_REORDER_MAX_DELAY_MS    2   // The longest a packet is held back
+
+/*
+ * Seeds the network's random number generators. The same seed gives the same impairments
+ * for the same sequence of sends on each thread.
+ */
+#define NETWORK_RANDOM_SEED     1
+
+/*
+ * Set to a period (milliseconds) to print a telemetry snapshot of what changed over each one while
+ * the test runs. Set to 0 to print only the totals at the end.
+ */
+#define TELEMETRY_EXPORT_PERIOD_MS  0
+
+/*
+ * Set to 1 to pin threads and allocate each side's memory on a NUMA node of its own: the sender's
+ * listener, minions and buffers on SENDER_NUMA_NODE, and the receiver's workers and buffers on
+ * RECEIVER_NUMA_NODE. Node numbers past the machine's last node wrap around, so on one node both
+ * sides share it. Set to 0 to leave threads and memory wherever the OS puts them, which is better
+ * when there are more threads than processors.
+ */
+#define PLACEMENT_ENABLED       0
+#define SENDER_NUMA_NODE        0
+#define RECEIVER_NUMA_NODE      1
+
+/*
+ * How each kind of thread is pinned when placement is enabled: to nothing, to any processor on its
+ * side's node, or to a processor of its own there -- one per physical core before any hyperthread
+ * sibling, and round-robin once they run out.
+ */
+#define PIN_NONE                0
+#define PIN_NODE                1
+#define PIN_CORE                2
+
+#define SENDER_LISTENER_PINNING PIN_CORE
+#define SENDER_MINION_PINNING   PIN_CORE
+#define RECEIVER_WORKER_PINNING PIN_CORE
+#define APP_THREAD_PINNING      PIN_NODE
+
+/*
+ * What carries the packets: the simulated network, a shared-memory section other processes on this
+ * host can map, or UDP. The two real backends carry packets between the roles in NETWORK_LOCAL_ROLES
+ * and whichever process or host plays the others. The defaults play both, over this process's own
+ * section or the loopback interface. See network_backend.h. A target can pick its own, as the network
+ * microbenchmark does.
+ */
+#define NETWORK_BACKEND_SIMULATOR       0
+#define NETWORK_BACKEND_SHARED_MEMORY   1
+#define NETWORK_BACKEND_UDP             2
+#ifndef NETWORK_BACKEND
+#define NETWORK_BACKEND                 NETWORK_BACKEND_SIMULATOR
+#endif
+
+#define NETWORK_LOCAL_ROLES     ((1 << ROLE_SENDER) | (1 << ROLE_RECEIVER))
+
+#define SHARED_MEMORY_NAME      "Local\\PacketTransporterNetwork"
+
+// Each role's socket is bound to its own address, and the other role sends to it.
+#define UDP_SENDER_ADDRESS      "127.0.0.1"
+#define UDP_SENDER_PORT         50000
+#define UDP_RECEIVER_ADDRESS    "127.0.0.1"
+#define UDP_RECEIVER_PORT       50001
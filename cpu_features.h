@@ -0,0 +1,20 @@
+#pragma once
+
+#include "config.h"
+
+/**
+ * The processor features the SIMD kernels dispatch on, for IsProcessorFeaturePresent. Older SDKs
+ * don't name these yet, so the kernels share these fallbacks rather than each keeping its own.
+ */
+#ifndef PF_ARM_NEON_INSTRUCTIONS_AVAILABLE
+#define PF_ARM_NEON_INSTRUCTIONS_AVAILABLE      19
+#endif
+#ifndef PF_ARM_V8_CRC32_INSTRUCTIONS_AVAILABLE
+#define PF_ARM_V8_CRC32_INSTRUCTIONS_AVAILABLE  31
+#endif
+#ifndef PF_SSE4_2_INSTRUCTIONS_AVAILABLE
+#define PF_SSE4_2_INSTRUCTIONS_AVAILABLE        38
+#endif
+#ifndef PF_AVX2_INSTRUCTIONS_AVAILABLE
+#define PF_AVX2_INSTRUCTIONS_AVAILABLE          40
+#endif
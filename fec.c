@@ -0,0 +1,245 @@
+//
+// GF(2^8) arithmetic, the Reed-Solomon erasure code built on it, and the runtime dispatch
+// between the multiply-and-add kernels.
+//
+
+#include "fec.h"
+#include "cpu_features.h"
+
+#if defined(_M_ARM64)
+    #include <arm64_neon.h>
+#elif defined(_M_X64) || defined(_M_IX86)
+    #include <immintrin.h>
+#else
+    #error "Unsupported architecture"
+#endif
+
+// x^8 + x^4 + x^3 + x^2 + 1, the usual Reed-Solomon field polynomial. 2 generates the field under it.
+#define GF_POLYNOMIAL       0x11D
+
+static BYTE gf_log[256];
+static BYTE gf_exp[512];
+
+// gf_product_low[c][x] is c * x, and gf_product_high[c][x] is c * (x << 4). A product is the
+// sum (XOR) of its two nibbles' lookups -- which is what a 16-entry byte shuffle does best.
+static BYTE gf_product_low[256][16];
+static BYTE gf_product_high[256][16];
+
+static BYTE coefficients[FEC_MAX_PARITY_PACKETS][FEC_MAX_DATA_PACKETS];
+
+static BYTE gf_mul(BYTE a, BYTE b) {
+    if (a == 0 || b == 0) {
+        return 0;
+    }
+    return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+static BYTE gf_inv(BYTE a) {
+    ASSERT(a != 0);
+    return gf_exp[255 - gf_log[a]];
+}
+
+// A kernel sets dst[i] ^= c * src[i] for bytes bytes.
+typedef void (*GF_MUL_ADD_ROUTINE)(PBYTE dst, PBYTE src, BYTE c, ULONG64 bytes);
+
+static void gf_mul_add_scalar(PBYTE dst, PBYTE src, BYTE c, ULONG64 bytes) {
+
+    PBYTE low = gf_product_low[c];
+    PBYTE high = gf_product_high[c];
+    for (ULONG64 i = 0; i < bytes; i++) {
+        dst[i] ^= low[src[i] & 0x0F] ^ high[src[i] >> 4];
+    }
+}
+
+#if defined(_M_ARM64)
+
+static void gf_mul_add_neon(PBYTE dst, PBYTE src, BYTE c, ULONG64 bytes) {
+
+    uint8x16_t low = vld1q_u8(gf_product_low[c]);
+    uint8x16_t high = vld1q_u8(gf_product_high[c]);
+    uint8x16_t low_nibbles = vdupq_n_u8(0x0F);
+    ULONG64 i = 0;
+
+    for (; i + 16 <= bytes; i += 16) {
+        uint8x16_t block = vld1q_u8(src + i);
+        uint8x16_t product = veorq_u8(vqtbl1q_u8(low, vandq_u8(block, low_nibbles)),
+                                      vqtbl1q_u8(high, vshrq_n_u8(block, 4)));
+        vst1q_u8(dst + i, veorq_u8(vld1q_u8(dst + i), product));
+    }
+    gf_mul_add_scalar(dst + i, src + i, c, bytes - i);
+}
+
+#else
+
+static void gf_mul_add_avx2(PBYTE dst, PBYTE src, BYTE c, ULONG64 bytes) {
+
+    // The shuffle looks up within each 128-bit lane, so both lanes get the same table.
+    __m256i low = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*) gf_product_low[c]));
+    __m256i high = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*) gf_product_high[c]));
+    __m256i low_nibbles = _mm256_set1_epi8(0x0F);
+    ULONG64 i = 0;
+
+    for (; i + 32 <= bytes; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i*) (src + i));
+        __m256i product = _mm256_xor_si256(
+            _mm256_shuffle_epi8(low, _mm256_and_si256(block, low_nibbles)),
+            _mm256_shuffle_epi8(high, _mm256_and_si256(_mm256_srli_epi16(block, 4), low_nibbles)));
+        __m256i sum = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*) (dst + i)), product);
+        _mm256_storeu_si256((__m256i*) (dst + i), sum);
+    }
+    gf_mul_add_scalar(dst + i, src + i, c, bytes - i);
+}
+
+#endif
+
+static GF_MUL_ADD_ROUTINE gf_mul_add = gf_mul_add_scalar;
+
+void fec_init(void) {
+
+    UINT32 x = 1;
+    for (UINT32 i = 0; i < 255; i++) {
+        gf_exp[i] = (BYTE) x;
+        gf_log[x] = (BYTE) i;
+        x <<= 1;
+        if (x & 0x100) {
+            x ^= GF_POLYNOMIAL;
+        }
+    }
+    // Doubled up, so a product can index by the sum of two logs without reducing it.
+    for (UINT32 i = 255; i < 512; i++) {
+        gf_exp[i] = gf_exp[i - 255];
+    }
+
+    for (UINT32 c = 0; c < 256; c++) {
+        for (UINT32 n = 0; n < 16; n++) {
+            gf_product_low[c][n] = gf_mul((BYTE) c, (BYTE) n);
+            gf_product_high[c][n] = gf_mul((BYTE) c, (BYTE) (n << 4));
+        }
+    }
+
+    // Cauchy: 1 / (x_j + y_i), with the parity packets' x_j and the data packets' y_i all distinct.
+    for (UINT32 j = 0; j < FEC_MAX_PARITY_PACKETS; j++) {
+        for (UINT32 i = 0; i < FEC_MAX_DATA_PACKETS; i++) {
+            coefficients[j][i] = gf_inv((BYTE) ((FEC_MAX_DATA_PACKETS + j) ^ i));
+        }
+    }
+
+#if defined(_M_ARM64)
+    if (IsProcessorFeaturePresent(PF_ARM_NEON_INSTRUCTIONS_AVAILABLE)) {
+        gf_mul_add = gf_mul_add_neon;
+    }
+#else
+    if (IsProcessorFeaturePresent(PF_AVX2_INSTRUCTIONS_AVAILABLE)) {
+        gf_mul_add = gf_mul_add_avx2;
+    }
+#endif
+}
+
+void fec_encode(PBYTE* data, PULONG64 lengths, ULONG64 n_data, PBYTE* parity, ULONG64 n_parity, ULONG64 parity_bytes) {
+
+    for (ULONG64 j = 0; j < n_parity; j++) {
+        memset(parity[j], 0, parity_bytes);
+    }
+
+    // Data packet by data packet, so each one is read from memory once and then comes from cache.
+    for (ULONG64 i = 0; i < n_data; i++) {
+        ASSERT(lengths[i] <= parity_bytes);
+        for (ULONG64 j = 0; j < n_parity; j++) {
+            gf_mul_add(parity[j], data[i], coefficients[j][i], lengths[i]);
+        }
+    }
+}
+
+/**
+ * @brief Inverts an n by n matrix over GF(2^8) in place, by Gauss-Jordan elimination.
+ * @return FALSE if the matrix is singular. A square piece of a Cauchy matrix never is.
+ */
+static BOOL invert_matrix(PBYTE matrix, ULONG64 n) {
+
+    BYTE inverse[FEC_MAX_PARITY_PACKETS * FEC_MAX_PARITY_PACKETS] = {0};
+    for (ULONG64 i = 0; i < n; i++) {
+        inverse[i * n + i] = 1;
+    }
+
+    for (ULONG64 column = 0; column < n; column++) {
+
+        // Find a row with something in this column and swap it up.
+        ULONG64 pivot = column;
+        while (pivot < n && matrix[pivot * n + column] == 0) {
+            pivot++;
+        }
+        if (pivot == n) {
+            return FALSE;
+        }
+        for (ULONG64 k = 0; k < n; k++) {
+            BYTE t = matrix[column * n + k];
+            matrix[column * n + k] = matrix[pivot * n + k];
+            matrix[pivot * n + k] = t;
+            t = inverse[column * n + k];
+            inverse[column * n + k] = inverse[pivot * n + k];
+            inverse[pivot * n + k] = t;
+        }
+
+        // Scale it to a leading 1, then clear the column out of every other row.
+        BYTE scale = gf_inv(matrix[column * n + column]);
+        for (ULONG64 k = 0; k < n; k++) {
+            matrix[column * n + k] = gf_mul(matrix[column * n + k], scale);
+            inverse[column * n + k] = gf_mul(inverse[column * n + k], scale);
+        }
+        for (ULONG64 row = 0; row < n; row++) {
+            BYTE factor = matrix[row * n + column];
+            if (row == column || factor == 0) {
+                continue;
+            }
+            for (ULONG64 k = 0; k < n; k++) {
+                matrix[row * n + k] ^= gf_mul(factor, matrix[column * n + k]);
+                inverse[row * n + k] ^= gf_mul(factor, inverse[column * n + k]);
+            }
+        }
+    }
+
+    memcpy(matrix, inverse, n * n);
+    return TRUE;
+}
+
+void fec_decode(PBYTE* data, PULONG64 lengths, ULONG64 n_data, PULONG64 missing, ULONG64 n_missing,
+                PBYTE* parity, PULONG64 parity_rows, ULONG64 parity_bytes) {
+
+    ASSERT(n_missing <= FEC_MAX_PARITY_PACKETS);
+
+    BOOL is_missing[FEC_MAX_DATA_PACKETS] = {0};
+    for (ULONG64 u = 0; u < n_missing; u++) {
+        is_missing[missing[u]] = TRUE;
+    }
+
+    // Take the packets we have out of each parity packet. What's left is the sum of the missing ones alone.
+    for (ULONG64 i = 0; i < n_data; i++) {
+        if (is_missing[i]) {
+            continue;
+        }
+        for (ULONG64 t = 0; t < n_missing; t++) {
+            gf_mul_add(parity[t], data[i], coefficients[parity_rows[t]][i], lengths[i]);
+        }
+    }
+
+    // That leaves n_missing equations in n_missing unknowns. Solve them.
+    BYTE matrix[FEC_MAX_PARITY_PACKETS * FEC_MAX_PARITY_PACKETS];
+    for (ULONG64 t = 0; t < n_missing; t++) {
+        for (ULONG64 u = 0; u < n_missing; u++) {
+            matrix[t * n_missing + u] = coefficients[parity_rows[t]][missing[u]];
+        }
+    }
+    if (!invert_matrix(matrix, n_missing)) {
+        ASSERT(FALSE);
+        return;
+    }
+
+    for (ULONG64 u = 0; u < n_missing; u++) {
+        PBYTE packet = data[missing[u]];
+        ASSERT(lengths[missing[u]] <= parity_bytes);
+        memset(packet, 0, lengths[missing[u]]);
+        for (ULONG64 t = 0; t < n_missing; t++) {
+            gf_mul_add(packet, parity[t], matrix[u * n_missing + t], lengths[missing[u]]);
+        }
+    }
+}
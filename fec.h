@@ -0,0 +1,50 @@
+#pragma once
+
+#include "utils.h"
+
+/**
+ * Forward error correction: a systematic Reed-Solomon erasure code over GF(2^8).
+ *
+ * A group of up to FEC_MAX_DATA_PACKETS data packets is sent as-is, followed by up to
+ * FEC_MAX_PARITY_PACKETS parity packets. Parity packet j is the sum over the group of
+ * a coefficient c(j, i) times data packet i, byte by byte, with every data packet padded with
+ * zeros to the parity length. The coefficients form a Cauchy matrix, every square piece of
+ * which can be inverted -- so any m parity packets rebuild any m missing data packets.
+ *
+ * All of the bulk work is multiply-and-add of a whole payload by one coefficient. fec_init
+ * picks the kernel for that: AVX2 on x64 processors that have it, NEON on ARM64, and a
+ * scalar loop otherwise. All three use the same split-nibble product tables.
+ */
+
+#define FEC_MAX_DATA_PACKETS    128
+#define FEC_MAX_PARITY_PACKETS  16
+
+/**
+ * @brief Builds the GF(2^8) tables and picks the multiply-and-add kernel. Must be called before any other fec_ function.
+ */
+void fec_init(void);
+
+/**
+ * @brief Computes the parity packets for a group of data packets.
+ * @param data The group's data packets, in order.
+ * @param lengths The bytes in each data packet. None may be longer than parity_bytes.
+ * @param n_data The number of data packets, at most FEC_MAX_DATA_PACKETS.
+ * @param parity Where to write the parity packets. Each gets parity_bytes bytes.
+ * @param n_parity The number of parity packets, at most FEC_MAX_PARITY_PACKETS.
+ * @param parity_bytes The length of each parity packet.
+ */
+void fec_encode(PBYTE* data, PULONG64 lengths, ULONG64 n_data, PBYTE* parity, ULONG64 n_parity, ULONG64 parity_bytes);
+
+/**
+ * @brief Rebuilds the missing data packets of a group from the ones that arrived and some of its parity.
+ * @param data The group's data packets, in order. The missing ones are written to where these point.
+ * @param lengths The bytes in each data packet, missing or not.
+ * @param n_data The number of data packets in the group.
+ * @param missing The indexes of the missing data packets.
+ * @param n_missing The number of missing data packets, at most FEC_MAX_PARITY_PACKETS.
+ * @param parity n_missing parity packets of parity_bytes bytes each. They are used as scratch space.
+ * @param parity_rows The parity index of each of those parity packets.
+ * @param parity_bytes The length of each parity packet.
+ */
+void fec_decode(PBYTE* data, PULONG64 lengths, ULONG64 n_data, PULONG64 missing, ULONG64 n_missing,
+                PBYTE* parity, PULONG64 parity_rows, ULONG64 parity_bytes);
@@ -1,5 +1,8 @@
-#include "network.h"
+#include "network_backend.h"
 #include "network_packets.h"
+#include "bitmap.h"
+#include "telemetry.h"
+#include "placement.h"
 
 /**
  *  Network Layer Implementation
@@ -27,22 +30,48 @@
  *     If there ARE packets ready in the buffer, this thread will copy
  *     their data into the transport-layer packet, then free the PM and
  *     its data slots before returning a success code.
+ *
+ *  Every connection has a network of its own in each direction, chosen by the
+ *  connection ID in the packet's universal header. A connection that fills its
+ *  buffer only drops its own packets. Receivers take from the connections in turn,
+ *  starting from a different one each call, so no connection is starved at this end either.
  **/
 
 #if DEBUG
 typedef struct {
     ULONG64 packets_dropped_for_lack_of_slots;
     ULONG64 pms_overwritten;
+    ULONG64 packets_tail_dropped;
+    ULONG64 packets_dropped_by_impairment;
+    ULONG64 packets_duplicated;
+    ULONG64 packets_corrupted;
+    ULONG64 packets_reordered;
 } DEBUG_INFO;
 
 DEBUG_INFO debug_info;
 #endif
 
 #define TYPICAL_SLOT_CAPACITY 4
-#define NUM_PACKET_LISTS    64
+#define MAX_SLOTS_PER_PACKET    (MAX_PAYLOAD_SIZE / NETWORK_BUFFER_SLOT_SIZE_IN_BYTES + 1)
+#define LINEAR_COPY_SIZE_IN_BYTES   (MAX_SLOTS_PER_PACKET * NETWORK_BUFFER_SLOT_SIZE_IN_BYTES)
+
+// Every packet in a batch may be duplicated
+#define MAX_COPIES_PER_BATCH    (2 * MAX_PACKETS_PER_BATCH)
+
+// Link serialization times are kept in 1/65536ths of a TSC tick per byte, so fast links stay accurate.
+#define LINK_RATE_FIXED_POINT_SHIFT     16
+
+// A wheel tick is about 1/64 ms: the largest power of two TSC ticks that is no longer than that.
+#define WHEEL_TICKS_PER_MS_SHIFT        6
 
-#define DROP_PROBABILITY    0.00
-#define DROP_RATE (int) (DROP_PROBABILITY * RAND_MAX)
+// Level 0 has a bucket per tick, and spans 64 ms or so. Its occupancy is one bit per bucket,
+// summarized by one bit per word -- so there must be exactly 64 words.
+#define WHEEL_LEVEL0_BUCKETS            4096
+#define WHEEL_LEVEL0_WORDS              (WHEEL_LEVEL0_BUCKETS / 64)
+
+// Level 1 has coarser buckets for anything further out, and spans about a second.
+#define WHEEL_LEVEL1_BUCKETS            64
+#define WHEEL_LEVEL1_TICKS_PER_BUCKET   (WHEEL_LEVEL0_BUCKETS / 4)
 
 
 
@@ -61,8 +90,12 @@ typedef struct packet_metadata {
     UINT32 number_of_slots_reserved;
     ULONG64 total_size_in_bytes;
     ULONG64 arrival_time;
+    ULONG64 send_time;                          // When send_packet took it, for the one-way delay
     UINT32 capacity_of_slot_number_array;
     PUINT32 slot_numbers;
+    PBYTE linear_copy;                          // Taken from the network's pool while a packet whose slots are
+                                                // not contiguous is lent out. NULL otherwise.
+    struct network* net;                        // The network whose buffer holds this PM's slots
 } PM, *PPM;
 
 /**
@@ -77,50 +110,179 @@ typedef struct bitmap_lock {
 } BIT_LOCK, *PBIT_LOCK;
 
 /**
- *  The timer wheel provides access to SLists of packet metadata.
- *  We use this data structure to group PMs by arrival time.
- *  Senders add them with InterlockedPushEntrySList. The particular
- *  list is determined by the hand variable. We lazily bump the hand
- *  once per millisecond by comparing the tick count to the saved timestamp.
+ * A link is the wire one direction's packets are serialized onto. It is claimed with a single
+ * compare-exchange on the time its queue drains: a sender pushes that time out by the
+ * serialization time of everything it sends, and its packets depart in between.
+ */
+typedef struct link {
+    __declspec(align(CACHE_LINE_SIZE)) volatile ULONG64 last_departure;    // When the queue's last byte leaves (TSC)
+    ULONG64 tsc_per_byte;                                                   // Fixed point. 0 is an infinitely fast link.
+    ULONG64 queue_limit;                                                    // The longest a packet may wait for the link (TSC)
+    ULONG64 propagation_delay;                                              // From leaving the link to arriving (TSC)
+} LINK, *PLINK;
+
+/**
+ *  The timer wheel groups PMs by the tick they arrive in. It has two levels: level 0 has
+ *  a bucket per tick for the next 64 ms or so, and level 1 has a bucket per 1024 ticks
+ *  beyond that. Level 1 buckets are moved down into level 0 as they come into its range.
  *
- *  NOTE: the hand grows beyond the bounds of the list array. To find the list
- *  pointed to by the hand, we must use modulo:  index = hand % NUM_PACKET_LISTS
+ *  Senders add PMs with InterlockedPushListSListEx (so the buckets need no lock) and then
+ *  set the bucket's bit in the occupancy bitmap. A receiver finds the next bucket that
+ *  needs looking at with a find-first-set on the summary word and then on the bitmap word,
+ *  rather than by walking the buckets.
  *
+ *  The cursor is the earliest tick whose bucket may still hold packets. Only the thread
+ *  holding the advancing flag moves it, and it moves the earliest due bucket onto the
+ *  receiver's list in the order its packets were added.
+ *
+ *  NOTE: ticks and windows grow beyond the bounds of the bucket arrays. To find a tick's
+ *  bucket, we must use modulo:  index = tick % WHEEL_LEVEL0_BUCKETS
  */
 typedef struct {
-    SLIST_HEADER lists[NUM_PACKET_LISTS];
-    volatile UINT32 hand;
-    volatile ULONG64 last_updated_time;
+    SLIST_HEADER level0[WHEEL_LEVEL0_BUCKETS];
+    SLIST_HEADER level1[WHEEL_LEVEL1_BUCKETS];
+    volatile LONG64 level0_occupied[WHEEL_LEVEL0_WORDS];
+    volatile LONG64 level0_summary;                         // One bit per word that may be non-zero
+    volatile LONG64 level1_occupied;
+    __declspec(align(CACHE_LINE_SIZE)) volatile LONG64 cursor;     // In ticks
+    volatile LONG64 level1_cursor;                          // The next level 1 window to move down
+    volatile LONG advancing;
+    ULONG tick_shift;                                       // TSC ticks per wheel tick, as a power of two
 } PM_TIMER_WHEEL, *PPM_TIMER_WHEEL;
 
 /**
- * The network struct keeps track of all data for one of the networks
- * (sender->receiver and receiver->sender). This includes a bitmap lock,
- * a set of PMs, and a buffer of packet data.
+ * A receive queue is one of the network's "NIC" queues. Packets are steered to a queue by their
+ * transmission, and each queue has its own wheel and its own list of packets taken off it, so
+ * threads receiving from different queues never touch the same list heads.
+ *
+ * The packets_present event is shared by the same queue on every connection in one direction,
+ * since a receiving thread waits on all of them at once.
  */
-typedef struct network {
+typedef struct receive_queue {
     SLIST_HEADER receiver_packet_list;
     PM_TIMER_WHEEL pm_wheel;
+    HANDLE packets_present;
+} RECEIVE_QUEUE, *PRECEIVE_QUEUE;
+
+/**
+ * The network struct keeps track of all data for one of the networks
+ * (sender->receiver or receiver->sender, for one connection). This includes a bitmap lock,
+ * a set of PMs, a buffer of packet data, and the receive queues packets wait in.
+ */
+typedef struct network {
+    RECEIVE_QUEUE queues[RECEIVE_QUEUES_PER_NETWORK];
     BIT_LOCK net_lock;
     BIT_LOCK pm_lock;
     PPM metadata_slots;
-    volatile UINT32 next_PM_slot;
     PBYTE packet_buffer;
-    HANDLE packets_present;
+    PLINK link;
+    volatile LONG* receive_queue_owners;        // How many threads have taken each queue on the receiving end
+    volatile LONG* owned_receive_queues;        // A bit for each queue on the receiving end with an owner
+    SLIST_HEADER free_linear_copies;            // Linear copies no lent packet is using, LINEAR_COPY_SIZE_IN_BYTES each
+    UINT32 magazine_index;
+    int sending_role;                           // The side whose threads write the buffer, and whose node it is on
 } NET, *PNET;
 
 /**
  * The network state keeps track of all global variables relevant to
  * the entire network layer.
+ *
+ * The generation is bumped every time the network layer is created, so that
+ * threads can tell when the bits held in their magazines belong to bitmaps
+ * that no longer exist.
  */
 typedef struct network_state {
-    NET SR_net;
-    NET RS_net;
+    NET SR_nets[MAX_CONNECTIONS];
+    NET RS_nets[MAX_CONNECTIONS];
+    HANDLE SR_packets_present[RECEIVE_QUEUES_PER_NETWORK];
+    HANDLE RS_packets_present[RECEIVE_QUEUES_PER_NETWORK];
+    volatile LONG receive_queue_owners[2][RECEIVE_QUEUES_PER_NETWORK];  // Indexed by the receiving role
+    volatile LONG owned_receive_queues[2];      // Indexed by the receiving role. Only packets are steered to these.
+    LINK SR_link;
+    LINK RS_link;
     BOOL initialized;
+    volatile ULONG64 generation;
+    DWORD thread_exit_fls_index;
+    PNETWORK_BACKEND_CALLS backend;             // NULL when the simulator carries the packets
+    volatile LONG backend_calls;                // Calls inside the backend, which free_network_layer waits out
 } NET_STATE, *PNET_STATE;
 
 // This is our global net state variable, used to track all shared data.
-NET_STATE network_state;
+NET_STATE network_state = { .thread_exit_fls_index = FLS_OUT_OF_INDEXES };
+
+/**
+ * A magazine holds bits that this thread has already claimed from one row of a
+ * bitmap lock, but has not yet handed out. Popping from a magazine needs no
+ * interlocked operation at all -- the shared bitmap is only touched when the
+ * magazine runs dry and is refilled with every free bit of a whole row.
+ *
+ * Each thread sweeps the bitmap from its own starting row, so threads do not all
+ * pile onto the low rows (or bounce a shared hint between cores).
+ */
+typedef struct {
+    ULONG64 bits;                               // Claimed bits not yet handed out
+    UINT32 row;                                 // The row these bits came from
+    UINT32 next_row;                            // Where the next refill starts looking
+} MAGAZINE, *PMAGAZINE;
+
+typedef struct {
+    ULONG64 generation;                         // The network generation these bits were claimed from
+    MAGAZINE pm_magazine;
+    MAGAZINE slot_magazine;
+} NET_MAGAZINES, *PNET_MAGAZINES;
+
+// One network per connection in each direction. A network's magazine index is role * MAX_CONNECTIONS + connection.
+#define NUM_NETWORKS    (2 * MAX_CONNECTIONS)
+
+typedef struct {
+    NET_MAGAZINES nets[NUM_NETWORKS];
+    BOOL registered;                            // Whether the thread-exit callback knows about the thread
+} THREAD_MAGAZINES, *PTHREAD_MAGAZINES;
+
+__declspec(thread) THREAD_MAGAZINES thread_magazines;
+
+// The connection each thread looks at first the next time it receives. It moves on every call.
+__declspec(thread) UINT32 receive_cursor;
+
+/**
+ * The receive queue a thread owns for each role it receives as. A thread takes the queue with the fewest
+ * owners the first time it receives, and takes a new one if the network layer has been created again
+ * since. It lets go of its queues as it exits, or in release_receive_queue.
+ */
+typedef struct {
+    ULONG64 generation;
+    UINT32 queue;
+} RECEIVE_QUEUE_BINDING;
+
+__declspec(thread) RECEIVE_QUEUE_BINDING receive_queue_bindings[2];
+
+/**
+ * The impairments are decided per packet with a per-thread xoshiro256** generator, so the send path
+ * never touches shared state (or rand()'s lock) to decide a packet's fate. Rates are kept as thresholds
+ * on a 32-bit draw: a packet is impaired when the draw falls below the threshold.
+ *
+ * Like the magazines, a thread's generator is reseeded whenever the generation moves on.
+ */
+typedef struct {
+    BOOL enabled;                               // Whether any impairment is configured at all
+    ULONG64 drop_threshold;
+    ULONG64 duplicate_threshold;
+    ULONG64 corrupt_threshold;
+    ULONG64 reorder_threshold;
+    ULONG64 reorder_max_delay;                  // TSC
+    ULONG64 seed;
+    volatile LONG64 generation;
+    volatile LONG64 streams_handed_out;         // Each thread seeds from the seed and its number in line
+} IMPAIRMENTS;
+
+IMPAIRMENTS impairments;
+
+typedef struct {
+    ULONG64 state[4];
+    LONG64 generation;
+} PRNG;
+
+__declspec(thread) PRNG thread_prng;
 
 #if DEBUG
 void init_debug_info(void) {
@@ -129,8 +291,16 @@ void init_debug_info(void) {
 #endif
 /**
  *  Initialize the given network.
+ *  @param n The network to initialize
+ *  @param packets_present The events to set whenever a packet is added to each receive queue
+ *  @param receive_queue_owners The count of threads that have taken each queue on the receiving end
+ *  @param owned_receive_queues The mask of queues on the receiving end that have an owner
+ *  @param link The link this network's packets are serialized onto
+ *  @param magazine_index Which of each thread's magazines this network draws from
+ *  @param sending_role The side that sends on this network. Its buffers are allocated on that side's node.
  **/
-VOID net_init(PNET n) {
+VOID net_init(PNET n, PHANDLE packets_present, volatile LONG* receive_queue_owners, volatile LONG* owned_receive_queues,
+              PLINK link, UINT32 magazine_index, int sending_role) {
 
     ULONG64 number_of_slots = NETWORK_BUFFER_NUMBER_OF_SLOTS;
 
@@ -141,41 +311,57 @@ VOID net_init(PNET n) {
     n->pm_lock.num_bits = number_of_slots;
 
     // All data in the bitmap is zeroed, so the initial state of each slot is unclaimed.
-    n->net_lock.bitmap = zero_malloc((number_of_slots + 7) / 8);
-    n->pm_lock.bitmap = zero_malloc((number_of_slots + 7) / 8);
+    n->net_lock.bitmap = allocate_local_memory(sending_role, (number_of_slots + 7) / 8, MEM_RESERVE | MEM_COMMIT);
+    n->pm_lock.bitmap = allocate_local_memory(sending_role, (number_of_slots + 7) / 8, MEM_RESERVE | MEM_COMMIT);
 
     // Initialize PMs.
     // All data is zeroed, which sets the initial status of each packet to FREE.
-    n->metadata_slots = zero_malloc(number_of_slots * sizeof(PM));
+    n->metadata_slots = allocate_local_memory(sending_role, number_of_slots * sizeof(PM), MEM_RESERVE | MEM_COMMIT);
+    if (n->net_lock.bitmap == NULL || n->pm_lock.bitmap == NULL || n->metadata_slots == NULL) {
+        printf("Failed to allocate a network's bitmaps and PMs\n");
+        exit(1);
+    }
+    for (ULONG64 i = 0; i < number_of_slots; i++) {
+        n->metadata_slots[i].net = n;
+    }
 
     // Initialize the buffer. Do not commit physical space until it is necessary.
-    n->packet_buffer = VirtualAlloc(
-                                    NULL,
-                                    NETWORK_BUFFER_CAPACITY_IN_BYTES,
-                                    MEM_RESERVE,
-                                    PAGE_READWRITE
-                                    );
+    n->packet_buffer = allocate_local_memory(sending_role, NETWORK_BUFFER_CAPACITY_IN_BYTES, MEM_RESERVE);
+    if (n->packet_buffer == NULL) {
+        printf("Failed to reserve a network's packet buffer\n");
+        exit(1);
+    }
 
-    // Initialize the event that indicates that packets are in the buffer.
-    n->packets_present = CreateEvent(
-                                     NULL,                         // Default security attributes
-                                     MANUAL_RESET,                 // Manual reset event!
-                                     FALSE,                        // Initially the event is NOT set.
-                                     NULL                          // Anonymous event
-                                    );
+    n->link = link;
+    n->receive_queue_owners = receive_queue_owners;
+    n->owned_receive_queues = owned_receive_queues;
+    n->magazine_index = magazine_index;
+    n->sending_role = sending_role;
 
-    // Point the next_PM to the head of the PM array.
-    n->next_PM_slot = 0;
+    ULONG msb;
+    _BitScanReverse64(&msb, ms_to_tsc(1));
 
-    // Initialize timer wheel
-    for (int i = 0; i < NUM_PACKET_LISTS; i++) {
-        InitializeSListHead(&n->pm_wheel.lists[i]);
-    }
-    n->pm_wheel.hand = 0;
-    n->pm_wheel.last_updated_time = time_now();
+    for (UINT32 q = 0; q < RECEIVE_QUEUES_PER_NETWORK; q++) {
+        PRECEIVE_QUEUE queue = &n->queues[q];
+        queue->packets_present = packets_present[q];
+
+        // Initialize timer wheel
+        PPM_TIMER_WHEEL wheel = &queue->pm_wheel;
+        memset(wheel, 0, sizeof(PM_TIMER_WHEEL));
+        for (int i = 0; i < WHEEL_LEVEL0_BUCKETS; i++) {
+            InitializeSListHead(&wheel->level0[i]);
+        }
+        for (int i = 0; i < WHEEL_LEVEL1_BUCKETS; i++) {
+            InitializeSListHead(&wheel->level1[i]);
+        }
+        wheel->tick_shift = msb > WHEEL_TICKS_PER_MS_SHIFT ? msb - WHEEL_TICKS_PER_MS_SHIFT : 0;
+        wheel->cursor = (LONG64) (time_now() >> wheel->tick_shift);
+        wheel->level1_cursor = wheel->cursor / WHEEL_LEVEL1_TICKS_PER_BUCKET;
 
-    // Initialize receiver's packet list
-    InitializeSListHead(&n->receiver_packet_list);
+        // Initialize receiver's packet list
+        InitializeSListHead(&queue->receiver_packet_list);
+    }
+    InitializeSListHead(&n->free_linear_copies);
 
 
 #if DEBUG
@@ -185,31 +371,159 @@ VOID net_init(PNET n) {
 
 void net_free(PNET n) {
 
-    free(n->net_lock.bitmap);
+    free_local_memory(n->net_lock.bitmap);
+    free_local_memory(n->pm_lock.bitmap);
 
     // Free all slot lists in the PMs
     PPM pm = n->metadata_slots;
     for (; pm < n->metadata_slots + NETWORK_BUFFER_NUMBER_OF_SLOTS; pm++) {
         if (pm->slot_numbers != NULL) free(pm->slot_numbers);
+        if (pm->linear_copy != NULL) free_local_memory(pm->linear_copy);
+    }
+    PSLIST_ENTRY linear_copy;
+    while ((linear_copy = InterlockedPopEntrySList(&n->free_linear_copies)) != NULL) {
+        free_local_memory(linear_copy);
+    }
+    free_local_memory(n->metadata_slots);
+    free_local_memory(n->packet_buffer);
+}
+
+/**
+ * @brief Gives every bit in a magazine back to its bitmap.
+ * @param magazine The magazine to empty
+ * @param lock The bitmap lock the bits were claimed from
+ */
+void return_magazine(PMAGAZINE magazine, PBIT_LOCK lock) {
+    if (magazine->bits == 0) return;
+
+    LONG64 old_value = InterlockedAnd64(&lock->bitmap[magazine->row], ~(LONG64) magazine->bits);
+    ASSERT(((ULONG64) old_value & magazine->bits) == magazine->bits);
+    magazine->bits = 0;
+}
+
+/**
+ * @brief Called when a thread exits, so that the bits it was holding are not lost, and packets stop
+ *        being steered to the receive queues it took.
+ * @param data The exiting thread's magazines
+ */
+VOID NTAPI on_thread_exit(PVOID data) {
+    PTHREAD_MAGAZINES magazines = data;
+
+    if (magazines == NULL || !network_state.initialized) return;
+
+    release_receive_queue(ROLE_SENDER);
+    release_receive_queue(ROLE_RECEIVER);
+
+    for (UINT32 i = 0; i < NUM_NETWORKS; i++) {
+        PNET net = (i < MAX_CONNECTIONS) ? &network_state.SR_nets[i] : &network_state.RS_nets[i - MAX_CONNECTIONS];
+
+        if (magazines->nets[i].generation != network_state.generation) continue;
+        return_magazine(&magazines->nets[i].pm_magazine, &net->pm_lock);
+        return_magazine(&magazines->nets[i].slot_magazine, &net->net_lock);
+    }
+}
+
+/**
+ * @brief Makes sure on_thread_exit is called when the calling thread exits.
+ */
+static VOID register_thread_exit(VOID) {
+    if (!thread_magazines.registered && network_state.thread_exit_fls_index != FLS_OUT_OF_INDEXES) {
+        FlsSetValue(network_state.thread_exit_fls_index, &thread_magazines);
+        thread_magazines.registered = TRUE;
     }
-    free(n->metadata_slots);
+}
+
+/**
+ * @brief Finds this thread's magazines for the given network, resetting them if they are stale.
+ * @param net The network whose magazines are wanted
+ * @return The calling thread's magazines for this network.
+ */
+PNET_MAGAZINES get_thread_magazines(PNET net) {
+    PNET_MAGAZINES magazines = &thread_magazines.nets[net->magazine_index];
+
+    if (magazines->generation == network_state.generation) return magazines;
 
-    VirtualFree(
-                    n->packet_buffer,
-            0,
-        MEM_RELEASE
-                );
+    // The bitmaps these bits came from have been freed, so we simply forget them.
+    // Each thread starts its sweep from a different row to spread threads across the buffer.
+    UINT32 starting_row = GetCurrentThreadId() * 2654435761u;
+    memset(magazines, 0, sizeof(NET_MAGAZINES));
+    magazines->pm_magazine.next_row = starting_row % (UINT32) ((net->pm_lock.num_bits + 63) / 64);
+    magazines->slot_magazine.next_row = starting_row % (UINT32) ((net->net_lock.num_bits + 63) / 64);
+    magazines->generation = network_state.generation;
+    register_thread_exit();
+
+    return magazines;
+}
 
-    CloseHandle(n->packets_present);
+/**
+ * @brief Creates the event that tells receivers that packets are in one direction's buffers.
+ */
+static HANDLE create_packets_present_event(VOID) {
+    return CreateEvent(
+                       NULL,                         // Default security attributes
+                       MANUAL_RESET,                 // Manual reset event!
+                       FALSE,                        // Initially the event is NOT set.
+                       NULL                          // Anonymous event
+                      );
 }
 
 /**
  * @brief Initializes the entire network layer.
  */
 VOID create_network_layer(VOID) {
-    // Initialize networks
-    net_init(&network_state.SR_net);
-    net_init(&network_state.RS_net);
+
+    // A real wire needs none of the simulator's state.
+#if NETWORK_BACKEND == NETWORK_BACKEND_SHARED_MEMORY
+    network_state.backend = &shared_memory_backend;
+#elif NETWORK_BACKEND == NETWORK_BACKEND_UDP
+    network_state.backend = &udp_backend;
+#endif
+    if (network_state.backend != NULL) {
+        network_state.backend->create_layer();
+        network_state.initialized = TRUE;
+        return;
+    }
+
+    // Initialize networks: one per connection in each direction
+    for (UINT32 q = 0; q < RECEIVE_QUEUES_PER_NETWORK; q++) {
+        network_state.SR_packets_present[q] = create_packets_present_event();
+        network_state.RS_packets_present[q] = create_packets_present_event();
+    }
+    memset((PVOID) network_state.receive_queue_owners, 0, sizeof(network_state.receive_queue_owners));
+    memset((PVOID) network_state.owned_receive_queues, 0, sizeof(network_state.owned_receive_queues));
+    for (UINT32 i = 0; i < MAX_CONNECTIONS; i++) {
+        net_init(&network_state.SR_nets[i], network_state.SR_packets_present,
+                 network_state.receive_queue_owners[ROLE_RECEIVER], &network_state.owned_receive_queues[ROLE_RECEIVER],
+                 &network_state.SR_link, ROLE_SENDER * MAX_CONNECTIONS + i, ROLE_SENDER);
+        net_init(&network_state.RS_nets[i], network_state.RS_packets_present,
+                 network_state.receive_queue_owners[ROLE_SENDER], &network_state.owned_receive_queues[ROLE_SENDER],
+                 &network_state.RS_link, ROLE_RECEIVER * MAX_CONNECTIONS + i, ROLE_RECEIVER);
+    }
+    configure_link(ROLE_SENDER, LINK_RATE_BITS_PER_SECOND, LINK_QUEUE_CAPACITY_IN_BYTES);
+    configure_link(ROLE_RECEIVER, LINK_RATE_BITS_PER_SECOND, LINK_QUEUE_CAPACITY_IN_BYTES);
+    configure_link_latency(ROLE_SENDER, LATENCY_MS);
+    configure_link_latency(ROLE_RECEIVER, LATENCY_MS);
+    network_state.SR_link.last_departure = 0;
+    network_state.RS_link.last_departure = 0;
+
+    NETWORK_IMPAIRMENTS default_impairments = {
+        .drop_rate = NETWORK_DROP_RATE,
+        .duplicate_rate = NETWORK_DUPLICATE_RATE,
+        .corrupt_rate = NETWORK_CORRUPT_RATE,
+        .reorder_rate = NETWORK_REORDER_ENABLED ? NETWORK_REORDER_RATE : 0,
+        .reorder_max_delay_ms = NETWORK_REORDER_MAX_DELAY_MS,
+        .seed = NETWORK_RANDOM_SEED,
+    };
+    configure_impairments(&default_impairments);
+
+    // Any bits still sitting in a thread's magazine are from the old bitmaps.
+    InterlockedIncrement64((volatile LONG64*) &network_state.generation);
+
+    // Threads that exit hand their unused bits and their receive queues back through this callback.
+    if (network_state.thread_exit_fls_index == FLS_OUT_OF_INDEXES) {
+        network_state.thread_exit_fls_index = FlsAlloc(on_thread_exit);
+    }
+
     network_state.initialized = TRUE;
 }
 
@@ -217,74 +531,216 @@ VOID create_network_layer(VOID) {
  * @brief Frees network layer resources.
  **/
 void free_network_layer(void) {
-    network_state.initialized = FALSE;
-    net_free(&network_state.SR_net);
-    net_free(&network_state.RS_net);
+    InterlockedExchange((volatile LONG*) &network_state.initialized, FALSE);
+    if (network_state.backend != NULL) {
+
+        // Nothing joins the transport's threads, so some may be in a call still. Each returns
+        // within its timeout, and no new one gets in. The backend stays set, so later calls are
+        // refused rather than handed to a simulator that was never created.
+        while (network_state.backend_calls != 0) {
+            Sleep(1);
+        }
+        network_state.backend->free_layer();
+        return;
+    }
+    for (UINT32 i = 0; i < MAX_CONNECTIONS; i++) {
+        net_free(&network_state.SR_nets[i]);
+        net_free(&network_state.RS_nets[i]);
+    }
+    for (UINT32 q = 0; q < RECEIVE_QUEUES_PER_NETWORK; q++) {
+        CloseHandle(network_state.SR_packets_present[q]);
+        CloseHandle(network_state.RS_packets_present[q]);
+    }
 
 #if DEBUG
     printf("Packets dropped for lack of slots: %llu\n", debug_info.packets_dropped_for_lack_of_slots);
     printf("PMs overwritten due to full buffer: %llu\n", debug_info.pms_overwritten);
+    printf("Packets tail-dropped by a full link queue: %llu\n", debug_info.packets_tail_dropped);
+    printf("Packets dropped / duplicated / corrupted / reordered by impairments: %llu / %llu / %llu / %llu\n",
+           debug_info.packets_dropped_by_impairment, debug_info.packets_duplicated,
+           debug_info.packets_corrupted, debug_info.packets_reordered);
 #endif
 }
 
+void configure_link(int role, ULONG64 bits_per_second, ULONG64 queue_capacity_in_bytes) {
+
+    if (role != ROLE_SENDER && role != ROLE_RECEIVER) return;
+
+    PLINK link = &network_state.SR_link;
+    if (role == ROLE_RECEIVER) link = &network_state.RS_link;
+
+    link->tsc_per_byte = 0;
+    if (bits_per_second != 0) {
+        link->tsc_per_byte = (ms_to_tsc(1000) * 8 << LINK_RATE_FIXED_POINT_SHIFT) / bits_per_second;
+    }
+    link->queue_limit = (queue_capacity_in_bytes * link->tsc_per_byte) >> LINK_RATE_FIXED_POINT_SHIFT;
+}
+
+void configure_link_latency(int role, ULONG64 latency_ms) {
+
+    if (role != ROLE_SENDER && role != ROLE_RECEIVER) return;
+
+    PLINK link = &network_state.SR_link;
+    if (role == ROLE_RECEIVER) link = &network_state.RS_link;
+
+    link->propagation_delay = ms_to_tsc(latency_ms);
+}
+
 /**
- * @brief Finds an available PM.
- * @return TRUE if a PM is found (to whom address_of_next_PM will now point).
- *          FALSE if no PM is available.
- * @param net The network whose PMs are scanned
- * @return The PM that will be given to this packet.
+ * @brief Queues a run of packets for the link, in order. Each one departs once everything queued ahead
+ * of it, and then its own bytes, have been serialized at the link rate. A packet that would have to
+ * wait behind more than a full queue is tail-dropped, along with everything after it in the run.
+ * The whole run is placed with a single compare-exchange.
+ * @param link The link to queue on
+ * @param sizes The size of each packet in bytes
+ * @param count The number of packets in the run
+ * @param departures Receives the time (TSC) each queued packet's last byte leaves the link
+ * @return The number of packets queued. Packets sizes[0] through sizes[n - 1] were queued; the rest are dropped.
  */
-BOOL get_next_pm(PNET net, PPM* address_of_next_PM) {
+ULONG reserve_link_departures(PLINK link, PULONG64 sizes, ULONG count, PULONG64 departures) {
 
-    // Get a starting slot. If it's out of bounds, wrap.
-    UINT32 slot = net->next_PM_slot;
-    UINT32 last_slot = (slot + NETWORK_BUFFER_NUMBER_OF_SLOTS - 1) % NETWORK_BUFFER_NUMBER_OF_SLOTS;
-    PLONG64 bitmap = net->pm_lock.bitmap;
-    UINT32 old_slot = slot;
+    ULONG64 tsc_per_byte = link->tsc_per_byte;
+    ULONG64 now = time_now();
+    ULONG queued;
 
-    while (slot != last_slot) {
+    // An infinitely fast link never queues anything.
+    if (tsc_per_byte == 0) {
+        for (queued = 0; queued < count; queued++) {
+            departures[queued] = now;
+        }
+        return count;
+    }
 
-        // Recalculate row and offset
-        slot = slot % NETWORK_BUFFER_NUMBER_OF_SLOTS;
-        UINT32 row = slot / 64;
-        UINT32 offset = slot % 64;
-        ULONG64 mask = (1LL << offset);
+    while (TRUE) {
+        ULONG64 last_departure = link->last_departure;
+        ULONG64 departure = max(last_departure, now);
 
-        // If the entire 64 bit chunk of the bitmap is set, advance to the next chunk.
-        if (bitmap[row] == MAXULONG64) {
-            old_slot = slot;
-            row++;
-            slot = (row * 64) % NETWORK_BUFFER_NUMBER_OF_SLOTS;
+        for (queued = 0; queued < count; queued++) {
+            if (departure - now > link->queue_limit) break;
+            departure += (sizes[queued] * tsc_per_byte) >> LINK_RATE_FIXED_POINT_SHIFT;
+            departures[queued] = departure;
+        }
 
-            // It may be the case that this jump goes beyond our traversal. If that happens, we will want to return.
-            if (old_slot < last_slot && slot >= last_slot) return FALSE;
+        if (queued == 0) return 0;
 
-            continue;
+        // If another sender queued in the meantime, our packets go behind theirs.
+        if (InterlockedCompareExchange64((volatile LONG64*) &link->last_departure, (LONG64) departure,
+                                         (LONG64) last_departure) == (LONG64) last_departure) {
+            return queued;
         }
+    }
+}
 
-        // If this particular bit is set, advance.
-        if (bitmap[row] & mask) {
-            old_slot = slot;
-            slot++;
-            continue;
+/**
+ * @brief Claims up to count clear bits from a single bitmap row with one compare-exchange.
+ * This lets a batch reserve many slots (or PMs) for the price of a single interlocked
+ * operation per row, rather than one per bit.
+ * @param row The bitmap row to claim bits from
+ * @param count The maximum number of bits to claim
+ * @return A mask of the bits that were claimed. Zero if the row is full.
+ */
+ULONG64 claim_bits_in_row(volatile PLONG64 row, ULONG count) {
+    LONG64 old_value;
+    ULONG64 free_bits;
+    ULONG64 claimed;
+
+    do {
+        old_value = *row;
+        free_bits = ~(ULONG64) old_value;
+        if (free_bits == 0) return 0;
+
+        // Take the lowest clear bits, one at a time, until we have enough
+        claimed = 0;
+        for (ULONG i = 0; i < count && free_bits != 0; i++) {
+            ULONG64 lowest = free_bits & (0 - free_bits);
+            claimed |= lowest;
+            free_bits &= ~lowest;
         }
 
-        // Interlocked set it -- if you did not win, move on to the next bit
-        if (InterlockedBitTestAndSet64(&bitmap[row], offset)) {
-            old_slot = slot;
-            slot++;
+        // If someone else changed the row underneath us, we recompute and try again
+    } while (InterlockedCompareExchange64(row, old_value | (LONG64) claimed, old_value) != old_value);
+
+    return claimed;
+}
+
+/**
+ * @brief Refills an empty magazine with every free bit in the next row that has one.
+ * @param magazine The magazine to refill
+ * @param lock The bitmap lock to claim bits from
+ * @return TRUE if the magazine now holds bits, FALSE if the whole bitmap is claimed.
+ */
+BOOL refill_magazine(PMAGAZINE magazine, PBIT_LOCK lock) {
+
+    UINT32 number_of_rows = (UINT32) BITMAP_WORDS(lock->num_bits);
+    UINT32 row = magazine->next_row % number_of_rows;
+
+    for (UINT32 rows_checked = 0; rows_checked < number_of_rows; ) {
+
+        // Skip full rows without touching them with an interlocked operation
+        UINT32 free_row = (UINT32) (bitmap_find_next((PULONG64) lock->bitmap, (ULONG64) row * 64,
+                                                     (ULONG64) number_of_rows * 64, FALSE) / 64);
+        rows_checked += free_row - row;
+        if (free_row == number_of_rows) {
+            row = 0;
             continue;
         }
+        if (rows_checked >= number_of_rows) {
+            break;
+        }
+
+        ULONG64 claimed = claim_bits_in_row(&lock->bitmap[free_row], 64);
+        if (claimed) {
+            magazine->bits = claimed;
+            magazine->row = free_row;
+            magazine->next_row = (free_row + 1) % number_of_rows;
+            return TRUE;
+        }
 
-        // We got the PM! Now we update the address and return true
-        *address_of_next_PM = net->metadata_slots + slot;
-        net->next_PM_slot = slot;
-        return TRUE;
+        row = (free_row + 1) % number_of_rows;
+        rows_checked++;
     }
 
     return FALSE;
 }
 
+/**
+ * @brief Hands out one bit from the thread's magazine, refilling it if it has run dry.
+ * @param magazine The magazine to pop from
+ * @param lock The bitmap lock that backs the magazine
+ * @param index Receives the index (PM or slot number) of the bit
+ * @return TRUE if a bit was handed out, FALSE if none are available.
+ */
+BOOL pop_from_magazine(PMAGAZINE magazine, PBIT_LOCK lock, PUINT32 index) {
+
+    ULONG bit;
+
+    if (magazine->bits == 0 && !refill_magazine(magazine, lock)) return FALSE;
+
+    _BitScanForward64(&bit, magazine->bits);
+    magazine->bits &= magazine->bits - 1;
+    *index = magazine->row * 64 + bit;
+    return TRUE;
+}
+
+/**
+ * @brief Finds an available PM. The magazines only ever hold FREE PMs, so it holds no slots yet.
+ * @return TRUE if a PM is found (to whom address_of_next_PM will now point).
+ *          FALSE if no PM is available.
+ * @param net The network whose PMs are scanned
+ * @return The PM that will be given to this packet.
+ */
+BOOL get_next_pm(PNET net, PPM* address_of_next_PM) {
+
+    PNET_MAGAZINES magazines = get_thread_magazines(net);
+    UINT32 slot;
+
+    if (!pop_from_magazine(&magazines->pm_magazine, &net->pm_lock, &slot)) return FALSE;
+
+    // We got the PM! Now we update the address and return true
+    *address_of_next_PM = net->metadata_slots + slot;
+    return TRUE;
+}
+
 /**
  * @brief Assigns the given slot to the given PM. If the PM's slot buffer is full,
  * double its size, then add it.
@@ -310,7 +766,7 @@ void add_slot(PPM pm, UINT32 slot) {
     pm->slot_numbers[pm->number_of_slots_reserved] = slot;
     pm->number_of_slots_reserved++;
 
-    ASSERT(pm->number_of_slots_reserved <= MAX_PAYLOAD_SIZE / NETWORK_BUFFER_SLOT_SIZE_IN_BYTES + 1);
+    ASSERT(pm->number_of_slots_reserved <= MAX_SLOTS_PER_PACKET);
 }
 
 /**
@@ -325,64 +781,58 @@ void add_slot(PPM pm, UINT32 slot) {
  */
 void acquire_slots(PPM pm, UINT32 slots_needed, PNET net) {
 
-    UINT32 current_slot_count = pm->number_of_slots_reserved;
-
-    if(current_slot_count >= slots_needed) return;
+    PNET_MAGAZINES magazines = get_thread_magazines(net);
+    UINT32 slot;
 
-    ULONG64 num_slots = net->net_lock.num_bits;
-    PULONG64 bitmap_start = net->net_lock.bitmap;
-    PULONG64 bitmap_end = (PULONG64) ((ULONG_PTR) bitmap_start + (num_slots + 7) / 8);
-    BOOL result;
+    // Even if we do not get enough slots, we will return. And it's up to the caller to sort out
+    // the situation where insufficient slots were allocated.
+    while (pm->number_of_slots_reserved < slots_needed) {
+        if (!pop_from_magazine(&magazines->slot_magazine, &net->net_lock, &slot)) return;
+        add_slot(pm, slot);
+    }
+}
 
-    for (int i = 0; i < TIMES_TO_SCAN_BITMAP_BEFORE_EXIT; i++) {
-        UINT32 slot = 0;
-        ULONG64 offset = 0;
-        ULONG64 mask = 0;
-        volatile PULONG64 row = bitmap_start;
+/**
+ * @brief Finds up to count available PMs from this thread's magazine.
+ * @param net The network whose PMs are claimed
+ * @param pms The array into which the claimed PMs are written
+ * @param count The number of PMs wanted
+ * @return The number of PMs claimed.
+ */
+ULONG get_next_pms(PNET net, PPM* pms, ULONG count) {
 
-        while (row < bitmap_end) {
+    PNET_MAGAZINES magazines = get_thread_magazines(net);
+    ULONG found = 0;
+    UINT32 slot;
 
-            // Update our variables
-            offset = slot % 64;
-            mask = (1ULL << offset);
+    while (found < count && pop_from_magazine(&magazines->pm_magazine, &net->pm_lock, &slot)) {
+        pms[found++] = net->metadata_slots + slot;
+    }
 
-            // Skip the whole row if it is all set
-            if (*row == BITMAP_ROW_FULL_VALUE) {
-                row++;
-                slot += (64 - (slot % 64));
-                continue;
-            }
+    return found;
+}
 
-            // Skip the bit if it is set
-            if (*row & mask) {
-                slot++;
-                if (slot % 64 == 0) row++;
-                continue;
-            }
+/**
+ * @brief Reserves up to slots_needed data slots from this thread's magazine.
+ * Like acquire_slots, slots that are found are NOT released if there are not enough
+ * of them -- the caller decides what to do with a partial reservation.
+ * @param net The network whose data slots are reserved
+ * @param slots The array into which the reserved slot numbers are written
+ * @param slots_needed The target number of slots.
+ * @return The number of slots reserved.
+ */
+ULONG acquire_slot_run(PNET net, PUINT32 slots, ULONG slots_needed) {
 
-            // If we can set this bit before anyone else, then we have reserved this slot.
-            // We will add it to our stash of slots. And if it's the last one we need, we will return!
-            result = InterlockedBitTestAndSet64((PLONG64) row, offset);
-            if (!result) {
-                add_slot(pm, slot);
-                current_slot_count++;
-
-                if (current_slot_count == slots_needed) {
-                    pm->number_of_slots_reserved = current_slot_count;
-                    return;
-                }
-            }
+    PNET_MAGAZINES magazines = get_thread_magazines(net);
+    ULONG found = 0;
 
-            slot++;
-            if (slot % 64 == 0) row++;
-        }
+    while (found < slots_needed && pop_from_magazine(&magazines->slot_magazine, &net->net_lock, &slots[found])) {
+        found++;
     }
 
-    // Even if we do not get enough slots, we will return. And it's up to the caller to sort out
-    // the situation where insufficient slots were allocated.
+    return found;
 }
 
-
 void release_slot(PULONG64 bitmap, UINT32 slot) {
     UINT32 row = slot / 64;
     UINT32 offset = slot % 64;
@@ -417,33 +867,6 @@ void release_all_slots(PPM pm, PNET net) {
 }
 
 
-/**
- * Releases extra slots (relevant to the case where a PM is overwritten and its slots are claimed).
- * @param pm The PM containing all relevant metadata
- * @param slots_needed The total number of slots needed by this packet
- */
-void release_extra_slots(PPM pm, UINT32 slots_needed, PNET net) {
-
-    if (pm->number_of_slots_reserved == slots_needed) return;
-
-    // Double-check to ensure that the slots reserved are indeed greater than the need
-    ASSERT(pm->number_of_slots_reserved > slots_needed);
-    ASSERT(slots_needed > 0);
-    UINT32 slots_to_release = pm->number_of_slots_reserved - slots_needed;
-
-    // Find the location in the slot numbers from which we will remove.
-    UINT32 index = pm->number_of_slots_reserved - 1;
-
-    // Release each extra slot
-    for (UINT32 i = 0; i < slots_to_release; i++) {
-        release_slot(net->net_lock.bitmap, pm->slot_numbers[index]);
-        index--;
-    }
-
-    pm->number_of_slots_reserved = slots_needed;
-}
-
-
 /**
  * @brief Copies the data from the packet into its slots, as given by the PM.
  * @param pm The PM, containing all the slots necessary to write into.
@@ -482,12 +905,7 @@ void copy_packet_data_into_slots(PPM pm, PPACKET pkt, PNET net) {
             memcpy(dest, src, bytes_to_copy_for_this_slot);
         }
         __except (EXCEPTION_EXECUTE_HANDLER) {
-            LPVOID result = VirtualAlloc(
-                                dest,
-                                NETWORK_BUFFER_SLOT_SIZE_IN_BYTES,
-                                MEM_COMMIT,
-                                PAGE_READWRITE
-                                );
+            LPVOID result = commit_local_memory(net->sending_role, dest, NETWORK_BUFFER_SLOT_SIZE_IN_BYTES);
             ASSERT(result);
             memcpy(dest, src, bytes_to_copy_for_this_slot);
         }
@@ -538,10 +956,42 @@ void copy_from_slots_to_packet(PPM pm, PPACKET pkt, PNET net) {
     ASSERT(bytes_left_to_copy == 0);
 }
 
-#if DEBUG
-    BOOL flag = FALSE;
-    PPM over_grabbed;
-#endif
+/**
+ * @brief Finds the PM's packet as one contiguous run of bytes, without copying if possible.
+ * In the common case the PM's slots are adjacent in the buffer, so we can simply point into it.
+ * Otherwise, the slots are gathered into a linear copy from the network's pool, which the PM
+ * hands back when it is freed. So only packets that are lent out hold one.
+ * @param pm The PM whose packet is wanted
+ * @param net The network that holds the PM's slots
+ * @return A pointer to the packet, valid until the PM is freed. NULL if a linear copy was needed
+ *         and none could be allocated.
+ */
+PPACKET get_linear_packet(PPM pm, PNET net) {
+
+    UINT32 first_slot = pm->slot_numbers[0];
+    UINT32 index = 1;
+
+    // Check whether every slot follows the one before it
+    for (; index < pm->number_of_slots_reserved; index++) {
+        if (pm->slot_numbers[index] != first_slot + index) break;
+    }
+
+    if (index == pm->number_of_slots_reserved) {
+        return (PPACKET) (net->packet_buffer + first_slot * NETWORK_BUFFER_SLOT_SIZE_IN_BYTES);
+    }
+
+    // The slots are scattered, so we gather them into a copy. Every copy holds the biggest packet,
+    // so any of them will do. They are allocated on the receiving side's node, which reads them.
+    ASSERT(pm->linear_copy == NULL);
+    pm->linear_copy = (PBYTE) InterlockedPopEntrySList(&net->free_linear_copies);
+    if (pm->linear_copy == NULL) {
+        pm->linear_copy = allocate_local_memory(net->sending_role == ROLE_SENDER ? ROLE_RECEIVER : ROLE_SENDER,
+                                                LINEAR_COPY_SIZE_IN_BYTES, MEM_RESERVE | MEM_COMMIT);
+        if (pm->linear_copy == NULL) return NULL;
+    }
+    copy_from_slots_to_packet(pm, (PPACKET) pm->linear_copy, net);
+    return (PPACKET) pm->linear_copy;
+}
 
 /**
  *
@@ -553,6 +1003,11 @@ void free_pm(PPM pm, PNET network) {
     // Free up all data in the buffer
     release_all_slots(pm, network);
 
+    if (pm->linear_copy != NULL) {
+        InterlockedPushEntrySList(&network->free_linear_copies, (PSLIST_ENTRY) pm->linear_copy);
+        pm->linear_copy = NULL;
+    }
+
     // Get the index of the PM in the array so we know which bit in the bitmap to clear.
     UINT32 index = (UINT32)(pm - network->metadata_slots);
 
@@ -561,152 +1016,645 @@ void free_pm(PPM pm, PNET network) {
     ASSERT(result);
 }
 
-void update_hand_if_necessary(PPM_TIMER_WHEEL pm_wheel) {
-    ULONG64 old_time = pm_wheel->last_updated_time;
-    ULONG64 new_time = time_now();
-
-    // Check to see if we should advance the hand
-    if (tsc_to_ms(new_time - old_time) <= 1) return;
-
-    // If one millisecond HAS passed, then we will try updating the time
-    if (InterlockedCompareExchange64(
-        (volatile LONG64*) &pm_wheel->last_updated_time,
-        new_time,
-        old_time) != old_time) return;
+/**
+ * @brief Marks a level 0 bucket as (possibly) holding packets.
+ */
+void mark_bucket_occupied(PPM_TIMER_WHEEL wheel, UINT32 index) {
+    UINT32 word = index / 64;
 
-    // If we won and updated the time, then it's our job to advance the hand
-    InterlockedIncrement((volatile LONG*) &pm_wheel->hand);
+    InterlockedBitTestAndSet64(&wheel->level0_occupied[word], index % 64);
+    if (!(wheel->level0_summary & (1LL << word))) {
+        InterlockedOr64(&wheel->level0_summary, 1LL << word);
+    }
 }
 
 /**
- * @brief Adds a packet metadata struct to the hand's SList. Advanced the hand, if necessary.
- * @param pm The packet metadata to add to a list on the timer wheel
- * @param pnet The network whose timer wheel accepts the packet metadata.
+ * @brief Marks a level 0 bucket as empty. Done before the bucket is flushed, so that a packet
+ * added after the flush leaves its bit set.
  */
-void add_pm_to_list(PPM pm, PNET pnet) {
-    UINT32 current_hand = pnet->pm_wheel.hand % NUM_PACKET_LISTS;
-    InterlockedPushEntrySList(&pnet->pm_wheel.lists[current_hand], &pm->flink);
-    update_hand_if_necessary(&pnet->pm_wheel);
+void mark_bucket_empty(PPM_TIMER_WHEEL wheel, UINT32 index) {
+    UINT32 word = index / 64;
+
+    InterlockedBitTestAndReset64(&wheel->level0_occupied[word], index % 64);
+    if (wheel->level0_occupied[word] != 0) return;
+
+    // A sender may have set a bit in this word since we looked. If so, it may also have seen
+    // the summary bit still set and left it alone -- so we put it back.
+    InterlockedAnd64(&wheel->level0_summary, ~(1LL << word));
+    if (wheel->level0_occupied[word] != 0) {
+        InterlockedOr64(&wheel->level0_summary, 1LL << word);
+    }
 }
 
 /**
- * @brief Finds and removes a packet that has "arrived" at the end of the network.
- * @param pnet The network in which we scan for an available packet
- * @param pm The pointer back to the caller's PM. If we find a packet to remove,
- *          we will write the address of its PM here.
- * @return If a packet is found, 0. Otherwise, the closest ETA.
- *          If no packets are available, returns MAXULONG64
+ * @brief Finds the first occupied level 0 bucket at or after the given one, wrapping around the wheel.
+ * @param position The bucket to start from
+ * @return How many buckets past the position it is, or -1 if level 0 is empty.
  */
-ULONG64 try_get_available_packet(PNET pnet, PPM* pm_of_caller) {
-    ULONG64 closest_eta = MAXULONG64;
-    ULONG64 time = time_now();
-    PPM pm;
-
-    while (TRUE) {
-        // First, check for an element on the global list.
-        // If one exists and it has arrived, we will pop it from the list.
-        // Then we check again: if we are the first to get this element and it has arrived,
-        // we will grab it and return!
-
-        // NOTE: we can do this cast since the flink is the first field in the PM.
-        pm = (PPM) RtlFirstEntrySList(&pnet->receiver_packet_list);
-        if (pm) {
+LONG64 find_next_occupied_bucket(PPM_TIMER_WHEEL wheel, UINT32 position) {
+    UINT32 first_word = position / 64;
+    ULONG index;
+    ULONG bit;
+
+    // The rest of the starting word comes first.
+    ULONG64 bits = (ULONG64) wheel->level0_occupied[first_word] & (MAXULONG64 << (position % 64));
+    if (bits != 0) {
+        _BitScanForward64(&bit, bits);
+        return (LONG64) (first_word * 64 + bit) - position;
+    }
 
-            // If the packet at the head hasn't arrived yet, return its ETA.
-            if (time < pm->arrival_time) return pm->arrival_time;
+    // Then every word after it, round to the start of the starting word. We rotate the summary
+    // so its lowest bit is the next word. Its bits may be stale, so a word that turns out to be
+    // empty is just skipped.
+    ULONG64 summary = (ULONG64) wheel->level0_summary;
+    UINT32 rotation = (first_word + 1) % WHEEL_LEVEL0_WORDS;
+    ULONG64 rotated = rotation ? (summary >> rotation) | (summary << (64 - rotation)) : summary;
 
-            // If the packet has arrived, we will try to grab it.
-            pm = (PPM) InterlockedPopEntrySList(&pnet->receiver_packet_list);
+    while (rotated != 0) {
+        _BitScanForward64(&index, rotated);
+        rotated &= rotated - 1;
 
-            // If we can get a packet and it has arrived -- it's ours! Save its address and return.
-            if (pm && time >= pm->arrival_time) {
-                *pm_of_caller = pm;
-                return 0;
-            }
+        UINT32 word = (first_word + 1 + index) % WHEEL_LEVEL0_WORDS;
+        bits = (ULONG64) wheel->level0_occupied[word];
+        if (word == first_word) bits &= (1ULL << (position % 64)) - 1;
+        if (bits == 0) continue;
 
-            // If we popped a valid packet, but it hasn't arrived, let's put it back on the list.
-            // Then we'll return its ETA.
-            if (pm) {
-                closest_eta = pm->arrival_time;
-                InterlockedPushEntrySList(&pnet->receiver_packet_list, &pm->flink);
-                return closest_eta;
-            }
-        }
+        _BitScanForward64(&bit, bits);
+        return (LONG64) ((word * 64 + bit + WHEEL_LEVEL0_BUCKETS - position) % WHEEL_LEVEL0_BUCKETS);
+    }
+    return -1;
+}
 
-        // Now we know for sure there was no packet at the front of the global list.
-        // It's up to us to refill it, if we can.
+/**
+ * @brief Reverses a chain of PMs as flushed from a bucket, so it runs in the order they were added.
+ * @param head The most recently added PM
+ * @param tail Receives the most recently added PM, now at the end
+ * @param count Receives the number of PMs in the chain
+ * @return The first PM added.
+ */
+PSLIST_ENTRY reverse_pm_chain(PSLIST_ENTRY head, PSLIST_ENTRY* tail, PULONG count) {
+    PSLIST_ENTRY reversed = NULL;
+
+    *tail = head;
+    *count = 0;
+    while (head) {
+        PSLIST_ENTRY next = head->Next;
+        head->Next = reversed;
+        reversed = head;
+        head = next;
+        (*count)++;
+    }
+    return reversed;
+}
 
-        // First, we will walk our way through the lists on the wheel from the index below the hand
-        // and around. The last non-empty list we encounter must be the oldest. We will flush it
-        // to the global list, then retry our function.
-        update_hand_if_necessary(&pnet->pm_wheel);
-        UINT32 hand = pnet->pm_wheel.hand % NUM_PACKET_LISTS;
-        UINT32 index = (hand + NUM_PACKET_LISTS - 1) % NUM_PACKET_LISTS;
+void add_pm_chain_to_wheel(PPM_TIMER_WHEEL wheel, PPM newest, PPM oldest, ULONG count, ULONG64 tick);
 
-        // Check the first list. If it's null, return MAXULONG64. There are no available packets.
-        if (!RtlFirstEntrySList(&pnet->pm_wheel.lists[index])) return MAXULONG64;
-        UINT32 index_to_keep = index;
-        index = (index + NUM_PACKET_LISTS - 1) % NUM_PACKET_LISTS;
+/**
+ * @brief Empties a bucket and adds each of its PMs back to the wheel by its own arrival time.
+ * This is how level 1 buckets move down to level 0, and how we recover PMs that were added
+ * to a bucket the cursor had already passed.
+ */
+void readd_bucket(PPM_TIMER_WHEEL wheel, PSLIST_HEADER bucket) {
+    PSLIST_ENTRY tail;
+    ULONG count;
+    PSLIST_ENTRY entry = reverse_pm_chain(InterlockedFlushSList(bucket), &tail, &count);
+
+    while (entry) {
+        PPM pm = (PPM) entry;
+        entry = entry->Next;
+        add_pm_chain_to_wheel(wheel, pm, pm, 1, pm->arrival_time >> wheel->tick_shift);
+    }
+}
 
-        // Okay! We will find a list. Let's see if there's an older one.
-        while (index != hand) {
+/**
+ * @brief Adds a chain of PMs that all arrive in the same tick to the wheel with a single push.
+ * Buckets are stacks, so the chain must be linked from the newest PM back to the oldest --
+ * it is reversed again when the bucket is moved to the receiver's list.
+ * @param wheel The wheel to add to
+ * @param newest The PM sent last. Its flink starts the chain.
+ * @param oldest The PM sent first, at the end of the chain
+ * @param count The number of PMs in the chain
+ * @param tick The tick the PMs arrive in
+ */
+void add_pm_chain_to_wheel(PPM_TIMER_WHEEL wheel, PPM newest, PPM oldest, ULONG count, ULONG64 tick) {
+    ULONG64 cursor = (ULONG64) wheel->cursor;
 
-            // Check out this list -- if it is empty, then we will return the previous non-null list.
-            if (!RtlFirstEntrySList(&pnet->pm_wheel.lists[index])) break;
+    // Anything already due goes in the next bucket the receivers look at.
+    if (tick < cursor) tick = cursor;
 
-            index_to_keep = index;
-            index = (index + NUM_PACKET_LISTS - 1) % NUM_PACKET_LISTS;
-        }
+    if (tick - cursor < WHEEL_LEVEL0_BUCKETS) {
+        UINT32 index = (UINT32) (tick % WHEEL_LEVEL0_BUCKETS);
+        InterlockedPushListSListEx(&wheel->level0[index], &newest->flink, &oldest->flink, count);
+        mark_bucket_occupied(wheel, index);
 
-        // Now we will flush this list to the global list
-        PSLIST_ENTRY head = InterlockedFlushSList(&pnet->pm_wheel.lists[index_to_keep]);
+        // If the cursor moved past our tick while we were adding, the receivers won't look at
+        // this bucket again for a whole turn of the wheel. Put its packets where they belong now.
+        if ((ULONG64) wheel->cursor > tick) readd_bucket(wheel, &wheel->level0[index]);
+        return;
+    }
 
-        // If someone beat us to this list, then we know there should be packets in the global list now!
-        if (!head) continue;
+    // Too far out for level 0. Anything beyond level 1 too waits in its last bucket,
+    // and is sorted out again when that bucket moves down.
+    ULONG64 level1_cursor = (ULONG64) wheel->level1_cursor;
+    ULONG64 window = tick / WHEEL_LEVEL1_TICKS_PER_BUCKET;
+    if (window >= level1_cursor + WHEEL_LEVEL1_BUCKETS) window = level1_cursor + WHEEL_LEVEL1_BUCKETS - 1;
 
-        // We won the list! Let's push it to the global list.
-        PSLIST_ENTRY tail = head;
-        ULONG count = 1;
-        while (tail->Next) {
-            tail = tail->Next;
-            count++;
-        }
-        InterlockedPushListSListEx(&pnet->receiver_packet_list,
-                                    head,
-                                    tail,
-                                    count);
+    UINT32 index = (UINT32) (window % WHEEL_LEVEL1_BUCKETS);
+    InterlockedPushListSListEx(&wheel->level1[index], &newest->flink, &oldest->flink, count);
+    InterlockedOr64(&wheel->level1_occupied, 1LL << index);
 
-        // Now we will try again!
-        time = time_now();
-    }
-    return MAXULONG64;
+    if ((ULONG64) wheel->level1_cursor > window) readd_bucket(wheel, &wheel->level1[index]);
 }
 
-/*
- * send_packet
- *
- * Sends a packet through the simulated network.
+/**
+ * @brief Adds a single packet metadata struct to the wheel, by its arrival time.
+ * @param pm The packet metadata to add to the timer wheel
+ * @param queue The receive queue whose timer wheel accepts the packet metadata.
  */
-int send_packet(PPACKET pkt, int role) {
+void add_pm_to_wheel(PPM pm, PRECEIVE_QUEUE queue) {
+    add_pm_chain_to_wheel(&queue->pm_wheel, pm, pm, 1, pm->arrival_time >> queue->pm_wheel.tick_shift);
+}
 
-    // Validate inputs to ensure proper usage
-    if (pkt == NULL)                                    return PACKET_REJECTED;
-    if (pkt->bytes_in_payload > MAX_PAYLOAD_SIZE)       return PACKET_REJECTED;
-    if (role != ROLE_SENDER && role != ROLE_RECEIVER)   return PACKET_REJECTED;
+/**
+ * @brief Moves the cursor forward over buckets we found empty.
+ * @param from The cursor as we found it
+ * @param to The new cursor. Nothing before it may be waiting in level 0.
+ */
+void move_wheel_cursor(PPM_TIMER_WHEEL wheel, ULONG64 from, ULONG64 to) {
+    if (to <= from) return;
 
-    // TODO: Apply network unreliability (drop, duplicate, corrupt, reorder)
+    InterlockedExchange64(&wheel->cursor, (LONG64) to);
 
-    // Allocate all necessary stack variables
-    PNET network;
+    // A sender that read the old cursor may have added to one of the buckets we skipped, after
+    // we looked and before it could see the new cursor. Either it sees the new cursor or we see its bit.
+    ULONG64 skipped = min(to - from, WHEEL_LEVEL0_BUCKETS);
+    for (ULONG64 i = 0; i < skipped; i++) {
+        UINT32 index = (UINT32) ((from + i) % WHEEL_LEVEL0_BUCKETS);
+        if (!(wheel->level0_occupied[index / 64] & (1LL << (index % 64)))) continue;
+
+        mark_bucket_empty(wheel, index);
+        readd_bucket(wheel, &wheel->level0[index]);
+    }
+}
+
+/**
+ * @brief Moves the earliest due bucket onto the receiver's packet list, oldest packet first.
+ * Only called by the thread holding the wheel's advancing flag, and only when the list is empty.
+ * @param queue The receive queue whose wheel is advanced
+ * @param time The current time
+ * @return 0 if packets were moved to the list. Otherwise, when the next bucket is due
+ *          (to the tick), or MAXULONG64 if the wheel is empty.
+ */
+ULONG64 advance_timer_wheel(PRECEIVE_QUEUE queue, ULONG64 time) {
+    PPM_TIMER_WHEEL wheel = &queue->pm_wheel;
+    ULONG64 now = time >> wheel->tick_shift;
+
+    while (TRUE) {
+        ULONG64 cursor = (ULONG64) wheel->cursor;
+
+        // Any level 1 window that now fits inside level 0 moves down. The cursor moves before
+        // the flush, so a sender that adds to the window afterwards sees it and moves its own packets.
+        while (((ULONG64) wheel->level1_cursor + 1) * WHEEL_LEVEL1_TICKS_PER_BUCKET <= cursor + WHEEL_LEVEL0_BUCKETS) {
+            ULONG64 window = (ULONG64) InterlockedIncrement64(&wheel->level1_cursor) - 1;
+            UINT32 index = (UINT32) (window % WHEEL_LEVEL1_BUCKETS);
+            if (!(wheel->level1_occupied & (1LL << index))) continue;
+
+            InterlockedAnd64(&wheel->level1_occupied, ~(1LL << index));
+            readd_bucket(wheel, &wheel->level1[index]);
+        }
+
+        // Level 1 can't come due before its next window moves down.
+        ULONG64 level1_eta = MAXULONG64;
+        if (wheel->level1_occupied) {
+            level1_eta = (((ULONG64) wheel->level1_cursor + 1) * WHEEL_LEVEL1_TICKS_PER_BUCKET -
+                          WHEEL_LEVEL0_BUCKETS) << wheel->tick_shift;
+        }
+
+        LONG64 distance = find_next_occupied_bucket(wheel, (UINT32) (cursor % WHEEL_LEVEL0_BUCKETS));
+        if (distance < 0) {
+            move_wheel_cursor(wheel, cursor, now);
+            return level1_eta;
+        }
+
+        ULONG64 tick = cursor + (ULONG64) distance;
+        if (tick > now) {
+            move_wheel_cursor(wheel, cursor, now);
+            return min(tick << wheel->tick_shift, level1_eta);
+        }
+
+        // This bucket is due. Packets added to it from here on stay in it, and we find it again next time.
+        move_wheel_cursor(wheel, cursor, tick);
+        UINT32 index = (UINT32) (tick % WHEEL_LEVEL0_BUCKETS);
+        mark_bucket_empty(wheel, index);
+
+        PSLIST_ENTRY tail;
+        ULONG count;
+        PSLIST_ENTRY head = reverse_pm_chain(InterlockedFlushSList(&wheel->level0[index]), &tail, &count);
+
+        // The bit was stale. Look again.
+        if (!head) continue;
+
+        InterlockedPushListSListEx(&queue->receiver_packet_list, head, tail, count);
+        return 0;
+    }
+}
+
+/**
+ * @brief Finds and removes a packet that has "arrived" at the end of the network.
+ * @param queue The receive queue in which we scan for an available packet
+ * @param pm The pointer back to the caller's PM. If we find a packet to remove,
+ *          we will write the address of its PM here.
+ * @return If a packet is found, 0. Otherwise, the closest ETA.
+ *          If no packets are available, returns MAXULONG64
+ */
+ULONG64 try_get_available_packet(PRECEIVE_QUEUE queue, PPM* pm_of_caller) {
+    ULONG64 closest_eta;
+    ULONG64 time;
     PPM pm;
-    UINT32 slots_needed;
+
+    while (TRUE) {
+        time = time_now();
+
+        // First, check for an element on the list of packets taken off the wheel.
+        // If one exists and it has arrived, we will pop it from the list.
+        // Then we check again: if we are the first to get this element and it has arrived,
+        // we will grab it and return!
+
+        // NOTE: we can do this cast since the flink is the first field in the PM.
+        pm = (PPM) RtlFirstEntrySList(&queue->receiver_packet_list);
+        if (pm) {
+
+            // If the packet at the head hasn't arrived yet, return its ETA.
+            if (time < pm->arrival_time) return pm->arrival_time;
+
+            // If the packet has arrived, we will try to grab it.
+            pm = (PPM) InterlockedPopEntrySList(&queue->receiver_packet_list);
+
+            // If we can get a packet and it has arrived -- it's ours! Save its address and return.
+            if (pm && time >= pm->arrival_time) {
+                *pm_of_caller = pm;
+                return 0;
+            }
+
+            // If we popped a valid packet, but it hasn't arrived, let's put it back on the list.
+            // Then we'll return its ETA.
+            if (pm) {
+                closest_eta = pm->arrival_time;
+                InterlockedPushEntrySList(&queue->receiver_packet_list, &pm->flink);
+                return closest_eta;
+            }
+            continue;
+        }
+
+        // Now we know for sure there was no packet at the front of the list.
+        // It's up to us to refill it from the wheel -- unless someone else already is, in which
+        // case it will have packets in a moment. Say so by returning an ETA that has already passed.
+        if (InterlockedCompareExchange(&queue->pm_wheel.advancing, TRUE, FALSE) != FALSE) return time;
+
+        // Someone may have refilled it before we got the flag. One bucket at a time keeps it in order.
+        closest_eta = 0;
+        if (!RtlFirstEntrySList(&queue->receiver_packet_list)) {
+            closest_eta = advance_timer_wheel(queue, time);
+        }
+        InterlockedExchange(&queue->pm_wheel.advancing, FALSE);
+
+        // If nothing is due yet, that's when the next packet is. Otherwise, we will try again!
+        if (closest_eta != 0) return closest_eta;
+    }
+}
+
+/**
+ * @brief Steps a splitmix64 generator. Only used to expand a seed into xoshiro state.
+ */
+ULONG64 splitmix64(PULONG64 x) {
+    ULONG64 z = (*x += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+#define ROTATE_LEFT_64(x, k)    (((x) << (k)) | ((x) >> (64 - (k))))
+
+/**
+ * @brief Draws the next 64 random bits from this thread's xoshiro256** generator, seeding it first
+ * if it has never been seeded or the impairments have been reconfigured since.
+ */
+ULONG64 next_random(VOID) {
+    PRNG* prng = &thread_prng;
+
+    if (prng->generation != impairments.generation) {
+        ULONG64 x = impairments.seed + (ULONG64) InterlockedIncrement64(&impairments.streams_handed_out) *
+                    0xD1B54A32D192ED03ULL;
+        for (ULONG i = 0; i < 4; i++) {
+            prng->state[i] = splitmix64(&x);
+        }
+        prng->generation = impairments.generation;
+    }
+
+    PULONG64 s = prng->state;
+    ULONG64 result = ROTATE_LEFT_64(s[1] * 5, 7) * 9;
+    ULONG64 t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = ROTATE_LEFT_64(s[3], 45);
+
+    return result;
+}
+
+/**
+ * @brief Decides whether an impairment strikes this packet.
+ * @param threshold The impairment's threshold on a 32-bit draw. 0 never strikes
+ */
+BOOL impairment_strikes(ULONG64 threshold) {
+    if (threshold == 0) return FALSE;
+    return (next_random() >> 32) < threshold;
+}
+
+/**
+ * @brief Converts a percentage into a threshold on a 32-bit draw.
+ */
+ULONG64 rate_to_threshold(double rate) {
+    if (rate <= 0) return 0;
+    if (rate >= 100) return 1ULL << 32;
+    return (ULONG64) (rate / 100.0 * (double) (1ULL << 32));
+}
+
+ULONG64 get_max_packet_size(void) {
+#if NETWORK_BACKEND == NETWORK_BACKEND_SHARED_MEMORY
+    return shared_memory_backend.max_packet_size;
+#elif NETWORK_BACKEND == NETWORK_BACKEND_UDP
+    return udp_backend.max_packet_size;
+#else
+    return MAX_WIRE_PACKET_SIZE_IN_BYTES;
+#endif
+}
+
+void configure_impairments(PNETWORK_IMPAIRMENTS settings) {
+
+    if (settings == NULL) return;
+
+    impairments.drop_threshold = rate_to_threshold(settings->drop_rate);
+    impairments.duplicate_threshold = rate_to_threshold(settings->duplicate_rate);
+    impairments.corrupt_threshold = rate_to_threshold(settings->corrupt_rate);
+    impairments.reorder_threshold = settings->reorder_max_delay_ms != 0 ? rate_to_threshold(settings->reorder_rate) : 0;
+    impairments.reorder_max_delay = ms_to_tsc(settings->reorder_max_delay_ms);
+    impairments.seed = settings->seed;
+    impairments.streams_handed_out = 0;
+    impairments.enabled = impairments.drop_threshold != 0 || impairments.duplicate_threshold != 0 ||
+                          impairments.corrupt_threshold != 0 || impairments.reorder_threshold != 0;
+
+    // Every thread reseeds from the new seed the next time it draws.
+    InterlockedIncrement64(&impairments.generation);
+}
+
+/**
+ * @brief Decides how many copies of a packet the network carries: 0 if it is dropped, 2 if it is duplicated.
+ */
+ULONG copies_to_deliver(VOID) {
+    if (!impairments.enabled) return 1;
+
+    if (impairment_strikes(impairments.drop_threshold)) {
+#if DEBUG
+        InterlockedIncrement64((volatile LONG64*) &debug_info.packets_dropped_by_impairment);
+#endif
+        telemetry_count(TELEMETRY_PACKETS_DROPPED, 1);
+        return 0;
+    }
+    if (impairment_strikes(impairments.duplicate_threshold)) {
+#if DEBUG
+        InterlockedIncrement64((volatile LONG64*) &debug_info.packets_duplicated);
+#endif
+        return 2;
+    }
+    return 1;
+}
+
+/**
+ * @brief Flips one random bit of a packet's payload, in the network's copy of it. The receiver's
+ * payload checksum (see PAYLOAD_CHECKSUMS) catches the flip and NACKs the packet. The headers are
+ * left alone: the checksum only covers the payload, so a corrupted header would crash the transport
+ * rather than test it.
+ * @param pm The PM holding the packet
+ * @param pkt The sender's copy of the packet, used only to find where the payload starts
+ * @param net The network that holds the PM's slots
+ */
+void corrupt_packet_payload(PPM pm, PPACKET pkt, PNET net) {
+
+    if (pkt->bytes_in_payload == 0) return;
+
+    ULONG64 payload_offset = pm->total_size_in_bytes - pkt->bytes_in_payload;
+
+    ULONG64 r = next_random();
+    ULONG64 offset = payload_offset + (r % pkt->bytes_in_payload);
+    UINT32 slot = pm->slot_numbers[offset / NETWORK_BUFFER_SLOT_SIZE_IN_BYTES];
+
+    net->packet_buffer[slot * NETWORK_BUFFER_SLOT_SIZE_IN_BYTES + offset % NETWORK_BUFFER_SLOT_SIZE_IN_BYTES] ^=
+        (BYTE) (1 << ((r >> 32) & 7));
+#if DEBUG
+    InterlockedIncrement64((volatile LONG64*) &debug_info.packets_corrupted);
+#endif
+}
+
+/**
+ * @brief Applies the in-transit impairments to a packet that is already in the network's buffer.
+ * @return Any extra delay (TSC) to add to the packet's arrival time.
+ */
+ULONG64 impair_packet_in_transit(PPM pm, PPACKET pkt, PNET net) {
+    ULONG64 extra_delay = 0;
+
+    if (!impairments.enabled) return 0;
+
+    if (impairment_strikes(impairments.corrupt_threshold)) {
+        corrupt_packet_payload(pm, pkt, net);
+    }
+    if (impairment_strikes(impairments.reorder_threshold)) {
+        extra_delay = next_random() % impairments.reorder_max_delay;
+#if DEBUG
+        InterlockedIncrement64((volatile LONG64*) &debug_info.packets_reordered);
+#endif
+    }
+    return extra_delay;
+}
+
+/**
+ * @brief Looks for an arrived packet in one receive queue on every connection's network in one direction.
+ *        Each call starts from the connection after the one the last call started from, so a busy
+ *        connection can't starve the rest.
+ * @param networks The direction's networks, one per connection
+ * @param queue Which receive queue to look in
+ * @param pm_of_caller If we find a packet to remove, we will write the address of its PM here.
+ * @return If a packet is found, 0. Otherwise, the closest ETA across all connections.
+ *          If no packets are available, returns MAXULONG64
+ */
+ULONG64 try_get_available_packet_on_any_connection(PNET networks, UINT32 queue, PPM* pm_of_caller) {
+    ULONG64 closest_eta = MAXULONG64;
+    UINT32 first = receive_cursor++;
+
+    for (UINT32 i = 0; i < MAX_CONNECTIONS; i++) {
+        ULONG64 eta = try_get_available_packet(&networks[(first + i) % MAX_CONNECTIONS].queues[queue], pm_of_caller);
+        if (eta == 0) return 0;
+        if (eta < closest_eta) closest_eta = eta;
+    }
+    return closest_eta;
+}
+
+/**
+ * @brief Looks for an arrived packet in the thread's own receive queue first. If there is none, it takes
+ *        one from another queue, so a queue whose thread has gone quiet still gets drained.
+ * @param networks The direction's networks, one per connection
+ * @param home The receive queue this thread owns
+ * @param pm_of_caller If we find a packet to remove, we will write the address of its PM here.
+ * @return If a packet is found, 0. Otherwise, the closest ETA across all queues.
+ *          If no packets are available, returns MAXULONG64
+ */
+ULONG64 try_get_available_packet_on_any_queue(PNET networks, UINT32 home, PPM* pm_of_caller) {
+    ULONG64 closest_eta = MAXULONG64;
+
+    for (UINT32 i = 0; i < RECEIVE_QUEUES_PER_NETWORK; i++) {
+        ULONG64 eta = try_get_available_packet_on_any_connection(networks, (home + i) % RECEIVE_QUEUES_PER_NETWORK,
+                                                                 pm_of_caller);
+        if (eta == 0) return 0;
+        if (eta < closest_eta) closest_eta = eta;
+    }
+    return closest_eta;
+}
+
+/**
+ * @brief Sets the event of a receive queue packets were just added to. If nobody owns the queue -- its
+ *        last owner let go after the packets were steered to it -- an owned queue's event is set too,
+ *        since the threads that wait on it take packets from every queue.
+ */
+VOID wake_receive_queue(PNET network, UINT32 queue) {
+    SetEvent(network->queues[queue].packets_present);
+    if (network->receive_queue_owners[queue] != 0) return;
+
+    LONG owned = *network->owned_receive_queues;
+    ULONG first;
+    if (_BitScanForward(&first, (ULONG) owned)) SetEvent(network->queues[first].packets_present);
+}
+
+/**
+ * @brief Finds the receive queue this thread owns when it receives as the given role, taking the one with
+ *        the fewest owners if it doesn't have one yet. Threads beyond the number of queues share them.
+ */
+UINT32 get_home_receive_queue(int role) {
+    RECEIVE_QUEUE_BINDING* binding = &receive_queue_bindings[role];
+
+    if (binding->generation != network_state.generation) {
+        volatile LONG* owners = network_state.receive_queue_owners[role];
+        UINT32 queue = 0;
+        for (UINT32 q = 1; q < RECEIVE_QUEUES_PER_NETWORK; q++) {
+            if (owners[q] < owners[queue]) queue = q;
+        }
+
+        // The first owner puts the queue back into the steering.
+        if (InterlockedIncrement(&owners[queue]) == 1) {
+            InterlockedOr(&network_state.owned_receive_queues[role], 1L << queue);
+        }
+        binding->queue = queue;
+        binding->generation = network_state.generation;
+        register_thread_exit();
+    }
+    return binding->queue;
+}
+
+void release_receive_queue(int role) {
+
+    if (role != ROLE_SENDER && role != ROLE_RECEIVER) return;
+    if (network_state.backend != NULL) return;
+
+    RECEIVE_QUEUE_BINDING* binding = &receive_queue_bindings[role];
+    if (binding->generation != network_state.generation) return;
+    binding->generation = 0;
+
+    // The last owner takes the queue out of the steering. Another thread may take it between our
+    // decrement and the clear, so we look again once the bit is clear, and put it back if so.
+    volatile LONG* owners = network_state.receive_queue_owners[role];
+    volatile LONG* owned = &network_state.owned_receive_queues[role];
+    UINT32 queue = binding->queue;
+    if (InterlockedDecrement(&owners[queue]) == 0) {
+        InterlockedAnd(owned, ~(1L << queue));
+        if (owners[queue] != 0) InterlockedOr(owned, 1L << queue);
+    }
+
+    // Packets may still be in the queue we left, or on their way to it. Some owner's thread should
+    // look, as it takes packets from every queue.
+    wake_receive_queue(role == ROLE_RECEIVER ? &network_state.SR_nets[0] : &network_state.RS_nets[0], queue);
+}
+
+/**
+ * @brief Picks the receive queue a packet is steered to, by its transmission. Packets are only steered to
+ *        queues some thread owns, so nothing waits in a queue that nobody sleeps on.
+ * @param network The network the packet is sent on
+ * @param pkt The packet
+ */
+UINT32 steer_to_receive_queue(PNET network, PPACKET pkt) {
+    LONG owned = *network->owned_receive_queues;
+    ULONG owned_queues = __popcnt((UINT32) owned);
+    if (owned_queues == 0) return 0;
+
+    // The same multiplicative hash the receiver spreads transmissions over its workers with,
+    // scaled to the number of owned queues. Then we count along the owned ones to it.
+    UINT32 hash = (UINT32) pkt->transmission_id * 2654435761u;
+    ULONG pick = (ULONG) (((ULONG64) hash * owned_queues) >> 32);
+    for (UINT32 q = 0; q < RECEIVE_QUEUES_PER_NETWORK; q++) {
+        if ((owned & (1L << q)) && pick-- == 0) return q;
+    }
+    return 0;
+}
+
+/**
+ * @brief Finds the connection a packet travels on. Headers too short to hold a connection ID travel on connection 0.
+ */
+UINT32 get_connection_id(PPACKET pkt) {
+
+    if (pkt->total_bytes_in_packet_header >= offsetof(PACKET, connection_id) + sizeof(pkt->connection_id)) {
+        return pkt->connection_id;
+    }
+    return 0;
+}
+
+/**
+ * @brief Finds the network that carries packets sent by the given role on the packet's connection.
+ * Headers too short to hold a connection ID travel on connection 0.
+ * @param pkt The packet to be sent
+ * @param role The role sending it
+ * @return The network to send on, or NULL if the connection ID is out of range.
+ */
+PNET get_sending_network(PPACKET pkt, int role) {
+
+    UINT32 connection_id = get_connection_id(pkt);
+    if (connection_id >= MAX_CONNECTIONS) return NULL;
+
+    if (role == ROLE_RECEIVER) return &network_state.RS_nets[connection_id];
+    return &network_state.SR_nets[connection_id];
+}
+
+/**
+ * @brief Finds the networks (one per connection) that the given role receives from.
+ */
+PNET get_receiving_networks(int role) {
+    if (role == ROLE_SENDER) return network_state.RS_nets;
+    return network_state.SR_nets;
+}
+
+/**
+ * @brief Finds the size of the entire packet from its headers.
+ * @param pkt The packet to measure
+ * @return The total size of the packet in bytes, or 0 if its header values are invalid.
+ */
+ULONG64 get_packet_size(PPACKET pkt) {
+
     ULONG64 total_packet_size_in_bytes = 0;
     PDC_HEADER packet_info;
     ULONG64 packet_universal_header_size_in_bytes = 0;
     ULONG64 packet_data_header_size_in_bytes = 0;
     ULONG64 packet_payload_size_in_bytes = 0;
 
-    // Find the size of the entire packet and update its metadata field.
     packet_universal_header_size_in_bytes = pkt->total_bytes_in_packet_header;
     packet_info = (PDC_HEADER) ((ULONG_PTR) pkt + pkt->total_bytes_in_packet_header);
     packet_data_header_size_in_bytes = packet_info->total_bytes_in_dc_header;
@@ -714,33 +1662,63 @@ int send_packet(PPACKET pkt, int role) {
 
     // Check given values for security purposes -- the sum must not wrap
     if (packet_universal_header_size_in_bytes > UINT64_MAX - packet_data_header_size_in_bytes)
-        return PACKET_REJECTED;
+        return 0;
 
     total_packet_size_in_bytes = packet_universal_header_size_in_bytes + packet_data_header_size_in_bytes;
     if (packet_payload_size_in_bytes > UINT64_MAX - total_packet_size_in_bytes)
-        return PACKET_REJECTED;
+        return 0;
 
     total_packet_size_in_bytes += packet_payload_size_in_bytes;
+    return total_packet_size_in_bytes;
+}
 
-    // Applying dropped packets MUWAHAHAHAHA
-    if (rand() < DROP_RATE) {
-        return PACKET_ACCEPTED;
+ULONG size_packets_to_send(PPACKET* pkts, ULONG count, PULONG64 sizes) {
+
+    if (pkts == NULL || count == 0 || pkts[0] == NULL) return 0;
+    count = min(count, MAX_PACKETS_PER_BATCH);
+
+    UINT32 connection_id = get_connection_id(pkts[0]);
+    if (connection_id >= MAX_CONNECTIONS) return 0;
+
+    for (ULONG i = 0; i < count; i++) {
+        if (pkts[i] == NULL || pkts[i]->bytes_in_payload > MAX_PAYLOAD_SIZE) return i;
+        if (get_connection_id(pkts[i]) != connection_id) return i;
+
+        sizes[i] = get_packet_size(pkts[i]);
+        if (sizes[i] == 0 || sizes[i] > MAX_WIRE_PACKET_SIZE_IN_BYTES) return i;
     }
+    return count;
+}
 
-    // Select network based on role
-    network = &network_state.SR_net;
-    if (role == ROLE_RECEIVER) network = &network_state.RS_net;
+BOOL is_whole_packet(PPACKET pkt, ULONG64 bytes) {
 
-    // Determine the number of slots needed for this packet
-    slots_needed = (UINT32) (total_packet_size_in_bytes + NETWORK_BUFFER_SLOT_SIZE_IN_BYTES - 1)
-                    / NETWORK_BUFFER_SLOT_SIZE_IN_BYTES;
-    ASSERT(slots_needed >= 1);
+    // get_packet_size reads the universal header and the size at the start of the next one.
+    if (bytes < sizeof(ULONG64) || pkt->total_bytes_in_packet_header > bytes - sizeof(ULONG64)) return FALSE;
+    if (pkt->total_bytes_in_packet_header < offsetof(PACKET, connection_id)) return FALSE;
+    if (get_connection_id(pkt) >= MAX_CONNECTIONS) return FALSE;
+
+    return get_packet_size(pkt) == bytes;
+}
 
-    // Find an available PM. This will always succeed, as it will claim the next PM, even if it is in
-    // its READY state.
+/**
+ * @brief Puts one copy of a packet into the network: claims its PM and slots, queues it for the link
+ * and copies it in.
+ * @param pkt The packet to send
+ * @param network The network to send it on
+ * @param total_packet_size_in_bytes The packet's size, from its headers
+ * @param slots_needed The number of slots that size takes
+ * @return PACKET_ACCEPTED or PACKET_REJECTED, as for send_packet.
+ */
+int put_packet_on_network(PPACKET pkt, PNET network, ULONG64 total_packet_size_in_bytes, UINT32 slots_needed) {
+
+    PPM pm;
+
+    // Find a FREE PM. If there are none left, the network is full.
     BOOL status = get_next_pm(network, &pm);
     if (!status) return PACKET_REJECTED;
+    ASSERT(pm->number_of_slots_reserved == 0);
     pm->total_size_in_bytes = total_packet_size_in_bytes;
+    pm->send_time = time_now();
 
     // Now that we have a PM, we need to get data slots for it.
     acquire_slots(pm, slots_needed, network);
@@ -755,19 +1733,20 @@ int send_packet(PPACKET pkt, int role) {
         return PACKET_REJECTED;
     }
 
-    // When we claimed this PM, it is possible we took one in its READY state. If that was the case,
-    // we already have some number of slots reserved. We need to see if it is too many, and free the extras.
-    if (pm->number_of_slots_reserved > slots_needed) {
-        release_extra_slots(pm, slots_needed, network);
+    ASSERT(pm->number_of_slots_reserved == slots_needed);
+    ASSERT(slots_needed != 0);
+
+    // Queue the packet for the link. If the queue is full, the packet is lost -- but the sender can't tell.
+    ULONG64 departure;
+    if (reserve_link_departures(network->link, &total_packet_size_in_bytes, 1, &departure) == 0) {
+        free_pm(pm, network);
 #if DEBUG
-        flag = TRUE;
-        over_grabbed = pm;
+        debug_info.packets_tail_dropped++;
 #endif
+        telemetry_count(TELEMETRY_PACKETS_DROPPED, 1);
+        return PACKET_ACCEPTED;
     }
 
-    ASSERT(pm->number_of_slots_reserved == slots_needed);
-    ASSERT(slots_needed != 0);
-
     // Great! We have all necessary slots. Let's write our data into the memory buffer
     __try {
         copy_packet_data_into_slots(pm, pkt, network);
@@ -784,34 +1763,112 @@ int send_packet(PPACKET pkt, int role) {
 
     // The packet has been added to the network. Now we will timestamp it with its arrival time
     // and set its status as READY.
-    pm->arrival_time = deadline_from_now_ms(LATENCY_MS);
-    add_pm_to_list(pm, network);
-    SetEvent(network->packets_present);
+    pm->arrival_time = departure + network->link->propagation_delay + impair_packet_in_transit(pm, pkt, network);
+    UINT32 queue = steer_to_receive_queue(network, pkt);
+    add_pm_to_wheel(pm, &network->queues[queue]);
+    wake_receive_queue(network, queue);
 
+    telemetry_count(TELEMETRY_PACKETS_SENT, 1);
     return PACKET_ACCEPTED;
 }
 
-/*
- * receive_packet
- *
- * Receives a packet from the simulated network, waiting up to timeout_ms.
+/**
+ * @brief Does the work of send_packet, which times it.
  */
-int receive_packet(PPACKET pkt, ULONG64 timeout_ms, int role) {
+int send_one_packet(PPACKET pkt, int role) {
 
-    // First, we check for all necessary validations
-    if (pkt == NULL)                                    return NO_PACKET_AVAILABLE;
-    if (role != ROLE_SENDER && role != ROLE_RECEIVER)   return NO_PACKET_AVAILABLE;
+    // Validate inputs to ensure proper usage
+    if (pkt == NULL)                                    return PACKET_REJECTED;
+    if (pkt->bytes_in_payload > MAX_PAYLOAD_SIZE)       return PACKET_REJECTED;
+    if (role != ROLE_SENDER && role != ROLE_RECEIVER)   return PACKET_REJECTED;
 
     // Allocate all necessary stack variables
     PNET network;
+    UINT32 slots_needed;
+    ULONG copies;
+    ULONG64 total_packet_size_in_bytes = get_packet_size(pkt);
+
+    if (total_packet_size_in_bytes == 0) return PACKET_REJECTED;
+
+    // Select network based on role and connection
+    network = get_sending_network(pkt, role);
+    if (network == NULL) return PACKET_REJECTED;
+
+    // Determine the number of slots needed for this packet
+    slots_needed = (UINT32) (total_packet_size_in_bytes + NETWORK_BUFFER_SLOT_SIZE_IN_BYTES - 1)
+                    / NETWORK_BUFFER_SLOT_SIZE_IN_BYTES;
+    ASSERT(slots_needed >= 1);
+    if (slots_needed > MAX_SLOTS_PER_PACKET) return PACKET_REJECTED;
+
+    // A dropped packet was still accepted, as far as the sender can tell.
+    copies = copies_to_deliver();
+    if (copies == 0) return PACKET_ACCEPTED;
+
+    int status = put_packet_on_network(pkt, network, total_packet_size_in_bytes, slots_needed);
+
+    // The duplicate is best effort -- if the network has no room for it, it's simply not there.
+    if (status == PACKET_ACCEPTED && copies == 2) {
+        put_packet_on_network(pkt, network, total_packet_size_in_bytes, slots_needed);
+    }
+    return status;
+}
+
+/**
+ * @brief Lets a call into the backend, unless the layer is being freed. A call let in must leave_backend.
+ * @return TRUE if the call may go ahead.
+ */
+static BOOL enter_backend(void) {
+    InterlockedIncrement(&network_state.backend_calls);
+    if (network_state.initialized) return TRUE;
+    InterlockedDecrement(&network_state.backend_calls);
+    return FALSE;
+}
+
+static void leave_backend(void) {
+    InterlockedDecrement(&network_state.backend_calls);
+}
+
+/*
+ * send_packet
+ *
+ * Sends a packet through the simulated network.
+ */
+int send_packet(PPACKET pkt, int role) {
+
+    ULONG64 start = time_now();
+    int status;
+
+    if (network_state.backend != NULL) {
+        status = PACKET_REJECTED;
+        if (enter_backend()) {
+            if (network_state.backend->send_packets(&pkt, 1, role) == 1) status = PACKET_ACCEPTED;
+            leave_backend();
+        }
+    } else {
+        status = send_one_packet(pkt, role);
+    }
+
+    if (status == PACKET_REJECTED) telemetry_count(TELEMETRY_PACKETS_REJECTED, 1);
+    telemetry_record_since(TELEMETRY_SEND_PACKET_CALL, start);
+    return status;
+}
+
+/**
+ * @brief Waits up to timeout_ms for a packet to arrive at the end of any connection's network.
+ * The thread sleeps on its own receive queue's event, so it is only woken for packets steered to it.
+ * @param networks The networks to receive from, one per connection
+ * @param home The receive queue this thread owns
+ * @param timeout_ms Maximum time to wait (milliseconds)
+ * @return The PM of the packet that arrived, or NULL on timeout. The caller must free the PM.
+ */
+PPM wait_for_available_packet(PNET networks, UINT32 home, ULONG64 timeout_ms) {
+
+    HANDLE packets_present = networks->queues[home].packets_present;
     PPM pm;
     ULONG64 deadline;
     ULONG64 closest_eta = MAXULONG64;
     ULONG64 wait_time;
-
-    // Then we determine which network state to select
-    network = &network_state.SR_net;
-    if (role == ROLE_SENDER) network = &network_state.RS_net;
+    ULONG64 now;
 
     // Keep track of time
     deadline = deadline_from_now_ms(timeout_ms);
@@ -819,48 +1876,108 @@ int receive_packet(PPACKET pkt, ULONG64 timeout_ms, int role) {
     while (TRUE) {
 
         // Find an available packet
-        closest_eta = try_get_available_packet(network, &pm);
+        closest_eta = try_get_available_packet_on_any_queue(networks, home, &pm);
 
-        // If we were able to get a packet, then we will send its data up to the transport layer.
+        // If we were able to get a packet, then it's ours.
         if (closest_eta == 0) {
             ASSERT(pm->total_size_in_bytes > 0);
             ASSERT(pm->number_of_slots_reserved > 0);
+            return pm;
+        }
 
-            __try {
-                copy_from_slots_to_packet(pm, pkt, network);
-            }
-            // If the memcopy fails, we assume a bad actor on the transport layer,
-            // And we reject the packet.
-            __except (EXCEPTION_EXECUTE_HANDLER) {
-                printf("Error copying data to transport packet\n");
-                ASSERT(FALSE);
-                return PACKET_REJECTED;
+        // Check for a timeout before we think about waiting
+        now = time_now();
+        if (now > deadline) return NULL;
+
+        // Nothing has arrived yet, and we're going to sleep until something does. We reset our event
+        // and then look once more: a packet sent after that look sets the event again and wakes us.
+        if (closest_eta > now) {
+            ResetEvent(packets_present);
+            closest_eta = try_get_available_packet_on_any_queue(networks, home, &pm);
+            if (closest_eta == 0) {
+                ASSERT(pm->total_size_in_bytes > 0);
+                ASSERT(pm->number_of_slots_reserved > 0);
+                return pm;
             }
+            now = time_now();
+        }
 
-            // Great! The data was written to the packet. Let's free the data slots and move
-            // the PM back into its FREE state
-            free_pm(pm, network);
+        // We will wake up JUST when the next packet has arrived, or at the deadline.
+        // The time is read once: min() evaluates its arguments twice, and if the ETA passes in between,
+        // the unsigned difference wraps and we'd wait (nearly) forever.
+        ULONG64 wake_time = min(closest_eta, deadline);
+        wait_time = tsc_to_ms(wake_time > now ? wake_time - now : 0);
 
-            // Success! One packet was received. We can now return.
-            return PACKET_RECEIVED;
+        // Windows can't sleep for less than a millisecond -- if it's closer than that, we spin for it.
+        if (wait_time == 0) {
+            YieldProcessor();
+            continue;
         }
 
-        // If no packets in the network, we will reset our event.
-        if (closest_eta == MAXULONG64) {
-            ResetEvent(network->packets_present);
-        }
+        // And now we wait. We may wake a little early, and check again.
+        WaitForSingleObject(packets_present, (DWORD) wait_time);
+        telemetry_record_since(TELEMETRY_PACKETS_PRESENT_WAIT, now);
+    }
+}
+
+/**
+ * @brief Does the work of receive_packet, which times it.
+ */
+int receive_one_packet(PPACKET pkt, ULONG64 timeout_ms, int role) {
 
-        // We will also set out wait time -- ideally, we will wake up JUST when the next packet has arrived.
-        wait_time = min(NET_RETRY_MS, tsc_to_ms(max(0, closest_eta - time_now())));
+    // First, we check for all necessary validations
+    if (pkt == NULL)                                    return NO_PACKET_AVAILABLE;
+    if (role != ROLE_SENDER && role != ROLE_RECEIVER)   return NO_PACKET_AVAILABLE;
 
-        // And now we wait
-        WaitForSingleObject(network->packets_present, (DWORD) wait_time);
+    // Allocate all necessary stack variables
+    PPM pm;
 
-        // After waking up, we check for a timeout
-        if (time_now() > deadline) return NO_PACKET_AVAILABLE;
+    pm = wait_for_available_packet(get_receiving_networks(role), get_home_receive_queue(role), timeout_ms);
+    if (pm == NULL) return NO_PACKET_AVAILABLE;
+    telemetry_record_since(TELEMETRY_ONE_WAY_DELAY, pm->send_time);
 
-        // If we don't have a timeout, then we will scan the buffer again!
+    // We will send the packet's data up to the transport layer.
+    __try {
+        copy_from_slots_to_packet(pm, pkt, pm->net);
     }
+    // If the memcopy fails, we assume a bad actor on the transport layer,
+    // And we reject the packet.
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        printf("Error copying data to transport packet\n");
+        ASSERT(FALSE);
+        return PACKET_REJECTED;
+    }
+
+    // Great! The data was written to the packet. Let's free the data slots and move
+    // the PM back into its FREE state
+    free_pm(pm, pm->net);
+
+    // Success! One packet was received. We can now return.
+    return PACKET_RECEIVED;
+}
+
+/*
+ * receive_packet
+ *
+ * Receives a packet from the simulated network, waiting up to timeout_ms.
+ */
+int receive_packet(PPACKET pkt, ULONG64 timeout_ms, int role) {
+
+    ULONG64 start = time_now();
+    int status;
+
+    if (network_state.backend != NULL) {
+        status = NO_PACKET_AVAILABLE;
+        if (pkt != NULL && enter_backend()) {
+            if (network_state.backend->receive_packets(&pkt, 1, timeout_ms, role) == 1) status = PACKET_RECEIVED;
+            leave_backend();
+        }
+    } else {
+        status = receive_one_packet(pkt, timeout_ms, role);
+    }
+
+    telemetry_record_since(TELEMETRY_RECEIVE_PACKET_CALL, start);
+    return status;
 }
 
 /*
@@ -870,4 +1987,343 @@ int receive_packet(PPACKET pkt, ULONG64 timeout_ms, int role) {
  */
 int try_receive_packet(PPACKET pkt, int role) {
     return receive_packet(pkt, 0, role);
+}
+
+/**
+ * @brief Finds how many packets of a batch are accepted when only its first copies make it onto the network.
+ * The duplicate is best effort, as in send_one_packet: if the first copy cut off is a duplicate whose
+ * original went out, the packet still counts as accepted, or the caller would resend it.
+ * @param packets_to_send Which packet each copy is of, in order
+ * @param copies_sent How many copies, from the first, went out. Less than the batch's number of copies.
+ * @return The number of packets accepted, from the first.
+ */
+static ULONG packets_accepted_up_to(PULONG packets_to_send, ULONG copies_sent) {
+    ULONG packet = packets_to_send[copies_sent];
+
+    if (copies_sent > 0 && packets_to_send[copies_sent - 1] == packet) return packet + 1;
+    return packet;
+}
+
+/**
+ * @brief Does the work of send_packets, which times it.
+ */
+ULONG send_batch_of_packets(PPACKET* pkts, ULONG count, int role) {
+
+    // Validate inputs to ensure proper usage
+    if (pkts == NULL)                                   return 0;
+    if (role != ROLE_SENDER && role != ROLE_RECEIVER)   return 0;
+    count = min(count, MAX_PACKETS_PER_BATCH);
+
+    // Allocate all necessary stack variables
+    PNET network = NULL;
+    PPM pms[MAX_COPIES_PER_BATCH];
+    ULONG64 packet_sizes[MAX_PACKETS_PER_BATCH];
+    ULONG64 ready_sizes[MAX_COPIES_PER_BATCH];
+    ULONG64 departures[MAX_COPIES_PER_BATCH];
+    UINT32 slots_needed[MAX_PACKETS_PER_BATCH];
+    ULONG packets_to_send[MAX_COPIES_PER_BATCH];
+    UINT32 slots[MAX_COPIES_PER_BATCH * MAX_SLOTS_PER_PACKET];
+    ULONG number_to_send = 0;
+    ULONG total_slots_needed = 0;
+    ULONG accepted = count;
+    ULONG pms_found;
+    ULONG slots_found;
+    ULONG slots_used = 0;
+    ULONG ready = 0;
+
+    // Size every packet in the batch. The first invalid packet ends the batch, as does the first
+    // packet on a different connection from the first.
+    if (count > 0 && pkts[0] != NULL) {
+        network = get_sending_network(pkts[0], role);
+        if (network == NULL) return 0;
+    }
+
+    for (ULONG i = 0; i < count; i++) {
+        if (pkts[i] == NULL || pkts[i]->bytes_in_payload > MAX_PAYLOAD_SIZE) {
+            accepted = i;
+            break;
+        }
+        if (get_sending_network(pkts[i], role) != network) {
+            accepted = i;
+            break;
+        }
+
+        packet_sizes[i] = get_packet_size(pkts[i]);
+        slots_needed[i] = (UINT32) ((packet_sizes[i] + NETWORK_BUFFER_SLOT_SIZE_IN_BYTES - 1)
+                            / NETWORK_BUFFER_SLOT_SIZE_IN_BYTES);
+        if (packet_sizes[i] == 0 || slots_needed[i] > MAX_SLOTS_PER_PACKET) {
+            accepted = i;
+            break;
+        }
+
+        // A duplicated packet goes in the batch twice, a dropped one not at all
+        ULONG copies = copies_to_deliver();
+        for (ULONG copy = 0; copy < copies; copy++) {
+            packets_to_send[number_to_send++] = i;
+            total_slots_needed += slots_needed[i];
+        }
+    }
+
+    if (number_to_send == 0) return accepted;
+
+    // Reserve PMs and slots for the whole batch at once
+    pms_found = get_next_pms(network, pms, number_to_send);
+    slots_found = acquire_slot_run(network, slots, total_slots_needed);
+
+    // Hand out slots in order until we run out of PMs or slots. Everything after that is rejected.
+    ULONG64 send_time = time_now();
+    for (; ready < pms_found; ready++) {
+        ULONG i = packets_to_send[ready];
+        PPM pm = pms[ready];
+
+        if (slots_found - slots_used < slots_needed[i]) break;
+
+        ASSERT(pm->number_of_slots_reserved == 0);
+        for (UINT32 j = 0; j < slots_needed[i]; j++) {
+            add_slot(pm, slots[slots_used++]);
+        }
+        pm->total_size_in_bytes = packet_sizes[i];
+        pm->send_time = send_time;
+    }
+
+    if (ready < number_to_send) {
+        accepted = packets_accepted_up_to(packets_to_send, ready);
+#if DEBUG
+        if (ready < pms_found) debug_info.packets_dropped_for_lack_of_slots += pms_found - ready;
+#endif
+    }
+
+    // Give back anything we reserved but could not use
+    for (ULONG j = slots_used; j < slots_found; j++) {
+        release_slot(network->net_lock.bitmap, slots[j]);
+    }
+    for (ULONG j = ready; j < pms_found; j++) {
+        free_pm(pms[j], network);
+    }
+
+    // Queue the batch for the link. Whatever doesn't fit in the queue is lost, like any tail drop,
+    // so it still counts as accepted.
+    for (ULONG j = 0; j < ready; j++) {
+        ready_sizes[j] = packet_sizes[packets_to_send[j]];
+    }
+    ULONG queued = ready != 0 ? reserve_link_departures(network->link, ready_sizes, ready, departures) : 0;
+    for (ULONG j = queued; j < ready; j++) {
+        free_pm(pms[j], network);
+    }
+#if DEBUG
+    debug_info.packets_tail_dropped += ready - queued;
+#endif
+    if (queued < ready) telemetry_count(TELEMETRY_PACKETS_DROPPED, ready - queued);
+    ready = queued;
+
+    // Write our data into the memory buffer
+    for (ULONG j = 0; j < ready; j++) {
+        __try {
+            copy_packet_data_into_slots(pms[j], pkts[packets_to_send[j]], network);
+        }
+        // If the memcpy fails, then there must be a problem with the pointer
+        // passed in from the transport layer. We reject this packet and all
+        // that follow it -- unless it was only the duplicate that failed.
+        __except (EXCEPTION_EXECUTE_HANDLER) {
+            printf("Error copying from transport packet.\n");
+            accepted = packets_accepted_up_to(packets_to_send, j);
+            for (ULONG k = j; k < ready; k++) {
+                free_pm(pms[k], network);
+            }
+            ready = j;
+            ASSERT(FALSE);
+        }
+    }
+
+    if (ready == 0) return accepted;
+
+    // Timestamp each packet with its arrival time
+    ULONG64 latency = network->link->propagation_delay;
+    for (ULONG j = 0; j < ready; j++) {
+        pms[j]->arrival_time = departures[j] + latency + impair_packet_in_transit(pms[j], pkts[packets_to_send[j]], network);
+    }
+
+    // Chain each run of packets steered to the same queue that arrive in the same tick together
+    // for a single push, newest first. Every queue we add to gets its event set once.
+    ULONG queues_added_to = 0;
+    ULONG run_start = 0;
+    for (ULONG j = 0; j < ready; j++) {
+        UINT32 queue = steer_to_receive_queue(network, pkts[packets_to_send[j]]);
+        PPM_TIMER_WHEEL wheel = &network->queues[queue].pm_wheel;
+        ULONG64 tick = pms[j]->arrival_time >> wheel->tick_shift;
+        pms[j]->flink.Next = (j > run_start) ? &pms[j - 1]->flink : NULL;
+
+        if (j + 1 < ready &&
+            steer_to_receive_queue(network, pkts[packets_to_send[j + 1]]) == queue &&
+            (pms[j + 1]->arrival_time >> wheel->tick_shift) == tick) continue;
+
+        add_pm_chain_to_wheel(wheel, pms[j], pms[run_start], j - run_start + 1, tick);
+        queues_added_to |= 1UL << queue;
+        run_start = j + 1;
+    }
+    for (UINT32 q = 0; q < RECEIVE_QUEUES_PER_NETWORK; q++) {
+        if (queues_added_to & (1UL << q)) wake_receive_queue(network, q);
+    }
+
+    telemetry_count(TELEMETRY_PACKETS_SENT, ready);
+    return accepted;
+}
+
+/*
+ * send_packets
+ *
+ * Sends a batch of packets through the simulated network.
+ */
+ULONG send_packets(PPACKET* pkts, ULONG count, int role) {
+
+    ULONG64 start = time_now();
+    ULONG accepted = 0;
+
+    if (network_state.backend != NULL) {
+        if (enter_backend()) {
+            accepted = network_state.backend->send_packets(pkts, count, role);
+            leave_backend();
+        }
+    } else {
+        accepted = send_batch_of_packets(pkts, count, role);
+    }
+
+    // Anything past the most a batch can hold wasn't looked at, so it wasn't rejected either.
+    ULONG considered = min(count, MAX_PACKETS_PER_BATCH);
+    if (accepted < considered) telemetry_count(TELEMETRY_PACKETS_REJECTED, considered - accepted);
+    telemetry_record_since(TELEMETRY_SEND_PACKET_CALL, start);
+    return accepted;
+}
+
+/**
+ * @brief Does the work of receive_packets, which times it.
+ */
+ULONG receive_batch_of_packets(PPACKET* pkts, ULONG max_count, ULONG64 timeout_ms, int role) {
+
+    // First, we check for all necessary validations
+    if (pkts == NULL || max_count == 0)                 return 0;
+    if (role != ROLE_SENDER && role != ROLE_RECEIVER)   return 0;
+
+    // Allocate all necessary stack variables
+    PNET networks = get_receiving_networks(role);
+    UINT32 home = get_home_receive_queue(role);
+    PPM pm;
+    ULONG received = 0;
+
+    // Only the first packet is waited for.
+    pm = wait_for_available_packet(networks, home, timeout_ms);
+
+    while (pm != NULL) {
+
+        telemetry_record_since(TELEMETRY_ONE_WAY_DELAY, pm->send_time);
+        __try {
+            copy_from_slots_to_packet(pm, pkts[received], pm->net);
+        }
+        // If the memcopy fails, we assume a bad actor on the transport layer,
+        // And we reject the packet.
+        __except (EXCEPTION_EXECUTE_HANDLER) {
+            printf("Error copying data to transport packet\n");
+            free_pm(pm, pm->net);
+            ASSERT(FALSE);
+            return received;
+        }
+
+        free_pm(pm, pm->net);
+
+        received++;
+        if (received == max_count) break;
+
+        // Grab anything else that has already arrived, without waiting.
+        if (try_get_available_packet_on_any_queue(networks, home, &pm) != 0) break;
+    }
+
+    return received;
+}
+
+/*
+ * receive_packets
+ *
+ * Receives a batch of packets from the simulated network, waiting up to timeout_ms
+ * for the first one.
+ */
+ULONG receive_packets(PPACKET* pkts, ULONG max_count, ULONG64 timeout_ms, int role) {
+
+    ULONG64 start = time_now();
+    ULONG received = 0;
+
+    if (network_state.backend != NULL) {
+        if (enter_backend()) {
+            received = network_state.backend->receive_packets(pkts, max_count, timeout_ms, role);
+            leave_backend();
+        }
+    } else {
+        received = receive_batch_of_packets(pkts, max_count, timeout_ms, role);
+    }
+
+    telemetry_record_since(TELEMETRY_RECEIVE_PACKET_CALL, start);
+    return received;
+}
+
+/*
+ * receive_packet_view
+ *
+ * Receives a packet from the simulated network without copying it out of the buffer.
+ */
+int receive_packet_view(PPACKET* pkt, PVOID* view, ULONG64 timeout_ms, int role) {
+
+    // First, we check for all necessary validations
+    if (pkt == NULL || view == NULL)                    return NO_PACKET_AVAILABLE;
+    if (role != ROLE_SENDER && role != ROLE_RECEIVER)   return NO_PACKET_AVAILABLE;
+
+    // Allocate all necessary stack variables
+    PPM pm;
+    ULONG64 start = time_now();
+
+    if (network_state.backend != NULL) {
+        int status = NO_PACKET_AVAILABLE;
+        if (enter_backend()) {
+            status = network_state.backend->receive_packet_view(pkt, view, timeout_ms, role);
+            leave_backend();
+        }
+        telemetry_record_since(TELEMETRY_RECEIVE_PACKET_CALL, start);
+        return status;
+    }
+
+    pm = wait_for_available_packet(get_receiving_networks(role), get_home_receive_queue(role), timeout_ms);
+    telemetry_record_since(TELEMETRY_RECEIVE_PACKET_CALL, start);
+    if (pm == NULL) return NO_PACKET_AVAILABLE;
+    telemetry_record_since(TELEMETRY_ONE_WAY_DELAY, pm->send_time);
+
+    // The PM (and its slots) stay claimed until the transport layer releases the view. Without memory
+    // to gather a scattered packet into, it is dropped, as if the network had lost it.
+    *pkt = get_linear_packet(pm, pm->net);
+    if (*pkt == NULL) {
+        printf("Failed to allocate a linear copy. The packet is dropped.\n");
+        free_pm(pm, pm->net);
+        return NO_PACKET_AVAILABLE;
+    }
+    *view = pm;
+    return PACKET_RECEIVED;
+}
+
+/*
+ * release_packet_view
+ *
+ * Returns a packet lent out by receive_packet_view to the network.
+ */
+void release_packet_view(PVOID view, int role) {
+
+    if (view == NULL)                                   return;
+    if (role != ROLE_SENDER && role != ROLE_RECEIVER)   return;
+
+    if (network_state.backend != NULL) {
+        if (enter_backend()) {
+            network_state.backend->release_packet_view(view, role);
+            leave_backend();
+        }
+        return;
+    }
+
+    PPM pm = (PPM) view;
+    free_pm(pm, pm->net);
 }
\ No newline at end of file
@@ -21,6 +21,19 @@
  *
  * A packet "sent" at time T arrives at time T + propagation_delay.
  *
+ * SERIALIZATION DELAY
+ * -------------------
+ * Before it can propagate, a packet has to be clocked onto the wire one bit at a time,
+ * and only one packet can be on the wire at once. Each direction has a link of
+ * LINK_RATE_BITS_PER_SECOND, and packets leave it in the order they were sent:
+ *
+ *   departure = max(now, previous packet's departure) + size / rate
+ *   arrival   = departure + propagation_delay
+ *
+ * Packets waiting for the link sit in its queue. A packet that would have to wait
+ * behind more than LINK_QUEUE_CAPACITY_IN_BYTES is tail-dropped, silently, just as a
+ * router would. Every connection in a direction shares its link.
+ *
  *
  * ============================================================================
  * ARCHITECTURE
@@ -49,6 +62,28 @@
  *   - ROLE_SENDER receiving  -> Receiver-to-Sender buffer
  *   - ROLE_RECEIVER receiving -> Sender-to-Receiver buffer
  *
+ * CONNECTIONS
+ * -----------
+ * Each connection (up to MAX_CONNECTIONS) gets its own pair of buffers, picked by the
+ * connection_id in the packet's universal header. A connection that floods its buffer only
+ * drops its own packets. A receive takes from whichever connection has a packet ready,
+ * going around the connections in turn so that each one gets served.
+ *
+ * RECEIVE QUEUES
+ * --------------
+ * Like a NIC with receive-side scaling, each network has several receive queues
+ * (RECEIVE_QUEUES_PER_NETWORK), and packets are steered to one by a hash of their
+ * transmission_id. A thread takes a queue of its own the first time it receives, and is
+ * only woken for packets steered to that queue. When its queue is empty it takes packets
+ * from the others. A thread gives its queue up as it exits (or with release_receive_queue),
+ * and packets are only steered to queues some thread still owns, so none are stranded.
+ *
+ * BACKENDS
+ * --------
+ * All of the above is the simulator, which carries the packets by default. NETWORK_BACKEND in
+ * config.h can carry them over shared memory between processes, or over UDP between hosts, behind
+ * the same calls instead -- see network_backend.h.
+ *
  * ============================================================================
  */
 
@@ -69,6 +104,16 @@
  */
 #define LATENCY_MS                        20
 
+/* Rate of each direction's link, in bits per second. 0 models an infinitely fast link.
+ * Can be changed at runtime with configure_link.
+ */
+#define LINK_RATE_BITS_PER_SECOND         (10ULL * 1000 * 1000 * 1000)
+
+/* How many bytes can wait for each link before packets are tail-dropped.
+ * Queued packets also hold their network buffer slots, so keep this well below the buffer size.
+ */
+#define LINK_QUEUE_CAPACITY_IN_BYTES      (MB(4))
+
 /* Maximum packets each metwork buffer can hold.
  * Packets are dropped when buffer is full (which should not happpen).
  */
@@ -90,6 +135,16 @@
 #define BITMAP_ROW_FULL_VALUE             MAXULONG64
 #define TIMES_TO_SCAN_BITMAP_BEFORE_EXIT  1
 
+// The most packets that can be moved by a single call to send_packets/receive_packets
+#define MAX_PACKETS_PER_BATCH             64
+
+// The number of connections the network carries. Each has its own buffers in both directions.
+#define MAX_CONNECTIONS                   4
+
+// The number of receive queues on each network. Each receiving thread owns one (threads share them
+// once there are more threads than queues). At most 32.
+#define RECEIVE_QUEUES_PER_NETWORK        4
+
 /* ============================================================================
  * FUNCTIONS
  * ============================================================================*/
@@ -111,6 +166,78 @@ void create_network_layer(void);
  */
 void free_network_layer(void);
 
+/*
+ * configure_link
+ *
+ * Changes the rate and queue size of one direction's link. Packets already queued keep
+ * the departure times they were given.
+ *
+ * Parameters:
+ *   role                    - The role whose sends use the link (ROLE_SENDER or ROLE_RECEIVER)
+ *   bits_per_second         - The new link rate. 0 for an infinitely fast link.
+ *   queue_capacity_in_bytes - How many bytes may wait for the link before packets are tail-dropped
+ */
+void configure_link(int role, ULONG64 bits_per_second, ULONG64 queue_capacity_in_bytes);
+
+/*
+ * configure_link_latency
+ *
+ * Changes how long packets take to reach the far end of one direction's link once they have been
+ * serialized onto it. Starts at LATENCY_MS. Packets already sent keep the arrival times they were given.
+ *
+ * Parameters:
+ *   role       - The role whose sends use the link (ROLE_SENDER or ROLE_RECEIVER)
+ *   latency_ms - The new propagation delay, in milliseconds
+ */
+void configure_link_latency(int role, ULONG64 latency_ms);
+
+/*
+ * configure_impairments
+ *
+ * Changes how unreliable the network is. Rates are percentages (0 to 100, fractions allowed),
+ * applied to every packet sent in either direction:
+ *
+ *   - drop:      the packet is silently lost
+ *   - duplicate: the packet is delivered twice
+ *   - corrupt:   one bit of the packet's payload is flipped in transit, which the receiver's payload
+ *                checksum catches. Headers are left alone.
+ *   - reorder:   the packet is held back by up to reorder_max_delay_ms, so later packets overtake it
+ *
+ * Every thread draws from its own generator, seeded from seed and the order in which threads
+ * first send. Calling this again restarts every thread's generator.
+ */
+typedef struct {
+    double drop_rate;
+    double duplicate_rate;
+    double corrupt_rate;
+    double reorder_rate;
+    ULONG64 reorder_max_delay_ms;
+    ULONG64 seed;
+} NETWORK_IMPAIRMENTS, *PNETWORK_IMPAIRMENTS;
+
+void configure_impairments(PNETWORK_IMPAIRMENTS impairments);
+
+/*
+ * get_max_packet_size
+ *
+ * Returns the most bytes a packet can take, headers and all, on the network backend in use.
+ * send_packet rejects anything bigger. On the simulator and shared memory, a packet with a
+ * MAX_PAYLOAD_SIZE payload always fits. A UDP datagram holds less.
+ */
+ULONG64 get_max_packet_size(void);
+
+/*
+ * release_receive_queue
+ *
+ * Gives up the receive queue the calling thread took the first time it received as the given
+ * role, so packets stop being steered to it. Every thread does this as it exits. One that stops
+ * receiving but keeps running should call it, or its queue's packets wait for another thread's
+ * timeout. The thread's next receive takes a queue again.
+ *
+ * Parameters:
+ *   role - The role the thread received as (ROLE_SENDER or ROLE_RECEIVER)
+ */
+void release_receive_queue(int role);
 
 /*
  * send_packet
@@ -123,7 +250,7 @@ void free_network_layer(void);
  *
  * Returns:
  *   PACKET_ACCEPTED
- *   PACKET_REJECTED   invalid length, NULL pointer, or invalid role
+ *   PACKET_REJECTED   invalid length, NULL pointer, invalid role, or connection_id >= MAX_CONNECTIONS
  */
 #define PACKET_ACCEPTED  0
 #define PACKET_REJECTED  1
@@ -160,4 +287,77 @@ int receive_packet(PPACKET pkt, ULONG64 timeout_ms, int role);
  *   PACKET_RECEIVED      - Packet received successfully
  *   NO_PACKET_AVAILABLE  - No packet available
  */
-int try_receive_packet(PPACKET pkt, int role);
\ No newline at end of file
+int try_receive_packet(PPACKET pkt, int role);
+
+/*
+ * send_packets
+ *
+ * Sends a batch of packets through the simulated network. All PMs and data slots
+ * for the batch are reserved together, and the whole batch is added to the network
+ * with a single list push. Packets are accepted in order: if the network cannot take
+ * the whole batch, a prefix of it is accepted and the rest is rejected.
+ * A batch travels on a single connection, so the first packet on a different connection
+ * from pkts[0] ends the prefix.
+ *
+ * Parameters:
+ *   pkts  - Array of pointers to the packets to send
+ *   count - Number of packets in the array (at most MAX_PACKETS_PER_BATCH are sent)
+ *   role  - ROLE_SENDER or ROLE_RECEIVER (identifies the caller)
+ *
+ * Returns:
+ *   The number of packets accepted. Packets pkts[0] through pkts[n - 1] were accepted;
+ *   the caller should resend the remainder.
+ */
+ULONG send_packets(PPACKET* pkts, ULONG count, int role);
+
+/*
+ * receive_packets
+ *
+ * Receives up to max_count packets from the simulated network, waiting up to timeout_ms
+ * for the first one to arrive. Once a packet has arrived, every other packet that has
+ * already arrived is returned along with it without waiting again.
+ *
+ * Parameters:
+ *   pkts       - Array of pointers to packet structs where received data will be written
+ *   max_count  - Number of packet structs in the array
+ *   timeout_ms - Maximum time to wait for the first packet (milliseconds)
+ *   role       - ROLE_SENDER or ROLE_RECEIVER (identifies the caller)
+ *
+ * Returns:
+ *   The number of packets received (0 on timeout).
+ */
+ULONG receive_packets(PPACKET* pkts, ULONG max_count, ULONG64 timeout_ms, int role);
+
+/*
+ * receive_packet_view
+ *
+ * Receives a packet from the simulated network without copying it, waiting up to timeout_ms.
+ * Instead of writing into a caller's packet, the network lends out a pointer to the packet
+ * in its own buffer. The packet stays valid (and its space in the network stays claimed)
+ * until the caller hands it back with release_packet_view.
+ *
+ * Only the packet's headers and its bytes_in_payload bytes of payload may be read.
+ *
+ * Parameters:
+ *   pkt        - Pointer to where the address of the received packet will be written
+ *   view       - Pointer to where the view's handle will be written
+ *   timeout_ms - Maximum time to wait for a packet (milliseconds)
+ *   role       - ROLE_SENDER or ROLE_RECEIVER (identifies the caller)
+ *
+ * Returns:
+ *   PACKET_RECEIVED         - Packet received successfully
+ *   NO_PACKET_AVAILABLE     - Timeout (no packet arrived within timeout_ms)
+ */
+int receive_packet_view(PPACKET* pkt, PVOID* view, ULONG64 timeout_ms, int role);
+
+/*
+ * release_packet_view
+ *
+ * Hands a packet received with receive_packet_view back to the network.
+ * The packet pointer must not be used after this call.
+ *
+ * Parameters:
+ *   view - The handle written by receive_packet_view
+ *   role - The same role that was passed to receive_packet_view
+ */
+void release_packet_view(PVOID view, int role);
\ No newline at end of file
@@ -0,0 +1,106 @@
+/*
+ * network_backend.h
+ *
+ * Network Backends
+ *
+ * Whatever carries the packets, the network layer's calls keep the contract network.h gives them,
+ * so the transport runs unchanged on any backend. NETWORK_BACKEND in config.h picks one:
+ *
+ *   - NETWORK_BACKEND_SIMULATOR      The simulated links in network.c, inside one process, with
+ *                                    their latency, serialization delay and impairments.
+ *   - NETWORK_BACKEND_SHARED_MEMORY  A ring of packets for each direction in a named, memory-mapped
+ *                                    section, so the two ends can be separate processes on one host.
+ *   - NETWORK_BACKEND_UDP            UDP datagrams, sent and received in batches with Registered I/O,
+ *                                    so the two ends can be separate hosts.
+ *
+ * The simulator is built into network.c. Every other backend fills in a NETWORK_BACKEND_CALLS, and
+ * the network layer's calls hand their work to it. The calls still do their own timing and counting,
+ * so the telemetry reads the same on every backend -- except the one-way delay, which only the
+ * simulator can measure, as only its two ends share a clock.
+ *
+ * Only the simulator has links and impairments to configure. On a real wire configure_link,
+ * configure_link_latency and configure_impairments change nothing, and the wire has its own.
+ *
+ * LOCAL ROLES
+ * -----------
+ * A process plays the roles in NETWORK_LOCAL_ROLES. Sending or receiving as any other role is
+ * refused, as if the role were invalid: its packets belong to the process at the other end.
+ *
+ * SHARED MEMORY
+ * -------------
+ * Every process that names the same SHARED_MEMORY_NAME maps the same section. Whichever maps it
+ * first sets it up. Each direction's ring is a bounded MPMC queue of packet-sized slots, claimed
+ * with a CAS on its index like the sender's transmission queue. A receiver with nothing to take
+ * sleeps on the direction's named event, which a sender only sets when someone is asleep on it.
+ * A packet view lends out the packet's own slot until it is released, so nothing is copied.
+ *
+ * UDP
+ * ---
+ * Each local role binds a socket to its address and keeps UDP_RECEIVE_DEPTH receives posted on it,
+ * into a registered buffer. Each thread that sends gets a socket of its own, connected to the far
+ * end's address, with UDP_SEND_DEPTH registered slots to send from. A batch is queued with deferred
+ * sends and committed once, and its slots come back as the sends complete. A datagram holds a whole
+ * packet, and can be at most UDP_MAX_DATAGRAM_BYTES, so set_payload_size refuses payload sizes
+ * whose packets would not fit in one: on UDP the largest is 32 KB.
+ */
+
+#pragma once
+
+#include "network.h"
+
+// The most bytes a packet can take on any backend: the largest payload, with room for the headers.
+// It is also the most the simulator's slots hold.
+#define MAX_WIRE_PACKET_SIZE_IN_BYTES     (MAX_PAYLOAD_SIZE + NETWORK_BUFFER_SLOT_SIZE_IN_BYTES)
+
+#define IS_LOCAL_ROLE(role)               (((role) == ROLE_SENDER || (role) == ROLE_RECEIVER) &&    \
+                                           (NETWORK_LOCAL_ROLES & (1 << (role))))
+
+// Packets each direction's shared-memory ring holds. Must be a power of two.
+#define SHARED_MEMORY_RING_PACKETS        1024
+
+// How long a process waits for another to finish setting up the shared section.
+#define SHARED_MEMORY_SETUP_TIMEOUT_MS    5000
+
+// Receives kept posted on each local role's socket, and sends each thread can have in flight.
+#define UDP_RECEIVE_DEPTH                 1024
+#define UDP_SEND_DEPTH                    256
+
+// The biggest datagram UDP over IPv4 can carry, and so the biggest packet the UDP backend can send.
+#define UDP_MAX_DATAGRAM_BYTES            65507
+#define UDP_MAX_PACKET_SIZE_IN_BYTES      (MAX_WIRE_PACKET_SIZE_IN_BYTES < UDP_MAX_DATAGRAM_BYTES ?       \
+                                           MAX_WIRE_PACKET_SIZE_IN_BYTES : UDP_MAX_DATAGRAM_BYTES)
+
+// The room for each datagram in the registered buffers: the biggest packet, kept 8-byte aligned.
+#define UDP_SLOT_SIZE_IN_BYTES            ((UDP_MAX_PACKET_SIZE_IN_BYTES + 7) & ~7)
+
+// The kernel's buffer for each receiving socket, for datagrams that arrive while every receive is taken
+#define UDP_SOCKET_BUFFER_BYTES           MB(4)
+
+typedef struct {
+    void (*create_layer)(void);
+    void (*free_layer)(void);
+    ULONG (*send_packets)(PPACKET* pkts, ULONG count, int role);
+    ULONG (*receive_packets)(PPACKET* pkts, ULONG max_count, ULONG64 timeout_ms, int role);
+    int (*receive_packet_view)(PPACKET* pkt, PVOID* view, ULONG64 timeout_ms, int role);
+    void (*release_packet_view)(PVOID view, int role);
+    ULONG64 max_packet_size;                    // The most bytes a packet can take, headers and all
+} NETWORK_BACKEND_CALLS, *PNETWORK_BACKEND_CALLS;
+
+extern NETWORK_BACKEND_CALLS shared_memory_backend;
+extern NETWORK_BACKEND_CALLS udp_backend;
+
+/**
+ * @brief Finds how many packets at the front of a batch can be sent, as send_packets would: each must
+ *        have valid headers, fit in MAX_WIRE_PACKET_SIZE_IN_BYTES, and be on the first one's connection.
+ * @param pkts The batch
+ * @param count The number of packets in it. At most MAX_PACKETS_PER_BATCH are looked at.
+ * @param sizes Where each sendable packet's size is written, MAX_PACKETS_PER_BATCH long
+ * @return The number of packets, from the first, that can be sent.
+ */
+ULONG size_packets_to_send(PPACKET* pkts, ULONG count, PULONG64 sizes);
+
+/**
+ * @brief Checks that bytes arriving from outside the process hold a single whole packet: that its
+ *        headers are inside them, and that the sizes in its headers add up to them.
+ */
+BOOL is_whole_packet(PPACKET pkt, ULONG64 bytes);
@@ -0,0 +1,321 @@
+//
+// The shared-memory backend: a ring of packets for each direction, in a section that every process
+// on the host naming SHARED_MEMORY_NAME maps.
+//
+
+#include "network_backend.h"
+#include "telemetry.h"
+
+#define SECTION_NEW             0
+#define SECTION_SETTING_UP      1
+#define SECTION_READY           2
+
+typedef struct {
+    __declspec(align(CACHE_LINE_SIZE)) volatile LONG64 sequence;
+    ULONG64 bytes;
+    __declspec(align(CACHE_LINE_SIZE)) BYTE packet[MAX_WIRE_PACKET_SIZE_IN_BYTES];
+} SHARED_MEMORY_SLOT, *PSHARED_MEMORY_SLOT;
+
+/**
+ * Bounded lock-free MPMC ring, as the sender's transmission queue: each side claims a position with a
+ * CAS on its own index, and a slot's sequence says whose turn it is in it.
+ */
+typedef struct {
+    __declspec(align(CACHE_LINE_SIZE)) volatile LONG64 enqueue_index;
+    __declspec(align(CACHE_LINE_SIZE)) volatile LONG64 dequeue_index;
+    __declspec(align(CACHE_LINE_SIZE)) volatile LONG waiters; // Receivers asleep, or about to be, on the ring's event
+    SHARED_MEMORY_SLOT slots[SHARED_MEMORY_RING_PACKETS];
+} SHARED_MEMORY_RING, *PSHARED_MEMORY_RING;
+
+typedef struct {
+    volatile LONG state;
+    ULONG64 layout;                             // The section's size, so differently built processes refuse each other
+    SHARED_MEMORY_RING rings[2];                // Indexed by the sending role
+} SHARED_MEMORY_SECTION, *PSHARED_MEMORY_SECTION;
+
+static HANDLE section_mapping;
+static PSHARED_MEMORY_SECTION section;
+
+// Set when a ring has packets and a receiver is asleep on it. Indexed by the sending role.
+static HANDLE packets_present[2];
+
+static const char* event_names[2] = {
+    SHARED_MEMORY_NAME "ToReceiver",
+    SHARED_MEMORY_NAME "ToSender",
+};
+
+/**
+ * @brief Lays out a new section's rings. Its pages start out zeroed.
+ */
+static void set_up_section(void) {
+
+    for (int role = ROLE_SENDER; role <= ROLE_RECEIVER; role++) {
+        PSHARED_MEMORY_RING ring = &section->rings[role];
+        for (LONG64 i = 0; i < SHARED_MEMORY_RING_PACKETS; i++) {
+            ring->slots[i].sequence = i;
+        }
+    }
+    section->layout = sizeof(SHARED_MEMORY_SECTION);
+}
+
+static void shared_memory_create(void) {
+
+    ULONG64 size = sizeof(SHARED_MEMORY_SECTION);
+    section_mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+                                         (DWORD) (size >> 32), (DWORD) size, SHARED_MEMORY_NAME);
+    if (section_mapping == NULL) {
+        printf("Failed to create the shared-memory section %s\n", SHARED_MEMORY_NAME);
+        exit(1);
+    }
+    section = MapViewOfFile(section_mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+    if (section == NULL) {
+        printf("Failed to map the shared-memory section %s\n", SHARED_MEMORY_NAME);
+        exit(1);
+    }
+
+    // Whichever process gets here first sets the section up. The rest wait for it.
+    if (InterlockedCompareExchange(&section->state, SECTION_SETTING_UP, SECTION_NEW) == SECTION_NEW) {
+        set_up_section();
+        InterlockedExchange(&section->state, SECTION_READY);
+    }
+    ULONG64 deadline = deadline_from_now_ms(SHARED_MEMORY_SETUP_TIMEOUT_MS);
+    while (section->state != SECTION_READY) {
+        if (time_now() > deadline) {
+            printf("Timed out waiting for another process to set up %s\n", SHARED_MEMORY_NAME);
+            exit(1);
+        }
+        Sleep(1);
+    }
+    if (section->layout != sizeof(SHARED_MEMORY_SECTION)) {
+        printf("%s was set up by a process built with different settings\n", SHARED_MEMORY_NAME);
+        exit(1);
+    }
+
+    for (int role = ROLE_SENDER; role <= ROLE_RECEIVER; role++) {
+        packets_present[role] = CreateEventA(NULL, AUTO_RESET, FALSE, event_names[role]);
+        if (packets_present[role] == NULL) {
+            printf("Failed to create the event %s\n", event_names[role]);
+            exit(1);
+        }
+    }
+}
+
+static void shared_memory_free(void) {
+
+    for (int role = ROLE_SENDER; role <= ROLE_RECEIVER; role++) {
+        CloseHandle(packets_present[role]);
+        packets_present[role] = NULL;
+    }
+    UnmapViewOfFile(section);
+    CloseHandle(section_mapping);
+    section = NULL;
+    section_mapping = NULL;
+}
+
+/**
+ * @brief Claims the next empty slot of a ring to write a packet into.
+ * @return The slot, or NULL if the ring is full. Its sequence is published once the packet is in it.
+ */
+static PSHARED_MEMORY_SLOT claim_empty_slot(PSHARED_MEMORY_RING ring, PLONG64 claimed_position) {
+
+    PSHARED_MEMORY_SLOT slot;
+    LONG64 position = ring->enqueue_index;
+
+    while (TRUE) {
+        slot = &ring->slots[position & (SHARED_MEMORY_RING_PACKETS - 1)];
+        LONG64 difference = slot->sequence - position;
+
+        if (difference == 0) {
+            LONG64 observed = InterlockedCompareExchange64(&ring->enqueue_index, position + 1, position);
+            if (observed == position) {
+                break;
+            }
+            position = observed;
+        } else if (difference < 0) {
+            // The receiver a lap behind hasn't given this slot back yet, so the ring is full.
+            return NULL;
+        } else {
+            position = ring->enqueue_index;
+        }
+    }
+
+    *claimed_position = position;
+    return slot;
+}
+
+/**
+ * @brief Claims the oldest packet waiting in a ring.
+ * @return The packet's slot, or NULL if the ring is empty. The slot is the caller's until release_slot.
+ */
+static PSHARED_MEMORY_SLOT claim_packet(PSHARED_MEMORY_RING ring) {
+
+    PSHARED_MEMORY_SLOT slot;
+    LONG64 position = ring->dequeue_index;
+
+    while (TRUE) {
+        slot = &ring->slots[position & (SHARED_MEMORY_RING_PACKETS - 1)];
+        LONG64 difference = slot->sequence - (position + 1);
+
+        if (difference == 0) {
+            LONG64 observed = InterlockedCompareExchange64(&ring->dequeue_index, position + 1, position);
+            if (observed == position) {
+                return slot;
+            }
+            position = observed;
+        } else if (difference < 0) {
+            return NULL;
+        } else {
+            position = ring->dequeue_index;
+        }
+    }
+}
+
+/**
+ * @brief Hands a claimed slot back to senders, one full lap ahead. Slots can be released in any order.
+ */
+static void release_slot(PSHARED_MEMORY_SLOT slot) {
+    // While it is claimed, a slot's sequence is its position plus one.
+    InterlockedExchange64(&slot->sequence, slot->sequence - 1 + SHARED_MEMORY_RING_PACKETS);
+}
+
+/**
+ * @brief Claims the oldest whole packet in a ring, throwing away anything in it that isn't one.
+ */
+static PSHARED_MEMORY_SLOT claim_whole_packet(PSHARED_MEMORY_RING ring) {
+
+    PSHARED_MEMORY_SLOT slot;
+    while ((slot = claim_packet(ring)) != NULL) {
+        // The other end may be another process -- trust nothing it wrote.
+        if (slot->bytes <= MAX_WIRE_PACKET_SIZE_IN_BYTES && is_whole_packet((PPACKET) slot->packet, slot->bytes)) {
+            return slot;
+        }
+        release_slot(slot);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Waits up to timeout_ms for a whole packet to arrive in the ring a role receives from.
+ * @return The packet's slot, or NULL on timeout.
+ */
+static PSHARED_MEMORY_SLOT wait_for_packet(int role, ULONG64 timeout_ms) {
+
+    int sending_role = role == ROLE_SENDER ? ROLE_RECEIVER : ROLE_SENDER;
+    PSHARED_MEMORY_RING ring = &section->rings[sending_role];
+    ULONG64 deadline = deadline_from_now_ms(timeout_ms);
+
+    PSHARED_MEMORY_SLOT slot = claim_whole_packet(ring);
+    while (slot == NULL) {
+        ULONG64 now = time_now();
+        if (now >= deadline) return NULL;
+
+        // Say we're about to sleep before looking one last time, so a sender can't miss us.
+        InterlockedIncrement(&ring->waiters);
+        slot = claim_whole_packet(ring);
+        if (slot == NULL) {
+            WaitForSingleObject(packets_present[sending_role], (DWORD) max(tsc_to_ms(deadline - now), 1));
+            slot = claim_whole_packet(ring);
+        }
+        InterlockedDecrement(&ring->waiters);
+    }
+    return slot;
+}
+
+/**
+ * @brief Passes the wake-up on to another sleeping receiver if packets are still waiting. A set wakes
+ *        only one of them.
+ */
+static void wake_next_receiver(int role) {
+
+    int sending_role = role == ROLE_SENDER ? ROLE_RECEIVER : ROLE_SENDER;
+    PSHARED_MEMORY_RING ring = &section->rings[sending_role];
+
+    if (ring->waiters > 0 && ring->enqueue_index != ring->dequeue_index) {
+        SetEvent(packets_present[sending_role]);
+    }
+}
+
+static ULONG shared_memory_send_packets(PPACKET* pkts, ULONG count, int role) {
+
+    if (!IS_LOCAL_ROLE(role)) return 0;
+
+    ULONG64 sizes[MAX_PACKETS_PER_BATCH];
+    ULONG sendable = size_packets_to_send(pkts, count, sizes);
+    PSHARED_MEMORY_RING ring = &section->rings[role];
+    ULONG sent = 0;
+
+    for (; sent < sendable; sent++) {
+        LONG64 position;
+        PSHARED_MEMORY_SLOT slot = claim_empty_slot(ring, &position);
+        if (slot == NULL) break;
+
+        memcpy(slot->packet, pkts[sent], sizes[sent]);
+        slot->bytes = sizes[sent];
+
+        // Publish the packet. The interlocked write orders it after the copy.
+        InterlockedExchange64(&slot->sequence, position + 1);
+    }
+
+    if (sent == 0) return 0;
+
+    // The publish was a full barrier, so a receiver that counted itself in after it will find the packets.
+    if (ring->waiters > 0) {
+        SetEvent(packets_present[role]);
+    }
+    telemetry_count(TELEMETRY_PACKETS_SENT, sent);
+    return sent;
+}
+
+static ULONG shared_memory_receive_packets(PPACKET* pkts, ULONG max_count, ULONG64 timeout_ms, int role) {
+
+    if (pkts == NULL || max_count == 0) return 0;
+    if (!IS_LOCAL_ROLE(role))           return 0;
+
+    int sending_role = role == ROLE_SENDER ? ROLE_RECEIVER : ROLE_SENDER;
+    ULONG received = 0;
+
+    // Only the first packet is waited for.
+    PSHARED_MEMORY_SLOT slot = wait_for_packet(role, timeout_ms);
+    while (slot != NULL) {
+        memcpy(pkts[received], slot->packet, slot->bytes);
+        release_slot(slot);
+
+        received++;
+        if (received == max_count) break;
+        slot = claim_whole_packet(&section->rings[sending_role]);
+    }
+
+    if (received != 0) wake_next_receiver(role);
+    return received;
+}
+
+static int shared_memory_receive_packet_view(PPACKET* pkt, PVOID* view, ULONG64 timeout_ms, int role) {
+
+    if (pkt == NULL || view == NULL)    return NO_PACKET_AVAILABLE;
+    if (!IS_LOCAL_ROLE(role))           return NO_PACKET_AVAILABLE;
+
+    // The packet is read where it lies. Its slot stays claimed until the view is released.
+    PSHARED_MEMORY_SLOT slot = wait_for_packet(role, timeout_ms);
+    if (slot == NULL) return NO_PACKET_AVAILABLE;
+
+    wake_next_receiver(role);
+    *pkt = (PPACKET) slot->packet;
+    *view = slot;
+    return PACKET_RECEIVED;
+}
+
+static void shared_memory_release_packet_view(PVOID view, int role) {
+
+    UNREFERENCED_PARAMETER(role);
+    release_slot((PSHARED_MEMORY_SLOT) view);
+}
+
+NETWORK_BACKEND_CALLS shared_memory_backend = {
+    .create_layer = shared_memory_create,
+    .free_layer = shared_memory_free,
+    .send_packets = shared_memory_send_packets,
+    .receive_packets = shared_memory_receive_packets,
+    .receive_packet_view = shared_memory_receive_packet_view,
+    .release_packet_view = shared_memory_release_packet_view,
+    .max_packet_size = MAX_WIRE_PACKET_SIZE_IN_BYTES,
+};
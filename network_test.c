@@ -8,10 +8,8 @@
  * Validates data integrity for single-threaded and multi-threaded scenarios.
  *
  * Build:
- *   cl network_test.c network.c /Fe:network_test.exe
- *
- * Run:
- *   network_test.exe
+ *   Compiled into the PacketTransporter target, with its main below commented out. For timings of
+ *   the network layer's primitives, see the PacketTransporterMicrobenchmark target.
  */
 
 #include <stdio.h>
@@ -0,0 +1,463 @@
+//
+// The UDP backend: datagrams sent and received in batches with Registered I/O.
+//
+
+// Winsock has to come before windows.h, which would otherwise pull in the old winsock.h.
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <mswsock.h>
+#include <mstcpip.h>
+
+#include "network_backend.h"
+#include "placement.h"
+#include "telemetry.h"
+
+/**
+ * A local role's receiving socket. Every slot of its buffer has a receive posted into it, except the
+ * ones a thread has just taken the packets from.
+ */
+typedef struct {
+    SOCKET socket;
+    RIO_RQ request_queue;
+    RIO_CQ completion_queue;
+    RIO_BUFFERID buffer_id;
+    PBYTE buffer;                               // UDP_RECEIVE_DEPTH slots
+    HANDLE packets_present;                     // Set by RIO when a receive completes, once it has been asked to
+    SRWLOCK lock;                               // A request or completion queue may only be used by one thread at once
+} UDP_ENDPOINT, *PUDP_ENDPOINT;
+
+/**
+ * A thread's sending socket for one role, connected to the other role's address. Only the thread uses it.
+ */
+typedef struct udp_sender {
+    struct udp_sender* next;                    // Senders are only ever added, so the list can be walked unlocked.
+    SOCKET socket;
+    RIO_RQ request_queue;
+    RIO_CQ completion_queue;
+    RIO_BUFFERID buffer_id;
+    PBYTE buffer;                               // UDP_SEND_DEPTH slots
+    ULONG free_slots[UDP_SEND_DEPTH];
+    ULONG free_slot_count;
+} UDP_SENDER, *PUDP_SENDER;
+
+static RIO_EXTENSION_FUNCTION_TABLE rio;
+
+// Indexed by role. Only local roles have one.
+static UDP_ENDPOINT endpoints[2];
+
+static PUDP_SENDER volatile udp_senders;
+
+__declspec(thread) PUDP_SENDER thread_senders[2];
+
+/**
+ * @brief Finds the address a role's socket is bound to, and the other role sends to.
+ */
+static void get_role_address(int role, PSOCKADDR_IN address) {
+
+    memset(address, 0, sizeof(SOCKADDR_IN));
+    address->sin_family = AF_INET;
+    address->sin_port = htons(role == ROLE_SENDER ? UDP_SENDER_PORT : UDP_RECEIVER_PORT);
+
+    const char* text = role == ROLE_SENDER ? UDP_SENDER_ADDRESS : UDP_RECEIVER_ADDRESS;
+    if (inet_pton(AF_INET, text, &address->sin_addr) != 1) {
+        printf("Invalid UDP address %s\n", text);
+        exit(1);
+    }
+}
+
+/**
+ * @brief Opens a UDP socket for Registered I/O.
+ */
+static SOCKET open_socket(void) {
+
+    SOCKET s = WSASocket(AF_INET, SOCK_DGRAM, IPPROTO_UDP, NULL, 0, WSA_FLAG_REGISTERED_IO);
+    if (s == INVALID_SOCKET) {
+        printf("Failed to open a UDP socket: %d\n", WSAGetLastError());
+        exit(1);
+    }
+    return s;
+}
+
+/**
+ * @brief Registers a buffer of slots with RIO, allocated on the node of the role whose threads use it.
+ */
+static PBYTE register_buffer(int role, ULONG slots, PRIO_BUFFERID buffer_id) {
+
+    DWORD bytes = slots * UDP_SLOT_SIZE_IN_BYTES;
+    PBYTE buffer = allocate_local_memory(role, bytes, MEM_RESERVE | MEM_COMMIT);
+    if (buffer == NULL) {
+        printf("Failed to allocate a UDP buffer\n");
+        exit(1);
+    }
+
+    *buffer_id = rio.RIORegisterBuffer((PCHAR) buffer, bytes);
+    if (*buffer_id == RIO_INVALID_BUFFERID) {
+        printf("Failed to register a UDP buffer: %d\n", WSAGetLastError());
+        exit(1);
+    }
+    return buffer;
+}
+
+/**
+ * @brief Finds the part of a registered buffer that is one of its slots.
+ */
+static RIO_BUF get_slot(RIO_BUFFERID buffer_id, ULONG slot, ULONG bytes) {
+
+    RIO_BUF buf;
+    buf.BufferId = buffer_id;
+    buf.Offset = slot * UDP_SLOT_SIZE_IN_BYTES;
+    buf.Length = bytes;
+    return buf;
+}
+
+/**
+ * @brief Posts a receive into each of a role's slots, committing them together. The caller holds the endpoint's lock.
+ */
+static void post_receives(PUDP_ENDPOINT endpoint, PULONG slots, ULONG count) {
+
+    for (ULONG i = 0; i < count; i++) {
+        RIO_BUF buf = get_slot(endpoint->buffer_id, slots[i], UDP_SLOT_SIZE_IN_BYTES);
+        if (!rio.RIOReceive(endpoint->request_queue, &buf, 1, RIO_MSG_DEFER, (PVOID) (ULONG_PTR) slots[i])) {
+            printf("Failed to post a UDP receive: %d\n", WSAGetLastError());
+            exit(1);
+        }
+    }
+    rio.RIOReceive(endpoint->request_queue, NULL, 0, RIO_MSG_COMMIT_ONLY, NULL);
+}
+
+/**
+ * @brief Binds a local role's socket to its address and posts every receive it can hold.
+ */
+static void open_endpoint(int role) {
+
+    PUDP_ENDPOINT endpoint = &endpoints[role];
+    SOCKADDR_IN address;
+
+    endpoint->socket = open_socket();
+    get_role_address(role, &address);
+    if (bind(endpoint->socket, (PSOCKADDR) &address, sizeof(address)) == SOCKET_ERROR) {
+        printf("Failed to bind to %s:%d: %d\n", role == ROLE_SENDER ? UDP_SENDER_ADDRESS : UDP_RECEIVER_ADDRESS,
+               role == ROLE_SENDER ? UDP_SENDER_PORT : UDP_RECEIVER_PORT, WSAGetLastError());
+        exit(1);
+    }
+    int socket_buffer = UDP_SOCKET_BUFFER_BYTES;
+    setsockopt(endpoint->socket, SOL_SOCKET, SO_RCVBUF, (const char*) &socket_buffer, sizeof(socket_buffer));
+
+    endpoint->packets_present = CreateEvent(NULL, MANUAL_RESET, FALSE, NULL);
+    if (endpoint->packets_present == NULL) {
+        printf("Failed to create a UDP event\n");
+        exit(1);
+    }
+
+    RIO_NOTIFICATION_COMPLETION notification;
+    notification.Type = RIO_EVENT_COMPLETION;
+    notification.Event.EventHandle = endpoint->packets_present;
+    notification.Event.NotifyReset = TRUE;
+
+    // The socket only receives, but a request queue must allow a send.
+    endpoint->completion_queue = rio.RIOCreateCompletionQueue(UDP_RECEIVE_DEPTH + 1, &notification);
+    if (endpoint->completion_queue == RIO_INVALID_CQ) {
+        printf("Failed to create a UDP completion queue: %d\n", WSAGetLastError());
+        exit(1);
+    }
+    endpoint->request_queue = rio.RIOCreateRequestQueue(endpoint->socket, UDP_RECEIVE_DEPTH, 1, 1, 1,
+                                                        endpoint->completion_queue, endpoint->completion_queue, NULL);
+    if (endpoint->request_queue == RIO_INVALID_RQ) {
+        printf("Failed to create a UDP request queue: %d\n", WSAGetLastError());
+        exit(1);
+    }
+
+    endpoint->buffer = register_buffer(role, UDP_RECEIVE_DEPTH, &endpoint->buffer_id);
+    InitializeSRWLock(&endpoint->lock);
+
+    ULONG slots[UDP_RECEIVE_DEPTH];
+    for (ULONG i = 0; i < UDP_RECEIVE_DEPTH; i++) {
+        slots[i] = i;
+    }
+    post_receives(endpoint, slots, UDP_RECEIVE_DEPTH);
+}
+
+static void udp_create(void) {
+
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
+        printf("Failed to start Winsock\n");
+        exit(1);
+    }
+
+    // Any socket opened for Registered I/O hands out the function table.
+    SOCKET s = open_socket();
+    GUID table_id = WSAID_MULTIPLE_RIO;
+    DWORD bytes;
+    if (WSAIoctl(s, SIO_GET_MULTIPLE_EXTENSION_FUNCTION_POINTER, &table_id, sizeof(table_id),
+                 &rio, sizeof(rio), &bytes, NULL, NULL) == SOCKET_ERROR) {
+        printf("Registered I/O is not available: %d\n", WSAGetLastError());
+        exit(1);
+    }
+    closesocket(s);
+
+    for (int role = ROLE_SENDER; role <= ROLE_RECEIVER; role++) {
+        if (IS_LOCAL_ROLE(role)) open_endpoint(role);
+    }
+}
+
+static void udp_free(void) {
+
+    // Closing a socket closes its request queue too.
+    for (int role = ROLE_SENDER; role <= ROLE_RECEIVER; role++) {
+        PUDP_ENDPOINT endpoint = &endpoints[role];
+        if (endpoint->buffer == NULL) continue;
+
+        closesocket(endpoint->socket);
+        rio.RIOCloseCompletionQueue(endpoint->completion_queue);
+        rio.RIODeregisterBuffer(endpoint->buffer_id);
+        free_local_memory(endpoint->buffer);
+        CloseHandle(endpoint->packets_present);
+        memset(endpoint, 0, sizeof(UDP_ENDPOINT));
+    }
+
+    PUDP_SENDER sender = udp_senders;
+    while (sender != NULL) {
+        PUDP_SENDER next = sender->next;
+        closesocket(sender->socket);
+        rio.RIOCloseCompletionQueue(sender->completion_queue);
+        rio.RIODeregisterBuffer(sender->buffer_id);
+        free_local_memory(sender->buffer);
+        free(sender);
+        sender = next;
+    }
+    udp_senders = NULL;
+
+    WSACleanup();
+}
+
+/**
+ * @brief Finds the calling thread's socket for sending as a role, opening it the first time.
+ */
+static PUDP_SENDER get_thread_sender(int role) {
+
+    if (thread_senders[role] != NULL) {
+        return thread_senders[role];
+    }
+
+    PUDP_SENDER sender = zero_malloc(sizeof(UDP_SENDER));
+    SOCKADDR_IN address;
+    DWORD bytes;
+
+    sender->socket = open_socket();
+    get_role_address(role == ROLE_SENDER ? ROLE_RECEIVER : ROLE_SENDER, &address);
+    if (connect(sender->socket, (PSOCKADDR) &address, sizeof(address)) == SOCKET_ERROR) {
+        printf("Failed to connect a UDP socket: %d\n", WSAGetLastError());
+        exit(1);
+    }
+
+    // Nothing is received here, so an ICMP port unreachable from a far end that isn't up yet shouldn't fail the sends.
+    BOOL report_resets = FALSE;
+    WSAIoctl(sender->socket, SIO_UDP_CONNRESET, &report_resets, sizeof(report_resets), NULL, 0, &bytes, NULL, NULL);
+
+    sender->completion_queue = rio.RIOCreateCompletionQueue(UDP_SEND_DEPTH + 1, NULL);
+    if (sender->completion_queue == RIO_INVALID_CQ) {
+        printf("Failed to create a UDP completion queue: %d\n", WSAGetLastError());
+        exit(1);
+    }
+    sender->request_queue = rio.RIOCreateRequestQueue(sender->socket, 1, 1, UDP_SEND_DEPTH, 1,
+                                                      sender->completion_queue, sender->completion_queue, NULL);
+    if (sender->request_queue == RIO_INVALID_RQ) {
+        printf("Failed to create a UDP request queue: %d\n", WSAGetLastError());
+        exit(1);
+    }
+
+    sender->buffer = register_buffer(role, UDP_SEND_DEPTH, &sender->buffer_id);
+    for (ULONG i = 0; i < UDP_SEND_DEPTH; i++) {
+        sender->free_slots[i] = i;
+    }
+    sender->free_slot_count = UDP_SEND_DEPTH;
+
+    PUDP_SENDER head;
+    do {
+        head = udp_senders;
+        sender->next = head;
+    } while (InterlockedCompareExchangePointer((PVOID volatile*) &udp_senders, sender, head) != head);
+
+    thread_senders[role] = sender;
+    return sender;
+}
+
+/**
+ * @brief Takes back the slots of every send that has completed.
+ */
+static void reclaim_send_slots(PUDP_SENDER sender) {
+
+    RIORESULT results[MAX_PACKETS_PER_BATCH];
+    ULONG completed;
+
+    while ((completed = rio.RIODequeueCompletion(sender->completion_queue, results, MAX_PACKETS_PER_BATCH)) != 0) {
+        if (completed == RIO_CORRUPT_CQ) {
+            printf("A UDP completion queue is corrupt\n");
+            exit(1);
+        }
+        // A send that failed is as lost as a datagram dropped on the wire.
+        for (ULONG i = 0; i < completed; i++) {
+            sender->free_slots[sender->free_slot_count++] = (ULONG) results[i].RequestContext;
+        }
+        if (completed < MAX_PACKETS_PER_BATCH) break;
+    }
+}
+
+static ULONG udp_send_packets(PPACKET* pkts, ULONG count, int role) {
+
+    if (!IS_LOCAL_ROLE(role)) return 0;
+
+    ULONG64 sizes[MAX_PACKETS_PER_BATCH];
+    ULONG sendable = size_packets_to_send(pkts, count, sizes);
+    if (sendable == 0) return 0;
+
+    PUDP_SENDER sender = get_thread_sender(role);
+    reclaim_send_slots(sender);
+
+    // Queue the batch deferred, and hand it to the kernel at once. Once every slot is in flight the
+    // rest is rejected, and the caller resends it.
+    ULONG sent = 0;
+    for (; sent < sendable && sender->free_slot_count != 0; sent++) {
+        if (sizes[sent] > UDP_MAX_PACKET_SIZE_IN_BYTES) break;
+
+        ULONG slot = sender->free_slots[--sender->free_slot_count];
+        memcpy(sender->buffer + (ULONG64) slot * UDP_SLOT_SIZE_IN_BYTES, pkts[sent], sizes[sent]);
+
+        RIO_BUF buf = get_slot(sender->buffer_id, slot, (ULONG) sizes[sent]);
+        if (!rio.RIOSend(sender->request_queue, &buf, 1, RIO_MSG_DEFER, (PVOID) (ULONG_PTR) slot)) {
+            sender->free_slots[sender->free_slot_count++] = slot;
+            break;
+        }
+    }
+
+    if (sent == 0) return 0;
+
+    rio.RIOSend(sender->request_queue, NULL, 0, RIO_MSG_COMMIT_ONLY, NULL);
+    telemetry_count(TELEMETRY_PACKETS_SENT, sent);
+    return sent;
+}
+
+/**
+ * @brief Waits up to timeout_ms for receives to complete on a role's socket, and takes up to max_count of them.
+ * @param slots Where the slot each received datagram is in is written, max_count long
+ * @param bytes Where the size of each is written, max_count long
+ * @return The number of receives taken, or 0 on timeout. Their slots are the caller's until it posts them again.
+ */
+static ULONG take_receives(PUDP_ENDPOINT endpoint, ULONG max_count, ULONG64 timeout_ms, PULONG slots, PULONG bytes) {
+
+    RIORESULT results[MAX_PACKETS_PER_BATCH];
+    ULONG64 deadline = deadline_from_now_ms(timeout_ms);
+    max_count = min(max_count, MAX_PACKETS_PER_BATCH);
+
+    while (TRUE) {
+        AcquireSRWLockExclusive(&endpoint->lock);
+        ULONG completed = rio.RIODequeueCompletion(endpoint->completion_queue, results, max_count);
+
+        // Nothing yet: ask RIO to set the event on the next completion. That resets it first.
+        ULONG64 now = time_now();
+        if (completed == 0 && now < deadline) {
+            rio.RIONotify(endpoint->completion_queue);
+        }
+        ReleaseSRWLockExclusive(&endpoint->lock);
+
+        if (completed == RIO_CORRUPT_CQ) {
+            printf("A UDP completion queue is corrupt\n");
+            exit(1);
+        }
+        if (completed != 0) {
+            for (ULONG i = 0; i < completed; i++) {
+                slots[i] = (ULONG) results[i].RequestContext;
+                bytes[i] = results[i].Status == NO_ERROR ? results[i].BytesTransferred : 0;
+            }
+            return completed;
+        }
+        if (now >= deadline) return 0;
+
+        WaitForSingleObject(endpoint->packets_present, (DWORD) max(tsc_to_ms(deadline - now), 1));
+    }
+}
+
+static ULONG udp_receive_packets(PPACKET* pkts, ULONG max_count, ULONG64 timeout_ms, int role) {
+
+    if (pkts == NULL || max_count == 0) return 0;
+    if (!IS_LOCAL_ROLE(role))           return 0;
+
+    PUDP_ENDPOINT endpoint = &endpoints[role];
+    ULONG slots[MAX_PACKETS_PER_BATCH];
+    ULONG bytes[MAX_PACKETS_PER_BATCH];
+    ULONG received = 0;
+    ULONG64 deadline = deadline_from_now_ms(timeout_ms);
+
+    // Keep going until something whole arrives: anyone can send a datagram to the socket.
+    while (received == 0) {
+        ULONG64 now = time_now();
+        ULONG taken = take_receives(endpoint, max_count, now < deadline ? tsc_to_ms(deadline - now) : 0, slots, bytes);
+        if (taken == 0) return 0;
+
+        // The slots are ours until they are posted again, so the copies need no lock.
+        for (ULONG i = 0; i < taken; i++) {
+            PPACKET pkt = (PPACKET) (endpoint->buffer + (ULONG64) slots[i] * UDP_SLOT_SIZE_IN_BYTES);
+            if (is_whole_packet(pkt, bytes[i])) {
+                memcpy(pkts[received++], pkt, bytes[i]);
+            }
+        }
+
+        AcquireSRWLockExclusive(&endpoint->lock);
+        post_receives(endpoint, slots, taken);
+        ReleaseSRWLockExclusive(&endpoint->lock);
+    }
+    return received;
+}
+
+static int udp_receive_packet_view(PPACKET* pkt, PVOID* view, ULONG64 timeout_ms, int role) {
+
+    if (pkt == NULL || view == NULL)    return NO_PACKET_AVAILABLE;
+    if (!IS_LOCAL_ROLE(role))           return NO_PACKET_AVAILABLE;
+
+    PUDP_ENDPOINT endpoint = &endpoints[role];
+    ULONG64 deadline = deadline_from_now_ms(timeout_ms);
+    ULONG slot;
+    ULONG bytes;
+
+    while (TRUE) {
+        ULONG64 now = time_now();
+        if (take_receives(endpoint, 1, now < deadline ? tsc_to_ms(deadline - now) : 0, &slot, &bytes) == 0) {
+            return NO_PACKET_AVAILABLE;
+        }
+
+        // The packet is read where it landed. Its receive is posted again when the view is released.
+        PPACKET received = (PPACKET) (endpoint->buffer + (ULONG64) slot * UDP_SLOT_SIZE_IN_BYTES);
+        if (is_whole_packet(received, bytes)) {
+            *pkt = received;
+            *view = (PVOID) ((ULONG_PTR) slot + 1);
+            return PACKET_RECEIVED;
+        }
+
+        AcquireSRWLockExclusive(&endpoint->lock);
+        post_receives(endpoint, &slot, 1);
+        ReleaseSRWLockExclusive(&endpoint->lock);
+    }
+}
+
+static void udp_release_packet_view(PVOID view, int role) {
+
+    if (!IS_LOCAL_ROLE(role)) return;
+
+    PUDP_ENDPOINT endpoint = &endpoints[role];
+    ULONG slot = (ULONG) ((ULONG_PTR) view - 1);
+
+    AcquireSRWLockExclusive(&endpoint->lock);
+    post_receives(endpoint, &slot, 1);
+    ReleaseSRWLockExclusive(&endpoint->lock);
+}
+
+NETWORK_BACKEND_CALLS udp_backend = {
+    .create_layer = udp_create,
+    .free_layer = udp_free,
+    .send_packets = udp_send_packets,
+    .receive_packets = udp_receive_packets,
+    .receive_packet_view = udp_receive_packet_view,
+    .release_packet_view = udp_release_packet_view,
+    .max_packet_size = UDP_MAX_PACKET_SIZE_IN_BYTES,
+};
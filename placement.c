@@ -0,0 +1,202 @@
+//
+// Topology discovery, thread pinning and node-local allocation.
+//
+
+#include "placement.h"
+
+typedef struct placement_node {
+    GROUP_AFFINITY affinity;                                // Every processor on the node
+    PROCESSOR_NUMBER processors[MAX_PROCESSORS_PER_NODE];   // The first processor of each core, then the rest
+    ULONG processor_count;
+    volatile LONG next_processor;                           // The next one to pin a thread to
+} PLACEMENT_NODE, *PPLACEMENT_NODE;
+
+static PLACEMENT_NODE nodes[MAX_PLACEMENT_NODES];
+
+// 0 until placement_init, and whenever placement is off.
+static ULONG node_count;
+
+static const ULONG64 thread_pinning[THREAD_KINDS] = {
+    SENDER_LISTENER_PINNING,
+    SENDER_MINION_PINNING,
+    RECEIVER_WORKER_PINNING,
+    APP_THREAD_PINNING,
+    APP_THREAD_PINNING,
+};
+
+static const int thread_sides[THREAD_KINDS] = {
+    ROLE_SENDER,
+    ROLE_SENDER,
+    ROLE_RECEIVER,
+    ROLE_SENDER,
+    ROLE_RECEIVER,
+};
+
+/**
+ * @brief Finds the node a side's threads and memory are on. Nodes past the last one wrap around.
+ */
+static ULONG node_of_side(int role) {
+    ULONG node = role == ROLE_SENDER ? SENDER_NUMA_NODE : RECEIVER_NUMA_NODE;
+    return node % node_count;
+}
+
+/**
+ * @brief Finds the node a processor belongs to, or NULL if it isn't on any we know of.
+ */
+static PPLACEMENT_NODE node_of_processor(WORD group, ULONG number) {
+
+    for (ULONG n = 0; n < node_count; n++) {
+        if (nodes[n].affinity.Group == group && ((ULONG64) nodes[n].affinity.Mask & (1ULL << number))) {
+            return &nodes[n];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Adds a processor to the end of its node's list, unless it is already on it.
+ */
+static void add_processor(WORD group, ULONG number) {
+
+    PPLACEMENT_NODE node = node_of_processor(group, number);
+    if (node == NULL || node->processor_count == MAX_PROCESSORS_PER_NODE) return;
+
+    for (ULONG i = 0; i < node->processor_count; i++) {
+        if (node->processors[i].Group == group && node->processors[i].Number == number) return;
+    }
+
+    PPROCESSOR_NUMBER processor = &node->processors[node->processor_count++];
+    processor->Group = group;
+    processor->Number = (BYTE) number;
+    processor->Reserved = 0;
+}
+
+/**
+ * @brief Lists every node's processors a core at a time: the first processor of each core on one
+ *        pass, and their siblings on the next. If the cores can't be read, or miss any processor,
+ *        the node's mask fills in the rest in order.
+ */
+static void list_processors(void) {
+
+    DWORD length = 0;
+    PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX cores = NULL;
+
+    if (!GetLogicalProcessorInformationEx(RelationProcessorCore, NULL, &length) &&
+        GetLastError() == ERROR_INSUFFICIENT_BUFFER) {
+        cores = malloc(length);
+        if (cores != NULL && !GetLogicalProcessorInformationEx(RelationProcessorCore, cores, &length)) {
+            free(cores);
+            cores = NULL;
+        }
+    }
+
+    if (cores != NULL) {
+        for (ULONG pass = 0; pass < 2; pass++) {
+            PBYTE entry = (PBYTE) cores;
+            while (entry < (PBYTE) cores + length) {
+                PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX core = (PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX) entry;
+                PGROUP_AFFINITY mask = &core->Processor.GroupMask[0];
+
+                ULONG64 bits = (ULONG64) mask->Mask;
+                while (bits != 0) {
+                    ULONG bit;
+                    _BitScanForward64(&bit, bits);
+                    bits &= bits - 1;
+                    add_processor(mask->Group, bit);
+
+                    // The first pass takes only the core's first processor.
+                    if (pass == 0) break;
+                }
+                entry += core->Size;
+            }
+        }
+        free(cores);
+    }
+
+    for (ULONG n = 0; n < node_count; n++) {
+        ULONG64 bits = (ULONG64) nodes[n].affinity.Mask;
+        while (bits != 0) {
+            ULONG bit;
+            _BitScanForward64(&bit, bits);
+            bits &= bits - 1;
+            add_processor(nodes[n].affinity.Group, bit);
+        }
+    }
+}
+
+void placement_init(void) {
+
+    node_count = 0;
+    if (!PLACEMENT_ENABLED) return;
+
+    ULONG highest_node;
+    if (!GetNumaHighestNodeNumber(&highest_node)) return;
+
+    memset(nodes, 0, sizeof(nodes));
+    ULONG count = min(highest_node + 1, MAX_PLACEMENT_NODES);
+
+    // Node numbers can have gaps. A node we can't read has no processors, and only ever gets memory.
+    for (ULONG n = 0; n < count; n++) {
+        if (!GetNumaNodeProcessorMaskEx((USHORT) n, &nodes[n].affinity)) {
+            memset(&nodes[n].affinity, 0, sizeof(GROUP_AFFINITY));
+        }
+    }
+    node_count = count;
+
+    list_processors();
+}
+
+/**
+ * @brief Pins a thread as config.h says its kind should be. A thread that can't be pinned keeps the
+ *        default affinity, which still works.
+ */
+static void pin_thread(HANDLE thread, ULONG64 kind) {
+
+    if (node_count == 0 || thread_pinning[kind] == PIN_NONE) return;
+
+    PPLACEMENT_NODE node = &nodes[node_of_side(thread_sides[kind])];
+    if (node->processor_count == 0) return;
+
+    GROUP_AFFINITY affinity = node->affinity;
+    if (thread_pinning[kind] == PIN_CORE) {
+        ULONG index = (ULONG) InterlockedIncrement(&node->next_processor) - 1;
+        PPROCESSOR_NUMBER processor = &node->processors[index % node->processor_count];
+
+        memset(&affinity, 0, sizeof(GROUP_AFFINITY));
+        affinity.Group = processor->Group;
+        affinity.Mask = (KAFFINITY) 1 << processor->Number;
+    }
+    SetThreadGroupAffinity(thread, &affinity, NULL);
+}
+
+HANDLE create_placed_thread(ULONG64 kind, LPTHREAD_START_ROUTINE routine, LPVOID parameter, LPDWORD thread_id) {
+
+    ASSERT(kind < THREAD_KINDS);
+
+    HANDLE thread = CreateThread(DEFAULT_SECURITY, DEFAULT_STACK_SIZE, routine, parameter, CREATE_SUSPENDED, thread_id);
+    if (thread == NULL) return NULL;
+
+    pin_thread(thread, kind);
+    ResumeThread(thread);
+    return thread;
+}
+
+PVOID allocate_local_memory(int role, SIZE_T bytes, DWORD allocation_type) {
+
+    if (node_count == 0) {
+        return VirtualAlloc(NULL, bytes, allocation_type, PAGE_READWRITE);
+    }
+    return VirtualAllocExNuma(GetCurrentProcess(), NULL, bytes, allocation_type, PAGE_READWRITE, node_of_side(role));
+}
+
+PVOID commit_local_memory(int role, PVOID address, SIZE_T bytes) {
+
+    if (node_count == 0) {
+        return VirtualAlloc(address, bytes, MEM_COMMIT, PAGE_READWRITE);
+    }
+    return VirtualAllocExNuma(GetCurrentProcess(), address, bytes, MEM_COMMIT, PAGE_READWRITE, node_of_side(role));
+}
+
+void free_local_memory(PVOID address) {
+    VirtualFree(address, 0, MEM_RELEASE);
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "utils.h"
+
+/**
+ * Topology-aware placement: pins each kind of thread as config.h says, and allocates each side's
+ * memory on the NUMA node that side's threads run on.
+ *
+ * Everything belongs to one side. The sender's listener, its minions and the application's sending
+ * threads run on SENDER_NUMA_NODE, and so does the memory they write: the sender's transmission
+ * state and staging buffers, and each sender-to-receiver network's buffer, bitmaps and PMs. The
+ * receiver's workers and the application's receiving threads run on RECEIVER_NUMA_NODE, along with
+ * the receiver's caches, transmission pool, and the receiver-to-sender networks.
+ *
+ * Threads pinned to a core are handed out a node's processors in turn: the first processor of every
+ * physical core, and only then their hyperthread siblings. With PLACEMENT_ENABLED off, or before
+ * placement_init, threads keep the default affinity and memory goes wherever the OS puts it.
+ */
+
+// Kinds of thread
+#define THREAD_SENDER_LISTENER                  0
+#define THREAD_SENDER_MINION                    1
+#define THREAD_RECEIVER_WORKER                  2
+#define THREAD_APP_SENDER                       3
+#define THREAD_APP_RECEIVER                     4
+#define THREAD_KINDS                            5
+
+#define MAX_PLACEMENT_NODES                     64
+
+// A node's processors are all in one processor group, which has at most 64.
+#define MAX_PROCESSORS_PER_NODE                 64
+
+/**
+ * @brief Reads the machine's NUMA nodes and the cores on each. Call once at program start, before
+ *        any layer is created.
+ */
+void placement_init(void);
+
+/**
+ * @brief Creates a thread pinned for its kind. It doesn't run until it has been pinned, so nothing it
+ *        touches first lands on the wrong node.
+ * @param kind One of the THREAD_ kinds.
+ * @return The thread's handle, or NULL if it could not be created.
+ */
+HANDLE create_placed_thread(ULONG64 kind, LPTHREAD_START_ROUTINE routine, LPVOID parameter, LPDWORD thread_id);
+
+/**
+ * @brief Allocates memory (as VirtualAlloc does) on the node of the side that writes it.
+ * @param role ROLE_SENDER or ROLE_RECEIVER.
+ * @param allocation_type MEM_RESERVE, MEM_COMMIT or both, and optionally MEM_LARGE_PAGES.
+ * @return The memory, zeroed if committed, or NULL if it could not be allocated.
+ */
+PVOID allocate_local_memory(int role, SIZE_T bytes, DWORD allocation_type);
+
+/**
+ * @brief Commits part of a region reserved with allocate_local_memory, on the same side's node.
+ * @return The address, or NULL if it could not be committed.
+ */
+PVOID commit_local_memory(int role, PVOID address, SIZE_T bytes);
+
+/**
+ * @brief Frees memory from allocate_local_memory.
+ */
+void free_local_memory(PVOID address);
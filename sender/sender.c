@@ -4,6 +4,12 @@
 
 #include "../transport.h"
 #include "../transport_sender.h"
+#include "../bitmap.h"
+#include "../checksum.h"
+#include "../fec.h"
+#include "../compress.h"
+#include "../telemetry.h"
+#include "../placement.h"
 
 
 SENDER_STATE g_sender_state;
@@ -12,130 +18,221 @@ SENDER_STATE g_sender_state;
 VOID create_sender(VOID)
 {
     g_sender_state.transmissions_in_progress =
-        VirtualAlloc(NULL,
+        allocate_local_memory(ROLE_SENDER,
         MAXULONG32 * sizeof(SENDER_TRANSMISSION_INFO),
-        MEM_RESERVE,
-        PAGE_READWRITE);
+        MEM_RESERVE);
     if (g_sender_state.transmissions_in_progress == NULL) {
         DebugBreak();
     }
 
 
 
-    g_sender_state.transmissions_queue.work_array = (PUINT32)VirtualAlloc(NULL,
-        sizeof(UINT32) * WORK_ARRAY_SIZE,
-        MEM_RESERVE | MEM_COMMIT,
-        PAGE_READWRITE);
-    if (g_sender_state.transmissions_queue.work_array == NULL) {
-        DebugBreak();
-    }
+    for (ULONG64 c = 0; c < MAX_CONNECTIONS; c++) {
+        SENDER_CONNECTION* connection = &g_sender_state.connections[c];
+
+        connection->transmissions_queue.slots = (PTRANSMISSION_QUEUE_SLOT)allocate_local_memory(ROLE_SENDER,
+            sizeof(TRANSMISSION_QUEUE_SLOT) * TRANSMISSION_QUEUE_SIZE,
+            MEM_RESERVE | MEM_COMMIT);
+        if (connection->transmissions_queue.slots == NULL) {
+            DebugBreak();
+        }
+
+        // Every slot starts out empty and writable by the producer that claims its position.
+        for (LONG64 i = 0; i < TRANSMISSION_QUEUE_SIZE; i++) {
+            connection->transmissions_queue.slots[i].sequence = i;
+            connection->transmissions_queue.slots[i].transmission_id = EMPTY_WORK_ARRAY_ID;
+        }
 
-    // Filling work array with default values
-    memset(g_sender_state.transmissions_queue.work_array, EMPTY_WORK_ARRAY_ID, sizeof(UINT32) * WORK_ARRAY_SIZE);
+        connection->transmissions_queue.enqueue_index = 0;
+        connection->transmissions_queue.dequeue_index = 0;
 
-    g_sender_state.transmissions_queue.next_read_index = 0;
-    g_sender_state.transmissions_queue.next_write_index = 0;
+        // Every connection gets an equal share until the application says otherwise.
+        connection->weight = DEFAULT_CONNECTION_WEIGHT;
+        connection->credits = DEFAULT_CONNECTION_WEIGHT * CONNECTION_QUANTUM_IN_BYTES;
+    }
+    g_sender_state.scheduler_round = 0;
 
 
 
-    // Create sender listener thread.
-    CreateThread(NULL, 0, sender_listener, NULL, 0, NULL);
+    // Minion deques start out empty (top == bottom == 0).
+    memset(g_sender_state.minion_deques, 0, sizeof(g_sender_state.minion_deques));
 
-    InitializeCriticalSection(&g_work_array_lock);
+    g_sender_state.work_available = CreateEvent(NULL, AUTO_RESET, FALSE, NULL);
+    if (g_sender_state.work_available == NULL) {
+        DebugBreak();
+    }
 
-    // Create our minion threads.
     for (int i = 0; i < SENDER_MINION_COUNT; i++) {
-        CreateThread(NULL, 0, sender_minion, NULL, 0, NULL);
+        g_sender_state.minion_deques[i].chunk_acked_event = CreateEvent(NULL, AUTO_RESET, FALSE, NULL);
+        if (g_sender_state.minion_deques[i].chunk_acked_event == NULL) {
+            DebugBreak();
+        }
+    }
+
+    for (int i = 0; i < PAYLOAD_SIZE_CLASS_COUNT; i++) {
+        InitializeSListHead(&g_sender_state.free_staging_buffers[i]);
+    }
+    g_sender_state.payload_size = DEFAULT_PAYLOAD_SIZE;
+    g_sender_state.active_minions = SENDER_MINION_COUNT;
+
+    memset(&g_sender_state.congestion, 0, sizeof(g_sender_state.congestion));
+    g_sender_state.congestion.congestion_window = INITIAL_CONGESTION_WINDOW;
+    g_sender_state.congestion.in_startup = TRUE;
+    g_sender_state.congestion.retransmission_timeout = ms_to_tsc(INITIAL_RTO_MS);
+
+    // Create sender listener thread.
+    create_placed_thread(THREAD_SENDER_LISTENER, sender_listener, NULL, NULL);
+
+    // Create our minion threads. Each one is told its index so it can find its own deque.
+    // Pinned, each builds its batch packets on its own node as it first touches them.
+    for (ULONG64 i = 0; i < SENDER_MINION_COUNT; i++) {
+        create_placed_thread(THREAD_SENDER_MINION, sender_minion, (LPVOID) i, NULL);
     }
 }
 
 
 
-VOID packetize_contiguous(PVOID transmission_data, ULONG64 bytes_to_packetize, SENDER_MINION_INFO minion_info)
+// Each minion builds its batches here. The packets have room for the largest payload, which is
+// far too much for the stack.
+__declspec(thread) PDATA_PACKET minion_batch_packets;
+
+/**
+ * @brief Finds this thread's batch of packets to build into, allocating it the first time.
+ */
+static PDATA_PACKET get_batch_packets(VOID)
+{
+    if (minion_batch_packets == NULL) {
+        minion_batch_packets = zero_malloc(SEND_BATCH_SIZE_IN_PACKETS * sizeof(DATA_PACKET));
+    }
+    return minion_batch_packets;
+}
+
+VOID packetize_contiguous(PVOID transmission_data, ULONG64 bytes_to_packetize, SENDER_MINION_INFO minion_info,
+                          ULONG64 packet_offset_in_chunk)
 {
     ULONG64 numPackets;
-    DATA_PACKET packet;
+    ULONG64 payload_size = minion_info.payload_size;
+    PDATA_PACKET packets = get_batch_packets();
+    PPACKET batch[SEND_BATCH_SIZE_IN_PACKETS];
+    ULONG64 packets_in_batch = 0;
     UINT32 bytes_left_to_packetize = (INT32) bytes_to_packetize;
     // right now we are just assuming that we want every packet to be as full as possible.
-    numPackets = bytes_to_packetize / MAX_PAYLOAD_SIZE;
-    if (bytes_to_packetize % MAX_PAYLOAD_SIZE != 0) {
+    numPackets = bytes_to_packetize / payload_size;
+    if (bytes_to_packetize % payload_size != 0) {
         numPackets++;
     }
 
-    UINT32 starting_packet_number = (INT32) minion_info.chunk_index * MAX_CHUNK_SIZE_IN_PACKETS;
+    UINT32 starting_packet_number = (INT32) (minion_info.chunk_index * MAX_CHUNK_SIZE_IN_PACKETS + packet_offset_in_chunk);
+    volatile ULONG64* send_times =
+        g_sender_state.transmissions_in_progress[minion_info.transmission_id].packet_send_times;
+
+    if (g_sender_state.fec.enabled) {
+        InterlockedAdd64(&g_sender_state.fec.packets_sent, numPackets);
+    }
 
     for (int i = 0; i < numPackets; i++) {
+        PDATA_PACKET packet = &packets[packets_in_batch];
+
         // I feel like there is an easier way of organizing the fields, but it would require a lot of blick work.
-        packet.index_in_transmission = starting_packet_number + i;
-        packet.transmission_id = minion_info.transmission_id;
-        packet.n_packets_in_transmission = (INT32) minion_info.n_packets_in_transmission;
-        packet.must_be_zero = 0;
-        packet.bytes_in_header = 16;
-        packet.bytes_in_data_fields = 16;
-        packet.bytes_in_payload = min(bytes_left_to_packetize, MAX_PAYLOAD_SIZE);
+        packet->index_in_transmission = starting_packet_number + i;
+        packet->transmission_id = minion_info.transmission_id;
+        packet->n_packets_in_transmission = (INT32) minion_info.n_packets_in_transmission;
+        packet->must_be_zero = 0;
+        packet->bytes_in_header = 24;
+        packet->connection_id = minion_info.connection_id;
+        packet->bytes_in_data_fields = 40;
+        packet->payload_size = (UINT32) payload_size;
+        packet->parity_index = 0;
+        packet->parity_count = 0;
+        packet->parity_last_packet_bytes = 0;
+        packet->compressed_chunk_bytes = minion_info.chunk_bytes != 0 ? (UINT32) minion_info.bytes_to_send : 0;
+        packet->chunk_bytes = (UINT32) minion_info.chunk_bytes;
+        packet->data_reserved = 0;
+        packet->bytes_in_payload = (UINT32) min(bytes_left_to_packetize, payload_size);
 
         __try {
-            memcpy(packet.data, (PBYTE) transmission_data + i * MAX_PAYLOAD_SIZE, packet.bytes_in_payload);
+            memcpy(packet->data, (PBYTE) transmission_data + i * payload_size, packet->bytes_in_payload);
         } __except (EXCEPTION_EXECUTE_HANDLER) {
             printf("Failed to copy data to packet, likely a hack attempt\n");
             DebugBreak();
             exit(1);
         }
+        packet->payload_checksum = PAYLOAD_CHECKSUM(packet->data, packet->bytes_in_payload);
 
-        bytes_left_to_packetize -= packet.bytes_in_payload;
+        bytes_left_to_packetize -= packet->bytes_in_payload;
+        batch[packets_in_batch++] = (PPACKET) packet;
+        send_times[packet->index_in_transmission] = time_now();
 
-        // Retry on PACKET_REJECTED — the network buffer may be temporarily full.
-        // If we exhaust retries, move on; the retransmission logic in sender_minion
-        // will catch this packet on the next ACK-check cycle.
-        {
-            int send_attempts = 0;
-            int send_result;
-            do {
-                send_result = send_packet((PPACKET) &packet, ROLE_SENDER);
-                if (send_result == PACKET_REJECTED) {
-                    send_attempts++;
-                    Sleep(1);
-                }
-            } while (send_result == PACKET_REJECTED && send_attempts < MAX_ATTEMPTS_NETWORK);
-        }
 # if SUPERFLUOUS_PRINTS
-    printf("Sending packet with id %llu and index %llu\n", packet.transmission_id,packet.index_in_transmission);
+    printf("Sending packet with id %llu and index %llu\n", packet->transmission_id,packet->index_in_transmission);
 #endif
+
+        // Once the batch is full (or we are out of data), hand it all to the network at once.
+        if (packets_in_batch == SEND_BATCH_SIZE_IN_PACKETS || i == numPackets - 1) {
+            send_packet_batch(batch, packets_in_batch);
+            packets_in_batch = 0;
+        }
     }
 }
 
-VOID retransmit_packet(PSENDER_MINION_INFO info, ULONG64 packet_offset_in_chunk)
+BOOL build_retransmit_packet(PSENDER_MINION_INFO info, ULONG64 packet_offset_in_chunk, PDATA_PACKET packet)
 {
-    DATA_PACKET packet;
-
     // Convert from chunk-relative offset to absolute packet index in the transmission
     UINT32 index_in_transmission = (UINT32)(info->chunk_index * MAX_CHUNK_SIZE_IN_PACKETS + packet_offset_in_chunk);
 
     // Figure out how many bytes this packet has
-    ULONG64 byte_offset = packet_offset_in_chunk * MAX_PAYLOAD_SIZE;
+    ULONG64 byte_offset = packet_offset_in_chunk * info->payload_size;
     ULONG64 remaining = info->bytes_to_send - byte_offset;
 
-    packet.index_in_transmission = index_in_transmission;
-    packet.transmission_id = info->transmission_id;
-    packet.n_packets_in_transmission = (UINT32)info->n_packets_in_transmission;
-    packet.must_be_zero = 0;
-    packet.bytes_in_header = 16;
-    packet.bytes_in_data_fields = 16;
-    packet.bytes_in_payload = (UINT32)min(remaining, MAX_PAYLOAD_SIZE);
+    packet->index_in_transmission = index_in_transmission;
+    packet->transmission_id = info->transmission_id;
+    packet->n_packets_in_transmission = (UINT32)info->n_packets_in_transmission;
+    packet->must_be_zero = 0;
+    packet->bytes_in_header = 24;
+    packet->connection_id = info->connection_id;
+    packet->bytes_in_data_fields = 40;
+    packet->payload_size = (UINT32)info->payload_size;
+    packet->parity_index = 0;
+    packet->parity_count = 0;
+    packet->parity_last_packet_bytes = 0;
+    packet->compressed_chunk_bytes = info->chunk_bytes != 0 ? (UINT32)info->bytes_to_send : 0;
+    packet->chunk_bytes = (UINT32)info->chunk_bytes;
+    packet->data_reserved = 0;
+    packet->bytes_in_payload = (UINT32)min(remaining, info->payload_size);
 
     __try {
-        memcpy(packet.data, info->data_to_send + byte_offset, packet.bytes_in_payload);
+        memcpy(packet->data, info->data_to_send + byte_offset, packet->bytes_in_payload);
     } __except (EXCEPTION_EXECUTE_HANDLER) {
         printf("Failed to copy data for retransmit\n");
-        return;
+        return FALSE;
     }
+    packet->payload_checksum = PAYLOAD_CHECKSUM(packet->data, packet->bytes_in_payload);
 
-    send_packet((PPACKET)&packet, ROLE_SENDER);
+    return TRUE;
 }
 
-VOID send_packet_batch(ULONG64 number_of_packets_to_send)
+VOID send_packet_batch(PPACKET* packets, ULONG64 number_of_packets_to_send)
 {
-
+    // Retry on rejection -- the network buffer may be temporarily full.
+    // If we exhaust retries, move on; the retransmission logic in sender_minion
+    // will catch these packets on the next ACK-check cycle.
+    ULONG64 packets_sent = 0;
+    int send_attempts = 0;
+
+    while (packets_sent < number_of_packets_to_send && send_attempts < MAX_ATTEMPTS_NETWORK) {
+        packets_sent += send_packets(packets + packets_sent,
+                                     (ULONG) (number_of_packets_to_send - packets_sent),
+                                     ROLE_SENDER);
+
+        if (packets_sent < number_of_packets_to_send) {
+            // The network ran out of room -- that's as clear a congestion signal as a loss.
+            if (send_attempts == 0) {
+                on_congestion_event();
+            }
+            send_attempts++;
+            Sleep(1);
+        }
+    }
 }
 
 
@@ -144,41 +241,122 @@ DWORD sender_listener(LPVOID param)
     WaitForSingleObject(simulation_begin, INFINITE);
     ULONG64 timeout_ms = 100;
 
-    COMM_PACKET packet; // Will need to change this to an array of packet locations and receive them there ?
+    COMM_PACKET packets[LISTENER_BATCH_SIZE_IN_PACKETS];
+    PPACKET batch[LISTENER_BATCH_SIZE_IN_PACKETS];
+
+    for (int i = 0; i < LISTENER_BATCH_SIZE_IN_PACKETS; i++) {
+        batch[i] = (PPACKET) &packets[i];
+    }
 
     while (TRUE)
     {
-        int packet_received_status = receive_packet((PPACKET) &packet, timeout_ms, ROLE_SENDER);
-        if (packet_received_status == NO_PACKET_AVAILABLE)
+        ULONG packets_received = receive_packets(batch, LISTENER_BATCH_SIZE_IN_PACKETS, timeout_ms, ROLE_SENDER);
+        if (packets_received == 0)
         {
             continue;
         }
 
-        UINT32 transmission_id = packet.transmission_id;
+        ULONG64 packets_acked = 0;
+        BOOL receive_window_opened = FALSE;
+        telemetry_count(TELEMETRY_ACKS_RECEIVED, packets_received);
 
-        // Immediately write out the comms we received to our transmission bitmaps for the minions.
-        PSENDER_TRANSMISSION_INFO transmission_info = &g_sender_state.transmissions_in_progress[transmission_id];
+        for (ULONG p = 0; p < packets_received; p++)
+        {
+            PCOMM_PACKET packet = &packets[p];
+            UINT32 transmission_id = packet->transmission_id;
 
+            // Corrupted SACK ranges could ACK packets that never arrived. Drop the ACK -- the next one
+            // covers everything this one did.
+            ULONG64 sack_bytes = min(packet->bytes_in_sack_ranges, sizeof(packet->sack_ranges));
+            if (!PAYLOAD_CHECKSUM_MATCHES(packet->payload_checksum, packet->sack_ranges, sack_bytes))
+            {
+                continue;
+            }
 
-        for (UINT32 i = 0; i < packet.n_bits_to_read; i++)
-        {
-            BYTE current_byte = packet.bitmap[i / 8];
+            // Immediately write out the comms we received to our transmission bitmaps for the minions.
+            // Once every packet is ACK'd we have let go of the transmission, and its arrays may be gone.
+            if (transmission_id >= (ULONG64) g_sender_state.transmission_id_limit)
+            {
+                continue;
+            }
+            PSENDER_TRANSMISSION_INFO transmission_info = &g_sender_state.transmissions_in_progress[transmission_id];
+            if (transmission_info->packets_outstanding == 0)
+            {
+                continue;
+            }
+            ULONG64 latest = packet->latest_packet_index;
+            BOOL latest_was_outstanding = latest < transmission_info->number_of_packets_in_transmission &&
+                !BITMAP_TEST(transmission_info->packet_status_bitmap, latest);
+
+            // ACKs can arrive out of order, so the cumulative ACK only ever moves forward.
+            if (packet->cumulative_ack > transmission_info->cumulative_ack)
+            {
+                packets_acked += acknowledge_packet_range(transmission_info, transmission_info->cumulative_ack,
+                                                          packet->cumulative_ack);
+                transmission_info->cumulative_ack = packet->cumulative_ack;
+            }
 
-            // Had to look up this bitwise operator stuff but I think it's right.
-            int is_bit_set = current_byte & 1 << (i % 8);
+            // Same for the receive window. Minions waiting on it have no timer to wake them.
+            ULONG64 window_end = min(packet->receive_window_end, transmission_info->number_of_packets_in_transmission);
+            if (window_end > transmission_info->receive_window_end)
+            {
+                transmission_info->receive_window_end = window_end;
+                receive_window_opened = TRUE;
+            }
 
-            // Weird thing where I have to divide by 64 instead of 8 because the packet status bitmap is 64 bits
-            // as opposed to the packet bitmap's 8 bit data type.
-            if (is_bit_set)
+            ULONG64 n_ranges = min(packet->bytes_in_sack_ranges / sizeof(SACK_RANGE), MAX_SACK_RANGES);
+            for (ULONG64 r = 0; r < n_ranges; r++)
             {
-                UINT32 packet_index = packet.first_packet_index + i;
-                transmission_info->packet_status_bitmap[packet_index / 64] |= 1ULL << (packet_index % 64);
+                PSACK_RANGE range = &packet->sack_ranges[r];
+                packets_acked += acknowledge_packet_range(transmission_info, range->first_packet_index,
+                                                          (ULONG64) range->first_packet_index + range->n_packets);
             }
 
-        }
+            if (packet->packets_recovered != 0 && g_sender_state.fec.enabled)
+            {
+                InterlockedAdd64(&g_sender_state.fec.packets_lost, packet->packets_recovered);
+            }
+
+            ULONG64 nacked = packet->nacked_packet_index;
+            if (nacked < transmission_info->number_of_packets_in_transmission &&
+                !BITMAP_TEST(transmission_info->packet_status_bitmap, nacked))
+            {
+                request_retransmit(transmission_info, nacked);
+            }
+
+            // One RTT sample per ACK, from the packet that triggered it -- as long as this ACK is the
+            // first to cover it, otherwise the sample would include the time since the earlier ACK.
+            if (latest_was_outstanding &&
+                BITMAP_TEST(transmission_info->packet_status_bitmap, latest))
+            {
+                record_rtt_sample(transmission_info->packet_send_times[latest]);
+            }
+
+            // That was the last of it. The ACK is fully handled, so let go of the transmission.
+            if (transmission_info->packets_outstanding == 0)
+            {
+                release_transmission(transmission_info);
+            }
 #if SUPERFLUOUS_PRINTS
-    printf("Received ack packet with id %llu and index %llu\n, here is the first bitmap %llu \n", transmission_id, packet.first_packet_index, packet.bitmap[0]);
+    printf("Received ack packet with id %u, cumulative %u and %llu ranges\n", transmission_id, packet->cumulative_ack, n_ranges);
 #endif
+        }
+
+        // Hand the window back all at once, and wake a minion if one was waiting for it.
+        if (packets_acked != 0)
+        {
+            release_send_window(packets_acked);
+
+            if (g_sender_state.congestion.window_blocked &&
+                InterlockedExchange(&g_sender_state.congestion.window_blocked, FALSE))
+            {
+                receive_window_opened = TRUE;
+            }
+        }
+        if (receive_window_opened)
+        {
+            SetEvent(g_sender_state.work_available);
+        }
 
     }
 
@@ -194,19 +372,24 @@ DWORD sender_listener(LPVOID param)
 
 DWORD sender_minion(LPVOID param)
 {
-    WaitForSingleObject(simulation_begin, INFINITE);
-
-    typedef struct {
-        SENDER_MINION_INFO info;
-        BOOL active;
-    } PENDING_CHUNK;
+    ULONG64 minion_index = (ULONG64) param;
+    PMINION_DEQUE deque = &g_sender_state.minion_deques[minion_index];
+    PCHUNK_TASK parked_tasks[MINION_DEQUE_SIZE];
+    HANDLE wake_events[2] = { deque->chunk_acked_event, g_sender_state.work_available };
 
-    PENDING_CHUNK pending_chunks[MAX_PENDING_CHUNKS_PER_MINION] = {0};
-    int num_pending = 0;
+    WaitForSingleObject(simulation_begin, INFINITE);
 
     while (TRUE)
     {
-        while (num_pending < MAX_PENDING_CHUNKS_PER_MINION)
+        BOOL did_work = FALSE;
+
+        // A parked minion (see set_sender_minion_count) takes on nothing new. It only sees the chunks
+        // it already holds through, and anyone may steal those.
+        BOOL active = minion_index < (ULONG64) g_sender_state.active_minions;
+
+        // Take on new chunks while we have room for them. Fresh chunks go into our deque as SEND
+        // tasks, so an idle minion can steal and packetize them while we handle the rest.
+        while (active && deque->bottom - deque->top < MAX_PENDING_CHUNKS_PER_MINION)
         {
             SENDER_MINION_INFO briefcase = {0};
             find_work(&briefcase);
@@ -217,166 +400,888 @@ DWORD sender_minion(LPVOID param)
                 break;
             }
 
-            // Send the initial batch of packets for this chunk
-            packetize_contiguous(briefcase.data_to_send, briefcase.bytes_to_send, briefcase);
+            PCHUNK_TASK task = zero_malloc(sizeof(CHUNK_TASK));
+            task->info = briefcase;
+            task->state = CHUNK_TASK_SEND;
+            task->due_time = MAXULONG64;
+            push_chunk_task(deque, task);
+            SetEvent(g_sender_state.work_available);
+        }
 
-            // Find a free slot in our pending array and track this chunk
-            for (int i = 0; i < MAX_PENDING_CHUNKS_PER_MINION; i++)
+        // Work through our own deque one task at a time, so whatever we haven't got to yet stays
+        // stealable. Anything not finished is parked and pushed back once the pass is over.
+        ULONG64 num_parked = 0;
+        ULONG64 next_due_time = MAXULONG64;
+        PCHUNK_TASK task = pop_chunk_task(deque);
+
+        // Nothing of our own to do, so go help someone else.
+        for (ULONG64 i = 1; active && task == NULL && i < SENDER_MINION_COUNT; i++)
+        {
+            task = steal_chunk_task(&g_sender_state.minion_deques[(minion_index + i) % SENDER_MINION_COUNT]);
+        }
+
+        while (task != NULL)
+        {
+            // Claim the chunk so the listener knows who to wake once it's fully ACK'd.
+            PSENDER_CHUNK_INFO chunk = &g_sender_state.transmissions_in_progress[task->info.transmission_id].
+                chunks[task->info.chunk_index];
+            chunk->owner = (LONG) minion_index;
+
+            ULONG64 result = run_chunk_task(task, &next_due_time);
+
+            if (result != CHUNK_TASK_NOT_DUE)
             {
-                if (!pending_chunks[i].active)
-                {
-                    pending_chunks[i].info = briefcase;
-                    pending_chunks[i].active = TRUE;
-                    num_pending++;
-                    break;
-                }
+                did_work = TRUE;
+            }
+            if (result != CHUNK_TASK_FINISHED)
+            {
+                parked_tasks[num_parked++] = task;
             }
+
+            task = pop_chunk_task(deque);
+        }
+
+        // Push back oldest first so the deque keeps its order.
+        while (num_parked > 0)
+        {
+            push_chunk_task(deque, parked_tasks[--num_parked]);
         }
 
-        // No work to do just wait and sleep
-        if (num_pending == 0)
+        if (did_work)
         {
-            Sleep(LATENCY_MS / 2);
             continue;
         }
 
-        Sleep(LATENCY_MS);
+        // Nothing we hold is due. Sleep until the earliest ACK check, until one of our chunks is
+        // fully ACK'd, or until someone has new work.
+        DWORD timeout_ms = MINION_IDLE_TIMEOUT_MS;
+        if (next_due_time != MAXULONG64)
+        {
+            ULONG64 now = time_now();
+            ULONG64 wait = next_due_time > now ? tsc_to_ms(next_due_time - now) : 0;
+            timeout_ms = (DWORD) min(wait + 1, MINION_IDLE_TIMEOUT_MS);
+        }
+
+        // Only the active minions wait for new work. The event is auto-reset, and a parked minion
+        // that took the wake-up would leave the work sitting there.
+        WaitForMultipleObjects(active ? 2 : 1, wake_events, FALSE, timeout_ms);
+    }
+
+    return 0;
+}
+
+ULONG64 retransmit_expired_packets(PCHUNK_TASK task, ULONG64 packets_to_check)
+{
+    PSENDER_MINION_INFO minion_info = &task->info;
+    PSENDER_TRANSMISSION_INFO transmission_info = &g_sender_state.transmissions_in_progress[minion_info->transmission_id];
+    PULONG64 bitmap = transmission_info->packet_status_bitmap;
+    volatile ULONG64* send_times = transmission_info->packet_send_times;
+    ULONG64 first_packet = minion_info->chunk_index * MAX_CHUNK_SIZE_IN_PACKETS;
+    ULONG64 rto = g_sender_state.congestion.retransmission_timeout;
+    ULONG64 next_expiry = MAXULONG64;
+    ULONG64 now = time_now();
+
+    PDATA_PACKET packets = get_batch_packets();
+    PPACKET batch[SEND_BATCH_SIZE_IN_PACKETS];
+    ULONG64 packets_in_batch = 0;
+    ULONG64 packets_resent = 0;
+
+    ULONG64 end_packet = first_packet + packets_to_check;
+
+    // Only packets still waiting on their ACK matter, so hop from one gap straight to the next.
+    for (ULONG64 packet_num = bitmap_find_next(bitmap, first_packet, end_packet, FALSE); packet_num < end_packet;
+         packet_num = bitmap_find_next(bitmap, packet_num + 1, end_packet, FALSE))
+    {
+        ULONG64 j = packet_num - first_packet;
 
-        for (int i = 0; i < MAX_PENDING_CHUNKS_PER_MINION; i++)
+        // Its ACK may well still be on the way -- only resend once the packet's own timer is up.
+        ULONG64 expiry = (send_times[packet_num] & ~PACKET_RETRANSMITTED_FLAG) + rto;
+        if (expiry > now)
         {
-            if (!pending_chunks[i].active)
-            {
-                continue;
-            }
+            next_expiry = min(next_expiry, expiry);
+            continue;
+        }
 
-            PSENDER_MINION_INFO minion_info = &pending_chunks[i].info;
-            PSENDER_TRANSMISSION_INFO transmission_info = &g_sender_state.transmissions_in_progress[minion_info->transmission_id];
-            PULONG64 bitmap = transmission_info->packet_status_bitmap;
-            ULONG64 first_packet = minion_info->chunk_index * MAX_CHUNK_SIZE_IN_PACKETS;
-            ULONG64 num_packets = (minion_info->bytes_to_send + MAX_PAYLOAD_SIZE - 1) / MAX_PAYLOAD_SIZE;
+        // This packet wasn't ack'd so we need to resend it
+        if (!build_retransmit_packet(minion_info, j, &packets[packets_in_batch]))
+        {
+            continue;
+        }
+        batch[packets_in_batch] = (PPACKET) &packets[packets_in_batch];
+        packets_in_batch++;
+        packets_resent++;
 
-            BOOL all_acked = TRUE;
+        // Once a packet has been sent twice, its ACK can't tell us which send it answers.
+        send_times[packet_num] = now | PACKET_RETRANSMITTED_FLAG;
+        next_expiry = min(next_expiry, now + rto);
 
-            for (int j = 0; j < num_packets; j++)
-            {
-                ULONG64 packet_num = first_packet + j;
+        if (packets_in_batch == SEND_BATCH_SIZE_IN_PACKETS)
+        {
+            send_packet_batch(batch, packets_in_batch);
+            packets_in_batch = 0;
+        }
+    }
+
+    if (packets_in_batch != 0)
+    {
+        send_packet_batch(batch, packets_in_batch);
+    }
+
+    if (packets_resent != 0)
+    {
+        telemetry_count(TELEMETRY_PACKETS_RETRANSMITTED, packets_resent);
+    }
+    if (packets_resent != 0 && g_sender_state.fec.enabled)
+    {
+        InterlockedAdd64(&g_sender_state.fec.packets_lost, packets_resent);
+    }
+
+    return next_expiry;
+}
+
+ULONG64 choose_parity_count(ULONG64 n_data_packets)
+{
+    FEC_CONTROL* fec = &g_sender_state.fec;
+    LONG64 sent = fec->packets_sent;
+    LONG64 lost = fec->packets_lost;
+
+    // Let old losses fade. Two minions may both halve the counts, which only forgets a little faster.
+    if (sent > FEC_LOSS_WINDOW_PACKETS)
+    {
+        InterlockedExchange64(&fec->packets_sent, sent / 2);
+        InterlockedExchange64(&fec->packets_lost, lost / 2);
+    }
+
+    // Losses we expect in the group, rounded up, with headroom for the ones we didn't.
+    ULONG64 parity_count = sent > 0
+        ? ((ULONG64) lost * n_data_packets * FEC_PARITY_HEADROOM + (ULONG64) sent - 1) / (ULONG64) sent
+        : 0;
+    return min(FEC_MAX_PARITY_PACKETS, max(FEC_MIN_PARITY_PACKETS, parity_count));
+}
+
+VOID send_parity_packets(PSENDER_MINION_INFO minion_info)
+{
+    ULONG64 payload_size = minion_info->payload_size;
+    ULONG64 num_packets = (minion_info->bytes_to_send + payload_size - 1) / payload_size;
+    ULONG64 first_packet = minion_info->chunk_index * MAX_CHUNK_SIZE_IN_PACKETS;
+
+    PDATA_PACKET packets = get_batch_packets();
+    PPACKET batch[FEC_MAX_PARITY_PACKETS];
+    PBYTE parity[FEC_MAX_PARITY_PACKETS];
+    PBYTE data[PARITY_GROUP_SIZE_IN_PACKETS];
+    ULONG64 lengths[PARITY_GROUP_SIZE_IN_PACKETS];
+
+    for (ULONG64 group_start = 0; group_start < num_packets; group_start += PARITY_GROUP_SIZE_IN_PACKETS)
+    {
+        ULONG64 n_data = min(PARITY_GROUP_SIZE_IN_PACKETS, num_packets - group_start);
+        ULONG64 n_parity = choose_parity_count(n_data);
 
-                if (!(bitmap[packet_num / 64] & (1ULL << (packet_num % 64))))
+        for (ULONG64 i = 0; i < n_data; i++)
+        {
+            ULONG64 byte_offset = (group_start + i) * payload_size;
+            data[i] = minion_info->data_to_send + byte_offset;
+            lengths[i] = min(payload_size, minion_info->bytes_to_send - byte_offset);
+        }
+        for (ULONG64 j = 0; j < n_parity; j++)
+        {
+            parity[j] = packets[j].data;
+            batch[j] = (PPACKET) &packets[j];
+        }
+
+        __try {
+            fec_encode(data, lengths, n_data, parity, n_parity, payload_size);
+        } __except (EXCEPTION_EXECUTE_HANDLER) {
+            printf("Failed to read data for parity\n");
+            return;
+        }
+
+        for (ULONG64 j = 0; j < n_parity; j++)
+        {
+            PDATA_PACKET packet = &packets[j];
+            packet->index_in_transmission = (UINT32) (first_packet + group_start);
+            packet->transmission_id = minion_info->transmission_id;
+            packet->n_packets_in_transmission = (UINT32) minion_info->n_packets_in_transmission;
+            packet->must_be_zero = 0;
+            packet->bytes_in_header = 24;
+            packet->connection_id = minion_info->connection_id;
+            packet->bytes_in_data_fields = 40;
+            packet->payload_size = (UINT32) payload_size;
+            packet->parity_index = (UINT16) j;
+            packet->parity_count = (UINT16) n_parity;
+            packet->parity_last_packet_bytes = (UINT32) lengths[n_data - 1];
+            packet->compressed_chunk_bytes = 0;
+            packet->chunk_bytes = 0;
+            packet->data_reserved = 0;
+            packet->bytes_in_payload = (UINT32) payload_size;
+            packet->payload_checksum = PAYLOAD_CHECKSUM(packet->data, payload_size);
+        }
+
+        send_packet_batch(batch, n_parity);
+    }
+}
+
+/**
+ * @brief Checks whether a chunk task's retransmission timer is up, or one of its packets has been NACK'd.
+ */
+static BOOL chunk_task_is_due(PCHUNK_TASK task, PSENDER_CHUNK_INFO chunk)
+{
+    return time_now() >= task->due_time || InterlockedExchange(&chunk->retransmit_requested, FALSE);
+}
+
+ULONG64 run_chunk_task(PCHUNK_TASK task, PULONG64 next_due_time)
+{
+    PSENDER_MINION_INFO minion_info = &task->info;
+    PSENDER_TRANSMISSION_INFO transmission_info = &g_sender_state.transmissions_in_progress[minion_info->transmission_id];
+    ULONG64 num_packets = (minion_info->bytes_to_send + minion_info->payload_size - 1) / minion_info->payload_size;
+    PSENDER_CHUNK_INFO chunk = &transmission_info->chunks[minion_info->chunk_index];
+
+    switch (task->state)
+    {
+    case CHUNK_TASK_SEND:
+    {
+        // Send as much of the chunk as the receiver can take, and the congestion window lets us
+        ULONG64 first_packet = minion_info->chunk_index * MAX_CHUNK_SIZE_IN_PACKETS;
+        ULONG64 first_unsent = first_packet + task->packets_sent;
+        ULONG64 window_end = transmission_info->receive_window_end;
+
+        // A compressed chunk expands into all of its packets at once, so the receiver's window has to
+        // cover the whole chunk before any of it goes out.
+        if (minion_info->chunk_bytes != 0 &&
+            window_end < min(first_packet + MAX_CHUNK_SIZE_IN_PACKETS, minion_info->n_packets_in_transmission))
+        {
+            window_end = first_unsent;
+        }
+        ULONG64 packets_wanted = window_end > first_unsent ? min(num_packets - task->packets_sent, window_end - first_unsent) : 0;
+
+        ULONG64 packets_granted = packets_wanted != 0 ? acquire_send_window(packets_wanted) : 0;
+        if (packets_granted == 0 && packets_wanted != 0)
+        {
+            // Tell the listener we're waiting, then look once more in case it freed window in between.
+            InterlockedExchange(&g_sender_state.congestion.window_blocked, TRUE);
+            packets_granted = acquire_send_window(packets_wanted);
+        }
+
+        if (packets_granted == 0)
+        {
+            // Nothing sent yet, or no timer on what we did send has expired -- just wait for window.
+            if (task->packets_sent == 0 || !chunk_task_is_due(task, chunk))
+            {
+                if (task->packets_sent != 0)
                 {
-                    all_acked = FALSE;
-                    // This packet wasn't ack'd so we need to resend it
-                    retransmit_packet(minion_info, j);
+                    *next_due_time = min(*next_due_time, task->due_time);
                 }
+                return CHUNK_TASK_NOT_DUE;
             }
 
-            if (all_acked)
-            {
-                // If the chunk is done remove it
-                pending_chunks[i].active = FALSE;
-                num_pending--;
+            // Some of what we already sent has timed out. Lost packets hold window that nobody will
+            // get back until they're retransmitted, so do that while we wait.
+            task->due_time = retransmit_expired_packets(task, task->packets_sent);
+            return CHUNK_TASK_RAN;
+        }
 
-                // Check if the ENTIRE transmission is complete
-                BOOL transmission_done = TRUE;
-                for (ULONG64 i = 0; i < transmission_info->number_of_packets_in_transmission; i++)
-                {
-                    if (!(bitmap[i / 64] & (1ULL << (i % 64))))
-                    {
-                        transmission_done = FALSE;
-                        break;
-                    }
-                }
+        ULONG64 byte_offset = task->packets_sent * minion_info->payload_size;
+        packetize_contiguous(minion_info->data_to_send + byte_offset,
+                             min(packets_granted * minion_info->payload_size, minion_info->bytes_to_send - byte_offset),
+                             *minion_info,
+                             task->packets_sent);
+        task->packets_sent += packets_granted;
 
-                if (transmission_done)
-                {
-                    SetEvent(transmission_info->sending_complete_event);
-                }
+        // The packets we just sent start their timers now.
+        task->due_time = min(task->due_time, time_now() + g_sender_state.congestion.retransmission_timeout);
+
+        // Still more to send -- stay a SEND task. Another minion may pick up the rest.
+        if (task->packets_sent < num_packets)
+        {
+            return CHUNK_TASK_RAN;
+        }
+
+        // The whole chunk is out. Follow it with its parity, so the receiver can fill in what gets lost.
+        // The receiver has nowhere to rebuild a compressed chunk's packets into, so those go without.
+        if (g_sender_state.fec.enabled && minion_info->chunk_bytes == 0)
+        {
+            send_parity_packets(minion_info);
+        }
+
+        task->state = CHUNK_TASK_ACK_CHECK;
+        return CHUNK_TASK_RAN;
+    }
+
+    case CHUNK_TASK_RETRANSMIT:
+        // Resend only what has actually timed out, then sleep until the next timer.
+        task->due_time = retransmit_expired_packets(task, num_packets);
+        task->state = CHUNK_TASK_ACK_CHECK;
+        return CHUNK_TASK_RAN;
+
+    case CHUNK_TASK_ACK_CHECK:
+    default:
+        // The listener has already counted every packet of this chunk as ACK'd -- we're done with it.
+        if (chunk->packets_outstanding == 0)
+        {
+            if (task->info.staging_buffer != NULL)
+            {
+                free_staging_buffer(task->info.staging_buffer, task->info.payload_size);
             }
+            free(task);
+            release_transmission(transmission_info);
+            return CHUNK_TASK_FINISHED;
+        }
+
+        if (!chunk_task_is_due(task, chunk))
+        {
+            *next_due_time = min(*next_due_time, task->due_time);
+            return CHUNK_TASK_NOT_DUE;
         }
+
+        // A timer has expired. Hand the retransmit off as its own task, and let an idle
+        // minion know there is something worth stealing. The window doesn't shrink for this --
+        // it follows the measured delivery rate, which already reflects any losses.
+        task->state = CHUNK_TASK_RETRANSMIT;
+        SetEvent(g_sender_state.work_available);
+        return CHUNK_TASK_RAN;
     }
+}
 
-    return 0;
+ULONG64 acquire_send_window(ULONG64 packets_wanted)
+{
+    CONGESTION_CONTROL* congestion = &g_sender_state.congestion;
+
+    while (TRUE) {
+        LONG64 in_flight = congestion->packets_in_flight;
+        LONG64 available = congestion->congestion_window - in_flight;
+
+        if (available <= 0) {
+            return 0;
+        }
+
+        LONG64 granted = min(available, (LONG64) packets_wanted);
+        if (InterlockedCompareExchange64(&congestion->packets_in_flight, in_flight + granted, in_flight) == in_flight) {
+            return (ULONG64) granted;
+        }
+    }
 }
 
-VOID find_work(PSENDER_MINION_INFO briefcase)
+VOID complete_transmission(PSENDER_TRANSMISSION_INFO transmission_info)
 {
-    // Get our work array lock before we modify the work array in get next transmission ID
-    EnterCriticalSection(&g_work_array_lock);
-    briefcase->transmission_id = get_next_transmission_id();
-    LeaveCriticalSection(&g_work_array_lock);
+    PSEND_COMPLETION_QUEUE queue = transmission_info->completion_queue;
 
-    // Return if we can't find any transmissions to work on next.
-    if (briefcase->transmission_id == EMPTY_WORK_ARRAY_ID) {
+    ASSERT(bitmap_range_is_full(transmission_info->packet_status_bitmap, 0,
+                                transmission_info->number_of_packets_in_transmission));
+    telemetry_record_since(TELEMETRY_TRANSMISSION_COMPLETION, transmission_info->submit_time);
+
+    // Nothing references the arrays any more, and the ID may be reused as soon as we report it.
+    free(transmission_info->packet_status_bitmap);
+    free((PVOID) transmission_info->packet_send_times);
+    free(transmission_info->chunks);
+    transmission_info->packet_status_bitmap = NULL;
+    transmission_info->packet_send_times = NULL;
+    transmission_info->chunks = NULL;
+
+    if (queue == NULL)
+    {
+        SetEvent(transmission_info->sending_complete_event);
         return;
     }
 
-    PSENDER_TRANSMISSION_INFO info = &g_sender_state.transmissions_in_progress[briefcase->transmission_id];
+    // The completion lives in the transmission info, so reporting it never allocates.
+    InterlockedPushEntrySList(&queue->completions, &transmission_info->completion.flink);
+    SetEvent(queue->completion_available);
+}
+
+ULONG64 acknowledge_packet_range(PSENDER_TRANSMISSION_INFO transmission_info, ULONG64 first_packet_index,
+                                 ULONG64 end_packet_index)
+{
+    PULONG64 bitmap = transmission_info->packet_status_bitmap;
+    ULONG64 packets_acked = 0;
+
+    end_packet_index = min(end_packet_index, transmission_info->number_of_packets_in_transmission);
+
+    while (first_packet_index < end_packet_index)
+    {
+        // The slice of the range that falls in this chunk.
+        ULONG64 chunk_index = first_packet_index / MAX_CHUNK_SIZE_IN_PACKETS;
+        ULONG64 slice_end = min(end_packet_index, (chunk_index + 1) * MAX_CHUNK_SIZE_IN_PACKETS);
+        PSENDER_CHUNK_INFO chunk = &transmission_info->chunks[chunk_index];
+
+        // A compressed chunk went out in only its first few packets. The rest are ACK'd along with it,
+        // but never held any window, so they don't count towards what the listener hands back.
+        ULONG64 wire_end = chunk->compressed_packets != 0
+            ? chunk_index * MAX_CHUNK_SIZE_IN_PACKETS + chunk->compressed_packets
+            : slice_end;
+
+        LONG count = 0;
+        if (first_packet_index < wire_end)
+        {
+            count = (LONG) bitmap_set_range(bitmap, first_packet_index, min(slice_end, wire_end));
+            packets_acked += count;
+        }
+        if (slice_end > wire_end)
+        {
+            count += (LONG) bitmap_set_range(bitmap, max(first_packet_index, wire_end), slice_end);
+        }
+        first_packet_index = slice_end;
+        if (count == 0)
+        {
+            continue;
+        }
+
+        // Count the packets off their chunk. The last one wakes whichever minion holds the chunk.
+        if (InterlockedAdd(&chunk->packets_outstanding, -count) == 0)
+        {
+            SetEvent(g_sender_state.minion_deques[chunk->owner].chunk_acked_event);
+        }
+
+        // And off the whole transmission. The listener lets go of it once it is done with the ACK.
+        InterlockedAdd64(&transmission_info->packets_outstanding, -count);
+    }
 
-    // Interlocked increment our chunk index so it is safe across the multiple threads.
-    ULONG64 chunk_index = InterlockedIncrement64((volatile LONG64*) &info->next_chunk_index) - 1;
+    return packets_acked;
+}
 
-    // Check if this chunk is past the end of the transmission
-    ULONG64 first_packet_of_chunk = chunk_index * MAX_CHUNK_SIZE_IN_PACKETS;
-    if (first_packet_of_chunk >= info->number_of_packets_in_transmission)
+VOID release_transmission(PSENDER_TRANSMISSION_INFO transmission_info)
+{
+    if (InterlockedDecrement(&transmission_info->references) == 0)
     {
-        briefcase->transmission_id = EMPTY_WORK_ARRAY_ID;
-        
+        complete_transmission(transmission_info);
+    }
+}
+
+VOID request_retransmit(PSENDER_TRANSMISSION_INFO transmission_info, ULONG64 packet_index)
+{
+    // Back-date the send so its timer has already run out, and mark it as sent twice already: an ACK
+    // before the resend can't tell which send it answers, so Karn's rule has to drop its sample.
+    transmission_info->packet_send_times[packet_index] = PACKET_RETRANSMITTED_FLAG;
+
+    PSENDER_CHUNK_INFO chunk = &transmission_info->chunks[packet_index / MAX_CHUNK_SIZE_IN_PACKETS];
+    InterlockedExchange(&chunk->retransmit_requested, TRUE);
+    SetEvent(g_sender_state.minion_deques[chunk->owner].chunk_acked_event);
+}
+
+VOID release_send_window(ULONG64 packets_acked)
+{
+    CONGESTION_CONTROL* congestion = &g_sender_state.congestion;
+    ULONG64 now = time_now();
+    LONG64 max_window = MAX_CONGESTION_WINDOW(g_sender_state.payload_size);
+
+    InterlockedAdd64(&congestion->packets_in_flight, -(LONG64) packets_acked);
+
+    // Startup: one more packet of window per packet ACK'd, so the window doubles every round trip.
+    if (congestion->in_startup) {
+        LONG64 window = congestion->congestion_window;
+        InterlockedCompareExchange64(&congestion->congestion_window,
+                                     min(window + (LONG64) packets_acked, max_window),
+                                     window);
+    }
+
+    congestion->round_packets_acked += packets_acked;
+
+    // A round lasts one min RTT (or until we have one, one propagation round trip).
+    ULONG64 round_length = congestion->min_rtt ? congestion->min_rtt : ms_to_tsc(ACK_CHECK_INTERVAL_MS);
+    ULONG64 elapsed = now - congestion->round_start_time;
+    if (congestion->round_start_time != 0 && elapsed < round_length) {
+        return;
+    }
+
+    // Close out the round with a delivery rate sample, then refresh the max over the last few rounds.
+    if (congestion->round_start_time != 0) {
+        ULONG64 sample = congestion->round_packets_acked * ms_to_tsc(1000) / elapsed;
+        congestion->bandwidth_samples[congestion->round_count % BANDWIDTH_FILTER_ROUNDS] = sample;
+        congestion->round_count++;
+
+        congestion->max_bandwidth = 0;
+        for (ULONG64 i = 0; i < BANDWIDTH_FILTER_ROUNDS; i++) {
+            congestion->max_bandwidth = max(congestion->max_bandwidth, congestion->bandwidth_samples[i]);
+        }
+
+        if (congestion->in_startup) {
+            // Still growing by at least a quarter per round? Then there's more pipe to fill.
+            if (congestion->max_bandwidth >= congestion->startup_target_bandwidth) {
+                congestion->startup_target_bandwidth = congestion->max_bandwidth + congestion->max_bandwidth / 4;
+                congestion->startup_flat_rounds = 0;
+            } else if (++congestion->startup_flat_rounds >= STARTUP_FLAT_ROUNDS) {
+                congestion->in_startup = FALSE;
+            }
+        }
+
+        if (!congestion->in_startup) {
+            LONG64 window = (LONG64) (CONGESTION_WINDOW_GAIN * estimate_bdp_in_packets());
+            InterlockedExchange64(&congestion->congestion_window,
+                                  max(min(window, max_window), MIN_CONGESTION_WINDOW));
+        }
+    }
+
+    congestion->round_start_time = now;
+    congestion->round_packets_acked = 0;
+}
+
+VOID on_congestion_event(VOID)
+{
+    CONGESTION_CONTROL* congestion = &g_sender_state.congestion;
+    ULONG64 bdp = estimate_bdp_in_packets();
+
+    // Minions race the listener here, but all either of them does is end startup and shrink the window.
+    congestion->in_startup = FALSE;
+
+    LONG64 window = congestion->congestion_window;
+    LONG64 target = bdp ? (LONG64) (CONGESTION_WINDOW_GAIN * bdp) : window / 2;
+    target = max(target, MIN_CONGESTION_WINDOW);
+    if (target < window) {
+        InterlockedCompareExchange64(&congestion->congestion_window, target, window);
+    }
+}
+
+VOID record_rtt_sample(ULONG64 send_time)
+{
+    CONGESTION_CONTROL* congestion = &g_sender_state.congestion;
+
+    if (send_time & PACKET_RETRANSMITTED_FLAG) {
         return;
     }
 
+    ULONG64 now = time_now();
+    LONG64 sample = (LONG64) (now - send_time);
+    LONG64 smoothed = (LONG64) congestion->smoothed_rtt;
+    LONG64 variance = (LONG64) congestion->rtt_variance;
+
+    if (smoothed == 0) {
+        smoothed = sample;
+        variance = sample / 2;
+    } else {
+        // rttvar += (|srtt - sample| - rttvar) / 4, using the old srtt; then srtt += (sample - srtt) / 8
+        LONG64 deviation = smoothed > sample ? smoothed - sample : sample - smoothed;
+        variance += (deviation - variance) >> RTT_VARIANCE_SHIFT;
+        smoothed += (sample - smoothed) >> RTT_SMOOTHING_SHIFT;
+    }
+    congestion->smoothed_rtt = (ULONG64) smoothed;
+    congestion->rtt_variance = (ULONG64) variance;
+
+    ULONG64 rto = (ULONG64) (smoothed + RTO_VARIANCE_MULTIPLIER * variance);
+    congestion->retransmission_timeout = max(min(rto, ms_to_tsc(MAX_RTO_MS)), ms_to_tsc(MIN_RTO_MS));
+
+    // The min RTT is our estimate of the propagation delay with no queueing at all.
+    if (congestion->min_rtt == 0 || (ULONG64) sample <= congestion->min_rtt ||
+        now - congestion->min_rtt_time > ms_to_tsc(MIN_RTT_EXPIRY_MS)) {
+        congestion->min_rtt = (ULONG64) sample;
+        congestion->min_rtt_time = now;
+    }
+}
+
+ULONG64 estimate_bdp_in_packets(VOID)
+{
+    CONGESTION_CONTROL* congestion = &g_sender_state.congestion;
+
+    // packets/second * min RTT
+    return congestion->max_bandwidth * congestion->min_rtt / ms_to_tsc(1000);
+}
+
+VOID push_chunk_task(PMINION_DEQUE deque, PCHUNK_TASK task)
+{
+    LONG64 bottom = deque->bottom;
+    ASSERT(bottom - deque->top < MINION_DEQUE_SIZE);
+
+    deque->tasks[bottom & (MINION_DEQUE_SIZE - 1)] = task;
+
+    // Publish the task to thieves only after it has been stored.
+    InterlockedExchange64(&deque->bottom, bottom + 1);
+}
+
+PCHUNK_TASK pop_chunk_task(PMINION_DEQUE deque)
+{
+    LONG64 bottom = deque->bottom - 1;
+
+    // Full fence: the decrement must be visible to thieves before we read top.
+    InterlockedExchange64(&deque->bottom, bottom);
+    LONG64 top = deque->top;
+
+    if (top > bottom) {
+        // Empty -- put bottom back.
+        deque->bottom = bottom + 1;
+        return NULL;
+    }
+
+    PCHUNK_TASK task = deque->tasks[bottom & (MINION_DEQUE_SIZE - 1)];
+
+    if (top == bottom) {
+        // Last task -- race any thief for it.
+        if (InterlockedCompareExchange64(&deque->top, top + 1, top) != top) {
+            task = NULL;
+        }
+        deque->bottom = bottom + 1;
+    }
+
+    return task;
+}
+
+PCHUNK_TASK steal_chunk_task(PMINION_DEQUE deque)
+{
+    LONG64 top = deque->top;
+    LONG64 bottom = deque->bottom;
+
+    if (top >= bottom) {
+        return NULL;
+    }
+
+    PCHUNK_TASK task = deque->tasks[top & (MINION_DEQUE_SIZE - 1)];
+
+    // Lost to the owner or another thief -- the caller will just look elsewhere.
+    if (InterlockedCompareExchange64(&deque->top, top + 1, top) != top) {
+        return NULL;
+    }
+
+    return task;
+}
+
+VOID find_work(PSENDER_MINION_INFO briefcase)
+{
+    PSENDER_TRANSMISSION_INFO info;
+    ULONG64 chunk_index;
+
+    while (TRUE) {
+        briefcase->transmission_id = get_next_transmission_id();
+
+        // Return if we can't find any transmissions to work on next.
+        if (briefcase->transmission_id == EMPTY_WORK_ARRAY_ID) {
+            return;
+        }
+
+        info = &g_sender_state.transmissions_in_progress[briefcase->transmission_id];
+
+        // Interlocked increment our chunk index so it is safe across the multiple threads.
+        chunk_index = InterlockedIncrement64((volatile LONG64*) &info->next_chunk_index) - 1;
+
+        // A transmission with nothing left to hand out is dropped from the queue here rather than
+        // re-queued, so idle minions don't keep cycling through finished work.
+        if (chunk_index * MAX_CHUNK_SIZE_IN_PACKETS >= info->number_of_packets_in_transmission) {
+            continue;
+        }
+
+        // Only re-queue the transmission if there is at least one more chunk after this one.
+        if ((chunk_index + 1) * MAX_CHUNK_SIZE_IN_PACKETS < info->number_of_packets_in_transmission) {
+            while (!enqueue_transmission_id(briefcase->transmission_id)) {
+                YieldProcessor();
+            }
+        }
+
+        break;
+    }
+
     // Fill the briefcase.
+    briefcase->connection_id = info->connection_id;
     briefcase->chunk_index = chunk_index;
     briefcase->n_packets_in_transmission = info->number_of_packets_in_transmission;
-    briefcase->data_to_send = info->data + chunk_index * MAX_CHUNK_SIZE_IN_PACKETS * MAX_PAYLOAD_SIZE;
+    briefcase->payload_size = info->payload_size;
 
     // Calc the number of bytes we need to send (make sure we get the right amount if
     // at the last packet which might not be totally full)
-    ULONG64 byte_offset = chunk_index * MAX_CHUNK_SIZE_IN_PACKETS * MAX_PAYLOAD_SIZE;
-    briefcase->bytes_to_send = min(info->total_bytes - byte_offset, MAX_CHUNK_SIZE_IN_PACKETS * MAX_PAYLOAD_SIZE);
+    ULONG64 byte_offset = chunk_index * MAX_CHUNK_SIZE_IN_PACKETS * info->payload_size;
+    briefcase->bytes_to_send = min(info->total_bytes - byte_offset, MAX_CHUNK_SIZE_IN_PACKETS * info->payload_size);
+
+    if (info->read_routine == NULL) {
+        briefcase->data_to_send = info->data + byte_offset;
+        briefcase->staging_buffer = NULL;
+    } else {
+        // Streamed: only this chunk is ever in memory, and only until it is fully ACK'd.
+        briefcase->staging_buffer = allocate_staging_buffer(info->payload_size);
+        if (!info->read_routine(info->read_context, byte_offset, briefcase->staging_buffer, briefcase->bytes_to_send)) {
+            printf("Failed to read transmission %u from its source\n", briefcase->transmission_id);
+            exit(1);
+        }
+        briefcase->data_to_send = briefcase->staging_buffer;
+    }
 
+    if (g_sender_state.compression_enabled) {
+        compress_chunk(briefcase);
+    }
 
+    // The scheduler counts what actually goes out, so a compressed chunk costs its connection less.
+    InterlockedAdd64(&g_sender_state.connections[briefcase->connection_id].credits,
+                     -(LONG64) briefcase->bytes_to_send);
 }
 
-UINT32 get_next_transmission_id(VOID) {
-    // Circular buffer so doesn't go out of bounds
-    UINT32 slots_checked = 0;
-    while (g_sender_state.transmissions_queue.work_array[g_sender_state.transmissions_queue.
-        next_read_index % WORK_ARRAY_SIZE] == EMPTY_WORK_ARRAY_ID)
-    {
-        // Increase the read index (where we are up to reading the transmission IDs in transmission queue)
-        g_sender_state.transmissions_queue.next_read_index++;
-        slots_checked++;
-        if (slots_checked >= WORK_ARRAY_SIZE) 
-        {
-            return EMPTY_WORK_ARRAY_ID;
+VOID compress_chunk(PSENDER_MINION_INFO briefcase)
+{
+    ULONG64 payload_size = briefcase->payload_size;
+    ULONG64 num_packets = (briefcase->bytes_to_send + payload_size - 1) / payload_size;
+    ULONG64 max_packets = num_packets * COMPRESSION_MAX_PACKETS_PERCENT / 100;
+
+    // The receiver decompresses a chunk into all of its slots at once, so the chunk has to fit in the
+    // smallest window a streamed receive can have -- which rules out payload sizes above 32 KB. And a
+    // chunk too small to save a packet isn't worth it. Either way, telemetry shows what was skipped.
+    if (MAX_CHUNK_SIZE_IN_PACKETS > MIN_RECEIVE_WINDOW_IN_PACKETS(payload_size) || max_packets == 0) {
+        telemetry_count(TELEMETRY_CHUNKS_NOT_COMPRESSED, 1);
+        return;
+    }
+
+    PBYTE buffer = allocate_staging_buffer(payload_size);
+    ULONG64 compressed_bytes;
+    __try {
+        compressed_bytes = compress_block(briefcase->data_to_send, briefcase->bytes_to_send, buffer,
+                                          max_packets * payload_size);
+    } __except (EXCEPTION_EXECUTE_HANDLER) {
+        // Send it as it is, and let packetize_contiguous report the bad buffer.
+        compressed_bytes = 0;
+    }
+
+    if (compressed_bytes == 0) {
+        free_staging_buffer(buffer, payload_size);
+        telemetry_count(TELEMETRY_CHUNKS_NOT_COMPRESSED, 1);
+        return;
+    }
+
+    // A streamed chunk is done with the copy it was read into. Retransmits read the compressed one.
+    if (briefcase->staging_buffer != NULL) {
+        free_staging_buffer(briefcase->staging_buffer, payload_size);
+    }
+
+    // Before any of it is sent, so the listener knows which of its ACKs held window.
+    PSENDER_CHUNK_INFO chunk = &g_sender_state.transmissions_in_progress[briefcase->transmission_id].
+        chunks[briefcase->chunk_index];
+    chunk->compressed_packets = (LONG) ((compressed_bytes + payload_size - 1) / payload_size);
+
+    briefcase->staging_buffer = buffer;
+    briefcase->data_to_send = buffer;
+    briefcase->chunk_bytes = briefcase->bytes_to_send;
+    briefcase->bytes_to_send = compressed_bytes;
+}
+
+/**
+ * @brief Finds the free list of staging buffers for a payload size.
+ */
+static PSLIST_HEADER staging_buffer_list(ULONG64 payload_size)
+{
+    ULONG shift;
+    _BitScanReverse64(&shift, payload_size / MIN_PAYLOAD_SIZE);
+    ASSERT(shift < PAYLOAD_SIZE_CLASS_COUNT)
+    return &g_sender_state.free_staging_buffers[shift];
+}
+
+PBYTE allocate_staging_buffer(ULONG64 payload_size)
+{
+    PBYTE buffer = (PBYTE) InterlockedPopEntrySList(staging_buffer_list(payload_size));
+    if (buffer != NULL) {
+        return buffer;
+    }
+
+    buffer = allocate_local_memory(ROLE_SENDER, STAGING_BUFFER_SIZE_IN_BYTES(payload_size), MEM_RESERVE | MEM_COMMIT);
+    if (buffer == NULL) {
+        printf("Failed to allocate a staging buffer\n");
+        exit(1);
+    }
+    return buffer;
+}
+
+VOID free_staging_buffer(PBYTE buffer, ULONG64 payload_size)
+{
+    InterlockedPushEntrySList(staging_buffer_list(payload_size), (PSLIST_ENTRY) buffer);
+}
+
+BOOL enqueue_transmission_id(UINT32 transmission_id)
+{
+    UINT32 connection_id = g_sender_state.transmissions_in_progress[transmission_id].connection_id;
+    TRANSMISSION_QUEUE* queue = &g_sender_state.connections[connection_id].transmissions_queue;
+    PTRANSMISSION_QUEUE_SLOT slot;
+    LONG64 position = queue->enqueue_index;
+
+    while (TRUE) {
+        slot = &queue->slots[position & (TRANSMISSION_QUEUE_SIZE - 1)];
+        LONG64 difference = slot->sequence - position;
+
+        if (difference == 0) {
+            // The slot is empty for this lap -- try to claim the position.
+            LONG64 observed = InterlockedCompareExchange64(&queue->enqueue_index, position + 1, position);
+            if (observed == position) {
+                break;
+            }
+            position = observed;
+        } else if (difference < 0) {
+            // The consumer a lap behind hasn't freed this slot yet, so the queue is full.
+            return FALSE;
+        } else {
+            // Another producer got here first, reload and try the next position.
+            position = queue->enqueue_index;
         }
     }
 
-    UINT32 return_ID = g_sender_state.transmissions_queue.work_array[g_sender_state.transmissions_queue.
-        next_read_index % WORK_ARRAY_SIZE];
+    slot->transmission_id = transmission_id;
 
-    // Clear the ID I returned so it can be reused
-    g_sender_state.transmissions_queue.work_array[g_sender_state.transmissions_queue.
-        next_read_index % WORK_ARRAY_SIZE] = EMPTY_WORK_ARRAY_ID;
+    // Publish the ID to consumers. The interlocked write orders it after the ID store.
+    InterlockedExchange64(&slot->sequence, position + 1);
+    return TRUE;
+}
 
+UINT32 dequeue_transmission_id(TRANSMISSION_QUEUE* queue)
+{
+    PTRANSMISSION_QUEUE_SLOT slot;
+    LONG64 position = queue->dequeue_index;
 
+    while (TRUE) {
+        slot = &queue->slots[position & (TRANSMISSION_QUEUE_SIZE - 1)];
+        LONG64 difference = slot->sequence - (position + 1);
 
-    // // TODO
-    // PSENDER_TRANSMISSION_INFO info = &g_sender_state.transmissions_in_progress[return_ID];
-    //
-    // // Interlocked increment our chunk index so it is safe across the multiple threads.
-    // ULONG64 chunk_index = InterlockedIncrement64((volatile LONG64*) &info->next_chunk_index) - 1;
-    //
-    // // Check if this chunk is past the end of the transmission
-    // // if we are at the last packet, we don't need to add it back to the array, I am using the previous logic, there is probably a better way to do this.'
-    // ULONG64 first_packet_of_chunk = chunk_index * MAX_CHUNK_SIZE_IN_PACKETS;
-    // if (first_packet_of_chunk >= info->number_of_packets_in_transmission) {
-    //
-    // } else {
-        g_sender_state.transmissions_queue.work_array[g_sender_state.transmissions_queue.next_write_index % WORK_ARRAY_SIZE] = return_ID;
-        g_sender_state.transmissions_queue.next_write_index++;
+        if (difference == 0) {
+            // The slot holds a published ID -- try to claim it.
+            LONG64 observed = InterlockedCompareExchange64(&queue->dequeue_index, position + 1, position);
+            if (observed == position) {
+                break;
+            }
+            position = observed;
+        } else if (difference < 0) {
+            // Nothing has been published at this position yet, so the queue is empty.
+            return EMPTY_WORK_ARRAY_ID;
+        } else {
+            position = queue->dequeue_index;
+        }
+    }
 
-    //}
-    // there is a slowdown where we are not checking if it is the last packet in the transmission
+    UINT32 return_ID = slot->transmission_id;
 
+    // Hand the slot back to producers one full lap ahead.
+    InterlockedExchange64(&slot->sequence, position + TRANSMISSION_QUEUE_SIZE);
     return return_ID;
-}
\ No newline at end of file
+}
+
+UINT32 get_next_transmission_id(VOID)
+{
+    while (TRUE) {
+        LONG64 round = g_sender_state.scheduler_round;
+        BOOL work_waiting = FALSE;
+
+        // Each round starts from a different connection, so none is always served first.
+        for (LONG64 i = 0; i < MAX_CONNECTIONS; i++) {
+            SENDER_CONNECTION* connection = &g_sender_state.connections[(round + i) % MAX_CONNECTIONS];
+            TRANSMISSION_QUEUE* queue = &connection->transmissions_queue;
+
+            if (queue->enqueue_index == queue->dequeue_index) {
+                continue;
+            }
+            work_waiting = TRUE;
+
+            if (connection->credits <= 0) {
+                continue;
+            }
+
+            // find_work charges the chunk's bytes once it knows how many there are.
+            UINT32 transmission_id = dequeue_transmission_id(queue);
+            if (transmission_id == EMPTY_WORK_ARRAY_ID) {
+                continue;
+            }
+            return transmission_id;
+        }
+
+        if (!work_waiting) {
+            return EMPTY_WORK_ARRAY_ID;
+        }
+
+        // Every connection with work has spent its credit, so start the next round. Debt carries over,
+        // but unspent credit doesn't, so a connection that had nothing to send can't save up for a burst.
+        // Adding rather than setting keeps the charges of minions racing us.
+        if (InterlockedCompareExchange64(&g_sender_state.scheduler_round, round + 1, round) == round) {
+            for (ULONG64 c = 0; c < MAX_CONNECTIONS; c++) {
+                SENDER_CONNECTION* connection = &g_sender_state.connections[c];
+                InterlockedAdd64(&connection->credits,
+                                 connection->weight * CONNECTION_QUANTUM_IN_BYTES - max(connection->credits, 0));
+            }
+        } else {
+            YieldProcessor();
+        }
+    }
+}
@@ -0,0 +1,262 @@
+//
+// Per-thread telemetry slabs, the HDR-style histograms in them, and the snapshots summed from them.
+//
+
+#include "telemetry.h"
+
+typedef struct telemetry_slab {
+    struct telemetry_slab* next;                // Slabs are only ever added, so the list can be walked unlocked.
+    __declspec(align(CACHE_LINE_SIZE)) ULONG64 counters[TELEMETRY_COUNTERS];
+    __declspec(align(CACHE_LINE_SIZE)) TELEMETRY_HISTOGRAM histograms[TELEMETRY_HISTOGRAMS];
+} TELEMETRY_SLAB, *PTELEMETRY_SLAB;
+
+static PTELEMETRY_SLAB volatile telemetry_slabs;
+
+__declspec(thread) PTELEMETRY_SLAB thread_slab;
+
+static HANDLE export_thread;
+static HANDLE export_stop;
+static ULONG64 export_period_ms;
+
+static const char* counter_names[TELEMETRY_COUNTERS] = {
+    "PACKETS SENT",
+    "PACKETS REJECTED",
+    "PACKETS DROPPED",
+    "PACKETS RETRANSMITTED",
+    "DUPLICATES RECEIVED",
+    "CACHE FULL WAITS",
+    "ACKS SENT",
+    "ACKS RECEIVED",
+    "CHUNKS NOT COMPRESSED",
+};
+
+static const char* histogram_names[TELEMETRY_HISTOGRAMS] = {
+    "ONE-WAY DELAY",
+    "TRANSMISSION COMPLETION",
+    "SEND_PACKET CALL",
+    "RECEIVE_PACKET CALL",
+    "PACKETS_PRESENT WAIT",
+};
+
+/**
+ * @brief Finds the calling thread's slab, making it and adding it to the list the first time.
+ */
+static PTELEMETRY_SLAB get_thread_slab(void) {
+
+    if (thread_slab != NULL) {
+        return thread_slab;
+    }
+
+    PTELEMETRY_SLAB slab = VirtualAlloc(NULL, sizeof(TELEMETRY_SLAB), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    if (slab == NULL) {
+        printf("Failed to allocate a telemetry slab\n");
+        exit(1);
+    }
+
+    PTELEMETRY_SLAB head;
+    do {
+        head = telemetry_slabs;
+        slab->next = head;
+    } while (InterlockedCompareExchangePointer((PVOID volatile*) &telemetry_slabs, slab, head) != head);
+
+    thread_slab = slab;
+    return slab;
+}
+
+/**
+ * @brief Finds the bucket a value falls in: its top TELEMETRY_SUB_BUCKET_BITS + 1 bits, bar the leading one,
+ *        under the position of that leading one.
+ */
+static ULONG64 bucket_of(ULONG64 ticks) {
+
+    if (ticks < TELEMETRY_SUB_BUCKETS) {
+        return ticks;
+    }
+    ULONG msb;
+    _BitScanReverse64(&msb, ticks);
+    ULONG64 shift = msb - TELEMETRY_SUB_BUCKET_BITS;
+    return ((shift + 1) << TELEMETRY_SUB_BUCKET_BITS) + ((ticks >> shift) & (TELEMETRY_SUB_BUCKETS - 1));
+}
+
+/**
+ * @brief Finds the largest value that falls in a bucket.
+ */
+static ULONG64 bucket_top(ULONG64 bucket) {
+
+    if (bucket < TELEMETRY_SUB_BUCKETS) {
+        return bucket;
+    }
+    ULONG64 shift = (bucket >> TELEMETRY_SUB_BUCKET_BITS) - 1;
+    ULONG64 bottom = (TELEMETRY_SUB_BUCKETS + (bucket & (TELEMETRY_SUB_BUCKETS - 1))) << shift;
+    return bottom + ((1ULL << shift) - 1);
+}
+
+void telemetry_count(ULONG64 counter, ULONG64 n) {
+    ASSERT(counter < TELEMETRY_COUNTERS);
+    get_thread_slab()->counters[counter] += n;
+}
+
+void telemetry_record(ULONG64 histogram, ULONG64 ticks) {
+
+    ASSERT(histogram < TELEMETRY_HISTOGRAMS);
+    PTELEMETRY_HISTOGRAM h = &get_thread_slab()->histograms[histogram];
+
+    h->count++;
+    h->sum += ticks;
+    if (ticks > h->max) {
+        h->max = ticks;
+    }
+    h->buckets[bucket_of(ticks)]++;
+}
+
+void telemetry_record_since(ULONG64 histogram, ULONG64 start) {
+    ULONG64 now = time_now();
+    telemetry_record(histogram, now > start ? now - start : 0);
+}
+
+void telemetry_snapshot(PTELEMETRY_SNAPSHOT snapshot) {
+
+    memset(snapshot, 0, sizeof(TELEMETRY_SNAPSHOT));
+    snapshot->taken_at = time_now();
+
+    for (PTELEMETRY_SLAB slab = telemetry_slabs; slab != NULL; slab = slab->next) {
+        for (ULONG64 c = 0; c < TELEMETRY_COUNTERS; c++) {
+            snapshot->counters[c] += slab->counters[c];
+        }
+        for (ULONG64 i = 0; i < TELEMETRY_HISTOGRAMS; i++) {
+            PTELEMETRY_HISTOGRAM from = &slab->histograms[i];
+            PTELEMETRY_HISTOGRAM to = &snapshot->histograms[i];
+
+            // Read once: the thread may record another value between two reads.
+            ULONG64 largest = from->max;
+            to->count += from->count;
+            to->sum += from->sum;
+            to->max = max(to->max, largest);
+            for (ULONG64 b = 0; b < TELEMETRY_BUCKETS; b++) {
+                to->buckets[b] += from->buckets[b];
+            }
+        }
+    }
+}
+
+ULONG64 telemetry_percentile(PTELEMETRY_HISTOGRAM histogram, double percentile) {
+
+    // The count and the buckets are read at slightly different times, so go by the buckets.
+    ULONG64 total = 0;
+    for (ULONG64 b = 0; b < TELEMETRY_BUCKETS; b++) {
+        total += histogram->buckets[b];
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    ULONG64 rank = (ULONG64) (percentile / 100.0 * (double) total + 0.5);
+    rank = min(max(rank, 1), total);
+
+    ULONG64 seen = 0;
+    for (ULONG64 b = 0; b < TELEMETRY_BUCKETS; b++) {
+        seen += histogram->buckets[b];
+        if (seen >= rank) {
+            // The max is exact, and a bucket's top may be past it.
+            return min(bucket_top(b), histogram->max);
+        }
+    }
+    return histogram->max;
+}
+
+void telemetry_print(PTELEMETRY_SNAPSHOT snapshot, PTELEMETRY_SNAPSHOT since) {
+
+    double us_per_tick = 1000.0 / (double) ms_to_tsc(1);
+    TELEMETRY_HISTOGRAM difference;
+
+    if (since != NULL) {
+        printf("TELEMETRY OVER THE LAST %llu ms\n", tsc_to_ms(snapshot->taken_at - since->taken_at));
+    } else {
+        printf("TELEMETRY\n");
+    }
+
+    for (ULONG64 c = 0; c < TELEMETRY_COUNTERS; c++) {
+        ULONG64 value = snapshot->counters[c] - (since != NULL ? since->counters[c] : 0);
+        printf("  %-24s %llu\n", counter_names[c], value);
+    }
+
+    printf("  %-24s %10s %10s %10s %10s %10s %10s %10s (us)\n", "", "COUNT", "MEAN", "P50", "P90", "P99", "P99.9", "MAX");
+    for (ULONG64 i = 0; i < TELEMETRY_HISTOGRAMS; i++) {
+        PTELEMETRY_HISTOGRAM h = &snapshot->histograms[i];
+
+        // The max can't be taken apart, so an interval's max is the max so far.
+        if (since != NULL) {
+            PTELEMETRY_HISTOGRAM before = &since->histograms[i];
+            difference.count = h->count - before->count;
+            difference.sum = h->sum - before->sum;
+            difference.max = h->max;
+            for (ULONG64 b = 0; b < TELEMETRY_BUCKETS; b++) {
+                difference.buckets[b] = h->buckets[b] - before->buckets[b];
+            }
+            h = &difference;
+        }
+
+        double mean = h->count != 0 ? (double) h->sum / (double) h->count : 0;
+        printf("  %-24s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", histogram_names[i], h->count,
+               mean * us_per_tick,
+               (double) telemetry_percentile(h, 50) * us_per_tick,
+               (double) telemetry_percentile(h, 90) * us_per_tick,
+               (double) telemetry_percentile(h, 99) * us_per_tick,
+               (double) telemetry_percentile(h, 99.9) * us_per_tick,
+               (double) h->max * us_per_tick);
+    }
+}
+
+/**
+ * @brief Prints what changed since the last period, every period, until export_stop is set.
+ */
+static DWORD WINAPI telemetry_exporter(LPVOID parameter) {
+
+    UNREFERENCED_PARAMETER(parameter);
+
+    PTELEMETRY_SNAPSHOT last = zero_malloc(sizeof(TELEMETRY_SNAPSHOT));
+    PTELEMETRY_SNAPSHOT current = zero_malloc(sizeof(TELEMETRY_SNAPSHOT));
+    telemetry_snapshot(last);
+
+    while (WaitForSingleObject(export_stop, (DWORD) export_period_ms) == WAIT_TIMEOUT) {
+        telemetry_snapshot(current);
+        telemetry_print(current, last);
+
+        PTELEMETRY_SNAPSHOT swap = last;
+        last = current;
+        current = swap;
+    }
+
+    free(last);
+    free(current);
+    return 0;
+}
+
+void telemetry_start_export(ULONG64 period_ms) {
+
+    ASSERT(export_thread == NULL);
+    ASSERT(period_ms != 0);
+
+    export_period_ms = period_ms;
+    export_stop = CreateEvent(NULL, MANUAL_RESET, FALSE, NULL);
+    export_thread = CreateThread(DEFAULT_SECURITY, DEFAULT_STACK_SIZE, telemetry_exporter, NULL,
+                                 DEFAULT_CREATION_FLAGS, NULL);
+    if (export_stop == NULL || export_thread == NULL) {
+        printf("Failed to start the telemetry exporter\n");
+        exit(1);
+    }
+}
+
+void telemetry_stop_export(void) {
+
+    if (export_thread == NULL) {
+        return;
+    }
+
+    SetEvent(export_stop);
+    WaitForSingleObject(export_thread, INFINITE);
+    CloseHandle(export_thread);
+    CloseHandle(export_stop);
+    export_thread = NULL;
+    export_stop = NULL;
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include "utils.h"
+
+/**
+ * Always-on telemetry: event counters and latency histograms, kept per thread so that recording
+ * one is a plain increment of memory no other thread writes.
+ *
+ * Each thread that records anything gets its own slab the first time it does, and keeps it for the
+ * life of the process. Slabs are page-aligned and far larger than a cache line, so two threads
+ * never share a line. telemetry_snapshot sums every slab into one snapshot on demand; the counts it
+ * reads may be a few events behind the threads still recording them, but never torn.
+ *
+ * Histograms are HDR-style: log-linear buckets of TSC ticks. Values below 2^TELEMETRY_SUB_BUCKET_BITS
+ * get a bucket each. Above that, every power of two is split into 2^TELEMETRY_SUB_BUCKET_BITS equal
+ * buckets, so a percentile read from one is within 1 / 2^TELEMETRY_SUB_BUCKET_BITS of the true value,
+ * from a tick up to centuries.
+ */
+
+// Counters
+#define TELEMETRY_PACKETS_SENT                  0   // Put on the network
+#define TELEMETRY_PACKETS_REJECTED              1   // Refused by send_packet / send_packets
+#define TELEMETRY_PACKETS_DROPPED               2   // Accepted, but lost to impairments, a full buffer or a full link
+#define TELEMETRY_PACKETS_RETRANSMITTED         3
+#define TELEMETRY_DUPLICATES_RECEIVED           4   // Packets the receiver already had, or had already delivered
+#define TELEMETRY_CACHE_FULL_WAITS              5   // Times the receiver's cache was full and held a packet back
+#define TELEMETRY_ACKS_SENT                     6
+#define TELEMETRY_ACKS_RECEIVED                 7
+#define TELEMETRY_CHUNKS_NOT_COMPRESSED         8   // With compression on: payload size too big, or too little saved
+#define TELEMETRY_COUNTERS                      9
+
+// Histograms
+#define TELEMETRY_ONE_WAY_DELAY                 0   // From send_packet to the packet being received
+#define TELEMETRY_TRANSMISSION_COMPLETION       1   // From send_transmission to its last ACK
+#define TELEMETRY_SEND_PACKET_CALL              2   // One call of send_packet or send_packets
+#define TELEMETRY_RECEIVE_PACKET_CALL           3   // One call of receive_packet, receive_packets or receive_packet_view
+#define TELEMETRY_PACKETS_PRESENT_WAIT          4   // One wait on a receive queue's packets_present event
+#define TELEMETRY_HISTOGRAMS                    5
+
+#define TELEMETRY_SUB_BUCKET_BITS               4
+#define TELEMETRY_SUB_BUCKETS                   (1 << TELEMETRY_SUB_BUCKET_BITS)
+#define TELEMETRY_BUCKETS                       ((64 - TELEMETRY_SUB_BUCKET_BITS + 1) * TELEMETRY_SUB_BUCKETS)
+
+typedef struct telemetry_histogram {
+    ULONG64 count;
+    ULONG64 sum;                                // TSC
+    ULONG64 max;                                // TSC
+    ULONG64 buckets[TELEMETRY_BUCKETS];
+} TELEMETRY_HISTOGRAM, *PTELEMETRY_HISTOGRAM;
+
+typedef struct telemetry_snapshot {
+    ULONG64 taken_at;                           // TSC
+    ULONG64 counters[TELEMETRY_COUNTERS];
+    TELEMETRY_HISTOGRAM histograms[TELEMETRY_HISTOGRAMS];
+} TELEMETRY_SNAPSHOT, *PTELEMETRY_SNAPSHOT;
+
+/**
+ * @brief Adds n to one of the calling thread's counters.
+ * @param counter One of the TELEMETRY_ counter indexes.
+ */
+void telemetry_count(ULONG64 counter, ULONG64 n);
+
+/**
+ * @brief Records one value in one of the calling thread's histograms.
+ * @param histogram One of the TELEMETRY_ histogram indexes.
+ * @param ticks The value, in TSC ticks.
+ */
+void telemetry_record(ULONG64 histogram, ULONG64 ticks);
+
+/**
+ * @brief Records the time since start (from time_now) in one of the calling thread's histograms.
+ */
+void telemetry_record_since(ULONG64 histogram, ULONG64 start);
+
+/**
+ * @brief Sums every thread's counters and histograms into one snapshot.
+ */
+void telemetry_snapshot(PTELEMETRY_SNAPSHOT snapshot);
+
+/**
+ * @brief Finds a percentile of a histogram.
+ * @param percentile From 0 to 100.
+ * @return The value (TSC) at that percentile -- the top of its bucket -- or 0 if the histogram is empty.
+ */
+ULONG64 telemetry_percentile(PTELEMETRY_HISTOGRAM histogram, double percentile);
+
+/**
+ * @brief Prints a snapshot: every counter, and the count, mean, percentiles and max of every histogram.
+ * @param since An earlier snapshot to print the difference from, or NULL to print totals.
+ */
+void telemetry_print(PTELEMETRY_SNAPSHOT snapshot, PTELEMETRY_SNAPSHOT since);
+
+/**
+ * @brief Starts a thread that prints what changed since the last snapshot every period_ms, until
+ *        telemetry_stop_export is called.
+ */
+void telemetry_start_export(ULONG64 period_ms);
+
+/**
+ * @brief Stops the export thread, if there is one, and waits for it to finish.
+ */
+void telemetry_stop_export(void);
@@ -10,10 +10,16 @@
 #include "transport.h"
 #include "transport_sender.h"
 #include "transport_receiver.h"
+#include "bitmap.h"
+#include "checksum.h"
+#include "fec.h"
+#include "placement.h"
 
 RECEIVER_STATE g_receiver_state;
 
 void create_transport_layer(void) {
+    checksum_init();
+    fec_init();
     create_receiver();
     create_sender();
     return;
@@ -23,12 +29,18 @@ void free_transport_layer(void) {
     return;
 }
 
-int send_transmission(UINT32 transmission_id, PVOID data, SIZE_T length)
+/**
+ * @brief Sets up the sender's state for a transmission and hands it to the minions. Does not wait.
+ * @param connection_id The connection to send it on.
+ * @param data The transmission's data, or NULL if it is streamed from read_routine.
+ * @param queue Where to report the completion, or NULL if the caller will wait on sending_complete_event.
+ * @param context Reported with the completion.
+ * @return The transmission's sender state.
+ */
+static PSENDER_TRANSMISSION_INFO submit_transmission(UINT32 connection_id, UINT32 transmission_id, PVOID data,
+                                                     TRANSMISSION_READ_ROUTINE read_routine, PVOID read_context,
+                                                     SIZE_T length, PSEND_COMPLETION_QUEUE queue, PVOID context)
 {
-    // TODO: Student implementation
-    // - Break data into packets tagged with transmission_id
-    // - Send packets via send_packet()
-
 #if SUPERFLUOUS_PRINTS
     printf("Sending transmission %d length %llu\n", transmission_id, length);
 #endif
@@ -36,37 +48,204 @@ int send_transmission(UINT32 transmission_id, PVOID data, SIZE_T length)
     PSENDER_TRANSMISSION_INFO current_transmission = &g_sender_state.transmissions_in_progress[transmission_id];
 
 
-    if (VirtualAlloc(current_transmission, sizeof(SENDER_TRANSMISSION_INFO), MEM_COMMIT, PAGE_READWRITE) == NULL) {
+    if (commit_local_memory(ROLE_SENDER, current_transmission, sizeof(SENDER_TRANSMISSION_INFO)) == NULL) {
         DebugBreak();
     }
 
+    current_transmission->submit_time = time_now();
+    current_transmission->connection_id = connection_id;
     current_transmission->data = data;
+    current_transmission->read_routine = read_routine;
+    current_transmission->read_context = read_context;
 
-    ULONG64 num_packets = (length + MAX_PAYLOAD_SIZE - 1) / MAX_PAYLOAD_SIZE;
+    ULONG64 payload_size = (ULONG64) g_sender_state.payload_size;
+    ULONG64 num_packets = (length + payload_size - 1) / payload_size;
+    current_transmission->payload_size = payload_size;
     current_transmission->number_of_packets_in_transmission = num_packets;
-    current_transmission->packet_status_bitmap = zero_malloc((num_packets + 63) / 64 * sizeof(UINT64));
+    current_transmission->packet_status_bitmap = zero_malloc(BITMAP_WORDS(num_packets) * sizeof(UINT64));
     current_transmission->total_bytes = length;
-    current_transmission->sending_complete_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    current_transmission->sending_complete_event = queue == NULL ? CreateEvent(NULL, FALSE, FALSE, NULL) : NULL;
+    current_transmission->completion_queue = queue;
+    current_transmission->completion.transmission_id = transmission_id;
+    current_transmission->completion.context = context;
+    current_transmission->packets_outstanding = (LONG64) num_packets;
+    current_transmission->cumulative_ack = 0;
+    current_transmission->receive_window_end = min(num_packets, MIN_RECEIVE_WINDOW_IN_PACKETS(payload_size));
+    current_transmission->packet_send_times = zero_malloc(num_packets * sizeof(ULONG64));
+
+    // Every chunk starts with all of its packets outstanding; only the last one may be short.
+    ULONG64 num_chunks = (num_packets + MAX_CHUNK_SIZE_IN_PACKETS - 1) / MAX_CHUNK_SIZE_IN_PACKETS;
+    current_transmission->chunks = zero_malloc(num_chunks * sizeof(SENDER_CHUNK_INFO));
+    for (ULONG64 i = 0; i < num_chunks; i++) {
+        current_transmission->chunks[i].packets_outstanding =
+            (LONG) min(MAX_CHUNK_SIZE_IN_PACKETS, num_packets - i * MAX_CHUNK_SIZE_IN_PACKETS);
+    }
+    current_transmission->references = (LONG) num_chunks + 1;
+
+    // Raise the limit past this ID before any of its packets go out, so the listener takes its ACKs.
+    LONG64 limit = g_sender_state.transmission_id_limit;
+    while (limit <= (LONG64) transmission_id &&
+           InterlockedCompareExchange64(&g_sender_state.transmission_id_limit, (LONG64) transmission_id + 1,
+                                        limit) != limit) {
+        limit = g_sender_state.transmission_id_limit;
+    }
+
+
+    // Add the transmission ID to the work queue. The queue only fills up if more transmissions are
+    // in flight than it has slots, in which case we wait for the minions to drain it.
+    while (!enqueue_transmission_id(transmission_id)) {
+        Sleep(1);
+    }
+    SetEvent(g_sender_state.work_available);
+
+    return current_transmission;
+}
+
+int send_transmission(UINT32 transmission_id, PVOID data, SIZE_T length)
+{
+    return send_transmission_on_connection(0, transmission_id, data, length);
+}
+
+int send_transmission_on_connection(UINT32 connection_id, UINT32 transmission_id, PVOID data, SIZE_T length)
+{
+    if (connection_id >= MAX_CONNECTIONS) {
+        return TRANSMISSION_REJECTED;
+    }
+
+    PSENDER_TRANSMISSION_INFO info = submit_transmission(connection_id, transmission_id, data, NULL, NULL, length,
+                                                         NULL, NULL);
+
+    WaitForSingleObject(info->sending_complete_event, INFINITE);
+    CloseHandle(info->sending_complete_event);
+
+    return TRANSMISSION_ACCEPTED;
+}
+
+BOOL set_connection_weight(UINT32 connection_id, ULONG weight)
+{
+    if (connection_id >= MAX_CONNECTIONS || weight == 0 || weight > MAX_CONNECTION_WEIGHT) {
+        return FALSE;
+    }
+
+    // Takes effect from the next scheduling round.
+    InterlockedExchange64(&g_sender_state.connections[connection_id].weight, weight);
+    return TRUE;
+}
+
+BOOL set_payload_size(ULONG64 payload_size_in_bytes)
+{
+    if (!IS_VALID_PAYLOAD_SIZE(payload_size_in_bytes)) {
+        return FALSE;
+    }
+
+    // Every packet but a transmission's last carries a full payload, so it must fit through the network.
+    if (offsetof(DATA_PACKET, data) + payload_size_in_bytes > get_max_packet_size()) {
+        return FALSE;
+    }
+
+    InterlockedExchange64(&g_sender_state.payload_size, (LONG64) payload_size_in_bytes);
+    return TRUE;
+}
+
+ULONG64 get_payload_size(void)
+{
+    return (ULONG64) g_sender_state.payload_size;
+}
+
+void set_forward_error_correction(BOOL enabled)
+{
+    InterlockedExchange(&g_sender_state.fec.enabled, enabled ? TRUE : FALSE);
+}
+
+void set_compression(BOOL enabled)
+{
+    InterlockedExchange(&g_sender_state.compression_enabled, enabled ? TRUE : FALSE);
+}
+
+BOOL set_sender_minion_count(ULONG count)
+{
+    if (count == 0 || count > SENDER_MINION_COUNT) {
+        return FALSE;
+    }
 
+    InterlockedExchange(&g_sender_state.active_minions, (LONG) count);
+    SetEvent(g_sender_state.work_available);
+    return TRUE;
+}
+
+int send_transmission_stream(UINT32 transmission_id, TRANSMISSION_READ_ROUTINE read_routine, PVOID context,
+                             SIZE_T length)
+{
+    PSENDER_TRANSMISSION_INFO info = submit_transmission(0, transmission_id, NULL, read_routine, context, length,
+                                                         NULL, NULL);
 
-    // #TODO: Make this lock free
-    EnterCriticalSection(&g_work_array_lock);
-    // Add the transmission ID to the work array
-    ULONG64 write_index = g_sender_state.transmissions_queue.next_write_index % WORK_ARRAY_SIZE;
+    WaitForSingleObject(info->sending_complete_event, INFINITE);
+    CloseHandle(info->sending_complete_event);
 
-    g_sender_state.transmissions_queue.work_array[write_index % WORK_ARRAY_SIZE] = transmission_id;
+    return TRANSMISSION_ACCEPTED;
+}
 
-    // Increase the write index (How many IDs we have written in TOTAL to the transmission queue, this is
-    // different from the index we are on in get_next_transmission_id)
-    g_sender_state.transmissions_queue.next_write_index++;
+PSEND_COMPLETION_QUEUE create_send_completion_queue(void)
+{
+    PSEND_COMPLETION_QUEUE queue = zero_malloc(sizeof(SEND_COMPLETION_QUEUE));
 
-    LeaveCriticalSection(&g_work_array_lock);
+    InitializeSListHead(&queue->completions);
+    queue->completion_available = CreateEvent(NULL, AUTO_RESET, FALSE, NULL);
+    if (queue->completion_available == NULL) {
+        DebugBreak();
+    }
+    return queue;
+}
 
-    WaitForSingleObject(current_transmission->sending_complete_event, INFINITE);
-    
+int send_transmission_async(UINT32 transmission_id, PVOID data, SIZE_T length, PSEND_COMPLETION_QUEUE queue,
+                            PVOID context)
+{
+    submit_transmission(0, transmission_id, data, NULL, NULL, length, queue, context);
     return TRANSMISSION_ACCEPTED;
 }
 
+ULONG get_send_completions(PSEND_COMPLETION_QUEUE queue, PSEND_COMPLETION completions, ULONG max_completions,
+                           ULONG64 timeout_ms)
+{
+    ULONG n_completions = 0;
+    ULONG64 deadline = deadline_from_now_ms(timeout_ms);
+
+    while (TRUE) {
+        while (n_completions < max_completions) {
+            PSEND_COMPLETION completion = (PSEND_COMPLETION) InterlockedPopEntrySList(&queue->completions);
+            if (completion == NULL) {
+                break;
+            }
+            completions[n_completions++] = *completion;
+        }
+
+        // The event is auto-reset and any number of completions can share one Set, so only
+        // sleep once the list itself is empty.
+        ULONG64 now = time_now();
+        if (n_completions != 0 || now >= deadline) {
+            return n_completions;
+        }
+        WaitForSingleObject(queue->completion_available, (DWORD) tsc_to_ms(deadline - now));
+    }
+}
+
+BOOL is_transmission_sent(UINT32 transmission_id)
+{
+    // Nothing at or above the limit was ever submitted, so its memory is only reserved.
+    if (transmission_id >= (ULONG64) g_sender_state.transmission_id_limit) {
+        return FALSE;
+    }
+
+    // IDs needn't be dense, so an entry below the limit may never have been committed either.
+    PSENDER_TRANSMISSION_INFO info = &g_sender_state.transmissions_in_progress[transmission_id];
+    __try {
+        return info->submit_time != 0 && info->references == 0;
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        return FALSE;
+    }
+}
+
 int receive_transmission(UINT32 transmission_id, PVOID dest, PSIZE_T out_length, ULONG64 timeout_ms) {
     int returnVal = reciever_handler(transmission_id, dest, out_length, timeout_ms);
 
@@ -75,102 +254,85 @@ int receive_transmission(UINT32 transmission_id, PVOID dest, PSIZE_T out_length,
 #endif
     return returnVal;
 }
-BYTE write_to_cache(PDATA_PACKET Niko_Packet) {
-    printf(".");
+
+int receive_transmission_stream(UINT32 transmission_id, TRANSMISSION_WRITE_ROUTINE write_routine, PVOID context,
+                                PSIZE_T out_length, ULONG64 timeout_ms) {
+    int returnVal = stream_receiver_handler(transmission_id, write_routine, context, out_length, timeout_ms);
+
+#if SUPERFLUOUS_PRINTS
+    printf("Received streamed transmission %d length %llu\n", transmission_id, *out_length);
+#endif
+    return returnVal;
+}
+BYTE write_to_cache(PDATA_PACKET Niko_Packet, PVOID view) {
     // Make sure packet exists/if Niko does a bad job
     ASSERT(Niko_Packet);
-    // Attempt to reserve slot in cache to write into
-    boolean found_slot = FALSE;
-    int attempts = 0;
-    int return_value = 0;
-    int chunk = 0;
-    int offset = 0;
-//    int slot = 0;
-    int original_value_counter = 0;
-    // Continue looking for a slot in the cache to write in
-    while (found_slot == FALSE) {
-        // Take a "snapshot" / save original value of slot counter so that we can do consistent math even if other
-        // threads increment slot_counter
-        original_value_counter = g_receiver_state.packet_cache.slot_counter_writer;
-        // To find the correct slot in any chunk in our bitmap
-        offset = original_value_counter % NUM_BITS_IN_CHUNK;
-        // To find which chunk offset belongs to
-        chunk = (original_value_counter % BUFFER_SIZE_IN_PACKETS) / NUM_BITS_IN_CHUNK;
-        return_value = InterlockedBitTestAndSet64((PLONGLONG)&g_receiver_state.packet_cache.reserve_cache_slot[chunk], offset);
-        // We found a slot
-        if (return_value == 0) {
-            found_slot = TRUE;
-        }
-        // We did not find a slot so we move on to the next space on the cache
-        else {
-            // Once we reach max attempts, we drop the packet which is fine because sender side will send it again
-            if (attempts == MAX_ATTEMPTS_RECIEVER) {
-                return PACKET_CACHE_FAIL;
-            }
+    // Every packet of a transmission goes to the same worker, so its reassembly state has a single writer
+    PPACKET_CACHE cache = &g_receiver_state.packet_caches[receiver_worker_for_transmission(Niko_Packet->transmission_id)];
+    PCACHED_PACKET slot;
+    LONG64 position = cache->slot_counter_writer;
+
+    // Claim the next position in the ring. This mirrors enqueue_transmission_id.
+    while (TRUE) {
+        slot = &cache->packet_space[position & (cache->capacity - 1)];
+        LONG64 difference = slot->sequence - position;
 
-           attempts++;
+        if (difference == 0) {
+            // The slot is empty for this lap -- try to claim the position.
+            LONG64 observed = InterlockedCompareExchange64(&cache->slot_counter_writer, position + 1, position);
+            if (observed == position) {
+                break;
+            }
+            position = observed;
+        } else if (difference < 0) {
+            // The worker hasn't freed this slot from the last lap yet, so the cache is full.
+            return PACKET_CACHE_FULL;
+        } else {
+            // Another receiver thread got here first, reload and try the next position.
+            position = cache->slot_counter_writer;
         }
-        // we should increment regardless
-        InterlockedIncrement((PLONG)&g_receiver_state.packet_cache.slot_counter_writer);
-    }
-    // Write packet into the circular buffer
-    memcpy(&g_receiver_state.packet_cache.packet_space[chunk * NUM_BITS_IN_CHUNK + offset],
-        Niko_Packet, sizeof(DATA_PACKET));
-    // Update bitmap for reader side to indicate a packet can be read from this slot we reserved
-    //g_receiver_state.packet_cache.is_cache_slot_written[chunk * NUM_BITS_IN_CHUNK + offset] = 1;
-    InterlockedBitTestAndSet64((volatile PLONG64)&(g_receiver_state.packet_cache.is_cache_slot_written[chunk]), offset);
-    SetEvent(g_receiver_state.packet_cache.packets_waiting_in_cache);
+    }
+
+    // Write the packet's view into the circular buffer -- the packet itself stays in the network.
+    slot->packet = Niko_Packet;
+    slot->view = view;
+
+    // Publish the packet to the worker. The interlocked write orders it after the stores above.
+    InterlockedExchange64(&slot->sequence, position + 1);
+    SetEvent(cache->packets_waiting_in_cache);
     return PACKET_CACHE_SUCCESSFUL;
 
 }
 
-BYTE read_from_cache(PDATA_PACKET Noah_Packet) {
+void wait_for_cache_space(PDATA_PACKET pkt, ULONG64 timeout_ms) {
+    PPACKET_CACHE cache = &g_receiver_state.packet_caches[receiver_worker_for_transmission(pkt->transmission_id)];
+
+    // The timeout covers a wakeup that lands between the failed write and the wait.
+    InterlockedIncrement(&cache->writers_waiting);
+    WaitForSingleObject(cache->space_available, (DWORD) timeout_ms);
+    InterlockedDecrement(&cache->writers_waiting);
+}
+
+BYTE read_from_cache(PPACKET_CACHE cache, PDATA_PACKET* Noah_Packet, PVOID* view) {
     // Make sure packet exists/if Noah does a bad job
-    ASSERT(Noah_Packet);
-    boolean found_packet = FALSE;
-    int attempts = 0;
-    int return_value = 0;
-    int chunk = 0;
-    int offset = 0;
-    int original_value_counter = 0;
-    while (found_packet == FALSE) {
-        // Check bit maps to see if there is any packets in the cache to read from - From the Blickster himself
-        if (g_receiver_state.packet_cache.is_cache_slot_written[0] == 0 &&
-            g_receiver_state.packet_cache.is_cache_slot_written[1] == 0) {
-            return PACKET_FAILED_TO_READ;
-        }
-        // Take a "snapshot" / save original value of slot counter so that we can do consistent math even if other
-        // threads increment slot_counter
-        original_value_counter = g_receiver_state.packet_cache.slot_counter_reader;
-        // To find the correct slot in any chunk in our bitmap
-        offset = original_value_counter % NUM_BITS_IN_CHUNK;
-        // To find which chunk offset belongs to
-        chunk = (original_value_counter % BUFFER_SIZE_IN_PACKETS) / NUM_BITS_IN_CHUNK;
-        return_value = InterlockedBitTestAndReset64((PLONGLONG)&g_receiver_state.packet_cache.is_cache_slot_written[chunk], offset);
-        // We found a packet
-        if (return_value == 1) {
-            found_packet = TRUE;
-        }
-        else {
+    ASSERT(Noah_Packet && view);
+    // Only the worker reads from its cache, so the reader index needs no CAS.
+    LONG64 position = cache->slot_counter_reader;
+    PCACHED_PACKET slot = &cache->packet_space[position & (cache->capacity - 1)];
 
-            // TODO: DONT think we need this
-            attempts++;
-            // if we checked the entire cache
-            if (attempts == BUFFER_SIZE_IN_PACKETS) {
-                return PACKET_FAILED_TO_READ;
-            }
-        }
-        //regardless of if we succeed, we should increment this, before hand it was only in failure. //TODO
-        InterlockedIncrement((PLONG)&g_receiver_state.packet_cache.slot_counter_reader);
+    if (slot->sequence != position + 1) {
+        return PACKET_FAILED_TO_READ;
     }
-    memcpy(Noah_Packet,
-        &g_receiver_state.packet_cache.packet_space[chunk * NUM_BITS_IN_CHUNK + offset]
-        ,sizeof(DATA_PACKET));
 
+    *Noah_Packet = slot->packet;
+    *view = slot->view;
+
+    // Hand the slot back to the writers a full lap ahead.
+    InterlockedExchange64(&slot->sequence, position + (LONG64) cache->capacity);
+    cache->slot_counter_reader = position + 1;
 
-    // Update bitmap for writer side to indicate this cache slot is available to be written into again //TODO confusing bitmap with bytemap
-    return_value = InterlockedBitTestAndReset64((PLONGLONG)&g_receiver_state.packet_cache.reserve_cache_slot[chunk], offset);
-    // this must have previously been claimed to then be released, so we should have a 1
-    ASSERT(return_value == 1);
+    if (cache->writers_waiting != 0) {
+        SetEvent(cache->space_available);
+    }
     return PACKET_SUCCESSFULLY_READ;
 }
\ No newline at end of file
@@ -72,6 +72,194 @@ void free_transport_layer(void);
 #define TRANSMISSION_REJECTED       1
 int send_transmission(UINT32 transmission_id, PVOID data, SIZE_T length);
 
+/**
+ * send_transmission_on_connection
+ *
+ * Like send_transmission, but on the given connection rather than connection 0. Each connection
+ * has its own channel through the network, and the sender shares its bandwidth between the
+ * connections with work in proportion to their weights (see set_connection_weight).
+ *
+ * Transmission IDs are still unique across all connections.
+ *
+ * Parameters:
+ *   connection_id   - Which connection to send on (< MAX_CONNECTIONS)
+ *   transmission_id - Unique identifier for this transmission (assigned by app layer)
+ *   data            - Pointer to the data to send
+ *   length          - Number of bytes to send
+ *
+ * Returns:
+ *   TRANSMISSION_ACCEPTED - All data acknowledged by receiver
+ *   TRANSMISSION_REJECTED - connection_id is out of range
+ */
+int send_transmission_on_connection(UINT32 connection_id, UINT32 transmission_id, PVOID data, SIZE_T length);
+
+/**
+ * set_connection_weight
+ *
+ * Sets how many bytes a connection may send per scheduling round, relative to the others: weight
+ * times CONNECTION_QUANTUM_IN_BYTES. Shares are in bytes, whatever payload size each connection uses.
+ * Every connection starts at DEFAULT_CONNECTION_WEIGHT.
+ *
+ * Parameters:
+ *   connection_id - The connection to weigh (< MAX_CONNECTIONS)
+ *   weight        - From 1 to MAX_CONNECTION_WEIGHT
+ *
+ * Returns:
+ *   TRUE if the weight was set, FALSE if either argument is out of range.
+ */
+BOOL set_connection_weight(UINT32 connection_id, ULONG weight);
+
+/**
+ * set_payload_size
+ *
+ * Sets how many bytes of data each packet carries -- our MTU -- for transmissions submitted from
+ * now on. Transmissions already in flight keep the size they started with, and the receiver learns
+ * each transmission's size from its packets. Starts at DEFAULT_PAYLOAD_SIZE.
+ *
+ * Bigger packets spread the headers and the per-packet costs over more data, but each one takes
+ * longer to serialize and costs more to retransmit.
+ *
+ * Parameters:
+ *   payload_size_in_bytes - A power of two from MIN_PAYLOAD_SIZE to MAX_PAYLOAD_SIZE
+ *
+ * Returns:
+ *   TRUE if the size was set, FALSE if it is out of range, or if its packets are bigger than the
+ *   network can carry (see get_max_packet_size).
+ */
+BOOL set_payload_size(ULONG64 payload_size_in_bytes);
+
+/**
+ * get_payload_size
+ *
+ * Returns:
+ *   The payload size transmissions submitted now would be sent with.
+ */
+ULONG64 get_payload_size(void);
+
+/**
+ * set_forward_error_correction
+ *
+ * Turns forward error correction on or off for chunks sent from now on. With it on, every group of
+ * PARITY_GROUP_SIZE_IN_PACKETS data packets is followed by parity packets, and the receiver rebuilds
+ * up to that many lost packets of the group without waiting a round trip for their retransmission.
+ * How many parity packets a group gets follows the loss rate the sender sees. Starts off.
+ *
+ * Parity costs bandwidth whether or not anything is lost, so this is for lossy links.
+ * Streamed receives ignore the parity and rely on retransmission alone.
+ *
+ * Parameters:
+ *   enabled - TRUE to send parity packets, FALSE to stop
+ */
+void set_forward_error_correction(BOOL enabled);
+
+/**
+ * set_compression
+ *
+ * Turns chunk compression on or off for chunks handed out from now on. With it on, each chunk is
+ * compressed before it is packetized and goes out in fewer packets, and the receiver decompresses
+ * it straight into the transmission's buffer. A chunk that doesn't compress to at most
+ * COMPRESSION_MAX_PACKETS_PERCENT of its packets is sent as it is. Starts off.
+ *
+ * Compression costs sender CPU on every chunk, and the receiver can't use any of a compressed chunk
+ * until all of its packets are in. It pays off when the data compresses well and bandwidth, not CPU,
+ * is the limit. Compressed chunks get no parity, and payload sizes above 32 KB are never compressed:
+ * a chunk has to fit in the smallest receive window, MIN_RECEIVE_WINDOW_IN_BYTES. Every chunk sent
+ * as it is while compression is on counts towards TELEMETRY_CHUNKS_NOT_COMPRESSED.
+ *
+ * Parameters:
+ *   enabled - TRUE to compress chunks, FALSE to stop
+ */
+void set_compression(BOOL enabled);
+
+/**
+ * set_sender_minion_count
+ *
+ * Sets how many of the sender's SENDER_MINION_COUNT minion threads take on new chunks. The rest
+ * are parked: each finishes the chunks it already holds and then sleeps until it is needed again.
+ * All of them start active.
+ *
+ * Parameters:
+ *   count - From 1 to SENDER_MINION_COUNT
+ *
+ * Returns:
+ *   TRUE if the count was set, FALSE if it is out of range.
+ */
+BOOL set_sender_minion_count(ULONG count);
+
+/**
+ * send_transmission_stream
+ *
+ * Like send_transmission, but for data that need not be in memory all at once (a file bigger
+ * than RAM, say). The data is pulled from read_routine one chunk at a time as the minions get to
+ * it, and each chunk is only held until it has been ACK'd.
+ *
+ * Parameters:
+ *   transmission_id - Unique identifier for this transmission (assigned by app layer)
+ *   read_routine    - Called to read each chunk of the data. May be called from any minion.
+ *   context         - Passed through to read_routine
+ *   length          - Number of bytes to send
+ *
+ * Returns:
+ *   Same as send_transmission.
+ */
+int send_transmission_stream(UINT32 transmission_id, TRANSMISSION_READ_ROUTINE read_routine, PVOID context,
+                             SIZE_T length);
+
+/*
+ *  create_send_completion_queue
+ *
+ *  Creates a queue for asynchronous transmissions to report their completions through.
+ */
+PSEND_COMPLETION_QUEUE create_send_completion_queue(void);
+
+/**
+ * send_transmission_async
+ *
+ * Like send_transmission, but returns as soon as the transmission has been handed to the sender.
+ * One thread can have any number of these in flight at once.
+ *
+ * Parameters:
+ *   transmission_id - Unique identifier for this transmission (assigned by app layer). It is also
+ *                     the handle the completion and is_transmission_sent know it by.
+ *   data            - Pointer to the data to send. Must stay valid until the transmission completes.
+ *   length          - Number of bytes to send
+ *   queue           - Where the completion is reported once all data has been acknowledged
+ *   context         - Reported with the completion
+ *
+ * Returns:
+ *   TRANSMISSION_ACCEPTED - The transmission is under way
+ */
+int send_transmission_async(UINT32 transmission_id, PVOID data, SIZE_T length, PSEND_COMPLETION_QUEUE queue,
+                            PVOID context);
+
+/**
+ * get_send_completions
+ *
+ * Takes the completions of asynchronous transmissions off a queue, waiting for at least one.
+ *
+ * Parameters:
+ *   queue           - The queue the transmissions were sent with
+ *   completions     - Receives the completions
+ *   max_completions - How many completions fit in completions
+ *   timeout_ms      - Maximum time to wait if there are none yet
+ *
+ * Returns:
+ *   The number of completions written to completions (0 on timeout).
+ */
+ULONG get_send_completions(PSEND_COMPLETION_QUEUE queue, PSEND_COMPLETION completions, ULONG max_completions,
+                           ULONG64 timeout_ms);
+
+/**
+ * is_transmission_sent
+ *
+ * Polls an asynchronous transmission.
+ *
+ * Returns:
+ *   TRUE once all of its data has been acknowledged by the receiver and the sender is done with it.
+ *   FALSE until then, or if no transmission with this ID was ever sent.
+ */
+BOOL is_transmission_sent(UINT32 transmission_id);
+
 
 /*
  * receive_transmission
@@ -94,7 +282,29 @@ int send_transmission(UINT32 transmission_id, PVOID data, SIZE_T length);
  *   - Must track in-flight transmissions by transmission_id
  *   - Must reassemble packets into complete transmissions
  *   - Caller is responsible for providing a dest buffer large enough
+ *   - On a timeout, dest is no longer written to. What has arrived is kept, and calling again for
+ *     the same transmission picks up where this left off.
  */
 #define TRANSMISSION_RECEIVED       0
 #define NO_TRANSMISSION_AVAILABLE   1
-int receive_transmission(UINT32 transmission_id, PVOID dest, PSIZE_T out_length, ULONG64 timeout_ms);
\ No newline at end of file
+int receive_transmission(UINT32 transmission_id, PVOID dest, PSIZE_T out_length, ULONG64 timeout_ms);
+
+/**
+ * receive_transmission_stream
+ *
+ * Like receive_transmission, but rather than reassembling into a buffer the size of the whole
+ * transmission, hands the data to write_routine in order as soon as it is contiguous. Only a
+ * window of the transmission is ever held by the receiver.
+ *
+ * Parameters:
+ *   transmission_id - The transmission to receive
+ *   write_routine   - Called with each contiguous run of data, in order. Called from a receiver worker.
+ *   context         - Passed through to write_routine
+ *   out_length      - Pointer where byte count will be written
+ *   timeout_ms      - Maximum time to wait for a completed transmission
+ *
+ * Returns:
+ *   Same as receive_transmission.
+ */
+int receive_transmission_stream(UINT32 transmission_id, TRANSMISSION_WRITE_ROUTINE write_routine, PVOID context,
+                                PSIZE_T out_length, ULONG64 timeout_ms);
\ No newline at end of file
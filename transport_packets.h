@@ -58,43 +58,92 @@
 typedef struct data_packet {
     /* UNIVERSAL HEADER */
     ULONG64 bytes_in_header;                // Describes the size of the universal header (including this field).
-                                            // Currently, this is always 16
+                                            // Currently, this is always 24
 
     UINT32 transmission_id : 31;            // Indicates which transmission this packet belongs to.
     UINT32 must_be_zero : 1;                // When this bit is cleared, we interpret the packet as a data packet.
     UINT32 bytes_in_payload;                // Documents how many bytes in the payload are relevant.
-                                            // This must be > 0 and < MAX_PAYLOAD_SIZE.
+                                            // This must be > 0 and <= payload_size.
+    UINT32 connection_id;                   // The connection the transmission was sent on.
+    UINT32 payload_checksum;                // CRC32C of the bytes_in_payload bytes of data.
 
     /* DATA HEADER */
     ULONG64 bytes_in_data_fields;           // Describes the size of the data packet specific fields (including this field).
-                                            // Currently, this is always 16.
+                                            // Currently, this is always 40.
     UINT32 index_in_transmission;           // Indicates the packet's position in the transmission (e.g. packet #3/5)
+                                            // For a parity packet, the first packet of the group it covers.
     UINT32 n_packets_in_transmission;       // Contains the total number of packets in this transmission.
+    UINT32 payload_size;                    // Every packet of the transmission but the last carries exactly this many
+                                            // bytes. A power of two from MIN_PAYLOAD_SIZE to MAX_PAYLOAD_SIZE.
+    UINT16 parity_index;                    // Parity packets only: which of the group's parity packets this is.
+    UINT16 parity_count;                    // 0 for a data packet. For a parity packet, how many parity packets
+                                            // its group has -- at most FEC_MAX_PARITY_PACKETS.
+    UINT32 parity_last_packet_bytes;        // Parity packets only: the bytes in the group's last data packet.
+    UINT32 compressed_chunk_bytes;          // 0 unless the packet's chunk was compressed. If it was, the size of
+                                            // the compressed chunk, which the chunk's first packets carry in order.
+    UINT32 chunk_bytes;                     // Compressed chunks only: the bytes the chunk decompresses to.
+    UINT32 data_reserved;                   // Keeps the payload 8-byte aligned. Always 0.
 
-    BYTE data[MAX_PAYLOAD_SIZE];            // Contains the data to be transmitted.
+    BYTE data[MAX_PAYLOAD_SIZE];            // Contains the data to be transmitted. Only the first bytes_in_payload
+                                            // are sent -- a packet in network memory ends right after them.
 } DATA_PACKET, *PDATA_PACKET;
 
+// With forward error correction on, each group of this many packets -- starting from packet 0 -- is followed
+// by its parity packets. A parity packet always carries a full payload_size bytes. At most FEC_MAX_DATA_PACKETS.
+#define PARITY_GROUP_SIZE_IN_PACKETS 128
+
+// A compressed chunk covers this many packet indices, starting from a multiple of it -- the sender's chunk size.
+// It goes out in fewer packets than that, numbered from the start of the chunk. The rest are never sent: the
+// receiver fills in all of the chunk's packets at once when it decompresses it. Parity only covers chunks
+// sent uncompressed.
+#define COMPRESSED_CHUNK_SIZE_IN_PACKETS 128
+
+
+// An ACK reports at most this many SACK ranges, so it always fits in a single network slot.
+#define MAX_SACK_RANGES 16
+
+#define NO_PACKET_NACKED UINT32_MAX
+
+// A receiver always takes every packet below its cumulative ACK plus this many bytes' worth. It can advertise
+// a bigger window in its ACKs but never a smaller one, so the sender starts out assuming this much.
+// In packets, it depends on the transmission's payload size -- and is a power of two, as that is.
+#define MIN_RECEIVE_WINDOW_IN_BYTES MB(4)
+#define MIN_RECEIVE_WINDOW_IN_PACKETS(payload_size) (MIN_RECEIVE_WINDOW_IN_BYTES / (payload_size))
+
+typedef struct sack_range {
+    UINT32 first_packet_index;              // The first packet in a run of received packets.
+    UINT32 n_packets;                       // The number of packets in the run.
+} SACK_RANGE, *PSACK_RANGE;
 
 typedef struct comm_packet {
     /* UNIVERSAL HEADER */
     ULONG64 bytes_in_header;                // Describes the size of the universal header (including this field).
-                                            // Currently, this is always 16
+                                            // Currently, this is always 24
 
     UINT32 transmission_id : 31;            // Indicates which transmission we are acknowledging.
     UINT32 must_be_one : 1;                 // When this bit is set, we interpret the packet as a comm packet.
-    UINT32 bytes_in_bitmap;                 // Documents the total size of the bitmap in bytes.
-                                            // This must be > 0 and < MAX_PAYLOAD_SIZE.
+    UINT32 bytes_in_sack_ranges;            // Documents the total size of the SACK ranges in bytes.
+                                            // This is a multiple of sizeof(SACK_RANGE), and may be 0.
+    UINT32 connection_id;                   // Echoes the connection of the data packets being acknowledged.
+    UINT32 payload_checksum;                // CRC32C of the bytes_in_sack_ranges bytes of SACK ranges.
 
     /* COMM HEADER */
     ULONG64 bytes_in_comm_fields;           // Describes the size of the data packet specific fields (including this field).
-                                            // Currently, this is always 16.
-    UINT32 first_packet_index;              // Indicates the packet number of the first packet in the bitmaps.
-    UINT32 n_bits_to_read;                  // Indicates the number of relevant bits in the bitmap (corresponding
-                                            // with the number of packets being ACKed or NACKed.
+                                            // Currently, this is always 32.
+    UINT32 cumulative_ack;                  // Every packet with an index below this one has been received.
+    UINT32 latest_packet_index;             // The packet whose arrival triggered this ACK. The sender
+                                            // takes its RTT sample from this packet.
+    UINT32 receive_window_end;              // The receiver drops any packet with this index or above, so the
+                                            // sender must not send one for the first time.
+    UINT32 nacked_packet_index;             // A packet that arrived corrupted, which the sender should resend now
+                                            // rather than wait out its timer. NO_PACKET_NACKED if there isn't one.
+    UINT32 packets_recovered;               // Packets rebuilt from parity since the last ACK, so the sender can
+                                            // count them as lost when it sizes its parity.
+    UINT32 comm_reserved;                   // Keeps the SACK ranges 8-byte aligned. Always 0.
 
     /* PAYLOAD */
-    BYTE bitmap[MAX_PAYLOAD_SIZE];          // Contains bitmap, where each 0 indicates a packet that WAS NOT
-                                            // received and a 1 indicates a packet that WAS received.
+    SACK_RANGE sack_ranges[MAX_SACK_RANGES];// Runs of packets received above the cumulative ACK, most recent first.
+                                            // Anything not covered by a range (or the cumulative ACK) is still missing.
 } COMM_PACKET, *PCOMM_PACKET;
 
 
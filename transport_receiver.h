@@ -6,82 +6,294 @@
 /**
  *
  *  Key data structures:
- *      - For all transmissions, there is a sparse array. The index in the
- *        sparse array is the transmission ID.
+ *      - Each receiver worker has a hash map from transmission ID to the
+ *        transmission info of every transmission it is reassembling.
  *
- *      - Each entry in this sparse array will include a pointer to the
- *        data for that specific transmission. There is one pointer to the
- *        status bitmap for its packets and another pointer to the buffer of
- *        the data that has actually been received for that transmission.
+ *      - Each transmission info includes a pointer to the data for that
+ *        specific transmission. There is one pointer to the status bitmap
+ *        for its packets and another pointer to the buffer of the data that
+ *        has actually been received for that transmission.
+ *
+ *      - The application posts a receive for each transmission it wants,
+ *        and the worker places the data straight into the posted buffer.
+ *        Only data that arrives before its receive is posted is held in a
+ *        reassembly buffer, and moved over once when the receive turns up.
+ *
+ *      - A streamed receive posts a sink instead of a buffer. Its data is
+ *        staged in a bounded ring and written to the sink as soon as it is
+ *        contiguous, so memory is bounded by the window, not the file size.
+ *
+ *      - Transmission infos, their bitmaps, and the reassembly buffers all
+ *        come from a pool, and go back to it once they are done with.
  *
  */
 
-// This defines the number of packets that are saved in the circular buffer.
-// Cache_packet writes into it and main receiver thread pulls from it.
-#define BUFFER_SIZE_IN_PACKETS 128
-#define NUM_BITS_IN_CHUNK 64
-#define MAX_ATTEMPTS_RECIEVER 16
+// This defines the number of packets that are saved in each worker's circular buffer.
+// write_to_cache writes into it and the worker's main receiver thread pulls from it.
+// Must be a power of two -- ring positions are masked, not modded.
+#define PACKET_CACHE_CAPACITY 256
+// How long a receiver thread holding a packet waits for room in a full cache before trying again.
+#define CACHE_BACKPRESSURE_WAIT_MS 1
+
+// Reassembly is sharded across this many receiver workers, each draining its own packet cache.
+// Must be a power of two -- transmissions are routed by the top bits of a multiplicative hash of their ID.
+#define RECEIVER_WORKER_COUNT_LOG2 2
+#define RECEIVER_WORKER_COUNT (1 << RECEIVER_WORKER_COUNT_LOG2)
+#define receiver_worker_for_transmission(id) (((UINT32) (id) * 2654435761u) >> (32 - RECEIVER_WORKER_COUNT_LOG2))
+
+// ACKs are coalesced per transmission: one goes out after this many packets have arrived,
+// or once the oldest unacknowledged packet has waited this long, whichever comes first.
+#define ACK_COALESCE_PACKETS 16
+#define ACK_COALESCE_DELAY_MS 2
+// The number of transmissions that can have an ACK waiting on the timer at once.
+#define MAX_PENDING_ACKS 64
+
+// Each worker's map has this many entries. Must be a power of two -- entries are masked, not modded.
+#define TRANSMISSION_MAP_SIZE 4096
+// A map stops taking new transmissions at 3/4 full, so probe chains stay short.
+#define TRANSMISSION_MAP_MAX_COUNT (TRANSMISSION_MAP_SIZE / 4 * 3)
+// Each worker remembers this many of the transmissions it has reclaimed, so that a late
+// retransmission is answered with a full ACK rather than starting the transmission over.
+#define RECENTLY_DELIVERED_COUNT 256
+
+// Reassembly buffers come in power-of-two size classes, from 4 KB up to 1 GB (MAX_TRANSMISSION_LIMIT_KB).
+#define REASSEMBLY_MIN_SIZE_CLASS_SHIFT 12
+#define REASSEMBLY_SIZE_CLASS_COUNT 19
+// Classes smaller than this are carved out of slabs of this size, which is also the usual large page.
+#define REASSEMBLY_SLAB_SIZE_IN_BYTES MB(2)
+// Transmission infos are allocated this many at a time.
+#define TRANSMISSION_INFO_SLAB_COUNT 64
 
+// The size class of a transmission whose data goes straight into a posted receive.
+#define NO_REASSEMBLY_BUFFER REASSEMBLY_SIZE_CLASS_COUNT
+
+// Packets of a streamed transmission staged past what has gone to the sink -- the window we advertise.
+// The sender never sends past it, so nothing is dropped for lack of room. Must be a power of two.
+#define STREAM_STAGING_RING_PACKETS(payload_size) MIN_RECEIVE_WINDOW_IN_PACKETS(payload_size)
+
+/**
+ * A receive posted by the application: where a transmission's data should go. The worker that owns
+ * the transmission places every payload straight into dest, and sets complete once all of it is there.
+ * A streamed receive has no dest. Its data is handed to write_routine in order instead.
+ */
 typedef struct {
+    // NOTE: this field MUST be first -- postings are handed to the worker on an SLIST.
+    SLIST_ENTRY flink;
+    // Links the posting onto the worker's withdrawing list, once the application gives up on it.
+    SLIST_ENTRY withdraw_flink;
+    UINT32 transmission_id;
+    // Must have room for the whole transmission, and stay valid until complete or withdrawn is set.
+    PVOID dest;
+    TRANSMISSION_WRITE_ROUTINE write_routine;
+    PVOID write_context;
+    volatile size_t bytes_received;
+    volatile LONG complete;
+    // Set by the worker once it has let go of the posting. It never touches the posting again.
+    volatile LONG withdrawn;
+} RECEIVE_POSTING, *PRECEIVE_POSTING;
 
-    volatile LONG64 initializationStarted;
-    volatile LONG64 initializationComplete;
+/**
+ * The parity that has arrived for one group of PARITY_GROUP_SIZE_IN_PACKETS packets. Each parity
+ * packet can stand in for any one missing packet of its group, so a group is rebuilt as soon as
+ * it has as many parity packets as holes.
+ */
+typedef struct {
+    // parity_count * payload_size bytes. Slot j holds parity packet j, if bit j of parity_received is set.
+    PBYTE parity;
+    ULONG64 parity_received;
+    UINT32 parity_count;
+    // The payload size of the group's last packet, which the parity was computed over.
+    UINT32 last_packet_bytes;
+} RECEIVER_PARITY_GROUP, *PRECEIVER_PARITY_GROUP;
 
-    volatile PULONG64 status_bitmap;
+/**
+ * A compressed chunk. Its packets land in their own slots and are ACK'd like any others, but what
+ * they hold isn't the transmission's data until the last of them is in: then the chunk is decompressed
+ * over its slots, and the packets past the compressed ones are set too. Until then nothing is
+ * counted, and a streamed receive doesn't write the chunk out.
+ */
+typedef struct {
+    // The chunk's compressed packets still to arrive. 0 before the first and once it is decompressed.
+    ULONG64 packets_left;
+    // From the packets' headers. Every one must agree. 0 until the first packet arrives.
+    UINT32 compressed_bytes;
+    UINT32 chunk_bytes;
+} RECEIVER_COMPRESSED_CHUNK, *PRECEIVER_COMPRESSED_CHUNK;
+
+typedef struct {
+
+    // NOTE: this field MUST be first -- free and delivered infos are kept on SLISTs.
+    SLIST_ENTRY flink;
+    UINT32 transmission_id;
+    // The connection the transmission's packets arrive on. Its ACKs go back on the same one.
+    UINT32 connection_id;
+
+    // Recycled along with the info, and only reallocated if a transmission needs a bigger one.
+    PULONG64 status_bitmap;
+    ULONG64 status_bitmap_capacity_in_words;
+    // Either the posted receive's dest, or a reassembly buffer from the pool (until a receive is posted).
     PVOID transmission_data;
+    ULONG64 transmission_data_size_class;
+    PRECEIVE_POSTING posting;
     volatile ULONG64 num_packets_left;
-    HANDLE transmission_complete_event;
     volatile size_t file_size_in_bytes;
+    ULONG64 num_packets;
+    // How much each packet carries, from the packets' headers. Every one must agree.
+    ULONG64 payload_size;
+    // The payload size of the last packet, once it has arrived. Every other packet is full.
+    ULONG64 last_packet_bytes;
+    // Streamed receives only: how many packets have been written to the sink, and the size of the
+    // staging ring transmission_data is (0 if it holds the whole transmission).
+    ULONG64 packets_flushed;
+    ULONG64 staging_ring_packets;
+
+    // ACK coalescing state. This is only touched by the transmission's receiver worker.
+    ULONG64 cumulative_ack;
+    ULONG64 latest_packet_index;
+    // A packet that failed its checksum since the last ACK, or NO_PACKET_NACKED. The next ACK NACKs it.
+    ULONG64 nacked_packet_index;
+    ULONG64 packets_since_ack;
+    ULONG64 ack_deadline;
+    BOOL ack_pending;
+
+    // One per parity group, allocated when the first parity packet arrives. NULL until then.
+    PRECEIVER_PARITY_GROUP parity_groups;
+    // Packets rebuilt from parity since the last ACK. The next ACK reports them to the sender.
+    ULONG64 packets_recovered;
+
+    // One per chunk, allocated when the first compressed packet arrives. NULL until then.
+    PRECEIVER_COMPRESSED_CHUNK compressed_chunks;
 } TRANSMISSION_INFO, *PTRANSMISSION_INFO;
 
 typedef struct {
+    // Says who may touch the slot next, exactly as in the sender's transmission queue:
+    //  - sequence == position:     empty, the producer claiming this position may write it.
+    //  - sequence == position + 1: full, the worker may read it.
+    // After reading, the worker bumps the sequence a full lap ahead to hand the slot back.
+    volatile LONG64 sequence;
+    // Points into network memory lent to us by receive_packet_view. Only the header and the
+    // bytes_in_payload bytes of data the packet actually uses are there -- nothing is copied.
+    PDATA_PACKET packet;
+    // Handed back to release_packet_view once the packet has been documented
+    PVOID view;
+} CACHED_PACKET, *PCACHED_PACKET;
 
-    // This is the circular buffer that cache packet writes into
-    // and the main thread reads from.
-    DATA_PACKET packet_space[BUFFER_SIZE_IN_PACKETS];
-    // Writer index
-    volatile UINT32 slot_counter_writer;
-    // Reader index
-    volatile UINT32 slot_counter_reader;
-    // TODO: Initialize these bitmaps
-    // Bitmap which indicate that a thread has taken a slot on the cache and is about to write into it
-    volatile ULONG64 reserve_cache_slot[2];
-    // Bitmap which indicates which cache slots have been finished writing into
-    // We need this bitmap in order to handle a case where we reserve a cache slot, but we haven't
-    // finished writing into it. A case where we could try to read before we write into the cache slot
-    volatile ULONG64 is_cache_slot_written[2];
-    // This event is used to wake the main receiver thread
+typedef struct {
+
+    // This is the circular buffer that write_to_cache writes into
+    // and the worker reads from. It holds views of packets that
+    // are still in the network buffer, so the packets are never copied.
+    PCACHED_PACKET packet_space;
+    // A power of two
+    ULONG64 capacity;
+    // Writer index. The receiver threads claim positions with a CAS, so it gets its own cache line.
+    __declspec(align(CACHE_LINE_SIZE)) volatile LONG64 slot_counter_writer;
+    // Reader index. Only the worker moves it.
+    __declspec(align(CACHE_LINE_SIZE)) volatile LONG64 slot_counter_reader;
+    // The number of receiver threads holding a packet until the cache has room for it.
+    volatile LONG writers_waiting;
+    // This event is used to wake the worker
     // when packets are added to the cache.
     HANDLE packets_waiting_in_cache;
+    // The worker sets this after freeing a slot, if anyone is waiting for one.
+    HANDLE space_available;
 
-
-//todo see if we want a lock, or see how to synchronize
 } PACKET_CACHE, *PPACKET_CACHE;
 
 typedef struct {
-    // This sparse array stores the transmission information for transmission ID #N at index N in the array.
-    PTRANSMISSION_INFO transmission_info_sparse_array;
+    UINT32 transmission_id;
+    // NULL when the entry is empty
+    PTRANSMISSION_INFO info;
+} TRANSMISSION_MAP_ENTRY, *PTRANSMISSION_MAP_ENTRY;
 
-    // this is the thread that processes packets in the cache
-    HANDLE receiver_thread;
+typedef struct {
+    // Open addressing with linear probing. Removal shifts the rest of the chain back, so there are no tombstones.
+    TRANSMISSION_MAP_ENTRY entries[TRANSMISSION_MAP_SIZE];
+    // Only the owning worker touches the entries, so there is no lock.
+    ULONG64 count;
+    // Receives the application has posted, waiting for the worker to pick them up.
+    SLIST_HEADER posted;
+    // Receives the worker has picked up that no packet has arrived for yet. Linked through flink.
+    PRECEIVE_POSTING waiting_postings;
+    // Receives that have timed out, waiting for the worker to let go of them. Linked through withdraw_flink.
+    SLIST_HEADER withdrawing;
+    // Transmissions that have been delivered, waiting for the worker to reclaim them.
+    SLIST_HEADER delivered;
+    // Ring of the IDs the worker has reclaimed most recently. Empty entries hold UINT32_MAX.
+    UINT32 recently_delivered[RECENTLY_DELIVERED_COUNT];
+    ULONG64 recently_delivered_next;
+} TRANSMISSION_MAP, *PTRANSMISSION_MAP;
+
+typedef struct {
+    SLIST_HEADER free_transmission_infos;
+    // One free list per size class. A free buffer holds its list entry in its first bytes.
+    SLIST_HEADER free_buffers[REASSEMBLY_SIZE_CLASS_COUNT];
+    // 0 once we know large pages aren't available to us.
+    volatile SIZE_T large_page_size;
+} TRANSMISSION_POOL, *PTRANSMISSION_POOL;
+
+typedef struct {
+    // Worker N looks up the transmissions it owns in transmission_maps[N].
+    TRANSMISSION_MAP transmission_maps[RECEIVER_WORKER_COUNT];
+
+    // Where transmission infos and reassembly buffers come from, shared by all of the workers.
+    TRANSMISSION_POOL pool;
+
+    // These are the threads that process packets in the caches. Worker N drains packet_caches[N],
+    // and every packet of a transmission goes to the same worker.
+    HANDLE receiver_threads[RECEIVER_WORKER_COUNT];
 
-    PACKET_CACHE packet_cache;
+    PACKET_CACHE packet_caches[RECEIVER_WORKER_COUNT];
 
 } RECEIVER_STATE, *PRECEIVER_STATE;
 
 extern RECEIVER_STATE g_receiver_state;
 
 /**
- * Creates data structures for a NEW transmission.
+ * @brief Files a parity packet with its group, and rebuilds the group's missing packets if it now can.
+ * @return The number of packets rebuilt. 0 if the parity was stale, bogus, or not enough yet.
+ */
+ULONG64 document_parity_packet(PTRANSMISSION_INFO info, PDATA_PACKET pkt);
+
+/**
+ * @brief Rebuilds the missing packets of a parity group once it has at least as much parity as it has holes.
+ *        Frees the group's parity once the group is whole.
+ * @return The number of packets rebuilt.
+ */
+ULONG64 rebuild_parity_group(PTRANSMISSION_INFO info, ULONG64 group_index);
+
+/**
+ * @brief Frees a transmission's parity groups, along with any parity they still hold.
+ */
+void release_parity_groups(PTRANSMISSION_INFO info);
+
+/**
+ * @brief Files a packet of a compressed chunk, and decompresses the chunk once it has all of them.
+ *        The packet must already have passed document_received_transmission's checks.
+ */
+void document_compressed_packet(PTRANSMISSION_INFO info, PDATA_PACKET pkt);
+
+/**
+ * @brief Frees a transmission's compressed chunks.
+ */
+void release_compressed_chunks(PTRANSMISSION_INFO info);
+
+/**
+ * Initializes a pooled transmission info for a NEW transmission.
  * When a packet arrives with a new and unique transmission ID,
- * this function will initialize its status bitmap as well as its
- * sparse array of data.
+ * this function will initialize its status bitmap and either place its
+ * data straight into a posted receive, or take a reassembly buffer for
+ * it from the pool.
  *
+ * @param info The transmission info, fresh from allocate_transmission_info.
  * @param id The unique transmission ID for this transmission.
  * @param num_packets The number of packets that will be received for this transmission.
- *
+ * @param payload_size The number of bytes every packet but the last carries.
+ * @param posting The receive the application has already posted for it, or NULL.
+ * @return FALSE if the transmission is too big for any reassembly buffer.
  */
-void init_received_transmission(ULONG32 id, ULONG32 num_packets);
+BOOL init_received_transmission(PTRANSMISSION_INFO info, UINT32 id, ULONG64 num_packets, ULONG64 payload_size,
+                                PRECEIVE_POSTING posting);
 
 /**
  * Called by main receiver thread.
@@ -90,49 +302,168 @@ void init_received_transmission(ULONG32 id, ULONG32 num_packets);
  * the data from the packet's payload into the transmission's data buffer.
  * @pre assumed the transmission info is initialized
  */
-void document_received_transmission(PDATA_PACKET pkt);
+void document_received_transmission(PTRANSMISSION_INFO transmission_info, PDATA_PACKET pkt);
+
+/**
+ * @brief Streamed receives only: writes every packet that has become contiguous to the sink, and
+ *        completes the receive once the whole transmission has been written. Worker only.
+ */
+void flush_to_sink(PTRANSMISSION_INFO info);
+
+/**
+ * @brief Sets up the free lists of the transmission pool, and checks whether large pages are available.
+ */
+void initialize_transmission_pool(void);
+
+/**
+ * @brief Takes a transmission info from the pool, allocating a new slab of them if the pool is empty.
+ */
+PTRANSMISSION_INFO allocate_transmission_info(void);
+
+/**
+ * @brief Hands a transmission info back to the pool. Its bitmap and event stay with it for its next use.
+ */
+void free_transmission_info(PTRANSMISSION_INFO info);
+
+/**
+ * @brief Takes a reassembly buffer of at least the given size from the pool.
+ * @param bytes The smallest size the buffer can be.
+ * @param size_class Receives the buffer's size class, to hand back to free_reassembly_buffer.
+ * @return The buffer, or NULL if bytes is bigger than the largest size class.
+ */
+PVOID allocate_reassembly_buffer(ULONG64 bytes, PULONG64 size_class);
+
+/**
+ * @brief Hands a reassembly buffer back to the pool.
+ */
+void free_reassembly_buffer(PVOID buffer, ULONG64 size_class);
+
+/**
+ * @brief Initializes a worker's transmission map to empty.
+ */
+void initialize_transmission_map(PTRANSMISSION_MAP map);
+
+/**
+ * @brief Looks up a transmission in a worker's map. Only the owning worker may call this.
+ * @return The transmission's info, or NULL if the map doesn't hold it.
+ */
+PTRANSMISSION_INFO find_transmission(PTRANSMISSION_MAP map, UINT32 transmission_id);
+
+/**
+ * @brief Adds a transmission to a worker's map. Only the owning worker may call this.
+ * @return FALSE if the map is too full to take another transmission.
+ */
+BOOL insert_transmission(PTRANSMISSION_MAP map, PTRANSMISSION_INFO info);
+
+/**
+ * @brief Removes a transmission from a worker's map. Only the owning worker may call this.
+ */
+void remove_transmission(PTRANSMISSION_MAP map, UINT32 transmission_id);
+
+/**
+ * @brief Checks whether a worker has reclaimed the transmission recently.
+ */
+BOOL was_recently_delivered(PTRANSMISSION_MAP map, UINT32 transmission_id);
+
+/**
+ * @brief Posts a receive: hands the worker that owns the transmission the buffer its data should
+ *        be placed in, and wakes the worker. Data that arrived before the posting is moved over once.
+ * @param posting The receive. The caller polls posting->complete, and must keep the posting and
+ *        its dest alive until it is set.
+ */
+void post_receive(PRECEIVE_POSTING posting);
+
+/**
+ * @brief Takes back a receive the application has given up on, and waits until the worker has let go
+ *        of it. Whatever has arrived is moved back to a reassembly buffer, so posting the receive again
+ *        picks up where this one left off. The receive may still have completed first.
+ * @param posting The receive. Its dest is no longer touched once this returns.
+ */
+void withdraw_receive(PRECEIVE_POSTING posting);
+
+/**
+ * @brief Called by the worker once every packet of a posted transmission is in dest. Tells the
+ *        application, and queues the transmission for the worker to reclaim.
+ */
+void complete_posted_receive(PTRANSMISSION_INFO info);
+
+/**
+ * @brief Builds an ACK for a transmission from its status bitmap: the cumulative ACK,
+ *        followed by SACK ranges working backwards from the latest packet received.
+ * @param info The transmission to acknowledge.
+ * @param comm_packet Receives the ACK.
+ */
+void assemble_ack(PTRANSMISSION_INFO info, PCOMM_PACKET comm_packet);
+
+/**
+ * @brief Sends an ACK for the transmission and resets its coalescing count.
+ *        Called by the transmission's receiver worker.
+ * @param info The transmission to acknowledge.
+ */
+void send_ack(PTRANSMISSION_INFO info);
 
 /**
  * Initializes data structures and launches threads for the receiver:
- *  - Reserves the sparse array for all transmission info entries.
- *  - Launches main receiver thread.
+ *  - Sets up the transmission pool.
+ *  - Launches one main receiver thread per receiver worker, each with its own cache and transmission map.
  */
 void create_receiver(void);
 
 #define PACKET_CACHE_SUCCESSFUL 1
-#define PACKET_CACHE_FAIL       0
+#define PACKET_CACHE_FULL       0
 /**
- * @brief Adds the given packet to a queue of packets to be processed.
+ * @brief Adds the given packet to the cache of the receiver worker that owns its transmission.
  * @param pkt The packet to be added.
+ * @param view The network view that holds the packet. If the packet is rejected,
+ *        the caller still owns the view.
  * @retval 1 Packet is successfully received
- * @retval 0 Packet is rejected -- this can happen when the buffer is full.
+ * @retval 0 The cache is full. Rather than dropping the packet (and making the sender resend it
+ *         an RTO later), the caller should hold onto it, call wait_for_cache_space and try again.
  */
-BYTE write_to_cache(PDATA_PACKET pkt);
+BYTE write_to_cache(PDATA_PACKET pkt, PVOID view);
+
+/**
+ * @brief Waits for the worker that owns the packet's transmission to free up a slot in its cache.
+ * @param pkt The packet write_to_cache turned away.
+ * @param timeout_ms The longest to wait before the caller tries again anyway.
+ */
+void wait_for_cache_space(PDATA_PACKET pkt, ULONG64 timeout_ms);
 
 /**
  * @par Woken by cache packet when packets are available to be processed.
  *      Sends ACKs and NACKs via comm packets.
- *      Updates sparse array data structures to track the status of each packet in a transmission.
+ *      Updates the data structures that track the status of each packet in a transmission.
  *      There are two data structures updated: there is a bitmap per transmission tracking the presence
- *      of each packet. And there is a sparse array of packet data into which the packets processed by
- *      this thread will be memcpy'd. For security purposes, we guard the memcpy with a try-except.
- * @param param
+ *      of each packet. And there is the application's posted buffer (or, until it posts one, a
+ *      reassembly buffer) into which the packets processed by this thread will be memcpy'd.
+ *      Also picks up posted receives, and reclaims the transmissions that have been delivered.
+ *      One of these runs per receiver worker.
+ * @param param The worker's index, which selects its packet cache.
  * @return
  */
 DWORD main_receiver_thread(LPVOID param);
 
 /**
- * @brief Adds the given packet to a queue of packets to be processed.
- * @param pkt The packet to be added.
+ * @brief Takes the next packet off a receiver worker's queue of packets to be processed.
+ * @param cache The worker's packet cache. Only that worker reads from it.
+ * @param Noah_Packet Receives the address of the packet. It is only valid until its view is released.
+ * @param view Receives the network view that holds the packet. The caller must release it.
  * @retval 1 Packet from cache was succesfully read
- * @retval 0 Packet is rejected -- this can happen when the buffer is full.
+ * @retval 0 The cache is empty.
  */
 #define PACKET_SUCCESSFULLY_READ 1
 #define PACKET_FAILED_TO_READ 0
-BYTE read_from_cache(PDATA_PACKET Noah_Packet);
+BYTE read_from_cache(PPACKET_CACHE cache, PDATA_PACKET* Noah_Packet, PVOID* view);
 
 #define TRANSMISSION_RECEIVED       0
 #define NO_TRANSMISSION_AVAILABLE   1
 
 int reciever_handler(UINT32 transmission_id, PVOID dest, PSIZE_T out_length, ULONG64 timeout_ms);
 
+/**
+ * @brief Like reciever_handler, but the transmission's data is handed to write_routine in order
+ *        rather than copied into a buffer.
+ */
+int stream_receiver_handler(UINT32 transmission_id, TRANSMISSION_WRITE_ROUTINE write_routine, PVOID context,
+                            PSIZE_T out_length, ULONG64 timeout_ms);
+
@@ -1,18 +1,158 @@
 #pragma once
 
+#include "transport_packets.h"
+
 /**
  * When we split work across our sender minions (worker threads) we will need to know how many
  * packets are assigned to a minion. This is the maximum number of contiguous packets
  * we will assign to a minion at any time.
+ * It must be a multiple of 64, so that each word of a status bitmap belongs to exactly one chunk, and
+ * of PARITY_GROUP_SIZE_IN_PACKETS, so that each parity group does too.
  */
 #define MAX_CHUNK_SIZE_IN_PACKETS   128
+#if MAX_CHUNK_SIZE_IN_PACKETS != COMPRESSED_CHUNK_SIZE_IN_PACKETS
+#error "The receiver has to know where a compressed chunk starts"
+#endif
 #define SENDER_MINION_COUNT         8
-#define WORK_ARRAY_SIZE             256
+// Must be a power of two -- queue positions are masked, not modded. Every transmission with chunks
+// left to hand out sits in here, and with send_transmission_async one thread can have hundreds.
+#define TRANSMISSION_QUEUE_SIZE     1024
 #define MAX_PENDING_CHUNKS_PER_MINION   4
+
+// Bytes of credit a connection gets per scheduling round for each unit of weight: one chunk at the
+// smallest payload size. A connection's weight is DEFAULT_CONNECTION_WEIGHT, unless set_connection_weight
+// says otherwise.
+#define CONNECTION_QUANTUM_IN_BYTES (MAX_CHUNK_SIZE_IN_PACKETS * MIN_PAYLOAD_SIZE)
+#define DEFAULT_CONNECTION_WEIGHT   1
+#define MAX_CONNECTION_WEIGHT       64
 #define EMPTY_WORK_ARRAY_ID         UINT32_MAX
 
-CRITICAL_SECTION g_work_array_lock;
+// Every chunk task lives in exactly one minion's deque, and no more than MAX_PENDING_CHUNKS_PER_MINION
+// are created per minion, so this can never overflow. Must be a power of two.
+#define MINION_DEQUE_SIZE           32
+
+// One network round trip with empty queues. Used as the RTT until the listener has a real sample.
+#define ACK_CHECK_INTERVAL_MS       (2 * LATENCY_MS)
+
+/**
+ * Retransmission timeout, per packet: SRTT + 4 * RTTVAR (RFC 6298). Until the first sample it is
+ * INITIAL_RTO_MS. It never drops below one propagation round trip -- any timer shorter than that
+ * could only ever fire spuriously -- and never grows past MAX_RTO_MS.
+ */
+#define INITIAL_RTO_MS              (2 * ACK_CHECK_INTERVAL_MS)
+#define MIN_RTO_MS                  ACK_CHECK_INTERVAL_MS
+#define MAX_RTO_MS                  1000
+#define RTO_VARIANCE_MULTIPLIER     4
+
+// Longest an idle minion waits on work_available before looking around again.
+#define MINION_IDLE_TIMEOUT_MS      LATENCY_MS
+
+/**
+ * Congestion window, in packets, shared by every minion. BBR-style: rather than reacting to losses
+ * (most of ours are the receiver's cache overflowing, not the network), the window follows the
+ * measured bandwidth-delay product -- CONGESTION_WINDOW_GAIN times the best delivery rate of the last
+ * few rounds times the smallest RTT seen. Until the delivery rate stops growing the window grows by
+ * one packet per packet ACK'd (startup), doubling every round trip.
+ *
+ * A data packet takes its payload's worth of network slots plus one for the headers -- two at a 1 KB
+ * payload, 65 at 64 KB -- so the whole SR buffer holds at most that fraction of its slots in packets.
+ * There's no point in letting the window grow past that. The cap follows the current payload size
+ * (see set_payload_size).
+ */
+#define INITIAL_CONGESTION_WINDOW   64
+#define MIN_CONGESTION_WINDOW       16
+#define MAX_CONGESTION_WINDOW(payload_size) \
+    ((LONG64) (NETWORK_BUFFER_NUMBER_OF_SLOTS / ((payload_size) / NETWORK_BUFFER_SLOT_SIZE_IN_BYTES + 1)))
+#define CONGESTION_WINDOW_GAIN      2
+
+// Number of rounds of delivery-rate samples the bandwidth estimate takes the max over.
+#define BANDWIDTH_FILTER_ROUNDS     8
 
+// Startup ends once this many rounds in a row fail to grow the bandwidth estimate by a quarter.
+#define STARTUP_FLAT_ROUNDS         3
+
+// How long a min RTT sample is trusted before we take whatever the next sample is.
+#define MIN_RTT_EXPIRY_MS           10000
+
+// Weight of a new RTT sample in the smoothed RTT and in the RTT variance, as shifts (1/8 and 1/4, as in TCP).
+#define RTT_SMOOTHING_SHIFT         3
+#define RTT_VARIANCE_SHIFT          2
+
+// Forward error correction. Each parity group gets enough parity packets to cover this many times the losses
+// we expect in it, at the recent loss rate -- but at least the minimum, and never more than FEC_MAX_PARITY_PACKETS.
+#define FEC_PARITY_HEADROOM         2
+#define FEC_MIN_PARITY_PACKETS      1
+
+// The loss rate is measured over roughly this many recent packets: past it, both counts are halved.
+#define FEC_LOSS_WINDOW_PACKETS     (1 << 16)
+
+// A chunk is only sent compressed if that fits it in at most this many percent of its packets.
+// Otherwise the compressor gives up as soon as it has written that much.
+#define COMPRESSION_MAX_PACKETS_PERCENT 90
+
+// Top bit of a packet's send time: the packet has been retransmitted, so its ACK can't be attributed
+// to either send and mustn't be used as an RTT sample. TSC values never get anywhere near it.
+#define PACKET_RETRANSMITTED_FLAG   (1ULL << 63)
+
+// What a chunk task will do the next time a minion runs it.
+#define CHUNK_TASK_SEND             0
+#define CHUNK_TASK_ACK_CHECK        1
+#define CHUNK_TASK_RETRANSMIT       2
+
+// What came of running a chunk task.
+#define CHUNK_TASK_RAN              0
+#define CHUNK_TASK_NOT_DUE          1
+#define CHUNK_TASK_FINISHED         2
+
+// A streamed transmission is read into one of these a chunk at a time. They are recycled, so the
+// sender only ever holds as many as it has streamed chunk tasks alive, no matter how big the source.
+// A chunk's size depends on the payload size, so there is a free list for each one.
+#define STAGING_BUFFER_SIZE_IN_BYTES(payload_size)  (MAX_CHUNK_SIZE_IN_PACKETS * (payload_size))
+#define PAYLOAD_SIZE_CLASS_COUNT        7       // MIN_PAYLOAD_SIZE up to MAX_PAYLOAD_SIZE, by powers of two
+
+// Number of packets handed to the network in one send_packets/receive_packets call
+#define SEND_BATCH_SIZE_IN_PACKETS      16
+#define LISTENER_BATCH_SIZE_IN_PACKETS  8
+
+
+/**
+ * Per-chunk ACK bookkeeping, one per chunk of a transmission.
+ */
+typedef struct {
+    // Packets in this chunk not yet ACK'd. Only the sender listener decrements it.
+    volatile LONG packets_outstanding;
+
+    // Index of the minion that last ran this chunk's task -- the one to wake when it hits zero.
+    volatile LONG owner;
+
+    // Set by the listener when one of the chunk's packets is NACK'd, so its task runs before its timer is up.
+    volatile LONG retransmit_requested;
+
+    // 0 unless the chunk is sent compressed. Then, how many packets it goes out in -- the rest of its
+    // packets are ACK'd without ever being sent, so they hold no congestion window.
+    volatile LONG compressed_packets;
+} SENDER_CHUNK_INFO, *PSENDER_CHUNK_INFO;
+
+/**
+ * Reported through a SEND_COMPLETION_QUEUE once every packet of an asynchronous transmission is ACK'd.
+ */
+typedef struct {
+    // NOTE: this field MUST be first -- completions are queued on an SLIST.
+    SLIST_ENTRY flink;
+    UINT32 transmission_id;
+    // Whatever the caller passed to send_transmission_async.
+    PVOID context;
+} SEND_COMPLETION, *PSEND_COMPLETION;
+
+/**
+ * Where asynchronous transmissions report that they are done, in the spirit of an I/O completion
+ * port. Any number of transmissions (and threads) can share one.
+ */
+typedef struct {
+    SLIST_HEADER completions;
+    // Auto-reset. Set whenever a completion is queued.
+    HANDLE completion_available;
+} SEND_COMPLETION_QUEUE, *PSEND_COMPLETION_QUEUE;
 
 typedef struct {
 
@@ -39,10 +179,53 @@ typedef struct {
     // Total number of bytes in the transmission's data
     ULONG64 total_bytes;
 
+    // How much of the data each packet carries. Fixed when the transmission is submitted.
+    ULONG64 payload_size;
+
+    /**
+     * Packets in the whole transmission not yet ACK'd. The sender listener decrements this as it
+     * sets new bits in packet_status_bitmap, and lets go of its reference when it reaches zero.
+     */
+    volatile LONG64 packets_outstanding;
+
+    // The highest cumulative ACK the listener has applied. Everything below it is already set in
+    // packet_status_bitmap, so later ACKs only need to merge from here up.
+    ULONG64 cumulative_ack;
+
+    // No packet at or above this index may be sent for the first time. Starts at the window every
+    // receiver guarantees, and only the listener raises it, from the window the receiver advertises.
+    volatile ULONG64 receive_window_end;
+
+    // Array (index = chunk index) of per-chunk outstanding counters.
+    PSENDER_CHUNK_INFO chunks;
+
+    // Array (index = packet index) of when each packet was last sent (TSC). Drives the per-packet
+    // retransmission timer and the RTT samples. PACKET_RETRANSMITTED_FLAG is or'd in once a packet
+    // is resent (Karn's algorithm).
+    volatile ULONG64* packet_send_times;
+
+    // When the transmission was handed to the sender (TSC), for its completion time. Never 0 once it has been.
+    ULONG64 submit_time;
+
+    // One for each of its chunk tasks, and one the listener holds until the last packet is ACK'd. Whoever lets
+    // go of the last retires the transmission: frees its arrays and reports it complete (see release_transmission).
+    volatile LONG references;
+
+    // The connection the transmission is sent on. Picks both its transmission queue and its network.
+    UINT32 connection_id;
+
+    // Set when the transmission retires -- just for send_transmission, which waits on it.
     HANDLE sending_complete_event;
 
-    // Pointer to the transmission's data (given from send_transmission)
+    // Asynchronous transmissions only: where to report the completion, and the completion itself.
+    PSEND_COMPLETION_QUEUE completion_queue;
+    SEND_COMPLETION completion;
+
+    // Pointer to the transmission's data (given from send_transmission). NULL for a streamed
+    // transmission, whose data is pulled from read_routine one chunk at a time instead.
     PBYTE data;
+    TRANSMISSION_READ_ROUTINE read_routine;
+    PVOID read_context;
 
 } SENDER_TRANSMISSION_INFO, *PSENDER_TRANSMISSION_INFO;
 
@@ -51,12 +234,26 @@ typedef struct {
     // Transmission ID
     UINT32 transmission_id;
 
+    // The transmission's connection, stamped on every packet of the chunk
+    UINT32 connection_id;
+
     // Pointer to its offset in the transmission data
     PBYTE data_to_send;
 
+    // The staging buffer data_to_send points into for a streamed transmission, otherwise NULL.
+    // It has to live as long as the chunk, since retransmits read from it too.
+    PBYTE staging_buffer;
+
     // Size of the chunk that is being packetized
     ULONG64 bytes_to_send;
 
+    // 0 unless the chunk is compressed. Then data_to_send and bytes_to_send are the compressed chunk
+    // (in staging_buffer), and this is how many bytes of the transmission it covers.
+    ULONG64 chunk_bytes;
+
+    // How much of the data each packet carries (the transmission's payload size)
+    ULONG64 payload_size;
+
     // Number of packets in transmission
     ULONG64 n_packets_in_transmission;
 
@@ -65,27 +262,171 @@ typedef struct {
 
 } SENDER_MINION_INFO, *PSENDER_MINION_INFO;
 
+/**
+ * A unit of minion work: one chunk of a transmission plus what needs to happen to it next.
+ * Tasks move between minions when they are stolen, so everything needed to run one is in here.
+ */
+typedef struct {
+    SENDER_MINION_INFO info;
+
+    // One of the CHUNK_TASK_* states.
+    ULONG64 state;
+
+    // When the earliest retransmission timer among the chunk's un-ACK'd packets expires (TSC).
+    // Nothing needs to look at the chunk before then.
+    ULONG64 due_time;
+
+    // How many packets of the chunk have been sent for the first time. A SEND task that can't get
+    // enough window for the whole chunk sends what it can and picks up from here next time.
+    ULONG64 packets_sent;
+} CHUNK_TASK, *PCHUNK_TASK;
+
+/**
+ * Per-minion work-stealing deque (Chase-Lev). The owning minion pushes and pops at the bottom,
+ * any other minion may steal from the top. Only the last remaining task needs a CAS to settle a
+ * race between the owner and a thief.
+ */
+typedef struct {
+    __declspec(align(CACHE_LINE_SIZE)) volatile LONG64 top;
+    __declspec(align(CACHE_LINE_SIZE)) volatile LONG64 bottom;
+    PCHUNK_TASK tasks[MINION_DEQUE_SIZE];
+
+    // Auto-reset. Set by the sender listener when one of the chunks this minion owns is fully ACK'd.
+    HANDLE chunk_acked_event;
+} MINION_DEQUE, *PMINION_DEQUE;
+
+/**
+ * One slot in the transmission queue. The sequence number says who may touch the slot next:
+ *  - sequence == position:     empty, the producer claiming this position may write it.
+ *  - sequence == position + 1: full, the consumer claiming this position may read it.
+ * After reading, the consumer bumps the sequence a full lap ahead to hand the slot back.
+ */
+typedef struct {
+    volatile LONG64 sequence;
+    UINT32 transmission_id;
+} TRANSMISSION_QUEUE_SLOT, *PTRANSMISSION_QUEUE_SLOT;
+
 /**
  * This data structure keeps track of the transmissions in the order in which they are received.
  * It facilitates the minions as they seek out the next chunk of work.
- * Uses a circular buffer with separate read/write indices.
+ *
+ * Bounded lock-free MPMC ring: send_transmission and the minions (re-queueing a transmission with
+ * chunks left) produce, the minions consume. Each side claims a position with a CAS on its own
+ * index, so the two indices live on separate cache lines.
+ */
+typedef struct {
+    PTRANSMISSION_QUEUE_SLOT slots;
+    __declspec(align(CACHE_LINE_SIZE)) volatile LONG64 enqueue_index;
+    __declspec(align(CACHE_LINE_SIZE)) volatile LONG64 dequeue_index;
+} TRANSMISSION_QUEUE;
+
+/**
+ * Per-connection work. The minions share the sender between connections by deficit round robin:
+ * every round, each connection gets weight * CONNECTION_QUANTUM_IN_BYTES of credit, a minion only
+ * takes a new chunk from a connection with credit left, and each chunk is charged the bytes it sends.
+ * Once every connection with work has spent its credit, the next round starts. A chunk bigger than
+ * what was left puts the connection in debt, which the next rounds' credit pays off first -- so a
+ * connection sending big payloads gets no more bytes than one sending small ones. A connection that
+ * floods the sender with transmissions only delays its own.
+ */
+typedef struct {
+    TRANSMISSION_QUEUE transmissions_queue;
+    __declspec(align(CACHE_LINE_SIZE)) volatile LONG64 credits;
+    volatile LONG64 weight;
+} SENDER_CONNECTION;
+
+/**
+ * Sender-wide congestion state. Minions take window before sending a packet for the first time;
+ * the listener gives it back as packets are ACK'd. Retransmissions reuse the window the packet
+ * already holds, so every packet is counted in flight exactly once until it is ACK'd.
+ *
+ * Everything below congestion_window is only touched by the sender listener.
+ */
+typedef struct {
+    __declspec(align(CACHE_LINE_SIZE)) volatile LONG64 packets_in_flight;
+    __declspec(align(CACHE_LINE_SIZE)) volatile LONG64 congestion_window;
+
+    // Set by a minion that couldn't get any window, so the listener knows to wake someone up.
+    volatile LONG window_blocked;
+
+    // Smoothed RTT and RTT variance (TSC), 0 until the first sample.
+    volatile ULONG64 smoothed_rtt;
+    volatile ULONG64 rtt_variance;
+
+    // SRTT + 4 * RTTVAR, clamped -- what the minions time their retransmits off (TSC).
+    volatile ULONG64 retransmission_timeout;
+
+    // Smallest RTT seen (TSC) and when we saw it.
+    ULONG64 min_rtt;
+    ULONG64 min_rtt_time;
+
+    // The current round: when it started and how many packets have been ACK'd since.
+    ULONG64 round_start_time;
+    ULONG64 round_packets_acked;
+
+    // Delivery rate (packets per second) of each of the last few rounds, and the max over them.
+    ULONG64 bandwidth_samples[BANDWIDTH_FILTER_ROUNDS];
+    ULONG64 round_count;
+    ULONG64 max_bandwidth;
+
+    // Startup bookkeeping: the bandwidth we need to beat, and how many rounds we've failed to.
+    BOOL in_startup;
+    ULONG64 startup_target_bandwidth;
+    ULONG64 startup_flat_rounds;
+} CONGESTION_CONTROL;
+
+/**
+ * Forward error correction, when set_forward_error_correction turns it on: a minion follows each
+ * parity group it finishes sending with parity packets, so the receiver can rebuild lost packets
+ * without waiting a round trip for them. Parity packets are never ACK'd or retransmitted, and hold
+ * no congestion window.
+ *
+ * How many parity packets a group gets follows the loss rate. Packets retransmitted and packets the
+ * receiver reports rebuilding both count as lost; neither count is exact, but it tracks the link.
  */
 typedef struct {
-    PUINT32 work_array;
-    // Had to seperate these two
-    volatile ULONG64 next_read_index;
-    volatile ULONG64 next_write_index;
-} TRANSMISSION_CACHE;
+    volatile LONG enabled;
+    __declspec(align(CACHE_LINE_SIZE)) volatile LONG64 packets_sent;
+    volatile LONG64 packets_lost;
+} FEC_CONTROL;
 
 typedef struct {
 
-    // Queue of transmission IDs to indicate which
-    // transmission should be worked on next
-    TRANSMISSION_CACHE transmissions_queue;
+    // One queue of transmission IDs per connection, to indicate which
+    // transmission should be worked on next (index = connection ID)
+    SENDER_CONNECTION connections[MAX_CONNECTIONS];
+
+    // Bumped each time the connections' credits are refilled.
+    volatile LONG64 scheduler_round;
 
     // Sparse array (index = transmission ID) of transmission info structs
     PSENDER_TRANSMISSION_INFO transmissions_in_progress;
 
+    // One past the highest transmission ID ever submitted. No entry at or above it has been committed.
+    volatile LONG64 transmission_id_limit;
+
+    // One deque of chunk tasks per minion (index = minion index).
+    MINION_DEQUE minion_deques[SENDER_MINION_COUNT];
+
+    // Auto-reset. Set whenever there may be work an idle minion could pick up or steal.
+    HANDLE work_available;
+
+    CONGESTION_CONTROL congestion;
+
+    FEC_CONTROL fec;
+
+    // Set by set_compression. Compresses chunks as they are handed out, from then on.
+    volatile LONG compression_enabled;
+
+    // Staging buffers no chunk is using, one list per payload size class.
+    SLIST_HEADER free_staging_buffers[PAYLOAD_SIZE_CLASS_COUNT];
+
+    // The payload size transmissions submitted from now on are sent with (see set_payload_size).
+    volatile LONG64 payload_size;
+
+    // Minions at or above this index are parked (see set_sender_minion_count).
+    volatile LONG active_minions;
+
 } SENDER_STATE, *PSENDER_STATE;
 
 extern SENDER_STATE g_sender_state;
@@ -114,8 +455,11 @@ VOID create_sender(VOID);
  * we begin packetizing.
  * @param bytes_to_packetize The number of bytes to packetize.
  * @param minion_info Minion Info struct.
+ * @param packet_offset_in_chunk Index within the chunk of the first packet
+ * at transmission_data.
  */
-VOID packetize_contiguous(PVOID transmission_data, ULONG64 bytes_to_packetize, SENDER_MINION_INFO minion_info);
+VOID packetize_contiguous(PVOID transmission_data, ULONG64 bytes_to_packetize, SENDER_MINION_INFO minion_info,
+                          ULONG64 packet_offset_in_chunk);
 
 
 /**
@@ -123,15 +467,73 @@ VOID packetize_contiguous(PVOID transmission_data, ULONG64 bytes_to_packetize, S
  *  If the network rejects a packet, this function will again attempt
  *  to send the packet.
  *
- *  This function needs to listen for the network shutdown event, otherwise
- *  it will never end.
+ *  Retries are capped at MAX_ATTEMPTS_NETWORK. Anything still rejected after that
+ *  is left for the retransmission logic in sender_minion.
+ *
+ *  @param packets The packets to send.
+ *  @param number_of_packets_to_send The number of packets in the array.
+ */
+VOID send_packet_batch(PPACKET* packets, ULONG64 number_of_packets_to_send);
+
+/**
+ * @brief Retires a transmission nothing references any more: frees its per-packet and per-chunk
+ * arrays, then releases send_transmission, or queues the completion of an asynchronous transmission.
+ */
+VOID complete_transmission(PSENDER_TRANSMISSION_INFO transmission_info);
+
+/**
+ * @brief Lets go of one reference to a transmission, retiring it if that was the last one.
+ * Nothing may touch the transmission's arrays after its reference is let go.
+ */
+VOID release_transmission(PSENDER_TRANSMISSION_INFO transmission_info);
+
+/**
+ * @brief Listener only: marks packets [first_packet_index, end_packet_index) as ACK'd, one chunk
+ * at a time, and counts the newly ACK'd ones off their chunks and the transmission.
+ *
+ * @param transmission_info The transmission the ACK belongs to.
+ * @param first_packet_index The first packet in the range.
+ * @param end_packet_index One past the last packet in the range. Clamped to the transmission.
+ * @return The number of packets in the range that were not already ACK'd.
  */
-VOID send_packet_batch(ULONG64 number_of_packets_to_send);
+ULONG64 acknowledge_packet_range(PSENDER_TRANSMISSION_INFO transmission_info, ULONG64 first_packet_index,
+                                 ULONG64 end_packet_index);
+
+/**
+ * @brief Listener only: makes a NACK'd packet due for retransmission now, and wakes the minion that
+ * holds its chunk to resend it.
+ *
+ * @param transmission_info The transmission the NACK belongs to.
+ * @param packet_index The packet the receiver got corrupted. Must not be ACK'd already.
+ */
+VOID request_retransmit(PSENDER_TRANSMISSION_INFO transmission_info, ULONG64 packet_index);
+
+/**
+ * @brief Picks how many parity packets a group of data packets gets, from the recent loss rate.
+ *
+ * @param n_data_packets The number of data packets in the group.
+ * @return From FEC_MIN_PARITY_PACKETS to FEC_MAX_PARITY_PACKETS.
+ */
+ULONG64 choose_parity_count(ULONG64 n_data_packets);
+
+/**
+ * @brief Builds and sends the parity packets for every parity group of a chunk. The chunk's data
+ * packets must all have been sent.
+ *
+ * @param minion_info The chunk.
+ */
+VOID send_parity_packets(PSENDER_MINION_INFO minion_info);
 
 /**
  *
  * @brief The sender listener thread calls receive_packet to check for
- * incoming Comm Packets. When they arrive, this thread will
+ * incoming Comm Packets. When they arrive, this thread will merge the cumulative
+ * ACK and SACK ranges into the transmission's bitmap a chunk at a time, and
+ * count the newly ACK'd packets off their chunk and
+ * transmission counters. A chunk reaching zero wakes its owning minion; the
+ * whole transmission reaching zero completes send_transmission directly.
+ * ACKs whose SACK ranges fail their checksum are dropped, and a NACK'd packet
+ * is made due for retransmission straight away.
  *
  * There will be one sender listener running on each "machine".
  *
@@ -143,15 +545,14 @@ DWORD sender_listener(LPVOID param);
 
 
 /**
- * @brief Created when the transport layer is initialized. These worker threads
- * call find_work() to be assigned a chunk of a transmission to send. They will
- * packetize that chunk, then push them to the network via send_packet(). They
- * will not move on to a new chunk until all packets in that chunk have been ACKed.
+ * @brief Created when the transport layer is initialized. Each minion runs the chunk tasks in its
+ * own deque: sending a fresh chunk, checking a chunk's ACKs once its due time passes, and
+ * retransmitting whatever was not ACK'd. If it has room, it calls find_work() to take on a new chunk.
+ * When its own deque is empty, it steals from the other minions. It only sleeps when nothing it holds
+ * is due yet, and then only until the earliest due time, until work_available is set, or until the
+ * listener reports one of its chunks fully ACK'd.
  *
- * Potential future optimization: worker thread has two chunks to manage -- one to
- * packetize and send, one to check and ACK.
- *
- * @param param
+ * @param param The minion's index into minion_deques.
  * @return
  */
 DWORD sender_minion(LPVOID param);
@@ -160,15 +561,130 @@ DWORD sender_minion(LPVOID param);
  * @brief Called by the sender worker thread to determine its next job.
  * This will give the thread a chunk of a transmission to send & check,
  * or it will put it to sleep if no work is available.
+ * For a streamed transmission, this is where the chunk is read in from the source.
+ * With compression on, this is also where the chunk is compressed.
  */
 VOID find_work(PSENDER_MINION_INFO briefcase);
 
+/**
+ * @brief Compresses a freshly handed out chunk into a staging buffer, if that saves enough packets
+ * to be worth it (see COMPRESSION_MAX_PACKETS_PERCENT). Otherwise leaves the chunk as it was.
+ *
+ * @param briefcase The chunk, straight from find_work.
+ */
+VOID compress_chunk(PSENDER_MINION_INFO briefcase);
+
+/**
+ * @brief Takes a staging buffer for a chunk from the free list, allocating a new one if it is empty.
+ * @param payload_size The payload size of the transmission the chunk belongs to.
+ */
+PBYTE allocate_staging_buffer(ULONG64 payload_size);
+
+/**
+ * @brief Hands a staging buffer back to the free list for its payload size.
+ */
+VOID free_staging_buffer(PBYTE buffer, ULONG64 payload_size);
+
+/**
+ * @brief Pops the next transmission ID off one connection's transmission queue.
+ *
+ * @return The ID, or EMPTY_WORK_ARRAY_ID if the queue is empty.
+ */
+UINT32 dequeue_transmission_id(TRANSMISSION_QUEUE* queue);
+
+/**
+ * @brief Picks the connection that is owed the next chunk, and pops a transmission ID off its queue.
+ *
+ * @return The ID, or EMPTY_WORK_ARRAY_ID if every connection's queue is empty.
+ */
 UINT32 get_next_transmission_id(VOID);
 
 /**
- * @brief Rebuilds and resends a single packet from a chunk that was not ACKed.
+ * @brief Owner-only: pushes a task onto the bottom of a minion's deque.
+ */
+VOID push_chunk_task(PMINION_DEQUE deque, PCHUNK_TASK task);
+
+/**
+ * @brief Owner-only: pops the most recently pushed task off the bottom of a minion's deque.
+ *
+ * @return The task, or NULL if the deque is empty.
+ */
+PCHUNK_TASK pop_chunk_task(PMINION_DEQUE deque);
+
+/**
+ * @brief Takes the oldest task off the top of another minion's deque.
+ *
+ * @return The task, or NULL if the deque was empty or another thread won the race for it.
+ */
+PCHUNK_TASK steal_chunk_task(PMINION_DEQUE deque);
+
+/**
+ * @brief Runs one step of a chunk task (send, ACK check or retransmit).
+ *
+ * @param task The task to run. Freed here if the chunk turns out to be fully ACK'd.
+ * @param next_due_time Lowered to the task's due time if the task is still waiting on ACKs.
+ * @return CHUNK_TASK_RAN, CHUNK_TASK_NOT_DUE or CHUNK_TASK_FINISHED.
+ */
+ULONG64 run_chunk_task(PCHUNK_TASK task, PULONG64 next_due_time);
+
+/**
+ * @brief Pushes a transmission ID onto the tail of its connection's transmission queue.
+ *
+ * @param transmission_id The transmission that still has chunks to hand out.
+ * @return TRUE on success, FALSE if the queue is full.
+ */
+BOOL enqueue_transmission_id(UINT32 transmission_id);
+
+/**
+ * @brief Resends, in batches, every un-ACK'd packet among the first packets_to_check of a chunk
+ * whose retransmission timer has expired.
+ *
+ * @return When the next timer among the chunk's still un-ACK'd packets expires (TSC), or
+ * MAXULONG64 if there are none.
+ */
+ULONG64 retransmit_expired_packets(PCHUNK_TASK task, ULONG64 packets_to_check);
+
+/**
+ * @brief Takes up to packets_wanted packets of congestion window.
+ *
+ * @return The number of packets the caller may now send for the first time (possibly 0).
+ */
+ULONG64 acquire_send_window(ULONG64 packets_wanted);
+
+/**
+ * @brief Listener only: returns window for newly ACK'd packets. In startup the window grows by the
+ * same amount; afterwards it is re-sized from the bandwidth-delay product at the end of every round.
+ *
+ * @param packets_acked Number of packets ACK'd for the first time.
+ */
+VOID release_send_window(ULONG64 packets_acked);
+
+/**
+ * @brief Called when the network rejects packets for lack of room. The pipe is as full as it gets,
+ * so startup ends here and the window drops back to the bandwidth-delay product.
+ */
+VOID on_congestion_event(VOID);
+
+/**
+ * @brief Listener only: folds one RTT sample into the smoothed RTT, RTT variance, retransmission
+ * timeout and min RTT.
+ *
+ * @param send_time When the ACK'd packet was sent (TSC). Retransmitted packets are ignored.
+ */
+VOID record_rtt_sample(ULONG64 send_time);
+
+/**
+ * @brief The current bandwidth-delay product estimate, in packets. 0 until we have both a
+ * bandwidth and an RTT sample.
+ */
+ULONG64 estimate_bdp_in_packets(VOID);
+
+/**
+ * @brief Rebuilds a single packet from a chunk that was not ACKed, ready to be resent.
  *
  * @param info The minion's work info for the chunk containing the not ack'd packet.
  * @param packet_offset_in_chunk The index of the packet within this chunk.
+ * @param packet Where to build the packet.
+ * @return TRUE if the packet was built, FALSE if its data couldn't be read.
  */
-VOID retransmit_packet(PSENDER_MINION_INFO info, ULONG64 packet_offset_in_chunk);
\ No newline at end of file
+BOOL build_retransmit_packet(PSENDER_MINION_INFO info, ULONG64 packet_offset_in_chunk, PDATA_PACKET packet);
\ No newline at end of file
@@ -14,7 +14,9 @@
  *  UNIVERSAL PACKET HEADER
  *  The universal header can contain any number of fields, but it MUST begin with the size of the
  *  universal header (ULONG64). After that, it must include the transmission ID and the packet type.
- *  Finally, the total size of the payload (in bytes) is included.
+ *  Then the total size of the payload (in bytes) is included, followed by the connection that
+ *  carries the packet. A header too short to hold the connection ID is carried on connection 0.
+ *  Last is a checksum of the payload, which the far end recomputes before trusting it.
  *  As packet structures grow and change over time, the struct can expand to hold more fields
  *  and minimal edits will need to be made to the code.
  *
@@ -35,12 +37,31 @@ typedef struct universal_packet_header {
     UINT32 transmission_id : 31;            // Identifies which transmission this packet belongs to
     UINT32 packet_type : 1;                 // 0 = data packet, 1 = comm packet
     UINT32 bytes_in_payload;                // Identifies the number of bytes transmitted in the payload.
+    UINT32 connection_id;                   // Identifies which connection carries this packet (< MAX_CONNECTIONS).
+    UINT32 payload_checksum;                // CRC32C of the payload, or 0 when PAYLOAD_CHECKSUMS is off.
 
     // Additional fields may be added as packets expand over time.
     // Examples: error-correcting codes, version IDs, metadata for compression
 
 } PACKET, *PPACKET;
 
+/*
+ * Streaming transmissions: the transport layer pulls a transmission's data from a source, or pushes
+ * it to a sink, a piece at a time rather than holding all of it in memory.
+ *
+ * Each call covers bytes bytes starting at offset into the transmission. Return FALSE if the data
+ * could not be read or written.
+ */
+typedef BOOL (*TRANSMISSION_READ_ROUTINE)(PVOID context, ULONG64 offset, PVOID buffer, ULONG64 bytes);
+typedef BOOL (*TRANSMISSION_WRITE_ROUTINE)(PVOID context, ULONG64 offset, PVOID buffer, ULONG64 bytes);
+
+#if defined(_M_ARM64)
+    #define POPCOUNT64(x) _CountOneBits64(x)
+#else
+    #include <intrin.h>
+    #define POPCOUNT64(x) __popcnt64(x)
+#endif
+
 // Timing variables
 extern LARGE_INTEGER perf_frequency;
 extern LARGE_INTEGER time_start;
@@ -56,7 +77,7 @@ extern LARGE_INTEGER time_start;
 #define ACTIVE_EVENT_INDEX              1
 
 #define PAGE_SIZE_IN_BYTES                        4096
-#define PACKET_PAYLOAD_SIZE_IN_BYTES                      1024
+#define CACHE_LINE_SIZE                           64
 // Thread handles for starting and ending simulation
 extern HANDLE simulation_begin;
 extern HANDLE simulation_end;